@@ -0,0 +1,221 @@
+#include "BlockEngine.h"
+#include "Cpu.h"
+#include "Trap.h"
+
+//------------------------------------------------------------------------------
+// Instructions that may change the pc, the privilege mode or the address translation end a block.
+static bool endsBlock(uint8_t opcode)
+{
+	switch (opcode)
+	{
+	case 0x63: // branches
+	case 0x67: // jalr
+	case 0x6f: // jal
+	case 0x73: // ecall, ebreak, xret, sfence.vma, CSR accesses
+		return true;
+	default:
+		return false;
+	}
+}
+
+//------------------------------------------------------------------------------
+// Stores and AMOs may overwrite the running block.
+static bool writesMemory(uint8_t opcode)
+{
+	return opcode == 0x23 || opcode == 0x2f;
+}
+
+//------------------------------------------------------------------------------
+BlockEngine::BlockEngine(Cpu& c, bool native) :
+	cpu(c),
+	icache(nullptr),
+	last(nullptr)
+{
+	if (!cpu.icache)
+		cpu.initInstructionCache();
+	icache = cpu.icache.get();
+
+#ifdef WITH_JIT
+	if (native)
+		jit.reset(new Jit(*icache));
+#endif
+}
+
+//------------------------------------------------------------------------------
+BlockEngine::~BlockEngine()
+{
+}
+
+//------------------------------------------------------------------------------
+void BlockEngine::flush()
+{
+	blocks.clear();
+	last = nullptr;
+#ifdef WITH_JIT
+	if (jit)
+		jit->reset();
+#endif
+}
+
+//------------------------------------------------------------------------------
+void BlockEngine::step()
+{
+	if (cpu.waiting) [[unlikely]]
+	{
+		cpu.idle();
+		return;
+	}
+
+	Block* b = last ? follow(last) : nullptr;
+	if (b == nullptr)
+	{
+		b = lookup();
+		if (b == nullptr) [[unlikely]]
+		{
+			// Fetch fault or code outside of RAM: let the Cpu handle this instruction alone.
+			last = nullptr;
+			cpu.step();
+			return;
+		}
+
+		// Remember this successor, pushing out the oldest one.
+		if (last)
+		{
+			last->links[1] = last->links[0];
+			last->links[0].vpc = cpu.pc;
+			last->links[0].block = b;
+		}
+	}
+
+	last = b;
+	run(b);
+	// Counted whole, even when left early: still the same count on every run.
+	cpu.retire(b->insts.size());
+}
+
+//------------------------------------------------------------------------------
+BlockEngine::Block* BlockEngine::follow(Block* from)
+{
+	// A mapping change may send the same virtual pc somewhere else.
+	if (from->epoch != cpu.map_epoch) [[unlikely]]
+	{
+		from->links[0] = Link();
+		from->links[1] = Link();
+		from->epoch = cpu.map_epoch;
+		return nullptr;
+	}
+
+	for (const Link& l : from->links)
+	{
+		if (l.block && l.vpc == cpu.pc && l.block->version == icache->codeVersion(l.block->ppc))
+			return l.block;
+	}
+	return nullptr;
+}
+
+//------------------------------------------------------------------------------
+BlockEngine::Block* BlockEngine::lookup()
+{
+	AccessResult r = cpu.try_translate(cpu.pc, Cpu::AccessType::Instruction);
+	if (r.failed())
+		return nullptr;
+	uint64_t ppc = r.value;
+
+	if (icache->lookup(ppc) == nullptr)
+		return nullptr;
+
+	std::unique_ptr<Block>& b = blocks[ppc];
+	if (!b)
+	{
+		b.reset(new Block);
+		b->ppc = ppc;
+		translate(b.get());
+	}
+	else if (b->version != icache->codeVersion(ppc))
+	{
+		// The code changed: rebuild in place so that links to this block stay valid.
+		translate(b.get());
+	}
+	return b.get();
+}
+
+//------------------------------------------------------------------------------
+void BlockEngine::translate(Block* b)
+{
+	b->version = icache->codeVersion(b->ppc);
+	b->links[0] = Link();
+	b->links[1] = Link();
+	b->epoch = cpu.map_epoch;
+	b->insts.clear();
+#ifdef WITH_JIT
+	b->hits = 0;
+	b->code = nullptr;
+#endif
+
+	for (uint64_t p = b->ppc; ; p += 4)
+	{
+		const DecodedInst* d = icache->lookup(p);
+		if (d == nullptr)
+			break;
+
+		b->insts.push_back(*d);
+		if (endsBlock(d->opcode) || b->insts.size() == MAX_BLOCK_SIZE || (p + 4) % PAGE_SIZE == 0)
+			break;
+	}
+}
+
+//------------------------------------------------------------------------------
+void BlockEngine::run(Block* b)
+{
+#ifdef WITH_JIT
+	if (b->code)
+	{
+		jit->run(b->code, cpu);
+		return;
+	}
+	if (jit && ++b->hits == JIT_THRESHOLD)
+	{
+		compile(b);
+		if (b->code)
+		{
+			jit->run(b->code, cpu);
+			return;
+		}
+	}
+#endif
+
+	uint64_t vpc = cpu.pc;
+	for (const DecodedInst& d : b->insts)
+	{
+		vpc += 4;
+		cpu.pc = vpc;
+		cpu.execute(d);
+
+		// Taken branch, jump or trap.
+		if (cpu.pc != vpc)
+			break;
+
+		// The block itself was overwritten: its next records may be stale.
+		if (writesMemory(d.opcode) && b->version != icache->codeVersion(b->ppc)) [[unlikely]]
+			break;
+	}
+}
+
+#ifdef WITH_JIT
+//------------------------------------------------------------------------------
+void BlockEngine::compile(Block* b)
+{
+	b->code = jit->compile(b->insts, b->ppc, b->version);
+	if (b->code || !jit->isAvailable())
+		return;
+
+	// The code buffer is full: start over, hot blocks will be compiled again.
+	jit->reset();
+	for (auto&& it : blocks)
+	{
+		it.second->hits = 0;
+		it.second->code = nullptr;
+	}
+	b->code = jit->compile(b->insts, b->ppc, b->version);
+}
+#endif
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "InstructionCache.h"
+#ifdef WITH_JIT
+#include "Jit.h"
+#endif
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+class Cpu;
+
+/// Execution engine running guest basic blocks instead of single instructions.
+/// A block is a run of instructions ending with a branch, jal/jalr, a SYSTEM/CSR instruction or
+/// the end of its page. It is translated once into the list of its predecoded records, and keeps
+/// links to its successor blocks so that hot loops do not go through the lookup again.
+class BlockEngine
+{
+public:
+	/// Upper bound of the number of instructions of a block.
+	static const size_t MAX_BLOCK_SIZE = 64;
+
+#ifdef WITH_JIT
+	/// Executions of a block before it is compiled to native code.
+	static const uint32_t JIT_THRESHOLD = 32;
+#endif
+
+	/// The RAM must already be mapped on the Cpu bus. With `native`, hot blocks are compiled to
+	/// host code when the JIT backend is built in (WITH_JIT).
+	BlockEngine(Cpu& c, bool native = false);
+	virtual ~BlockEngine();
+
+	/// Run the block starting at the current pc. Interrupts should be checked between two calls.
+	void step();
+
+	/// Drop every translated block.
+	void flush();
+
+	//! Statistics
+	size_t blockCount() const { return blocks.size(); }
+
+protected:
+	struct Block;
+
+	/// A successor of a block, reached when the pc is `vpc` after the block.
+	struct Link {
+		uint64_t vpc = 0;
+		Block* block = nullptr;
+	};
+
+	struct Block {
+		/// Physical address of the first instruction.
+		uint64_t ppc;
+		/// Code version of the page when the block was translated.
+		uint32_t version;
+		std::vector<DecodedInst> insts;
+		/// Last two successors, valid while `epoch` matches the Cpu mapping epoch.
+		Link links[2];
+		uint64_t epoch;
+#ifdef WITH_JIT
+		uint32_t hits;
+		Jit::Code code;
+#endif
+	};
+
+	Block* lookup();
+	Block* follow(Block* from);
+	void translate(Block* b);
+	void run(Block* b);
+
+	Cpu& cpu;
+	InstructionCache* icache;
+	/// Blocks by physical address of their first instruction.
+	std::unordered_map<uint64_t, std::unique_ptr<Block>> blocks;
+	/// Block executed by the previous step(), whose links are tried first.
+	Block* last;
+#ifdef WITH_JIT
+	std::unique_ptr<Jit> jit;
+
+	void compile(Block* b);
+#endif
+};
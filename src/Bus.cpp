@@ -11,7 +11,7 @@ bool Bus::addDevice(uint64_t baseaddr, Device* dev)
 	if (!dev)
 		return false;
 	myDevices.push_back(DeviceEntry(baseaddr, dev->size(), dev));
-	devices_sorted = false;
+	std::sort(myDevices.begin(), myDevices.end());
 	return true;
 }
 
@@ -25,45 +25,54 @@ Device* Bus::getDevice(uint64_t baseaddr)
 	return nullptr;
 }
 
-void Bus::ensureSorted() const {
-	if (!devices_sorted) {
-		std::sort(const_cast<std::vector<DeviceEntry>&>(myDevices).begin(), 
-		          const_cast<std::vector<DeviceEntry>&>(myDevices).end());
-		const_cast<bool&>(devices_sorted) = true;
-	}
+uint64_t Bus::load(uint64_t addr, uint8_t size) const
+{
+	AccessResult r = tryLoad(addr, size);
+	if (r.failed())
+		throw(CpuException(r.ex));
+	return r.value;
 }
 
-uint64_t Bus::load(uint64_t addr, uint8_t size) const
+void Bus::store(uint64_t addr, uint8_t size, uint64_t value)
+{
+	Except ex = tryStore(addr, size, value);
+	if (ex != Except::InvalidExcept)
+		throw(CpuException(ex));
+}
+
+const Bus::DeviceEntry* Bus::findDevice(uint64_t addr) const
 {
-	ensureSorted();
-	
 	// Use binary search for faster device lookup
 	auto it = std::lower_bound(myDevices.begin(), myDevices.end(), addr, 
 		[](const DeviceEntry& entry, uint64_t addr) {
 			return entry.end <= addr;
 		});
 	
-	if (it != myDevices.end() && it->base <= addr && addr < it->end) {
-		return it->device->load(addr - it->base, size);
-	}
+	if (it != myDevices.end() && it->base <= addr && addr < it->end)
+		return &*it;
+	return nullptr;
+}
+
+AccessResult Bus::tryLoad(uint64_t addr, uint8_t size) const
+{
+	if (const DeviceEntry* dev = findDevice(addr))
+		return dev->device->tryLoad(addr - dev->base, size);
 
-	throw(CpuException(Except::LoadAccessFault));
+	return AccessResult::fault(Except::LoadAccessFault);
 }
 
-void Bus::store(uint64_t addr, uint8_t size, uint64_t value)
+Except Bus::tryStore(uint64_t addr, uint8_t size, uint64_t value)
 {
-	ensureSorted();
-	
-	// Use binary search for faster device lookup
-	auto it = std::lower_bound(myDevices.begin(), myDevices.end(), addr, 
-		[](const DeviceEntry& entry, uint64_t addr) {
-			return entry.end <= addr;
-		});
-	
-	if (it != myDevices.end() && it->base <= addr && addr < it->end) {
-		it->device->store(addr - it->base, size, value);
-		return;
-	}
+	if (const DeviceEntry* dev = findDevice(addr))
+		return dev->device->tryStore(addr - dev->base, size, value);
 
-	throw(CpuException(Except::StoreAMOAccessFault));
+	return Except::StoreAMOAccessFault;
+}
+
+uint8_t* Bus::dmaSpan(uint64_t addr, uint64_t bytes, bool write)
+{
+	const DeviceEntry* dev = findDevice(addr);
+	if (dev == nullptr || bytes > dev->end - addr)
+		return nullptr;
+	return dev->device->dmaSpan(addr - dev->base, bytes, write);
 }
@@ -1,21 +1,40 @@
 #pragma once
 
 #include "Device.h"
+#include "Wakeup.h"
 
 #include <map>
+#include <mutex>
 #include <algorithm>
 
 class Bus {
 public:
-	Bus() : devices_sorted(false) {}
+	Bus() {}
 	virtual ~Bus() {}
 
 	//! Device configuration
 	bool addDevice(uint64_t baseaddr, Device* dev);
 	Device* getDevice(uint64_t baseaddr);
+	//! Number of devices added, to tell when cached device pointers must be looked up again.
+	size_t deviceCount() const { return myDevices.size(); }
 
 	uint64_t load(uint64_t addr, uint8_t size) const;
 	void store(uint64_t addr, uint8_t size, uint64_t value);
+	//! Same, reporting faults in the result instead of throwing CpuException.
+	AccessResult tryLoad(uint64_t addr, uint8_t size) const;
+	Except tryStore(uint64_t addr, uint8_t size, uint64_t value);
+
+	//! Direct memory access for devices: host address of the guest physical range
+	//! [addr, addr+bytes), or nullptr if the range is not entirely inside one memory device.
+	//! Set `write` when the range is going to be written.
+	uint8_t* dmaSpan(uint64_t addr, uint64_t bytes, bool write);
+
+	//! Notified by the devices interrupting from their own threads, waking the harts in wfi.
+	Wakeup& wakeup() { return idle; }
+
+	//! Taken by the harts around their accesses to the devices other than the RAM, and while
+	//! they service the interrupt sources: the devices only ever see one hart at a time.
+	std::mutex& deviceLock() { return device_mutex; }
 
 protected:
 	struct DeviceEntry {
@@ -28,8 +47,11 @@ protected:
 			return base < other.base;
 		}
 	};
+	//! Sorted by base address, before the harts start.
 	std::vector<DeviceEntry> myDevices;
-	mutable bool devices_sorted;
+	Wakeup idle;
+	std::mutex device_mutex;
 	
-	void ensureSorted() const;
+	//! Device whose range holds `addr`, nullptr if none.
+	const DeviceEntry* findDevice(uint64_t addr) const;
 };
\ No newline at end of file
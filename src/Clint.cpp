@@ -1,11 +1,16 @@
 #include "Clint.h"
 #include "Trap.h"
 
+#include <algorithm>
+
 //------------------------------------------------------------------------------
-Clint::Clint() :
+Clint::Clint(TimeSource s) :
+    source(s),
     mtime(0),
-    mtimecmp(0)
+    base(0),
+    wakeup(nullptr)
 {
+    base = ticks();
 }
 
 //------------------------------------------------------------------------------
@@ -16,8 +21,9 @@ Clint::~Clint()
 //------------------------------------------------------------------------------
 uint64_t Clint::load(uint64_t addr, uint8_t size) const
 {
-    if (size == 64)
-        return load64(addr);
+    // The msip registers are words, the timer registers double words.
+    if (addr < CLINT_MTIMECMP ? size == 32 : size == 64)
+        return addr < CLINT_MTIMECMP ? load32(addr) : load64(addr);
     else
         throw CpuException(Except::LoadAccessFault);
 }
@@ -25,29 +31,119 @@ uint64_t Clint::load(uint64_t addr, uint8_t size) const
 //------------------------------------------------------------------------------
 void Clint::store(uint64_t addr, uint8_t size, uint64_t value)
 {
-    if (size == 64)
-        store64(addr, value);
+    if (addr < CLINT_MTIMECMP ? size == 32 : size == 64)
+    {
+        if (addr < CLINT_MTIMECMP)
+            store32(addr, value);
+        else
+            store64(addr, value);
+    }
     else
         throw CpuException(Except::StoreAMOAccessFault);
 }
 
 //------------------------------------------------------------------------------
-uint64_t Clint::load64(uint64_t addr) const
+void Clint::setInstructionCounter(uint32_t hart, const std::atomic<uint64_t>* counter)
+{
+    // mtime goes on from its current value.
+    if (hart == 0)
+    {
+        mtime = time();
+        harts[0].instret = counter;
+        base = ticks();
+    }
+    else
+        harts[hart].instret = counter;
+    harts[hart].next_update = 0;
+}
+
+//------------------------------------------------------------------------------
+bool Clint::update(uint32_t hart)
 {
-    switch (addr)
+    Hart& h = harts[hart];
+    uint64_t now = time();
+    if (now >= h.mtimecmp)
     {
-    case CLINT_MTIMECMP: return mtimecmp;
-    case CLINT_MTIME: return mtime;
-    default: return 0;
+        // Pending until mtimecmp is written.
+        h.next_update = UINT64_MAX;
+        return true;
     }
+
+    uint64_t count = h.instret ? h.instret->load(std::memory_order_relaxed) : 0;
+    uint64_t wait = h.mtimecmp - now;
+    if (source == TimeSource::Host)
+        wait = CLINT_HOST_POLL;
+    else if (hart != 0)
+        wait = std::min(wait, CLINT_HOST_POLL);
+    if (!h.instret)
+        h.next_update = UINT64_MAX;
+    else
+        h.next_update = wait > UINT64_MAX - count ? UINT64_MAX : count + wait;
+    return false;
+}
+
+//------------------------------------------------------------------------------
+uint64_t Clint::ticksToTimer(uint32_t hart) const
+{
+    uint64_t now = time();
+    uint64_t mtimecmp = harts[hart].mtimecmp;
+    if (now >= mtimecmp)
+        return 0;
+    return mtimecmp == UINT64_MAX ? UINT64_MAX : mtimecmp - now;
+}
+
+//------------------------------------------------------------------------------
+void Clint::slept(uint32_t hart, uint64_t ticks)
+{
+    if (source == TimeSource::Instructions && hart == 0)
+        mtime += ticks;
+    harts[hart].next_update = 0;
+}
+
+//------------------------------------------------------------------------------
+uint64_t Clint::load32(uint64_t addr) const
+{
+    uint64_t hart = (addr - CLINT_MSIP) / 4;
+    return hart < MAX_HARTS ? harts[hart].msip : 0;
+}
+
+//------------------------------------------------------------------------------
+void Clint::store32(uint64_t addr, uint64_t value)
+{
+    uint64_t hart = (addr - CLINT_MSIP) / 4;
+    if (hart >= MAX_HARTS)
+        return;
+    harts[hart].msip = value & 1;
+    if (wakeup)
+        wakeup->notify();
+}
+
+//------------------------------------------------------------------------------
+uint64_t Clint::load64(uint64_t addr) const
+{
+    if (addr == CLINT_MTIME)
+        return time();
+    uint64_t hart = (addr - CLINT_MTIMECMP) / 8;
+    if (addr % 8 == 0 && hart < MAX_HARTS)
+        return harts[hart].mtimecmp;
+    return 0;
 }
  
 //------------------------------------------------------------------------------
 void Clint::store64(uint64_t addr, uint64_t value)
 {
-    switch (addr)
+    if (addr == CLINT_MTIME)
+    {
+        mtime = value;
+        base = ticks();
+        for (Hart& h : harts)
+            h.next_update = 0;
+        return;
+    }
+    uint64_t hart = (addr - CLINT_MTIMECMP) / 8;
+    if (addr % 8 == 0 && hart < MAX_HARTS)
     {
-    case CLINT_MTIMECMP: mtimecmp = value; break;
-    case CLINT_MTIME: mtime = value; break;
+        harts[hart].mtimecmp = value;
+        harts[hart].next_update = 0;
     }
 }
@@ -1,13 +1,22 @@
 #pragma once
 
 #include "Device.h"
+#include "Wakeup.h"
+
+#include <atomic>
+#include <chrono>
+#include <ratio>
 
 //! The clint module contains the core-local interruptor (CLINT). The CLINT
 //! block holds memory-mapped control and status registers associated with
 //! software and timer interrupts. It generates per-hart software interrupts and timer.
 
-/// The address of a mtimecmp register starts. A mtimecmp is a dram mapped machine mode timer
-/// compare register, used to trigger an interrupt when mtimecmp is greater than or equal to mtime.
+/// The address of the msip registers, a word per hart. Bit 0 of a msip is the machine software
+/// interrupt pending bit of its hart, written by the other harts to interrupt it (IPI).
+const uint64_t CLINT_MSIP = 0x0;
+/// The address of a mtimecmp register starts, a double word per hart. A mtimecmp is a dram
+/// mapped machine mode timer compare register, used to trigger an interrupt when mtimecmp is
+/// greater than or equal to mtime.
 const uint64_t CLINT_MTIMECMP = 0x4000;
 /// The address of a timer register. A mtime is a machine mode timer register which runs at a
 /// constant frequency.
@@ -16,11 +25,26 @@ const uint64_t CLINT_MTIME = 0xbff8;
 /// The size of CLINT.
 const uint64_t CLINT_SIZE = 0x10000;
 
+/// Frequency of mtime when it follows the host clock: 10 MHz, as the qemu virt machine.
+const uint64_t CLINT_HOST_FREQUENCY = 10000000;
+/// Instructions run between two looks at the host clock, while the timer is armed.
+const uint64_t CLINT_HOST_POLL = 4096;
+
 /// The core-local interruptor (CLINT).
 class Clint : public Device
 {
 public:
-    Clint();
+    using HostTicks = std::chrono::duration<uint64_t, std::ratio<1, CLINT_HOST_FREQUENCY>>;
+
+    /// What makes mtime advance.
+    enum class TimeSource {
+        /// One tick per instruction retired by hart 0: runs are reproducible, with one hart.
+        Instructions,
+        /// The host monotonic clock, at CLINT_HOST_FREQUENCY.
+        Host,
+    };
+
+    Clint(TimeSource source = TimeSource::Instructions);
     virtual ~Clint();
 
     //! Device Interface
@@ -31,12 +55,62 @@ public:
     //! Get address space size of device
     uint64_t size() const { return CLINT_SIZE; }
 
+    //! The harts call the functions below for themselves, holding the device lock of the bus
+    //! except for deadline().
+
+    /// Count of the instructions retired by `hart`. mtime stands still in
+    /// TimeSource::Instructions until hart 0 gives it; the other harts look at the timer after
+    /// some of theirs.
+    void setInstructionCounter(uint32_t hart, const std::atomic<uint64_t>* counter);
+
+    /// Current value of mtime.
+    uint64_t time() const { return mtime + (ticks() - base); }
+
+    /// Instruction count at which `hart` should call update(): its timer is only looked at on
+    /// this deadline, moved back to 0 when mtime or its mtimecmp are written.
+    uint64_t deadline(uint32_t hart) const { return harts[hart].next_update.load(std::memory_order_relaxed); }
+    /// Return true if mtime reached the mtimecmp of `hart`, its timer interrupt being pending,
+    /// and set its next deadline: when mtime reaches mtimecmp, or the next look at the clock.
+    bool update(uint32_t hart);
+
+    /// Ticks left until mtime reaches the mtimecmp of `hart`, 0 if it did, UINT64_MAX if it
+    /// never will: how long it may sleep waiting for an interrupt, at CLINT_HOST_FREQUENCY.
+    uint64_t ticksToTimer(uint32_t hart) const;
+    /// `hart` slept `ticks` ticks at CLINT_HOST_FREQUENCY, retiring no instruction: mtime counts
+    /// the sleeps of hart 0 in TimeSource::Instructions too.
+    void slept(uint32_t hart, uint64_t ticks);
+
+    /// The machine software interrupt of `hart` is pending.
+    bool softwareInterrupt(uint32_t hart) const { return harts[hart].msip != 0; }
+    /// Notified when a msip is written, for the harts to look at their interrupts.
+    void setWakeup(Wakeup* w) { wakeup = w; }
+
 protected:
+    uint64_t load32(uint64_t addr) const;
+    void store32(uint64_t addr, uint64_t value);
     uint64_t load64(uint64_t addr) const;
     void store64(uint64_t addr, uint64_t value);
 
-    uint64_t mtime;
-    uint64_t mtimecmp;
-};
+    /// Count of the time source, instructions or host ticks.
+    uint64_t ticks() const
+    {
+        if (source == TimeSource::Host)
+            return std::chrono::duration_cast<HostTicks>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        return harts[0].instret ? harts[0].instret->load(std::memory_order_relaxed) : 0;
+    }
 
+    struct Hart {
+        const std::atomic<uint64_t>* instret = nullptr;
+        uint64_t mtimecmp = 0;
+        /// Read by the hart between its instructions, without the lock.
+        std::atomic<uint64_t> next_update{ 0 };
+        uint32_t msip = 0;
+    };
 
+    TimeSource source;
+    /// mtime was `mtime` when the time source was at `base`.
+    uint64_t mtime;
+    uint64_t base;
+    Hart harts[MAX_HARTS];
+    Wakeup* wakeup;
+};
@@ -4,18 +4,26 @@
 #include "Uart.h"
 #include "Plic.h"
 #include "VirtIO.h"
-
+#include "VirtIONet.h"
+#include "Clint.h"
+#include "Memory.h"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <mutex>
 #include <vector>
 #include <string>
 #include <iostream>
 #include <iomanip>
 
 //---------------------------------------------------------
-Cpu::Cpu(Bus& b, uint64_t spinit) :
+Cpu::Cpu(Bus& b, uint64_t spinit, uint32_t hartid) :
 	regs(32, 0),
 	csrs(4096, 0),
 	mode(Mode::Machine),
 	pc(DRAM_BASE),
+	hart(hartid),
 	bus(b),
 	enable_paging(false),
 	page_table(0)
@@ -23,6 +31,7 @@ Cpu::Cpu(Bus& b, uint64_t spinit) :
 	regs[REGSP] = spinit;
 
 	csrs[MISA] = RV64 | RVI | RVU | RVS;
+	csrs[MHARTID] = hartid;
 }
 
 //---------------------------------------------------------
@@ -44,34 +53,132 @@ uint64_t Cpu::readMem(uint64_t addr, uint8_t size) const
 
 
 //---------------------------------------------------------
-uint64_t Cpu::load(uint64_t addr, uint8_t size)
+AccessResult Cpu::load_slow(uint64_t addr, uint8_t size)
 {
-	try {
-		uint64_t p_addr = translate(addr, AccessType::Load);
-		return bus.load(p_addr, size);
+	if (enable_paging)
+	{
+		const Tlb::Entry* e = tlb.find(Tlb::Load, addr);
+		if (e == nullptr)
+		{
+			Except ex = Except::InvalidExcept;
+			e = fill_tlb(addr, AccessType::Load, ex);
+			if (e == nullptr)
+				return AccessResult::fault(ex);
+
+			// The page may be RAM.
+			if (const uint8_t* p = host_address(addr, size, Tlb::Load))
+				return AccessResult::ok(load_host(p, size));
+		}
+		addr = e->ppage | (addr & (PAGE_SIZE - 1));
 	}
-	catch (const CpuException& e)
+	else if (ram == nullptr) [[unlikely]]
 	{
-		e.take_trap(this);
-		if (e.is_fatal())
-			throw CpuFatal(e.what());
-		return 0;
+		find_ram();
+		if (const uint8_t* p = host_address(addr, size, Tlb::Load))
+			return AccessResult::ok(load_host(p, size));
 	}
+
+	// A device register: its read may have side effects on the interrupt sources.
+	irq_check = true;
+	std::lock_guard<std::mutex> lock(bus.deviceLock());
+	return bus.tryLoad(addr, size);
 }
 
 //---------------------------------------------------------
-void Cpu::store(uint64_t addr, uint8_t size, uint64_t value)
+void Cpu::store_slow(uint64_t addr, uint8_t size, uint64_t value)
 {
-	try {
-		uint64_t p_addr = translate(addr, AccessType::Store);
-		bus.store(p_addr, size, value);
+	if (enable_paging)
+	{
+		const Tlb::Entry* e = tlb.find(Tlb::Store, addr);
+		if (e == nullptr)
+		{
+			Except ex = Except::InvalidExcept;
+			e = fill_tlb(addr, AccessType::Store, ex);
+			if (e == nullptr)
+			{
+				raise(ex);
+				return;
+			}
+
+			// The page may be RAM.
+			if (host_address(addr, size, Tlb::Store))
+			{
+				store(addr, size, value);
+				return;
+			}
+		}
+		addr = e->ppage | (addr & (PAGE_SIZE - 1));
 	}
-	catch (const CpuException& e)
+	else if (ram == nullptr) [[unlikely]]
 	{
-		e.take_trap(this);
-		if (e.is_fatal())
-			throw CpuFatal(e.what());
+		find_ram();
+		if (host_address(addr, size, Tlb::Store))
+		{
+			store(addr, size, value);
+			return;
+		}
+	}
+
+	// A device register: a queue notification, a timer compare, an interrupt claim...
+	irq_check = true;
+	Except ex = Except::InvalidExcept;
+	{
+		std::lock_guard<std::mutex> lock(bus.deviceLock());
+		ex = bus.tryStore(addr, size, value);
+	}
+	if (ex != Except::InvalidExcept) [[unlikely]]
+		raise(ex);
+}
+
+//---------------------------------------------------------
+uint8_t* Cpu::amo_address(uint64_t addr, uint8_t size, AccessType access, bool& fault)
+{
+	// Atomic accesses must be naturally aligned on the host as well.
+	fault = false;
+	if (addr % (size / 8) != 0) [[unlikely]]
+	{
+		fault = true;
+		raise(access == AccessType::Load ? Except::LoadAddressMisaligned : Except::StoreAMOAddressMisaligned);
+		return nullptr;
+	}
+	Tlb::Access kind = access == AccessType::Load ? Tlb::Load : Tlb::Store;
+	if (uint8_t* p = host_address(addr, size, kind)) [[likely]]
+		return p;
+
+	if (enable_paging)
+	{
+		Except ex = Except::InvalidExcept;
+		if (tlb.find(kind, addr) == nullptr && fill_tlb(addr, access, ex) == nullptr)
+		{
+			fault = true;
+			raise(ex);
+			return nullptr;
+		}
+	}
+	else if (ram == nullptr)
+		find_ram();
+	return host_address(addr, size, kind);
+}
+
+//---------------------------------------------------------
+void Cpu::find_ram() const
+{
+	ram = dynamic_cast<Memory*>(bus.getDevice(DRAM_BASE));
+#if BYTE_ORDER==LITTLE_ENDIAN
+	if (ram && ram->size())
+	{
+		ram_host = ram->host(0);
+		ram_size = ram->size();
 	}
+#endif
+}
+
+//---------------------------------------------------------
+void Cpu::raise(Except ex)
+{
+	Trap::take_trap(this, ex);
+	if (is_fatal(ex))
+		throw CpuFatal(except_name(ex));
 }
 
 /// Update the physical page number (PPN) and the addressing mode.
@@ -82,21 +189,117 @@ void Cpu::update_paging(uint64_t csr_addr)
 
 	// Read the physical page number (PPN) of the root page table, i.e., its
 	// supervisor physical address divided by 4 KiB.
-	page_table = (load_csr(SATP) & (((uint64_t)1 << 44) - 1)) * PAGE_SIZE;
+	uint64_t root = (load_csr(SATP) & (((uint64_t)1 << 44) - 1)) * PAGE_SIZE;
+
+	// Read the address space identifier (ASID): the TLB keeps the translations of the other
+	// address spaces. The same ASID given to another page table can only hold stale ones.
+	uint16_t asid = ASU16(load_csr(SATP) >> 44);
+	if (asid == tlb.getAsid() && root != page_table)
+		tlb.flushAsid(asid);
+	tlb.setAsid(asid);
+	page_table = root;
 
 	// Read the MODE field, which selects the current address-translation scheme.
 	uint64_t mode = load_csr(SATP) >> 60;
 
 	// Enable the SV39 paging if the value of the mode field is 8.
-	enable_paging = (mode == 8);
+	sv39 = (mode == 8);
+	enable_paging = sv39 && this->mode != Mode::Machine;
+
+	map_epoch++;
+}
+
+//---------------------------------------------------------
+void Cpu::set_mode(Mode m)
+{
+	mode = m;
+	irq_check = true;
+	bool paging = sv39 && mode != Mode::Machine;
+	if (paging != enable_paging)
+	{
+		// The same virtual pc may be somewhere else now.
+		enable_paging = paging;
+		map_epoch++;
+	}
+}
+
+//---------------------------------------------------------
+void Cpu::flush_tlb()
+{
+	tlb.flush();
+	map_epoch++;
 }
 
+static_assert(int(Cpu::AccessType::Instruction) == Tlb::Instruction && int(Cpu::AccessType::Load) == Tlb::Load &&
+	int(Cpu::AccessType::Store) == Tlb::Store, "Tlb::Access follows Cpu::AccessType");
+
 /// Translate a virtual address to a physical address for the paged virtual-dram system.
 uint64_t Cpu::translate(uint64_t addr, AccessType access_type) const
+{
+	AccessResult r = try_translate(addr, access_type);
+	if (r.failed())
+		throw CpuException(r.ex);
+	return r.value;
+}
+
+//---------------------------------------------------------
+AccessResult Cpu::try_translate(uint64_t addr, AccessType access_type) const
 {
 	if (!enable_paging)
-		return addr;
+		return AccessResult::ok(addr);
+
+	const Tlb::Entry* e = tlb.find(Tlb::Access(access_type), addr);
+	if (e == nullptr) [[unlikely]]
+	{
+		Except ex = Except::InvalidExcept;
+		e = fill_tlb(addr, access_type, ex);
+		if (e == nullptr)
+			return AccessResult::fault(ex);
+	}
+	return AccessResult::ok(e->ppage | (addr & (PAGE_SIZE - 1)));
+}
 
+//---------------------------------------------------------
+const Tlb::Entry* Cpu::fill_tlb(uint64_t addr, AccessType access_type, Except& ex) const
+{
+	bool global = false;
+	uint64_t span = PAGE_SIZE;
+	AccessResult r = walk(addr, access_type, global, span);
+	if (r.failed())
+	{
+		ex = r.ex;
+		return nullptr;
+	}
+	uint64_t paddr = r.value;
+
+	if (ram == nullptr)
+		find_ram();
+
+	// Only whole pages of RAM are reached directly.
+	uint8_t* host = nullptr;
+	uint64_t page = (paddr & ~(PAGE_SIZE - 1)) - DRAM_BASE;
+	if (page < ram_size && PAGE_SIZE <= ram_size - page)
+		host = ram_host + page;
+	return tlb.insert(Tlb::Access(access_type), addr, paddr, host, global, span);
+}
+
+//---------------------------------------------------------
+// Page fault raised by an access of type `access_type`.
+static Except pageFault(Cpu::AccessType access_type)
+{
+	switch (access_type)
+	{
+	case Cpu::AccessType::Instruction: return Except::InstructionPageFault;
+	case Cpu::AccessType::Load: return Except::LoadPageFault;
+	default: return Except::StoreAMOPageFault;
+	}
+}
+
+/// Walk the Sv39 page table to translate a virtual address to a physical address.
+/// `global` is set if the mapping belongs to every address space, `span` to the size of the page
+/// or superpage of the leaf PTE.
+AccessResult Cpu::walk(uint64_t addr, AccessType access_type, bool& global, uint64_t& span) const
+{
 	// The following comments are cited from 4.3.2 Virtual Address Translation Process
 	// in "The RISC-V Instruction Set Manual Volume II-Privileged Architecture_20190608".
 
@@ -115,7 +318,10 @@ uint64_t Cpu::translate(uint64_t addr, AccessType access_type) const
 		// "2. Let pte be the value of the PTE at address a+va.vpn[i]×PTESIZE. (For Sv32,
 		//     PTESIZE=4.) If accessing pte violates a PMA or PMP check, raise an access
 		//     exception corresponding to the original access type."
-		pte = bus.load(a + vpnx8[i], 64);
+		AccessResult entry = bus.tryLoad(a + vpnx8[i], 64);
+		if (entry.failed())
+			return entry;
+		pte = entry.value;
 
 		// "3. If pte.v = 0, or if pte.r = 0 and pte.w = 1, stop and raise a page-fault
 		//     exception corresponding to the original access type."
@@ -124,14 +330,12 @@ uint64_t Cpu::translate(uint64_t addr, AccessType access_type) const
 		uint64_t w = (pte >> 2) & 1;
 		uint64_t x = (pte >> 3) & 1;
 		if (v == 0 || (r == 0 && w == 1)) {
-			switch (access_type)
-			{
-			case AccessType::Instruction: throw CpuException(Except::InstructionPageFault);
-			case AccessType::Load: throw CpuException(Except::LoadPageFault);
-			case AccessType::Store: throw CpuException(Except::StoreAMOPageFault);
-			}
+			return AccessResult::fault(pageFault(access_type));
 		}
 
+		// A global PTE makes every mapping below it global too.
+		global |= ((pte >> 5) & 1) != 0;
+
 		// "4. Otherwise, the PTE is valid. If pte.r = 1 or pte.x = 1, go to step 5.
 		//     Otherwise, this PTE is a pointer to the next level of the page table.
 		//     Let i = i − 1. If i < 0, stop and raise a page-fault exception
@@ -145,12 +349,7 @@ uint64_t Cpu::translate(uint64_t addr, AccessType access_type) const
 		a = ppn * PAGE_SIZE;
 		if (i < 0)
 		{
-			switch (access_type)
-			{
-			case AccessType::Instruction: throw CpuException(Except::InstructionPageFault);
-			case AccessType::Load: throw CpuException(Except::LoadPageFault);
-			case AccessType::Store: throw CpuException(Except::StoreAMOPageFault);
-			}
+			return AccessResult::fault(pageFault(access_type));
 		}
 	}
 
@@ -182,36 +381,31 @@ uint64_t Cpu::translate(uint64_t addr, AccessType access_type) const
 	//     va.vpn[i−1:0].
 	//     • pa.ppn[LEVELS−1:i] = pte.ppn[LEVELS−1:i]."
 	uint64_t offset = addr & 0xfff;
+	span = PAGE_SIZE << (9 * i);
 	switch (i)
 	{
 	case 0:
 	{
 		uint64_t ppn = (pte >> 10) & 0x0fffffffffff;
-		return (ppn << 12) | offset;
+		return AccessResult::ok((ppn << 12) | offset);
 	}
 	break;
 	case 1:
 	{
 		// Superpage translation. A superpage is a dram page of larger size than an
 		// ordinary page (4 KiB). It reduces TLB misses and improves performance.
-		return (ppn[2] << 30) | (ppn[1] << 21) | (vpn[0] << 12) | offset;
+		return AccessResult::ok((ppn[2] << 30) | (ppn[1] << 21) | (vpn[0] << 12) | offset);
 	}
 	break;
 	case 2:
 	{
 		// Superpage translation. A superpage is a dram page of larger size than an
 		// ordinary page (4 KiB). It reduces TLB misses and improves performance.
-		return (ppn[2] << 30) | (vpn[1] << 21) | (vpn[0] << 12) | offset;
+		return AccessResult::ok((ppn[2] << 30) | (vpn[1] << 21) | (vpn[0] << 12) | offset);
 	}
 	default:
-		switch (access_type)
-		{
-		case AccessType::Instruction: throw CpuException(Except::InstructionPageFault);
-		case AccessType::Load: throw CpuException(Except::LoadPageFault);
-		case AccessType::Store: throw CpuException(Except::StoreAMOPageFault);
-		}
+		return AccessResult::fault(pageFault(access_type));
 	};
-	return 0;
 }
 
 
@@ -220,6 +414,8 @@ uint64_t Cpu::load_csr(uint64_t addr) const
 {
 	if (addr == SIE)
 		return csrs[MIE] & csrs[MIDELEG];
+	else if (addr == SIP)
+		return csrs[MIP] & csrs[MIDELEG];
 	else
 		return csrs[addr];
 }
@@ -227,8 +423,15 @@ uint64_t Cpu::load_csr(uint64_t addr) const
 //---------------------------------------------------------
 void Cpu::store_csr(uint64_t addr, uint64_t value)
 {
+	irq_check = true;
 	if (addr == SIE)
 		csrs[MIE] = (csrs[MIE] & ~csrs[MIDELEG]) | (value & csrs[MIDELEG]);
+	else if (addr == SIP)
+	{
+		// Only the software interrupt can be raised or cleared by the supervisor.
+		uint64_t mask = csrs[MIDELEG] & MIP_SSIP;
+		csrs[MIP] = (csrs[MIP] & ~mask) | (value & mask);
+	}
 	else
 		csrs[addr] = value;
 }
@@ -254,45 +457,115 @@ void Cpu::decode(uint32_t inst, uint8_t& opcode, uint8_t& rd, uint8_t& rs1, uint
 
 Interrupt Cpu::check_pending_interrupt()
 {
+	if (bus.deviceCount() != cached_devices) [[unlikely]]
+	{
+		std::lock_guard<std::mutex> lock(bus.deviceLock());
+		cached_devices = bus.deviceCount();
+		cached_uart = dynamic_cast<Uart*>(bus.getDevice(UART_BASE));
+		cached_virtio = dynamic_cast<VirtIO*>(bus.getDevice(VIRTIO_BASE));
+		cached_net = dynamic_cast<VirtIONet*>(bus.getDevice(VIRTIO_NET_BASE));
+		cached_clint = dynamic_cast<Clint*>(bus.getDevice(CLINT_BASE));
+		cached_plic = dynamic_cast<Plic*>(bus.getDevice(PLIC_BASE));
+		if (cached_clint)
+		{
+			cached_clint->setInstructionCounter(hart, &instret);
+			cached_clint->setWakeup(&bus.wakeup());
+		}
+		if (cached_plic)
+			cached_plic->setWakeup(&bus.wakeup());
+		if (cached_uart)
+			cached_uart->setPlic(cached_plic);
+		if (cached_virtio)
+			cached_virtio->setPlic(cached_plic);
+		if (cached_net)
+			cached_net->setPlic(cached_plic);
+		irq_check = true;
+	}
+
+	// Nothing to look at between the events which may change the outcome: a CSR write, a mode
+	// change or a MMIO access by the hart, its timer deadline, a notification of the bus wakeup
+	// (a device raising its line, a change in the PLIC, an IPI...).
+	Clint* clint = cached_clint;
+	Plic* plic = cached_plic;
+	uint64_t count = instret.load(std::memory_order_relaxed);
+	if (!irq_check && (!clint || count < clint->deadline(hart)) && bus.wakeup().epoch() == wake_epoch) [[likely]]
+		return Interrupt::InvalidInterrupt;
+	irq_check = false;
+
+	// Notifications from now on cut the next sleep short and bring the hart back here: they may
+	// be missed below.
+	wake_epoch = bus.wakeup().epoch();
+	std::lock_guard<std::mutex> lock(bus.deviceLock());
+
+	// The timer is only looked at on its deadline. MTIP follows mtime >= mtimecmp until taken,
+	// MSIP follows the msip of the hart.
+	if (clint && count >= clint->deadline(hart)) [[unlikely]]
+	{
+		if (clint->update(hart))
+			store_csr(MIP, load_csr(MIP) | MIP_MTIP);
+		else
+			store_csr(MIP, load_csr(MIP) & ~MIP_MTIP);
+	}
+	if (clint)
+	{
+		uint64_t msip = clint->softwareInterrupt(hart) ? MIP_MSIP : 0;
+		if ((load_csr(MIP) & MIP_MSIP) != msip)
+			store_csr(MIP, (load_csr(MIP) & ~MIP_MSIP) | msip);
+	}
+
+	// Hand the disk requests to the VirtIO worker as soon as they are notified, even with
+	// interrupts disabled: the guest keeps running while they are in flight. Frames are moved
+	// as soon as possible too.
+	VirtIO* virtio = cached_virtio;
+	if (virtio && virtio->is_notified())
+		virtio->disk_access(this);
+	VirtIONet* net = cached_net;
+	if (net && net->is_notified())
+		net->process(this);
+
 	// 3.1.6.1 Privilege and Global Interrupt-Enable Stack in mstatus register
 	// "When a hart is executing in privilege mode x, interrupts are globally enabled when x
 	// IE=1 and globally disabled when x IE=0."
+	uint64_t enabled = ~0ULL;
 	switch (mode)
 	{
 	case Mode::Machine:
 	{
 		// Check if the MIE bit is enabled.
 		if (((load_csr(MSTATUS) >> 3) & 1) == 0)
-			return Interrupt::InvalidInterrupt;
+			enabled = 0;
 	}
 	break;
 	case Mode::Supervisor:
 	{
-		// Check if the SIE bit is enabled.
+		// Check if the SIE bit is enabled. Machine interrupts stay enabled below machine mode.
 		if (((load_csr(SSTATUS) >> 1) & 1) == 0)
-			return Interrupt::InvalidInterrupt;
+			enabled = MIP_MEIP | MIP_MSIP | MIP_MTIP;
 	}
 	break;
 	};
 
-	// Check external interrupt for uart.
-	Uart* uart = dynamic_cast<Uart*>(bus.getDevice(UART_BASE));
-	VirtIO* virtio = dynamic_cast<VirtIO*>(bus.getDevice(VIRTIO_BASE));
-
-	uint64_t irq = 0;
-	if (uart && uart->is_interrupting())
-		irq = UART_IRQ;
-	else if (virtio && virtio->is_interrupting())
+	// Service the devices which raised their line, the uart having nothing to do, and request
+	// their interrupt from the PLIC: the disk requests completed, the frames moved. The
+	// machine and supervisor external interrupts follow the two PLIC contexts of the hart,
+	// until claimed.
+	if (plic)
 	{
-		virtio->disk_access(this);
-		irq = VIRTIO_IRQ;
-	}
+		for (uint64_t lines = plic->asserted(); lines != 0; lines &= lines - 1)
+		{
+			uint32_t irq = std::countr_zero(lines);
+			plic->lower(irq);
+			if (irq == VIRTIO_IRQ && virtio && !virtio->complete(this))
+				continue;
+			if (irq == VIRTIO_NET_IRQ && net && !net->complete())
+				continue;
+			plic->trigger(irq);
+		}
 
-	if (irq != 0)
-	{
-		bus.store(PLIC_SCLAIM+PLIC_BASE, 32, irq);
-		//.expect("failed to write an IRQ to the PLIC_SCLAIM");
-		store_csr(MIP, load_csr(MIP) | MIP_SEIP);
+		uint64_t eip = (plic->highest(plic_mcontext(hart)) ? MIP_MEIP : 0) |
+			(plic->highest(plic_scontext(hart)) ? MIP_SEIP : 0);
+		if ((load_csr(MIP) & (MIP_MEIP | MIP_SEIP)) != eip)
+			store_csr(MIP, (load_csr(MIP) & ~(MIP_MEIP | MIP_SEIP)) | eip);
 	}
 
 	// "An interrupt i will be taken if bit i is set in both mip and mie, and if interrupts are globally enabled.
@@ -304,6 +577,9 @@ Interrupt Cpu::check_pending_interrupt()
 	// mode."
 
 	auto pending = load_csr(MIE) & load_csr(MIP);
+	if (pending != 0)
+		waiting = false;
+	pending &= enabled;
 
 	if ((pending & MIP_MEIP) != 0) {
 		store_csr(MIP, load_csr(MIP) & ~MIP_MEIP);
@@ -335,433 +611,91 @@ Interrupt Cpu::check_pending_interrupt()
 
 
 //---------------------------------------------------------
-void Cpu::execute(uint32_t inst, uint8_t opcode, uint8_t rd, uint8_t rs1, uint8_t rs2, uint8_t funct3, uint8_t funct7)
+void Cpu::idle()
 {
-	// Emulate that register x0 is hardwired with all bits equal to 0.
-	regs[0] = 0;
+	// Sleep until the timer expires, if it may wake the hart, or until a device notifies. The
+	// sleep is cut in slices of a second at most.
+	Clint* clint = cached_clint;
+	uint64_t ticks = CLINT_HOST_FREQUENCY;
+	if (clint && (load_csr(MIE) & MIP_MTIP))
+	{
+		std::lock_guard<std::mutex> lock(bus.deviceLock());
+		ticks = std::min(ticks, clint->ticksToTimer(hart));
+	}
 
-	try {
+	auto start = std::chrono::steady_clock::now();
+	bus.wakeup().wait(wake_epoch, start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(Clint::HostTicks(ticks)));
+	if (clint)
+	{
+		auto slept = std::chrono::duration_cast<Clint::HostTicks>(std::chrono::steady_clock::now() - start);
+		std::lock_guard<std::mutex> lock(bus.deviceLock());
+		clint->slept(hart, std::min(ticks, uint64_t(slept.count())));
+	}
+	irq_check = true;
+}
 
-		switch (opcode) {
-		case 0x03: //..................................................................
-		{
-			// imm[11:0] = inst[31:20]
-			int64_t imm = ASI64(ASI32(inst & 0xfff00000) >> 20);
-			uint64_t addr = warppingAdd(regs[rs1], imm);
-			switch (funct3) {
-			case 0x0: regs[rd] = ASU64(ASI64(ASI8(load(addr, 8)))); break;		// lb
-			case 0x1: regs[rd] = ASU64(ASI64(ASI16(load(addr, 16)))); break;	// lh
-			case 0x2: regs[rd] = ASU64(ASI64(ASI32(load(addr, 32)))); break;	// lw
-			case 0x3: regs[rd] = load(addr, 64); break;							// ld
-			case 0x4: regs[rd] = load(addr, 8); break;							// lbu
-			case 0x5: regs[rd] = load(addr, 16); break;							// lhu
-			case 0x6: regs[rd] = load(addr, 32); break;							// lwu
-			default: executeError(opcode, funct3, funct7);
-			};
-		}
-		break;
-		case 0x0f:
-		{
-			// A fence instruction does nothing because this emulator executes an
-			// instruction sequentially on a single thread.
-			if (funct3 == 0x0)
-			{
-				// Fence: Do nothing
-			}
-			else
-				executeError(opcode, funct3, funct7);
-		}
-		break;
+//---------------------------------------------------------
+void Cpu::step()
+{
+	if (waiting) [[unlikely]]
+	{
+		idle();
+		return;
+	}
+	if (!icache) [[unlikely]]
+		initInstructionCache();
 
-		case 0x13: //..................................................................
-		{
-			// imm[11:0] = inst[31:20]
-			int64_t imm = ASI64(ASI32(inst & 0xfff00000)) >> 20;
-			// "The shift amount is encoded in the lower 6 bits of the I-immediate field for RV64I."
-			uint32_t shamt = (imm & 0x3f);
-			switch (funct3) {
-			case 0x0: regs[rd] = warppingAdd(regs[rs1], imm); break;			// addi
-			case 0x1: regs[rd] = regs[rs1] << shamt; break;						// slli
-			case 0x2: regs[rd] = (ASI64(regs[rs1]) < (ASI64(imm))) ? 1 : 0;	break; // slti
-			case 0x3: regs[rd] = (regs[rs1] < ASU64(imm)) ? 1 : 0; break;		// sltiu
-			case 0x4: regs[rd] = regs[rs1] ^ ASU64(imm); break;					// xori
-			case 0x5: // lhu
-				switch (funct7>>1) {
-				case 0x00: regs[rd] = warppingShr(regs[rs1], shamt); break;		// srli
-				case 0x10: regs[rd] = ASU64(warppingShr(ASI64(regs[rs1]), shamt)); break;// srai
-				default: 
-					break;
-				} break;
-			case 0x6: regs[rd] = regs[rs1] | imm; break;						// ori
-			case 0x7: regs[rd] = regs[rs1] & imm; break;						// andi
-			default: executeError(opcode, funct3, funct7);
-			};
-		}
-		break;
-		case 0x17: // auipc //..................................................................
-		{
-			int64_t imm = ASI64(ASI32(inst & 0xfffff000));
-			regs[rd] = warppingSub(warppingAdd(pc, imm), 4);
-		}
-		break;
-		case 0x1b: //..................................................................
-		{
-			// imm[11:0] = inst[31:20]
-			int64_t imm = ASI64(ASI32(inst)) >> 20;
-			// "SLLIW, SRLIW, and SRAIW encodings with imm[5] ̸= 0 are reserved."
-			// "The shift amount is encoded in the lower 6 bits of the I-immediate field for RV64I."
-			uint32_t shamt = (imm & 0x1f);
-			switch (funct3) {
-			case 0x0: regs[rd] = ASU64(ASI64(ASI32(warppingAdd(regs[rs1], imm)))); break;	// addiw
-			case 0x1: regs[rd] = ASU64(ASI64(ASI32(warppingShl(regs[rs1], shamt)))); break;	// slliw
-			case 0x5:
-				switch (funct7) {
-				case 0x00: regs[rd] = ASI32(warppingShr(ASU32(regs[rs1]), shamt)); break;	// srliw
-				case 0x20: regs[rd] = ASU64(ASI64(warppingShr(ASI32(regs[rs1]), shamt))); break; // sraiw
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			default: executeError(opcode, funct3, funct7);
-			};
-		}
-		break;
-		case 0x23: // store //..................................................................
-		{
-			int64_t imm = (ASI64(ASI32(inst & 0xfe000000)) >> 20) | ((inst >> 7) & 0x1f);
-			auto addr = warppingAdd(regs[rs1], imm);
-			switch (funct3) {
-			case 0x0: store(addr, 8, regs[rs2]); break;		// sb
-			case 0x1: store(addr, 16, regs[rs2]); break;	// sh
-			case 0x2: store(addr, 32, regs[rs2]); break;	// sw
-			case 0x3: store(addr, 64, regs[rs2]); break;	// sd
-			default: executeError(opcode, funct3, funct7);
-			};
-		} break;
-		case 0x2f: //..................................................................
-		{
-			// RV64A: "A" standard extension for atomic instructions
-			uint8_t funct5 = (funct7 & 0b1111100) >> 2;
-			uint8_t _aq = (funct7 & 0b0000010) >> 1; // acquire access
-			uint8_t _rl = funct7 & 0b0000001; // release access
-			if (funct3 == 0x02 && funct5 == 0x00) {
-				// amoadd.w
-				uint64_t t = load(regs[rs1], 32);
-				store(regs[rs1], 32, warppingAdd(t, regs[rs2]));
-				regs[rd] = t;
-			}
-			else if (funct3 == 0x3 && funct5 == 0x00) {
-				// amoadd.d
-				uint64_t t = load(regs[rs1], 64);
-				store(regs[rs1], 64, warppingAdd(t, regs[rs2]));
-				regs[rd] = t;
-			}
-			else if (funct3 == 0x2 && funct5 == 0x01) {
-				// amoswap.w
-				uint64_t t = load(regs[rs1], 32);
-				store(regs[rs1], 32, regs[rs2]);
-				regs[rd] = t;
-			}
-			else if (funct3 == 0x3 && funct5 == 0x01) {
-				// amoswap.d
-				uint64_t t = load(regs[rs1], 64);
-				store(regs[rs1], 64, regs[rs2]);
-				regs[rd] = t;
-			}
-			else
-			{
-				executeError(opcode, funct3, funct7);
-			}
-		} break;
-		case 0x33: //..................................................................
-		{
-			// "SLL, SRL, and SRA perform logical left, logical right, and arithmetic right
-			// shifts on the value in register rs1 by the shift amount held in register rs2.
-			// In RV64I, only the low 6 bits of rs2 are considered for the shift amount."
-			uint32_t shamt = regs[rs2] & 0x3f;
-			switch (funct3) {
-			case 0x0:
-				switch (funct7) {
-				case 0x00: regs[rd] = warppingAdd(regs[rs1], regs[rs2]); break;	// add
-				case 0x01: regs[rd] = warppingMul(regs[rs1], regs[rs2]); break;	// mul
-				case 0x20: regs[rd] = warppingSub(regs[rs1], regs[rs2]); break;	// sub
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x1:
-				switch (funct7) {
-				case 0x00: regs[rd] = warppingShl(regs[rs1], shamt); break;		// sll
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x2:
-				switch (funct7) {
-				case 0x00: regs[rd] = (ASI64(regs[rs1]) < ASI64(regs[rs2])) ? 1 : 0; break;	// slt
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x3:
-				switch (funct7) {
-				case 0x00: regs[rd] = (regs[rs1] < regs[rs2]) ? 1 : 0; break;	// sltu
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x4:
-				switch (funct7) {
-				case 0x00: regs[rd] = regs[rs1] ^ regs[rs2]; break;				// xor
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x5:
-				switch (funct7) {
-				case 0x00: regs[rd] = warppingShr(regs[rs1], shamt); break;		// srl
-				case 0x20: regs[rd] = ASU64(warppingShr(ASI64(regs[rs1]), shamt)); break; // sra
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x6:
-				switch (funct7) {
-				case 0x00: regs[rd] = regs[rs1] | regs[rs2]; break;				// or
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x7:
-				switch (funct7) {
-				case 0x00: regs[rd] = regs[rs1] & regs[rs2]; break;				// and
-				default: executeError(opcode, funct3, funct7);
-				}
-				break;
-			default: executeError(opcode, funct3, funct7);
-			};
-		}
-		break;
-		case 0x37: //..................................................................
-			regs[rd] = ASU64(ASI64(ASI32(inst & 0xfffff000))); break;			// lui
-		case 0x3b: //..................................................................
-		{
-			// "The shift amount is given by rs2[4:0]."
-			uint32_t shamt = regs[rs2] & 0x1f;
-			switch (funct3) {
-			case 0x0:
-				switch (funct7) {
-				case 0x00: regs[rd] = ASU64(ASI64(ASI32(warppingAdd(regs[rs1], regs[rs2])))); break;	// addw
-				case 0x20: regs[rd] = ASU64(ASI32(warppingSub(regs[rs1], regs[rs2]))); break;			// subw
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x1:
-				switch (funct7) {
-				case 0x00: regs[rd] = ASU64(ASI32(warppingShl(ASU32(regs[rs1]), shamt))); break;		// sllw
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x5:
-				switch (funct7) {
-				case 0x00: regs[rd] = ASU64(ASI32(warppingShr(ASU32(regs[rs1]), shamt))); break;		// srlw
-				case 0x01:
-					if (regs[rs2] == 0) {
-						regs[rd] = 0xffffffffffffffff;
-					} else {
-						uint32_t result = ASU32(regs[rs1]) / ASU32(regs[rs2]);
-						regs[rd] = ASU64(ASI64(ASI32(result)));
-					}
-					break;		// divuw      // TODO: Set DZ (Divide by Zero) in the FCSR csr flag to 1.
-				case 0x20: regs[rd] = ASU64(ASI32(regs[rs1]) >> ASI32(shamt)); break;				// sraw
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			case 0x7:
-				switch (funct7) {
-				case 0x01: regs[rd] = (regs[rs2] == 0) ? regs[rs1] : warppingRem(ASU32(regs[rs1]), ASU32(regs[rs2])); break;		// remuw
-				default: executeError(opcode, funct3, funct7);
-				} break;
-			default: executeError(opcode, funct3, funct7);
-			};
-		}
-		break;
-		case 0x63: //..................................................................
-		{
-			// imm[12|10:5|4:1|11] = inst[31|30:25|11:8|7]
-			uint64_t imm = ASU64(ASI64(ASI32(inst & 0x80000000)) >> 19)
-				| ((inst & 0x00000080) << 4) // imm[11]
-				| ((inst >> 20) & 0x7e0) // imm[10:5]
-				| ((inst >> 7) & 0x1e); // imm[4:1]
-
-			switch (funct3) {
-			case 0x0: // beq
-				if (regs[rs1] == regs[rs2])
-					pc = warppingSub(warppingAdd(pc, imm), 4);
-				break;
-			case 0x1: // bne
-				if (regs[rs1] != regs[rs2])
-					pc = warppingSub(warppingAdd(pc, imm), 4);
-				break;
-			case 0x4: // blt
-				if (ASI64(regs[rs1]) < ASI64(regs[rs2]))
-					pc = warppingSub(warppingAdd(pc, imm), 4);
-				break;
-			case 0x5: // bge
-				if (ASI64(regs[rs1]) >= ASI64(regs[rs2]))
-					pc = warppingSub(warppingAdd(pc, imm), 4);
-				break;
-			case 0x6: // bltu
-				if (regs[rs1] < regs[rs2])
-					pc = warppingSub(warppingAdd(pc, imm), 4);
-				break;
-			case 0x7: // bgeu
-				if (regs[rs1] >= regs[rs2])
-					pc = warppingSub(warppingAdd(pc, imm), 4);
-				break;
-			default: executeError(opcode, funct3, funct7);
-			};
-		}
-		break;
-		case 0x67: // jalr  //..................................................................
-		{
-			// Note: Don't add 4 because the pc already moved on.
-			auto t = pc;
-			int64_t imm = ASI64(ASI32(inst & 0xfff00000)) >> 20;
-			pc = warppingAdd(regs[rs1], imm) & ~1;
-			regs[rd] = t;
-		}
-		break;
-		case 0x6f: // jal //..................................................................
-		{
-			regs[rd] = pc;
+	// Move the pc first, so that a fault on the fetch is reported at this instruction.
+	uint64_t v_pc = pc;
+	pc += 4;
+	retire(1);
 
-			// imm[20|10:1|11|19:12] = inst[31|30:21|20|19:12]
-			int64_t imm = ASI64(ASI32(inst & 0x80000000) >> 11) // imm[20]
-				| (inst & 0xff000) // imm[19:12]
-				| ((inst >> 9) & 0x800) // imm[11]
-				| ((inst >> 20) & 0x7fe); // imm[10:1]
+	AccessResult p_pc = try_translate(v_pc, AccessType::Instruction);
+	if (p_pc.failed()) [[unlikely]]
+	{
+		raise(p_pc.ex);
+		return;
+	}
 
-			pc = warppingSub(warppingAdd(pc, imm), 4);
-		}
-		break;
-		case 0x73:	//CSRS  //..................................................................
-		{
-			uint64_t csr_addr = ASU64((inst & 0xfff00000) >> 20);
-			switch (funct3) {
-			case 0x0: {
-				if (rs2 == 0x0 && funct7 == 0x0) {
-					// ecall
-					// Makes a request of the execution environment by raising an
-					// environment call exception.
-					switch (mode) {
-					case Mode::User:
-						throw CpuException(Except::EnvironmentCallFromUMode);
-					case Mode::Supervisor:
-						throw CpuException(Except::EnvironmentCallFromSMode);
-					case Mode::Machine:
-						throw CpuException(Except::EnvironmentCallFromMMode);
-					};
-
-				}
-				else if (rs2 == 0x1 && funct7 == 0x0) {
-					// ebreak
-					// Makes a request of the debugger bu raising a Breakpoint
-					// exception.
-					throw CpuException(Except::Breakpoint);
-				}
-				else if (rs2 == 0x2 && funct7 == 0x8) {
-					// sret
-					// The SRET instruction returns from a supervisor-mode exception
-					// handler. It does the following operations:
-					// - Sets the pc to CSRs[sepc].
-					// - Sets the privilege mode to CSRs[sstatus].SPP.
-					// - Sets CSRs[sstatus].SIE to CSRs[sstatus].SPIE.
-					// - Sets CSRs[sstatus].SPIE to 1.
-					// - Sets CSRs[sstatus].SPP to 0.
-					pc = load_csr(SEPC);
-					// When the SRET instruction is executed to return from the trap
-					// handler, the privilege level is set to user mode if the SPP
-					// bit is 0, or supervisor mode if the SPP bit is 1. The SPP bit
-					// is the 8th of the SSTATUS csr.
-					mode = (((load_csr(SSTATUS) >> 8) & 1) == 1) ? Mode::Supervisor : Mode::User;
-					// The SPIE bit is the 5th and the SIE bit is the 1st of the
-					// SSTATUS csr.
-					if (((load_csr(SSTATUS) >> 5) & 1) == 1)
-						store_csr(SSTATUS, load_csr(SSTATUS) | (1 << 1));
-					else
-						store_csr(SSTATUS, load_csr(SSTATUS) & ~(1 << 1));
-					store_csr(SSTATUS, load_csr(SSTATUS) | (1 << 5));
-					store_csr(SSTATUS, load_csr(SSTATUS) & ~(1 << 8));
-				}
-				else if (rs2 == 0x2 && funct7 == 0x18)
-				{
-					// mret
-					// The MRET instruction returns from a machine-mode exception
-					// handler. It does the following operations:
-					// - Sets the pc to CSRs[mepc].
-					// - Sets the privilege mode to CSRs[mstatus].MPP.
-					// - Sets CSRs[mstatus].MIE to CSRs[mstatus].MPIE.
-					// - Sets CSRs[mstatus].MPIE to 1.
-					// - Sets CSRs[mstatus].MPP to 0.
-					pc = load_csr(MEPC);
-					// MPP is two bits wide at [11..12] of the MSTATUS csr.
-					switch ((load_csr(MSTATUS) >> 11) & 0b11) {
-					case 2: mode = Mode::Machine; break;
-					case 1: mode = Mode::Supervisor; break;
-					default: mode = Mode::User; break;
-					};
-
-					// The MPIE bit is the 7th and the MIE bit is the 3rd of the
-					// MSTATUS csr.
-					if (((load_csr(MSTATUS) >> 7) & 1) == 1)
-						store_csr(MSTATUS, load_csr(MSTATUS) | (1 << 3));
-					else
-						store_csr(MSTATUS, load_csr(MSTATUS) & ~(1 << 3));
-
-					store_csr(MSTATUS, load_csr(MSTATUS) | (1 << 7));
-					store_csr(MSTATUS, load_csr(MSTATUS) & ~(0b11 << 11));
-				}
-				else if (funct7 == 0x9)
-				{
-					// sfence.vma
-							// Do nothing.
-				}
-				else
-				{
-					executeError(opcode, funct3, funct7);
-				}
-			} break;
-			case 0x1: // csrrw
-			{
-				auto t = load_csr(csr_addr);
-				store_csr(csr_addr, regs[rs1]);
-				regs[rd] = t;
-				update_paging(csr_addr);
-			} break;
-			case 0x2: // csrrs
-			{
-				auto t = load_csr(csr_addr);
-				store_csr(csr_addr, t | regs[rs1]);
-				regs[rd] = t;
-				update_paging(csr_addr);
-			} break;
-			case 0x3: // csrrc
-			{
-				auto t = load_csr(csr_addr);
-				store_csr(csr_addr, t & (~regs[rs1]));
-				regs[rd] = t;
-				update_paging(csr_addr);
-			} break;
-			case 0x5: // csrrwi
-			{
-				auto zimm = ASU64(rs1);
-				regs[rd] = load_csr(csr_addr);
-				store_csr(csr_addr, zimm);
-				update_paging(csr_addr);
-			} break;
-			case 0x6: // csrrsi
-			{
-				auto zimm = ASU64(rs1);
-				auto t = load_csr(csr_addr);
-				store_csr(csr_addr, t | zimm);
-				regs[rd] = t;
-				update_paging(csr_addr);
-			} break;
-			case 0x7: // csrrci
-			{
-				auto zimm = ASU64(rs1);
-				auto t = load_csr(csr_addr);
-				store_csr(csr_addr, t & (~zimm));
-				regs[rd] = t;
-				update_paging(csr_addr);
-			} break;
-			default: executeError(opcode, funct3, funct7);
-			}
-		} break;
-		default: executeError(opcode, funct3, funct7);
-		}
+	const DecodedInst* d = icache->lookup(p_pc.value);
+	if (d) [[likely]]
+	{
+		execute(*d);
+		return;
+	}
+
+	// Not a RAM address: fetch and decode it the slow way.
+	AccessResult inst = bus.tryLoad(p_pc.value, 32);
+	if (inst.failed())
+		raise(inst.ex);
+	else
+		execute(predecode(ASU32(inst.value)));
+}
+
+//---------------------------------------------------------
+void Cpu::initInstructionCache()
+{
+	Memory* ram = dynamic_cast<Memory*>(bus.getDevice(DRAM_BASE));
+	if (!ram)
+		throw CpuFatal("No RAM at DRAM_BASE");
+	icache.reset(new InstructionCache(*ram));
+}
+
+//---------------------------------------------------------
+// The decoded fields are ignored: predecode extracts them again.
+void Cpu::execute(uint32_t inst, uint8_t /*opcode*/, uint8_t /*rd*/, uint8_t /*rs1*/, uint8_t /*rs2*/, uint8_t /*funct3*/, uint8_t /*funct7*/)
+{
+	execute(predecode(inst));
+}
+
+//---------------------------------------------------------
+void Cpu::execute(const DecodedInst& d)
+{
+	// Emulate that register x0 is hardwired with all bits equal to 0.
+	regs[0] = 0;
+
+	try {
+		d.handler(*this, d);
 	}
 	catch (const CpuException& e)
 	{
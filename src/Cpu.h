@@ -1,11 +1,16 @@
 #pragma once
 
 #include "Bus.h"
+#include "InstructionCache.h"
+#include "Tlb.h"
 #include "Trap.h"
 #include "Uart.h"
 #include "VirtIO.h"
 
 #include <stdint.h>
+#include <atomic>
+#include <cstring>
+#include <memory>
 
 #define REGX0 0
 #define REGX1 1
@@ -13,6 +18,9 @@
 
 class Cpu {
 	friend struct Trap;
+	friend struct Isa;
+	friend class BlockEngine;
+	friend class Jit;
 public:
 	enum class Mode {
 		User = 0x00,
@@ -32,7 +40,8 @@ public:
 	};
 	
 	//! Object 
-	Cpu(Bus& b, uint64_t spinit);
+	//! Harts share the Bus and its devices, each one running on its own thread.
+	Cpu(Bus& b, uint64_t spinit, uint32_t hartid = 0);
 	virtual ~Cpu();
 
 	//! Main loop functions
@@ -41,13 +50,28 @@ public:
 	void execute(uint32_t inst, uint8_t opcode, uint8_t rd, uint8_t rs1, uint8_t rs2, uint8_t funct3, uint8_t funct7);
 	void forwardPC() { pc += 4; }
 
+	//! Run one instruction through the predecoded instruction cache: same as
+	//! fetch/forwardPC/decode/execute, without decoding hot code again.
+	void step();
+
+	//! Decode an instruction word into a record holding its handler.
+	static DecodedInst predecode(uint32_t inst);
+
 	Interrupt check_pending_interrupt();
 
 	/// Update the physical page number (PPN) and the addressing mode.
 	void update_paging(uint64_t csr_addr);
 
+	/// Change the privilege mode. Addresses are not translated in machine mode.
+	void set_mode(Mode m);
+
+	/// Drop every cached translation (sfence.vma x0, x0).
+	void flush_tlb();
+
 	/// Translate a virtual address to a physical address for the paged virtual-dram system.
 	uint64_t translate(uint64_t addr, AccessType access_type) const;
+	/// Same, returning the page fault instead of throwing it.
+	AccessResult try_translate(uint64_t addr, AccessType access_type) const;
 
 
 	//! Utility
@@ -55,6 +79,10 @@ public:
 	void setPC(uint64_t p) { pc = p; }
 	uint64_t getRegister(size_t i) const { return regs[i]; }
 	uint64_t getCsr(size_t i) const { return load_csr(i); }
+	uint64_t getInstret() const { return instret.load(std::memory_order_relaxed); }
+	uint32_t getHartId() const { return hart; }
+	//! A wfi is waiting for an interrupt: step() sleeps instead of running instructions.
+	bool isWaiting() const { return waiting; }
 	uint64_t readMem(uint64_t addr, uint8_t size) const;
 
 	//! Inspection for GUI
@@ -62,8 +90,32 @@ public:
 	const std::vector<uint64_t>& getCsrs() const { return csrs; }
 
 	//! Cpu functions
-	uint64_t load(uint64_t addr, uint8_t size);
-	void store(uint64_t addr, uint8_t size, uint64_t value);
+	//! RAM accesses are done inline on the host memory; any other access goes through the Bus.
+	//! A load returns its fault, leaving it to the caller to raise.
+	AccessResult try_load(uint64_t addr, uint8_t size)
+	{
+		if (const uint8_t* p = host_address(addr, size, Tlb::Load)) [[likely]]
+			return AccessResult::ok(load_host(p, size));
+		return load_slow(addr, size);
+	}
+	//! Same, taking the trap of a fault: the value is then 0.
+	uint64_t load(uint64_t addr, uint8_t size)
+	{
+		AccessResult r = try_load(addr, size);
+		if (r.failed()) [[unlikely]]
+			raise(r.ex);
+		return r.value;
+	}
+	void store(uint64_t addr, uint8_t size, uint64_t value)
+	{
+		if (uint8_t* p = host_address(addr, size, Tlb::Store)) [[likely]]
+		{
+			ram->invalidateCode(p - ram_host, size / 8);
+			store_host(p, size, value);
+			return;
+		}
+		store_slow(addr, size, value);
+	}
 	uint64_t load_csr(uint64_t addr) const;
 	void store_csr(uint64_t addr, uint64_t value);
 
@@ -86,6 +138,81 @@ protected:
 
 	void executeError(uint8_t opcode, uint8_t funct3, uint8_t funct7) const;
 
+	//! Run a predecoded instruction, taking the trap it may raise.
+	void execute(const DecodedInst& d);
+
+	//! Sleep in wfi until a device notifies the bus wakeup, or until the timer expires.
+	void idle();
+
+	//! Host address of an access of `size` bits at `addr`, if it falls in RAM: through the TLB
+	//! when paging is enabled, else in the DRAM_BASE window. Return nullptr for any other access.
+	uint8_t* host_address(uint64_t addr, uint8_t size, Tlb::Access access) const
+	{
+		if (size != 8 && size != 16 && size != 32 && size != 64)
+			return nullptr;
+
+		if (enable_paging)
+		{
+			// Accesses crossing the page go through the Bus, like any other device.
+			const Tlb::Entry* e = tlb.find(access, addr);
+			uint64_t offset = addr & (PAGE_SIZE - 1);
+			if (e && e->host && offset + size / 8 <= PAGE_SIZE)
+				return e->host + offset;
+			return nullptr;
+		}
+
+		uint64_t offset = addr - DRAM_BASE;
+		if (offset < ram_size && size / 8 <= ram_size - offset)
+			return ram_host + offset;
+		return nullptr;
+	}
+
+	//! Accesses to the little-endian RAM; `size` is one of 8, 16, 32 or 64.
+	static uint64_t load_host(const uint8_t* p, uint8_t size)
+	{
+		switch (size)
+		{
+		case 8: return ASU64(*p);
+		case 16: { uint16_t v; std::memcpy(&v, p, sizeof(v)); return ASU64(v); }
+		case 32: { uint32_t v; std::memcpy(&v, p, sizeof(v)); return ASU64(v); }
+		default: { uint64_t v; std::memcpy(&v, p, sizeof(v)); return v; }
+		}
+	}
+	static void store_host(uint8_t* p, uint8_t size, uint64_t value)
+	{
+		switch (size)
+		{
+		case 8: *p = ASU8(value); break;
+		case 16: { uint16_t v = ASU16(value); std::memcpy(p, &v, sizeof(v)); break; }
+		case 32: { uint32_t v = ASU32(value); std::memcpy(p, &v, sizeof(v)); break; }
+		default: std::memcpy(p, &value, sizeof(value)); break;
+		}
+	}
+
+	//! Host address of the `size` bits at `addr` for an atomic access, translated as `access`,
+	//! or nullptr for a device register. Set `fault` when the access trapped.
+	uint8_t* amo_address(uint64_t addr, uint8_t size, AccessType access, bool& fault);
+
+	//! Accesses missing the TLB, or outside of the RAM.
+	AccessResult load_slow(uint64_t addr, uint8_t size);
+	void store_slow(uint64_t addr, uint8_t size, uint64_t value);
+
+	//! Look for the RAM mapped at DRAM_BASE, until found.
+	void find_ram() const;
+
+	//! Take the trap of an exception raised by the current instruction, without unwinding.
+	//! Fatal exceptions are thrown as CpuFatal.
+	void raise(Except ex);
+
+	//! Create the instruction cache over the RAM mapped at DRAM_BASE.
+	void initInstructionCache();
+
+	//! Walk the page table for a TLB miss and cache the translation of the page of `addr`.
+	//! Return nullptr and set `ex` on a page or access fault.
+	const Tlb::Entry* fill_tlb(uint64_t addr, AccessType access_type, Except& ex) const;
+	//! Sv39 page table walk.
+	AccessResult walk(uint64_t addr, AccessType access_type, bool& global, uint64_t& span) const;
+
 	//! internals
 	//! Registers
 	std::vector<uint64_t>	regs;
@@ -95,13 +222,48 @@ protected:
 	Mode		mode;
 	//! program counter
 	uint64_t	pc;
-	//! SV39 paging flag.
+	//! Instructions retired, whole blocks being counted in block mode. The CLINT time base,
+	//! read from the other harts: only this one writes it, without a locked instruction.
+	std::atomic<uint64_t>	instret{ 0 };
+	void retire(uint64_t n) { instret.store(instret.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+	//! mhartid, the index of the hart in the CLINT and the PLIC.
+	const uint32_t hart;
+	//! LR/SC reservation: the RAM word loaded by the last lr, its size in bytes and its value.
+	//! Dropped by sc and by traps.
+	uint8_t* reserved = nullptr;
+	uint8_t reserved_size = 0;
+	uint64_t reserved_value = 0;
+	//! Waiting for an interrupt since a wfi, until one is pending in mip and mie.
+	bool waiting = false;
+	//! Wakeup epoch sampled before the last look at the interrupt sources.
+	uint64_t wake_epoch = 0;
+	//! The interrupt sources must be looked at again: set on the hart events which may change
+	//! the pending interrupts, the devices raising their PLIC line instead.
+	bool irq_check = true;
+	//! SV39 paging flag, set by SATP.
+	bool sv39 = false;
+	//! Addresses are translated: SV39 paging, outside of machine mode.
 	bool enable_paging;
 	/// physical page number (PPN)  PAGE_SIZE (4096).
 	uint64_t page_table;
-	//! Cached device pointers for interrupt checking
+	/// Bumped whenever the virtual to physical mapping may have changed (SATP write, sfence.vma).
+	uint64_t map_epoch = 0;
+	/// Translations of the current page table, filled as pages are accessed.
+	mutable Tlb tlb;
+	/// RAM mapped at DRAM_BASE, found on the first access outside of the TLB and of the window.
+	/// The window is left empty on hosts of another byte order.
+	mutable Memory* ram = nullptr;
+	mutable uint8_t* ram_host = nullptr;
+	mutable uint64_t ram_size = 0;
+	//! Predecoded instructions of the RAM, created on first step().
+	std::unique_ptr<InstructionCache> icache;
+	//! Cached device pointers for interrupt checking, looked up again when devices are added
+	size_t cached_devices = 0;
 	class Uart* cached_uart = nullptr;
 	class VirtIO* cached_virtio = nullptr;
+	class VirtIONet* cached_net = nullptr;
+	class Clint* cached_clint = nullptr;
+	class Plic* cached_plic = nullptr;
 public:
 	Bus& bus;
 };
\ No newline at end of file
@@ -0,0 +1,663 @@
+#include "Cpu.h"
+#include "Defines.h"
+#include "Trap.h"
+#include "Memory.h"
+
+#include <atomic>
+#include <mutex>
+#include <type_traits>
+
+//! Instruction handlers. Each one executes a single predecoded instruction, with the pc already
+//! pointing past it (see Cpu::step).
+struct Isa {
+	typedef const DecodedInst& D;
+
+	//--- Loads ---------------------------------------------------------------
+	// A load which traps leaves rd alone, for the instruction to run again once the fault is
+	// handled. T sign- or zero-extends the value.
+	template <typename T>
+	static void load(Cpu& c, D d)
+	{
+		AccessResult r = c.try_load(c.warppingAdd(c.regs[d.rs1], d.imm), sizeof(T) * 8);
+		if (r.failed()) [[unlikely]]
+		{
+			c.raise(r.ex);
+			return;
+		}
+		c.regs[d.rd] = ASU64(ASI64(T(r.value)));
+	}
+	static void lb(Cpu& c, D d) { load<int8_t>(c, d); }
+	static void lh(Cpu& c, D d) { load<int16_t>(c, d); }
+	static void lw(Cpu& c, D d) { load<int32_t>(c, d); }
+	static void ld(Cpu& c, D d) { load<uint64_t>(c, d); }
+	static void lbu(Cpu& c, D d) { load<uint8_t>(c, d); }
+	static void lhu(Cpu& c, D d) { load<uint16_t>(c, d); }
+	static void lwu(Cpu& c, D d) { load<uint32_t>(c, d); }
+
+	//--- Misc ----------------------------------------------------------------
+	static void nop(Cpu&, D) {}
+	// A fence orders the accesses of the hart for the other harts, running on other threads.
+	static void fence(Cpu&, D) { std::atomic_thread_fence(std::memory_order_seq_cst); }
+	static void illegal(Cpu& c, D d) { c.executeError(d.opcode, d.funct3, d.funct7); }
+
+	//--- OP-IMM --------------------------------------------------------------
+	static void addi(Cpu& c, D d) { c.regs[d.rd] = c.warppingAdd(c.regs[d.rs1], d.imm); }
+	static void slli(Cpu& c, D d) { c.regs[d.rd] = c.regs[d.rs1] << d.imm; }
+	static void slti(Cpu& c, D d) { c.regs[d.rd] = (ASI64(c.regs[d.rs1]) < d.imm) ? 1 : 0; }
+	static void sltiu(Cpu& c, D d) { c.regs[d.rd] = (c.regs[d.rs1] < ASU64(d.imm)) ? 1 : 0; }
+	static void xori(Cpu& c, D d) { c.regs[d.rd] = c.regs[d.rs1] ^ ASU64(d.imm); }
+	static void srli(Cpu& c, D d) { c.regs[d.rd] = c.warppingShr(c.regs[d.rs1], ASU64(d.imm)); }
+	static void srai(Cpu& c, D d) { c.regs[d.rd] = ASU64(c.warppingShr(ASI64(c.regs[d.rs1]), ASU64(d.imm))); }
+	static void ori(Cpu& c, D d) { c.regs[d.rd] = c.regs[d.rs1] | d.imm; }
+	static void andi(Cpu& c, D d) { c.regs[d.rd] = c.regs[d.rs1] & d.imm; }
+
+	//--- U-type --------------------------------------------------------------
+	static void auipc(Cpu& c, D d) { c.regs[d.rd] = c.warppingSub(c.warppingAdd(c.pc, d.imm), 4); }
+	static void lui(Cpu& c, D d) { c.regs[d.rd] = ASU64(d.imm); }
+
+	//--- OP-IMM-32 -----------------------------------------------------------
+	static void addiw(Cpu& c, D d) { c.regs[d.rd] = ASU64(ASI64(ASI32(c.warppingAdd(c.regs[d.rs1], d.imm)))); }
+	static void slliw(Cpu& c, D d) { c.regs[d.rd] = ASU64(ASI64(ASI32(c.warppingShl(c.regs[d.rs1], ASU64(d.imm))))); }
+	static void srliw(Cpu& c, D d) { c.regs[d.rd] = ASI32(c.warppingShr(ASU32(c.regs[d.rs1]), ASU64(d.imm))); }
+	static void sraiw(Cpu& c, D d) { c.regs[d.rd] = ASU64(ASI64(c.warppingShr(ASI32(c.regs[d.rs1]), ASU64(d.imm)))); }
+
+	//--- Stores --------------------------------------------------------------
+	static void sb(Cpu& c, D d) { c.store(c.warppingAdd(c.regs[d.rs1], d.imm), 8, c.regs[d.rs2]); }
+	static void sh(Cpu& c, D d) { c.store(c.warppingAdd(c.regs[d.rs1], d.imm), 16, c.regs[d.rs2]); }
+	static void sw(Cpu& c, D d) { c.store(c.warppingAdd(c.regs[d.rs1], d.imm), 32, c.regs[d.rs2]); }
+	static void sd(Cpu& c, D d) { c.store(c.warppingAdd(c.regs[d.rs1], d.imm), 64, c.regs[d.rs2]); }
+
+	//--- RV64A ---------------------------------------------------------------
+	// The host atomics are sequentially consistent, which covers the aq and rl bits.
+
+	// The read-modify-write of an AMO is atomic for the other harts when it hits the RAM: `op`
+	// applies it to the host word and returns the old value, sign-extended into rd. A device
+	// register is read then written through the bus, under its lock; either access failing is
+	// a single store/AMO access fault, leaving rd alone.
+	template <typename T, typename Op>
+	static void amo(Cpu& c, D d, Op op)
+	{
+		uint64_t addr = c.regs[d.rs1];
+		T src = T(c.regs[d.rs2]);
+		T old;
+		bool fault = false;
+		if (uint8_t* p = c.amo_address(addr, sizeof(T) * 8, Cpu::AccessType::Store, fault))
+		{
+			old = op(std::atomic_ref<T>(*reinterpret_cast<T*>(p)), src);
+			c.ram->invalidateCode(p - c.ram_host, sizeof(T));
+		}
+		else if (fault)
+			return;
+		else
+		{
+			// amo_address left the translation in the TLB.
+			uint64_t paddr = c.try_translate(addr, Cpu::AccessType::Store).value;
+			Except ex = Except::InvalidExcept;
+			c.irq_check = true;
+			{
+				std::lock_guard<std::mutex> lock(c.bus.deviceLock());
+				AccessResult r = c.bus.tryLoad(paddr, sizeof(T) * 8);
+				if (r.failed())
+					ex = Except::StoreAMOAccessFault;
+				else
+				{
+					T value = T(r.value);
+					old = op(std::atomic_ref<T>(value), src);
+					if (c.bus.tryStore(paddr, sizeof(T) * 8, value) != Except::InvalidExcept)
+						ex = Except::StoreAMOAccessFault;
+				}
+			}
+			if (ex != Except::InvalidExcept) [[unlikely]]
+			{
+				c.raise(ex);
+				return;
+			}
+		}
+		c.regs[d.rd] = ASU64(ASI64(std::make_signed_t<T>(old)));
+	}
+	static void amoadd_w(Cpu& c, D d) { amo<uint32_t>(c, d, [](auto a, auto v) { return a.fetch_add(v); }); }
+	static void amoadd_d(Cpu& c, D d) { amo<uint64_t>(c, d, [](auto a, auto v) { return a.fetch_add(v); }); }
+	static void amoswap_w(Cpu& c, D d) { amo<uint32_t>(c, d, [](auto a, auto v) { return a.exchange(v); }); }
+	static void amoswap_d(Cpu& c, D d) { amo<uint64_t>(c, d, [](auto a, auto v) { return a.exchange(v); }); }
+	static void amoxor_w(Cpu& c, D d) { amo<uint32_t>(c, d, [](auto a, auto v) { return a.fetch_xor(v); }); }
+	static void amoxor_d(Cpu& c, D d) { amo<uint64_t>(c, d, [](auto a, auto v) { return a.fetch_xor(v); }); }
+	static void amoand_w(Cpu& c, D d) { amo<uint32_t>(c, d, [](auto a, auto v) { return a.fetch_and(v); }); }
+	static void amoand_d(Cpu& c, D d) { amo<uint64_t>(c, d, [](auto a, auto v) { return a.fetch_and(v); }); }
+	static void amoor_w(Cpu& c, D d) { amo<uint32_t>(c, d, [](auto a, auto v) { return a.fetch_or(v); }); }
+	static void amoor_d(Cpu& c, D d) { amo<uint64_t>(c, d, [](auto a, auto v) { return a.fetch_or(v); }); }
+
+	// min and max have no host instruction: `v` replaces the word while `first` orders it
+	// before, through a compare-and-swap loop.
+	template <typename T, typename First>
+	static T fetch_keep(std::atomic_ref<T> a, T v, First first)
+	{
+		T old = a.load();
+		while (first(v, old) && !a.compare_exchange_weak(old, v)) {}
+		return old;
+	}
+	static void amomin_w(Cpu& c, D d) { amo<uint32_t>(c, d, [](auto a, auto v) { return fetch_keep(a, v, [](int32_t x, int32_t y) { return x < y; }); }); }
+	static void amomin_d(Cpu& c, D d) { amo<uint64_t>(c, d, [](auto a, auto v) { return fetch_keep(a, v, [](int64_t x, int64_t y) { return x < y; }); }); }
+	static void amomax_w(Cpu& c, D d) { amo<uint32_t>(c, d, [](auto a, auto v) { return fetch_keep(a, v, [](int32_t x, int32_t y) { return x > y; }); }); }
+	static void amomax_d(Cpu& c, D d) { amo<uint64_t>(c, d, [](auto a, auto v) { return fetch_keep(a, v, [](int64_t x, int64_t y) { return x > y; }); }); }
+	static void amominu_w(Cpu& c, D d) { amo<uint32_t>(c, d, [](auto a, auto v) { return fetch_keep(a, v, [](uint32_t x, uint32_t y) { return x < y; }); }); }
+	static void amominu_d(Cpu& c, D d) { amo<uint64_t>(c, d, [](auto a, auto v) { return fetch_keep(a, v, [](uint64_t x, uint64_t y) { return x < y; }); }); }
+	static void amomaxu_w(Cpu& c, D d) { amo<uint32_t>(c, d, [](auto a, auto v) { return fetch_keep(a, v, [](uint32_t x, uint32_t y) { return x > y; }); }); }
+	static void amomaxu_d(Cpu& c, D d) { amo<uint64_t>(c, d, [](auto a, auto v) { return fetch_keep(a, v, [](uint64_t x, uint64_t y) { return x > y; }); }); }
+
+	// lr reserves the RAM word it loads, remembering its value; sc stores only if the word still
+	// holds that value, with a compare-and-swap, then drops the reservation. A word written
+	// back to the same value by another hart in between goes unnoticed. A device register is
+	// never reserved.
+	template <typename T>
+	static void lr(Cpu& c, D d)
+	{
+		uint64_t addr = c.regs[d.rs1];
+		bool fault = false;
+		uint8_t* p = c.amo_address(addr, sizeof(T) * 8, Cpu::AccessType::Load, fault);
+		if (fault)
+			return;
+		T value;
+		if (p)
+			value = std::atomic_ref<T>(*reinterpret_cast<T*>(p)).load();
+		else
+		{
+			AccessResult r = c.try_load(addr, sizeof(T) * 8);
+			if (r.failed()) [[unlikely]]
+			{
+				c.raise(r.ex);
+				return;
+			}
+			value = T(r.value);
+		}
+		c.reserved = p;
+		c.reserved_size = sizeof(T);
+		c.reserved_value = value;
+		c.regs[d.rd] = ASU64(ASI64(std::make_signed_t<T>(value)));
+	}
+	template <typename T>
+	static void sc(Cpu& c, D d)
+	{
+		bool fault = false;
+		uint8_t* p = c.amo_address(c.regs[d.rs1], sizeof(T) * 8, Cpu::AccessType::Store, fault);
+		if (fault)
+			return;
+		T expected = T(c.reserved_value);
+		bool stored = p && p == c.reserved && c.reserved_size == sizeof(T) &&
+			std::atomic_ref<T>(*reinterpret_cast<T*>(p)).compare_exchange_strong(expected, T(c.regs[d.rs2]));
+		if (stored)
+			c.ram->invalidateCode(p - c.ram_host, sizeof(T));
+		c.reserved = nullptr;
+		c.regs[d.rd] = stored ? 0 : 1;
+	}
+	static void lr_w(Cpu& c, D d) { lr<uint32_t>(c, d); }
+	static void lr_d(Cpu& c, D d) { lr<uint64_t>(c, d); }
+	static void sc_w(Cpu& c, D d) { sc<uint32_t>(c, d); }
+	static void sc_d(Cpu& c, D d) { sc<uint64_t>(c, d); }
+
+	//--- OP ------------------------------------------------------------------
+	// "SLL, SRL, and SRA perform logical left, logical right, and arithmetic right
+	// shifts on the value in register rs1 by the shift amount held in register rs2.
+	// In RV64I, only the low 6 bits of rs2 are considered for the shift amount."
+	static void add(Cpu& c, D d) { c.regs[d.rd] = c.warppingAdd(c.regs[d.rs1], c.regs[d.rs2]); }
+	static void mul(Cpu& c, D d) { c.regs[d.rd] = c.warppingMul(c.regs[d.rs1], c.regs[d.rs2]); }
+	static void sub(Cpu& c, D d) { c.regs[d.rd] = c.warppingSub(c.regs[d.rs1], c.regs[d.rs2]); }
+	static void sll(Cpu& c, D d) { c.regs[d.rd] = c.warppingShl(c.regs[d.rs1], c.regs[d.rs2] & 0x3f); }
+	static void slt(Cpu& c, D d) { c.regs[d.rd] = (ASI64(c.regs[d.rs1]) < ASI64(c.regs[d.rs2])) ? 1 : 0; }
+	static void sltu(Cpu& c, D d) { c.regs[d.rd] = (c.regs[d.rs1] < c.regs[d.rs2]) ? 1 : 0; }
+	static void xor_(Cpu& c, D d) { c.regs[d.rd] = c.regs[d.rs1] ^ c.regs[d.rs2]; }
+	static void srl(Cpu& c, D d) { c.regs[d.rd] = c.warppingShr(c.regs[d.rs1], c.regs[d.rs2] & 0x3f); }
+	static void sra(Cpu& c, D d) { c.regs[d.rd] = ASU64(c.warppingShr(ASI64(c.regs[d.rs1]), c.regs[d.rs2] & 0x3f)); }
+	static void or_(Cpu& c, D d) { c.regs[d.rd] = c.regs[d.rs1] | c.regs[d.rs2]; }
+	static void and_(Cpu& c, D d) { c.regs[d.rd] = c.regs[d.rs1] & c.regs[d.rs2]; }
+
+	//--- OP-32 ---------------------------------------------------------------
+	// "The shift amount is given by rs2[4:0]."
+	static void addw(Cpu& c, D d) { c.regs[d.rd] = ASU64(ASI64(ASI32(c.warppingAdd(c.regs[d.rs1], c.regs[d.rs2])))); }
+	static void subw(Cpu& c, D d) { c.regs[d.rd] = ASU64(ASI32(c.warppingSub(c.regs[d.rs1], c.regs[d.rs2]))); }
+	static void sllw(Cpu& c, D d) { c.regs[d.rd] = ASU64(ASI32(c.warppingShl(ASU32(c.regs[d.rs1]), c.regs[d.rs2] & 0x1f))); }
+	static void srlw(Cpu& c, D d) { c.regs[d.rd] = ASU64(ASI32(c.warppingShr(ASU32(c.regs[d.rs1]), c.regs[d.rs2] & 0x1f))); }
+	static void sraw(Cpu& c, D d) { c.regs[d.rd] = ASU64(ASI32(c.regs[d.rs1]) >> ASI32(c.regs[d.rs2] & 0x1f)); }
+	static void divuw(Cpu& c, D d)
+	{
+		// TODO: Set DZ (Divide by Zero) in the FCSR csr flag to 1.
+		if (c.regs[d.rs2] == 0)
+			c.regs[d.rd] = 0xffffffffffffffff;
+		else
+			c.regs[d.rd] = ASU64(ASI64(ASI32(ASU32(c.regs[d.rs1]) / ASU32(c.regs[d.rs2]))));
+	}
+	static void remuw(Cpu& c, D d)
+	{
+		c.regs[d.rd] = (c.regs[d.rs2] == 0) ? c.regs[d.rs1] : c.warppingRem(ASU32(c.regs[d.rs1]), ASU32(c.regs[d.rs2]));
+	}
+
+	//--- Branches ------------------------------------------------------------
+	static void beq(Cpu& c, D d) { if (c.regs[d.rs1] == c.regs[d.rs2]) c.pc = c.warppingSub(c.warppingAdd(c.pc, d.imm), 4); }
+	static void bne(Cpu& c, D d) { if (c.regs[d.rs1] != c.regs[d.rs2]) c.pc = c.warppingSub(c.warppingAdd(c.pc, d.imm), 4); }
+	static void blt(Cpu& c, D d) { if (ASI64(c.regs[d.rs1]) < ASI64(c.regs[d.rs2])) c.pc = c.warppingSub(c.warppingAdd(c.pc, d.imm), 4); }
+	static void bge(Cpu& c, D d) { if (ASI64(c.regs[d.rs1]) >= ASI64(c.regs[d.rs2])) c.pc = c.warppingSub(c.warppingAdd(c.pc, d.imm), 4); }
+	static void bltu(Cpu& c, D d) { if (c.regs[d.rs1] < c.regs[d.rs2]) c.pc = c.warppingSub(c.warppingAdd(c.pc, d.imm), 4); }
+	static void bgeu(Cpu& c, D d) { if (c.regs[d.rs1] >= c.regs[d.rs2]) c.pc = c.warppingSub(c.warppingAdd(c.pc, d.imm), 4); }
+
+	//--- Jumps ---------------------------------------------------------------
+	static void jalr(Cpu& c, D d)
+	{
+		// Note: Don't add 4 because the pc already moved on.
+		auto t = c.pc;
+		c.pc = c.warppingAdd(c.regs[d.rs1], d.imm) & ~1;
+		c.regs[d.rd] = t;
+	}
+	static void jal(Cpu& c, D d)
+	{
+		c.regs[d.rd] = c.pc;
+		c.pc = c.warppingSub(c.warppingAdd(c.pc, d.imm), 4);
+	}
+
+	//--- SYSTEM --------------------------------------------------------------
+	static void ecall(Cpu& c, D)
+	{
+		// Makes a request of the execution environment by raising an
+		// environment call exception.
+		switch (c.mode) {
+		case Cpu::Mode::User:
+			c.raise(Except::EnvironmentCallFromUMode);
+			break;
+		case Cpu::Mode::Supervisor:
+			c.raise(Except::EnvironmentCallFromSMode);
+			break;
+		case Cpu::Mode::Machine:
+			c.raise(Except::EnvironmentCallFromMMode);
+			break;
+		};
+	}
+	static void ebreak(Cpu& c, D)
+	{
+		// Makes a request of the debugger bu raising a Breakpoint
+		// exception.
+		c.raise(Except::Breakpoint);
+	}
+	static void sret(Cpu& c, D)
+	{
+		// The SRET instruction returns from a supervisor-mode exception
+		// handler. It does the following operations:
+		// - Sets the pc to CSRs[sepc].
+		// - Sets the privilege mode to CSRs[sstatus].SPP.
+		// - Sets CSRs[sstatus].SIE to CSRs[sstatus].SPIE.
+		// - Sets CSRs[sstatus].SPIE to 1.
+		// - Sets CSRs[sstatus].SPP to 0.
+		c.pc = c.load_csr(SEPC);
+		// When the SRET instruction is executed to return from the trap
+		// handler, the privilege level is set to user mode if the SPP
+		// bit is 0, or supervisor mode if the SPP bit is 1. The SPP bit
+		// is the 8th of the SSTATUS csr.
+		c.set_mode((((c.load_csr(SSTATUS) >> 8) & 1) == 1) ? Cpu::Mode::Supervisor : Cpu::Mode::User);
+		// The SPIE bit is the 5th and the SIE bit is the 1st of the
+		// SSTATUS csr.
+		if (((c.load_csr(SSTATUS) >> 5) & 1) == 1)
+			c.store_csr(SSTATUS, c.load_csr(SSTATUS) | (1 << 1));
+		else
+			c.store_csr(SSTATUS, c.load_csr(SSTATUS) & ~(1 << 1));
+		c.store_csr(SSTATUS, c.load_csr(SSTATUS) | (1 << 5));
+		c.store_csr(SSTATUS, c.load_csr(SSTATUS) & ~(1 << 8));
+	}
+	static void mret(Cpu& c, D)
+	{
+		// The MRET instruction returns from a machine-mode exception
+		// handler. It does the following operations:
+		// - Sets the pc to CSRs[mepc].
+		// - Sets the privilege mode to CSRs[mstatus].MPP.
+		// - Sets CSRs[mstatus].MIE to CSRs[mstatus].MPIE.
+		// - Sets CSRs[mstatus].MPIE to 1.
+		// - Sets CSRs[mstatus].MPP to 0.
+		c.pc = c.load_csr(MEPC);
+		// MPP is two bits wide at [11..12] of the MSTATUS csr.
+		switch ((c.load_csr(MSTATUS) >> 11) & 0b11) {
+		case 3: c.set_mode(Cpu::Mode::Machine); break;
+		case 1: c.set_mode(Cpu::Mode::Supervisor); break;
+		default: c.set_mode(Cpu::Mode::User); break;
+		};
+
+		// The MPIE bit is the 7th and the MIE bit is the 3rd of the
+		// MSTATUS csr.
+		if (((c.load_csr(MSTATUS) >> 7) & 1) == 1)
+			c.store_csr(MSTATUS, c.load_csr(MSTATUS) | (1 << 3));
+		else
+			c.store_csr(MSTATUS, c.load_csr(MSTATUS) & ~(1 << 3));
+
+		c.store_csr(MSTATUS, c.load_csr(MSTATUS) | (1 << 7));
+		c.store_csr(MSTATUS, c.load_csr(MSTATUS) & ~(0b11 << 11));
+	}
+	// wfi: stall the hart until an interrupt is pending, sleeping on the host meanwhile.
+	static void wfi(Cpu& c, D)
+	{
+		c.waiting = true;
+		c.irq_check = true;
+	}
+	// sfence.vma: flush the TLB and the block links, which depend on the mapping.
+	// rs1 selects a virtual address and rs2 an address space, x0 standing for all of them.
+	static void sfence_vma(Cpu& c, D d)
+	{
+		if (d.rs1 == 0 && d.rs2 == 0)
+		{
+			c.flush_tlb();
+			return;
+		}
+
+		uint16_t asid = ASU16(c.regs[d.rs2]);
+		if (d.rs1 == 0)
+			c.tlb.flushAsid(asid);
+		else if (d.rs2 == 0)
+			c.tlb.flushPage(c.regs[d.rs1]);
+		else
+			c.tlb.flushPage(c.regs[d.rs1], asid);
+		c.map_epoch++;
+	}
+
+	static void csrrw(Cpu& c, D d)
+	{
+		auto t = c.load_csr(d.imm);
+		c.store_csr(d.imm, c.regs[d.rs1]);
+		c.regs[d.rd] = t;
+		c.update_paging(d.imm);
+	}
+	static void csrrs(Cpu& c, D d)
+	{
+		auto t = c.load_csr(d.imm);
+		c.store_csr(d.imm, t | c.regs[d.rs1]);
+		c.regs[d.rd] = t;
+		c.update_paging(d.imm);
+	}
+	static void csrrc(Cpu& c, D d)
+	{
+		auto t = c.load_csr(d.imm);
+		c.store_csr(d.imm, t & (~c.regs[d.rs1]));
+		c.regs[d.rd] = t;
+		c.update_paging(d.imm);
+	}
+	static void csrrwi(Cpu& c, D d)
+	{
+		auto zimm = ASU64(d.rs1);
+		c.regs[d.rd] = c.load_csr(d.imm);
+		c.store_csr(d.imm, zimm);
+		c.update_paging(d.imm);
+	}
+	static void csrrsi(Cpu& c, D d)
+	{
+		auto zimm = ASU64(d.rs1);
+		auto t = c.load_csr(d.imm);
+		c.store_csr(d.imm, t | zimm);
+		c.regs[d.rd] = t;
+		c.update_paging(d.imm);
+	}
+	static void csrrci(Cpu& c, D d)
+	{
+		auto zimm = ASU64(d.rs1);
+		auto t = c.load_csr(d.imm);
+		c.store_csr(d.imm, t & (~zimm));
+		c.regs[d.rd] = t;
+		c.update_paging(d.imm);
+	}
+};
+
+//---------------------------------------------------------
+// Dispatch table
+//
+// An instruction is identified by its major opcode (bits 6:2), funct3 and funct7, which index a
+// flat table of operations built at compile time. The handler of the operation is stored in the
+// predecoded record and called through its pointer: computed gotos would be faster to jump
+// through but are not available with MSVC.
+
+namespace {
+
+/// Operations, in the order of their entries in OPS.
+enum Op : uint8_t {
+	OP_ILLEGAL, OP_NOP, OP_FENCE,
+	OP_LB, OP_LH, OP_LW, OP_LD, OP_LBU, OP_LHU, OP_LWU,
+	OP_ADDI, OP_SLLI, OP_SLTI, OP_SLTIU, OP_XORI, OP_SRLI, OP_SRAI, OP_ORI, OP_ANDI,
+	OP_AUIPC, OP_LUI,
+	OP_ADDIW, OP_SLLIW, OP_SRLIW, OP_SRAIW,
+	OP_SB, OP_SH, OP_SW, OP_SD,
+	/// The double word variant of each A instruction follows the word one.
+	OP_AMOADD_W, OP_AMOADD_D, OP_AMOSWAP_W, OP_AMOSWAP_D, OP_LR_W, OP_LR_D, OP_SC_W, OP_SC_D,
+	OP_AMOXOR_W, OP_AMOXOR_D, OP_AMOAND_W, OP_AMOAND_D, OP_AMOOR_W, OP_AMOOR_D,
+	OP_AMOMIN_W, OP_AMOMIN_D, OP_AMOMAX_W, OP_AMOMAX_D, OP_AMOMINU_W, OP_AMOMINU_D, OP_AMOMAXU_W, OP_AMOMAXU_D,
+	OP_ADD, OP_MUL, OP_SUB, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_SRA, OP_OR, OP_AND,
+	OP_ADDW, OP_SUBW, OP_SLLW, OP_SRLW, OP_SRAW, OP_DIVUW, OP_REMUW,
+	OP_BEQ, OP_BNE, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU,
+	OP_JALR, OP_JAL,
+	/// ecall, ebreak, sret, mret and wfi only differ by rs2: see systemOp().
+	OP_SYSTEM,
+	OP_ECALL, OP_EBREAK, OP_SRET, OP_MRET, OP_WFI, OP_SFENCE_VMA,
+	OP_CSRRW, OP_CSRRS, OP_CSRRC, OP_CSRRWI, OP_CSRRSI, OP_CSRRCI,
+	OP_COUNT
+};
+
+/// Immediate encodings.
+enum class Imm : uint8_t { None, I, Shift64, Shift32, S, B, U, J, Csr };
+
+struct OpInfo {
+	DecodedInst::Handler handler;
+	Imm imm;
+};
+
+constexpr OpInfo OPS[OP_COUNT] = {
+	{ &Isa::illegal, Imm::None }, { &Isa::nop, Imm::None }, { &Isa::fence, Imm::None },
+	{ &Isa::lb, Imm::I }, { &Isa::lh, Imm::I }, { &Isa::lw, Imm::I }, { &Isa::ld, Imm::I },
+	{ &Isa::lbu, Imm::I }, { &Isa::lhu, Imm::I }, { &Isa::lwu, Imm::I },
+	{ &Isa::addi, Imm::I }, { &Isa::slli, Imm::Shift64 }, { &Isa::slti, Imm::I }, { &Isa::sltiu, Imm::I },
+	{ &Isa::xori, Imm::I }, { &Isa::srli, Imm::Shift64 }, { &Isa::srai, Imm::Shift64 }, { &Isa::ori, Imm::I },
+	{ &Isa::andi, Imm::I },
+	{ &Isa::auipc, Imm::U }, { &Isa::lui, Imm::U },
+	{ &Isa::addiw, Imm::I }, { &Isa::slliw, Imm::Shift32 }, { &Isa::srliw, Imm::Shift32 }, { &Isa::sraiw, Imm::Shift32 },
+	{ &Isa::sb, Imm::S }, { &Isa::sh, Imm::S }, { &Isa::sw, Imm::S }, { &Isa::sd, Imm::S },
+	{ &Isa::amoadd_w, Imm::None }, { &Isa::amoadd_d, Imm::None }, { &Isa::amoswap_w, Imm::None }, { &Isa::amoswap_d, Imm::None },
+	{ &Isa::lr_w, Imm::None }, { &Isa::lr_d, Imm::None }, { &Isa::sc_w, Imm::None }, { &Isa::sc_d, Imm::None },
+	{ &Isa::amoxor_w, Imm::None }, { &Isa::amoxor_d, Imm::None }, { &Isa::amoand_w, Imm::None }, { &Isa::amoand_d, Imm::None },
+	{ &Isa::amoor_w, Imm::None }, { &Isa::amoor_d, Imm::None },
+	{ &Isa::amomin_w, Imm::None }, { &Isa::amomin_d, Imm::None }, { &Isa::amomax_w, Imm::None }, { &Isa::amomax_d, Imm::None },
+	{ &Isa::amominu_w, Imm::None }, { &Isa::amominu_d, Imm::None }, { &Isa::amomaxu_w, Imm::None }, { &Isa::amomaxu_d, Imm::None },
+	{ &Isa::add, Imm::None }, { &Isa::mul, Imm::None }, { &Isa::sub, Imm::None }, { &Isa::sll, Imm::None },
+	{ &Isa::slt, Imm::None }, { &Isa::sltu, Imm::None }, { &Isa::xor_, Imm::None }, { &Isa::srl, Imm::None },
+	{ &Isa::sra, Imm::None }, { &Isa::or_, Imm::None }, { &Isa::and_, Imm::None },
+	{ &Isa::addw, Imm::None }, { &Isa::subw, Imm::None }, { &Isa::sllw, Imm::None }, { &Isa::srlw, Imm::None },
+	{ &Isa::sraw, Imm::None }, { &Isa::divuw, Imm::None }, { &Isa::remuw, Imm::None },
+	{ &Isa::beq, Imm::B }, { &Isa::bne, Imm::B }, { &Isa::blt, Imm::B }, { &Isa::bge, Imm::B },
+	{ &Isa::bltu, Imm::B }, { &Isa::bgeu, Imm::B },
+	{ &Isa::jalr, Imm::I }, { &Isa::jal, Imm::J },
+	{ &Isa::illegal, Imm::None },
+	{ &Isa::ecall, Imm::Csr }, { &Isa::ebreak, Imm::Csr }, { &Isa::sret, Imm::Csr }, { &Isa::mret, Imm::Csr },
+	{ &Isa::wfi, Imm::None }, { &Isa::sfence_vma, Imm::Csr },
+	{ &Isa::csrrw, Imm::Csr }, { &Isa::csrrs, Imm::Csr }, { &Isa::csrrc, Imm::Csr },
+	{ &Isa::csrrwi, Imm::Csr }, { &Isa::csrrsi, Imm::Csr }, { &Isa::csrrci, Imm::Csr },
+};
+
+/// Operation of the instruction with the major opcode `major` (opcode >> 2), funct3 and funct7.
+constexpr uint8_t classify(uint32_t major, uint32_t funct3, uint32_t funct7)
+{
+	switch ((major << 2) | 0x3) {
+	case 0x03:
+		return funct3 <= 0x6 ? uint8_t(OP_LB + funct3) : uint8_t(OP_ILLEGAL);
+	case 0x0f: // fence
+		return funct3 == 0x0 ? OP_FENCE : OP_ILLEGAL;
+	case 0x13:
+		switch (funct3) {
+		case 0x0: return OP_ADDI;
+		case 0x1: return OP_SLLI;
+		case 0x2: return OP_SLTI;
+		case 0x3: return OP_SLTIU;
+		case 0x4: return OP_XORI;
+		case 0x5: // funct7 bit 0 is shamt[5]
+			return (funct7 >> 1) == 0x00 ? OP_SRLI : (funct7 >> 1) == 0x10 ? OP_SRAI : OP_NOP;
+		case 0x6: return OP_ORI;
+		default: return OP_ANDI;
+		}
+	case 0x17:
+		return OP_AUIPC;
+	case 0x1b:
+		switch (funct3) {
+		case 0x0: return OP_ADDIW;
+		case 0x1: return OP_SLLIW;
+		case 0x5: return funct7 == 0x00 ? OP_SRLIW : funct7 == 0x20 ? OP_SRAIW : OP_ILLEGAL;
+		default: return OP_ILLEGAL;
+		}
+	case 0x23:
+		return funct3 <= 0x3 ? uint8_t(OP_SB + funct3) : uint8_t(OP_ILLEGAL);
+	case 0x2f:
+	{
+		// RV64A: funct7 also holds the aq and rl bits.
+		const uint32_t funct5 = (funct7 & 0b1111100) >> 2;
+		if (funct3 != 0x2 && funct3 != 0x3)
+			return OP_ILLEGAL;
+		const uint8_t d = funct3 == 0x3 ? 1 : 0;
+		switch (funct5) {
+		case 0x00: return uint8_t(OP_AMOADD_W + d);
+		case 0x01: return uint8_t(OP_AMOSWAP_W + d);
+		case 0x02: return uint8_t(OP_LR_W + d);
+		case 0x03: return uint8_t(OP_SC_W + d);
+		case 0x04: return uint8_t(OP_AMOXOR_W + d);
+		case 0x08: return uint8_t(OP_AMOOR_W + d);
+		case 0x0c: return uint8_t(OP_AMOAND_W + d);
+		case 0x10: return uint8_t(OP_AMOMIN_W + d);
+		case 0x14: return uint8_t(OP_AMOMAX_W + d);
+		case 0x18: return uint8_t(OP_AMOMINU_W + d);
+		case 0x1c: return uint8_t(OP_AMOMAXU_W + d);
+		default: return OP_ILLEGAL;
+		}
+	}
+	case 0x33:
+		if (funct7 == 0x00)
+		{
+			const uint8_t ops[] = { OP_ADD, OP_SLL, OP_SLT, OP_SLTU, OP_XOR, OP_SRL, OP_OR, OP_AND };
+			return ops[funct3];
+		}
+		if (funct7 == 0x01 && funct3 == 0x0) return OP_MUL;
+		if (funct7 == 0x20 && funct3 == 0x0) return OP_SUB;
+		if (funct7 == 0x20 && funct3 == 0x5) return OP_SRA;
+		return OP_ILLEGAL;
+	case 0x37:
+		return OP_LUI;
+	case 0x3b:
+		if (funct3 == 0x0 && funct7 == 0x00) return OP_ADDW;
+		if (funct3 == 0x0 && funct7 == 0x20) return OP_SUBW;
+		if (funct3 == 0x1 && funct7 == 0x00) return OP_SLLW;
+		if (funct3 == 0x5 && funct7 == 0x00) return OP_SRLW;
+		if (funct3 == 0x5 && funct7 == 0x01) return OP_DIVUW;
+		if (funct3 == 0x5 && funct7 == 0x20) return OP_SRAW;
+		if (funct3 == 0x7 && funct7 == 0x01) return OP_REMUW;
+		return OP_ILLEGAL;
+	case 0x63:
+	{
+		const uint8_t ops[] = { OP_BEQ, OP_BNE, OP_ILLEGAL, OP_ILLEGAL, OP_BLT, OP_BGE, OP_BLTU, OP_BGEU };
+		return ops[funct3];
+	}
+	case 0x67:
+		return OP_JALR;
+	case 0x6f:
+		return OP_JAL;
+	case 0x73:
+		switch (funct3) {
+		case 0x0:
+			if (funct7 == 0x9) return OP_SFENCE_VMA;
+			return (funct7 == 0x0 || funct7 == 0x8 || funct7 == 0x18) ? OP_SYSTEM : OP_ILLEGAL;
+		case 0x1: return OP_CSRRW;
+		case 0x2: return OP_CSRRS;
+		case 0x3: return OP_CSRRC;
+		case 0x5: return OP_CSRRWI;
+		case 0x6: return OP_CSRRSI;
+		case 0x7: return OP_CSRRCI;
+		default: return OP_ILLEGAL;
+		}
+	}
+	return OP_ILLEGAL;
+}
+
+/// Index in DISPATCH: major opcode in bits 4:0, funct3 in bits 7:5 and funct7 in bits 14:8.
+const size_t DISPATCH_SIZE = 1 << 15;
+
+struct DispatchTable {
+	uint8_t ops[DISPATCH_SIZE];
+};
+
+constexpr DispatchTable buildDispatch()
+{
+	DispatchTable t = {};
+	for (uint32_t i = 0; i < DISPATCH_SIZE; i++)
+		t.ops[i] = classify(i & 0x1f, (i >> 5) & 0x7, i >> 8);
+	return t;
+}
+
+constexpr DispatchTable DISPATCH = buildDispatch();
+
+static_assert(DISPATCH.ops[0x13 >> 2] == OP_ADDI, "addi");
+static_assert(DISPATCH.ops[(0x33 >> 2) | (0x0 << 5) | (0x20 << 8)] == OP_SUB, "sub");
+static_assert(DISPATCH.ops[(0x73 >> 2) | (0x0 << 5) | (0x18 << 8)] == OP_SYSTEM, "mret");
+static_assert(DISPATCH.ops[(0x2f >> 2) | (0x3 << 5) | (0x0f << 8)] == OP_SC_D, "sc.d.aqrl");
+
+uint8_t systemOp(uint8_t rs2, uint8_t funct7)
+{
+	if (rs2 == 0x0 && funct7 == 0x0) return OP_ECALL;
+	if (rs2 == 0x1 && funct7 == 0x0) return OP_EBREAK;
+	if (rs2 == 0x2 && funct7 == 0x8) return OP_SRET;
+	if (rs2 == 0x2 && funct7 == 0x18) return OP_MRET;
+	if (rs2 == 0x5 && funct7 == 0x8) return OP_WFI;
+	return OP_ILLEGAL;
+}
+
+int64_t immediate(uint32_t inst, Imm imm)
+{
+	switch (imm) {
+	case Imm::I: // imm[11:0] = inst[31:20]
+		return ASI64(ASI32(inst)) >> 20;
+	case Imm::Shift64:
+		// "The shift amount is encoded in the lower 6 bits of the I-immediate field for RV64I."
+		return (ASI64(ASI32(inst)) >> 20) & 0x3f;
+	case Imm::Shift32:
+		// "SLLIW, SRLIW, and SRAIW encodings with imm[5] ̸= 0 are reserved."
+		return (ASI64(ASI32(inst)) >> 20) & 0x1f;
+	case Imm::S:
+		return (ASI64(ASI32(inst & 0xfe000000)) >> 20) | ((inst >> 7) & 0x1f);
+	case Imm::B:
+		// imm[12|10:5|4:1|11] = inst[31|30:25|11:8|7]
+		return ASI64(ASU64(ASI64(ASI32(inst & 0x80000000)) >> 19)
+			| ((inst & 0x00000080) << 4) // imm[11]
+			| ((inst >> 20) & 0x7e0) // imm[10:5]
+			| ((inst >> 7) & 0x1e)); // imm[4:1]
+	case Imm::U:
+		return ASI64(ASI32(inst & 0xfffff000));
+	case Imm::J:
+		// imm[20|10:1|11|19:12] = inst[31|30:21|20|19:12]
+		return ASI64(ASI32(inst & 0x80000000) >> 11) // imm[20]
+			| (inst & 0xff000) // imm[19:12]
+			| ((inst >> 9) & 0x800) // imm[11]
+			| ((inst >> 20) & 0x7fe); // imm[10:1]
+	case Imm::Csr: // CSR address
+		return ASI64((inst & 0xfff00000) >> 20);
+	default:
+		return 0;
+	}
+}
+
+} // namespace
+
+//---------------------------------------------------------
+DecodedInst Cpu::predecode(uint32_t inst)
+{
+	DecodedInst d;
+	d.inst = inst;
+	d.opcode = inst & 0x0000007f;
+	d.rd = (inst & 0x00000f80) >> 7;
+	d.rs1 = (inst & 0x000f8000) >> 15;
+	d.rs2 = (inst & 0x01f00000) >> 20;
+	d.funct3 = (inst & 0x00007000) >> 12;
+	d.funct7 = (inst & 0xfe000000) >> 25;
+
+	// 16-bit (compressed) encodings are not supported.
+	uint8_t op = OP_ILLEGAL;
+	if ((inst & 0x3) == 0x3)
+		op = DISPATCH.ops[((inst >> 2) & 0x1f) | (d.funct3 << 5) | (d.funct7 << 8)];
+	if (op == OP_SYSTEM)
+		op = systemOp(d.rs2, d.funct7);
+
+	d.handler = OPS[op].handler;
+	d.imm = immediate(inst, OPS[op].imm);
+	return d;
+}
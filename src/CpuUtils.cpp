@@ -33,6 +33,24 @@ std::vector<Instruction> InstructionSet =
 	{0x2f,0x02,0x04,"amoswap.w"},
 	{0x2f,0x03,0x00,"amoadd.d"},
 	{0x2f,0x03,0x04,"amoswap.d"},
+	{0x2f,0x02,0x08,"lr.w"},
+	{0x2f,0x02,0x0c,"sc.w"},
+	{0x2f,0x02,0x10,"amoxor.w"},
+	{0x2f,0x02,0x20,"amoor.w"},
+	{0x2f,0x02,0x30,"amoand.w"},
+	{0x2f,0x02,0x40,"amomin.w"},
+	{0x2f,0x02,0x50,"amomax.w"},
+	{0x2f,0x02,0x60,"amominu.w"},
+	{0x2f,0x02,0x70,"amomaxu.w"},
+	{0x2f,0x03,0x08,"lr.d"},
+	{0x2f,0x03,0x0c,"sc.d"},
+	{0x2f,0x03,0x10,"amoxor.d"},
+	{0x2f,0x03,0x20,"amoor.d"},
+	{0x2f,0x03,0x30,"amoand.d"},
+	{0x2f,0x03,0x40,"amomin.d"},
+	{0x2f,0x03,0x50,"amomax.d"},
+	{0x2f,0x03,0x60,"amominu.d"},
+	{0x2f,0x03,0x70,"amomaxu.d"},
 	{0x33,0x0,0x0,"add"},
 	{0x33,0x0,0x1,"mul"},
 	{0x33,0x0,0x20,"sub"},
@@ -61,7 +79,7 @@ std::vector<Instruction> InstructionSet =
 	{0x67,(uint8_t)-1,(uint8_t)-1,"jalr"},
 	{0x6f,(uint8_t)-1,(uint8_t)-1,"jal"},
 	{0x73,0x0,0x0,"ecall or ebreak"},
-	{0x73,0x0,0x8,"sret"},
+	{0x73,0x0,0x8,"sret or wfi"},
 	{0x73,0x0,0x18,"mret"},
 	{0x73,0x0,0x9,"sfence.vma (nop)"},
 	{0x73,0x1,(uint8_t)-1,"csrrw"},
@@ -63,6 +63,8 @@ const uint64_t MCAUSE = 0x342;
 const uint64_t MTVAL = 0x343;
 /// Machine interrupt pending.
 const uint64_t MIP = 0x344;
+/// Hardware thread ID.
+const uint64_t MHARTID = 0xf14;
 
 // MIP fields.
 const uint64_t MIP_SSIP = 1 << 1;
@@ -90,6 +92,9 @@ const uint64_t SIP = 0x144;
 /// Supervisor address translation and protection.
 const uint64_t SATP = 0x180;
 
+/// The number of harts the CLINT and the PLIC serve.
+const uint32_t MAX_HARTS = 8;
+
 /// The address which the core-local interruptor (CLINT) starts. It contains the timer and
 /// generates per-hart software interrupts and timer
 /// interrupts.
@@ -108,6 +113,9 @@ const uint64_t UART_BASE = 0x10000000;
 /// The address which virtio starts.
 const uint64_t VIRTIO_BASE = 0x10001000;
 
+/// The address which the virtio network device starts, the next virtio slot of the QEMU virt machine.
+const uint64_t VIRTIO_NET_BASE = 0x10002000;
+
 struct Instruction {
 	uint8_t opcode;
 	uint8_t funct3;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Defines.h"
+#include "Trap.h"
 
 class Device {
 public:
@@ -14,4 +15,33 @@ public:
 
 	//! Get address space size of device
 	virtual uint64_t size() const = 0;
-};
\ No newline at end of file
+
+	//! Accesses reporting faults in their result instead of throwing CpuException.
+	//! By default they catch the exception of load() and store().
+	virtual AccessResult tryLoad(uint64_t addr, uint8_t size) const
+	{
+		try {
+			return AccessResult::ok(load(addr, size));
+		}
+		catch (const CpuException& e)
+		{
+			return AccessResult::fault(e.ex);
+		}
+	}
+
+	virtual Except tryStore(uint64_t addr, uint8_t size, uint64_t value)
+	{
+		try {
+			store(addr, size, value);
+			return Except::InvalidExcept;
+		}
+		catch (const CpuException& e)
+		{
+			return e.ex;
+		}
+	}
+
+	//! Direct memory access: host address of the `bytes` bytes at `addr`, or nullptr if the
+	//! device is not plain memory. Set `write` when the range is going to be written.
+	virtual uint8_t* dmaSpan(uint64_t /*addr*/, uint64_t /*bytes*/, bool /*write*/) { return nullptr; }
+};
@@ -0,0 +1,355 @@
+#include "Disk.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+//------------------------------------------------------------------------------
+MappedDisk::MappedDisk() :
+	image(nullptr),
+	imageSize(0)
+#ifdef _WIN32
+	, mapping(nullptr)
+#endif
+{
+}
+
+//------------------------------------------------------------------------------
+MappedDisk::~MappedDisk()
+{
+	close();
+}
+
+//------------------------------------------------------------------------------
+bool MappedDisk::open(const std::string& file, Mode mode)
+{
+	close();
+	bool shared = mode == Mode::Shared;
+
+#ifdef _WIN32
+	HANDLE handle = CreateFileA(file.c_str(), shared ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (handle == INVALID_HANDLE_VALUE)
+	{
+		std::cerr << "Unable to open: " << file << std::endl;
+		return false;
+	}
+
+	LARGE_INTEGER fsize;
+	if (!GetFileSizeEx(handle, &fsize))
+	{
+		CloseHandle(handle);
+		std::cerr << "Unable to read: " << file << std::endl;
+		return false;
+	}
+	imageSize = fsize.QuadPart;
+	if (imageSize == 0)
+	{
+		CloseHandle(handle);
+		return true;
+	}
+
+	// A copy-on-write view keeps the writes of a private disk in this process.
+	mapping = CreateFileMappingA(handle, nullptr, shared ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(handle);
+	if (mapping != nullptr)
+		image = static_cast<uint8_t*>(MapViewOfFile(mapping, shared ? FILE_MAP_WRITE : FILE_MAP_COPY, 0, 0, 0));
+#else
+	int fd = ::open(file.c_str(), shared ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+	{
+		std::cerr << "Unable to open: " << file << std::endl;
+		return false;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		::close(fd);
+		std::cerr << "Unable to read: " << file << std::endl;
+		return false;
+	}
+	imageSize = st.st_size;
+	if (imageSize == 0)
+	{
+		::close(fd);
+		return true;
+	}
+
+	// A private mapping is copy-on-write: pages written by the guest leave the file untouched.
+	void* p = mmap(nullptr, imageSize, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (p != MAP_FAILED)
+		image = static_cast<uint8_t*>(p);
+#endif
+
+	if (image == nullptr)
+	{
+		close();
+		std::cerr << "Unable to map: " << file << std::endl;
+		return false;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+void MappedDisk::close()
+{
+#ifdef _WIN32
+	if (image)
+		UnmapViewOfFile(image);
+	if (mapping)
+		CloseHandle(mapping);
+	mapping = nullptr;
+#else
+	if (image)
+		munmap(image, imageSize);
+#endif
+	image = nullptr;
+	imageSize = 0;
+}
+
+//------------------------------------------------------------------------------
+bool MappedDisk::read(uint64_t offset, void* dst, uint64_t bytes)
+{
+	if (!inside(offset, bytes))
+		return false;
+	if (bytes)
+		std::memcpy(dst, image + offset, bytes);
+	return true;
+}
+
+//------------------------------------------------------------------------------
+bool MappedDisk::write(uint64_t offset, const void* src, uint64_t bytes)
+{
+	if (!inside(offset, bytes))
+		return false;
+	if (bytes)
+		std::memcpy(image + offset, src, bytes);
+	return true;
+}
+
+//------------------------------------------------------------------------------
+/// Header of a delta file, followed by the bitmap of its blocks.
+struct DeltaHeader {
+	char magic[8];
+	uint64_t blockSize;
+	/// Size of the base image.
+	uint64_t imageSize;
+};
+
+static const char DELTA_MAGIC[8] = { 'R', 'V', 'D', 'E', 'L', 'T', 'A', '1' };
+
+//------------------------------------------------------------------------------
+OverlayDisk::OverlayDisk() :
+	dataStart(0)
+{
+}
+
+//------------------------------------------------------------------------------
+OverlayDisk::~OverlayDisk()
+{
+	close();
+}
+
+//------------------------------------------------------------------------------
+bool OverlayDisk::open(const std::string& baseFile, const std::string& deltaFile)
+{
+	close();
+	if (!base.open(baseFile, MappedDisk::Mode::Private))
+		return false;
+
+	uint64_t blocks = (base.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	bitmap.assign((blocks + 7) / 8, 0);
+	dataStart = (sizeof(DeltaHeader) + bitmap.size() + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+
+	// Existing delta: check it was made over this image.
+	delta.open(deltaFile, std::ios::in | std::ios::out | std::ios::binary);
+	if (delta.is_open())
+	{
+		DeltaHeader header;
+		delta.read(reinterpret_cast<char*>(&header), sizeof(header));
+		delta.read(reinterpret_cast<char*>(bitmap.data()), bitmap.size());
+		if (!delta || std::memcmp(header.magic, DELTA_MAGIC, sizeof(DELTA_MAGIC)) != 0 ||
+			header.blockSize != BLOCK_SIZE || header.imageSize != base.size())
+		{
+			close();
+			std::cerr << "Not a delta of " << baseFile << ": " << deltaFile << std::endl;
+			return false;
+		}
+		return true;
+	}
+
+	// New delta: an empty bitmap, blocks are added as they are written.
+	delta.clear();
+	delta.open(deltaFile, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+	DeltaHeader header;
+	std::memcpy(header.magic, DELTA_MAGIC, sizeof(DELTA_MAGIC));
+	header.blockSize = BLOCK_SIZE;
+	header.imageSize = base.size();
+	delta.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	delta.write(reinterpret_cast<const char*>(bitmap.data()), bitmap.size());
+	delta.flush();
+	if (!delta)
+	{
+		close();
+		std::cerr << "Unable to create: " << deltaFile << std::endl;
+		return false;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+void OverlayDisk::close()
+{
+	if (delta.is_open())
+		delta.close();
+	delta.clear();
+	base.close();
+	bitmap.clear();
+	dataStart = 0;
+}
+
+//------------------------------------------------------------------------------
+bool OverlayDisk::read(uint64_t offset, void* dst, uint64_t bytes)
+{
+	if (!inside(offset, bytes))
+		return false;
+
+	uint8_t* out = static_cast<uint8_t*>(dst);
+	while (bytes)
+	{
+		uint64_t chunk = std::min(bytes, BLOCK_SIZE - offset % BLOCK_SIZE);
+		if (inDelta(offset / BLOCK_SIZE))
+		{
+			delta.seekg(deltaOffset(offset));
+			delta.read(reinterpret_cast<char*>(out), chunk);
+			if (!delta)
+			{
+				delta.clear();
+				return false;
+			}
+		}
+		else
+			base.read(offset, out, chunk);
+
+		offset += chunk;
+		out += chunk;
+		bytes -= chunk;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+bool OverlayDisk::write(uint64_t offset, const void* src, uint64_t bytes)
+{
+	if (!inside(offset, bytes))
+		return false;
+
+	const uint8_t* in = static_cast<const uint8_t*>(src);
+	while (bytes)
+	{
+		uint64_t block = offset / BLOCK_SIZE;
+		uint64_t chunk = std::min(bytes, BLOCK_SIZE - offset % BLOCK_SIZE);
+		if (inDelta(block))
+		{
+			delta.seekp(deltaOffset(offset));
+			delta.write(reinterpret_cast<const char*>(in), chunk);
+		}
+		else
+		{
+			// First write to the block: copy it whole from the base image, patched.
+			uint8_t copy[BLOCK_SIZE];
+			uint64_t start = block * BLOCK_SIZE;
+			uint64_t length = std::min(BLOCK_SIZE, size() - start);
+			base.read(start, copy, length);
+			std::memcpy(copy + (offset - start), in, chunk);
+			delta.seekp(deltaOffset(start));
+			delta.write(reinterpret_cast<const char*>(copy), length);
+
+			// Only then record it in the bitmap.
+			if (delta)
+			{
+				bitmap[block / 8] |= 1 << (block % 8);
+				delta.seekp(sizeof(DeltaHeader) + block / 8);
+				delta.write(reinterpret_cast<const char*>(&bitmap[block / 8]), 1);
+			}
+		}
+		if (!delta)
+		{
+			delta.clear();
+			return false;
+		}
+
+		offset += chunk;
+		in += chunk;
+		bytes -= chunk;
+	}
+	return true;
+}
+
+//------------------------------------------------------------------------------
+uint64_t OverlayDisk::deltaBlocks() const
+{
+	uint64_t blocks = 0;
+	for (uint8_t bits : bitmap)
+		blocks += std::popcount(bits);
+	return blocks;
+}
+
+//------------------------------------------------------------------------------
+bool OverlayDisk::commit(const std::string& baseFile, const std::string& deltaFile)
+{
+	// Opening the overlay would create a missing delta.
+	if (!std::ifstream(deltaFile))
+	{
+		std::cerr << "No delta: " << deltaFile << std::endl;
+		return false;
+	}
+
+	{
+		OverlayDisk overlay;
+		MappedDisk target;
+		if (!overlay.open(baseFile, deltaFile) || !target.open(baseFile, MappedDisk::Mode::Shared))
+			return false;
+
+		uint8_t block[BLOCK_SIZE];
+		for (uint64_t b = 0; b < overlay.bitmap.size() * 8; b++)
+		{
+			if (!overlay.inDelta(b))
+				continue;
+
+			uint64_t start = b * BLOCK_SIZE;
+			uint64_t length = std::min(BLOCK_SIZE, overlay.size() - start);
+			if (!overlay.read(start, block, length) || !target.write(start, block, length))
+			{
+				std::cerr << "Unable to commit block " << b << " of: " << deltaFile << std::endl;
+				return false;
+			}
+		}
+	}
+	return discard(deltaFile);
+}
+
+//------------------------------------------------------------------------------
+bool OverlayDisk::discard(const std::string& deltaFile)
+{
+	if (std::remove(deltaFile.c_str()) != 0)
+	{
+		std::cerr << "Unable to delete: " << deltaFile << std::endl;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/// Backing store of a block device, addressed in bytes.
+class Disk
+{
+public:
+	virtual ~Disk() {}
+
+	/// Size of the image in bytes.
+	virtual uint64_t size() const = 0;
+
+	/// Copy the `bytes` bytes at `offset` of the image. Return false if the range is not
+	/// entirely inside the image.
+	virtual bool read(uint64_t offset, void* dst, uint64_t bytes) = 0;
+	virtual bool write(uint64_t offset, const void* src, uint64_t bytes) = 0;
+
+protected:
+	bool inside(uint64_t offset, uint64_t bytes) const
+	{
+		return offset <= size() && bytes <= size() - offset;
+	}
+};
+
+/// Disk image file mapped in memory: opening is immediate whatever the image size, pages are
+/// read from the file on first access and shared through the page cache by every instance
+/// mapping the same image.
+class MappedDisk : public Disk
+{
+public:
+	enum class Mode {
+		/// Writes stay in this instance and are lost when the disk is closed.
+		Private,
+		/// Writes go through to the image file.
+		Shared
+	};
+
+	MappedDisk();
+	virtual ~MappedDisk();
+	MappedDisk(const MappedDisk&) = delete;
+	MappedDisk& operator=(const MappedDisk&) = delete;
+
+	/// Map `file`, closing the image mapped before. Return false on error.
+	bool open(const std::string& file, Mode mode);
+	void close();
+
+	//! Disk Interface
+	uint64_t size() const { return imageSize; }
+	bool read(uint64_t offset, void* dst, uint64_t bytes);
+	bool write(uint64_t offset, const void* src, uint64_t bytes);
+
+	/// Mapped image, nullptr if none.
+	const uint8_t* data() const { return image; }
+
+protected:
+	uint8_t* image;
+	uint64_t imageSize;
+#ifdef _WIN32
+	/// File mapping object of the view.
+	void* mapping;
+#endif
+};
+
+/// Copy-on-write overlay of a disk image: the base image is only read, so that many instances
+/// can share it, and every block written goes to a per-instance delta file.
+/// The delta file holds a header, the bitmap of the blocks it holds, then each block at its own
+/// offset: blocks never written are holes of a sparse file, costing no disk space.
+class OverlayDisk : public Disk
+{
+public:
+	/// Granularity of the delta.
+	static constexpr uint64_t BLOCK_SIZE = 4096;
+
+	OverlayDisk();
+	virtual ~OverlayDisk();
+
+	/// Open `baseFile` over `deltaFile`, creating an empty delta if it does not exist.
+	/// Return false on error, or if the delta was made over an image of another size.
+	bool open(const std::string& baseFile, const std::string& deltaFile);
+	void close();
+
+	//! Disk Interface
+	uint64_t size() const { return base.size(); }
+	bool read(uint64_t offset, void* dst, uint64_t bytes);
+	bool write(uint64_t offset, const void* src, uint64_t bytes);
+
+	/// Number of blocks held by the delta.
+	uint64_t deltaBlocks() const;
+
+	//! Delta management, on closed disks.
+	/// Write the blocks of `deltaFile` into `baseFile`, then delete the delta. A missing delta is an error.
+	static bool commit(const std::string& baseFile, const std::string& deltaFile);
+	/// Delete `deltaFile`, dropping the writes it holds.
+	static bool discard(const std::string& deltaFile);
+
+protected:
+	bool inDelta(uint64_t block) const { return (bitmap[block / 8] >> (block % 8)) & 1; }
+	/// Offset of `offset` of the image in the delta file.
+	uint64_t deltaOffset(uint64_t offset) const { return dataStart + offset; }
+
+	/// Read only, the mapping being private.
+	MappedDisk base;
+	std::fstream delta;
+	/// One bit per block, set once the block is in the delta.
+	std::vector<uint8_t> bitmap;
+	/// Offset of the first block in the delta file.
+	uint64_t dataStart;
+};
@@ -0,0 +1,45 @@
+#include "InstructionCache.h"
+#include "Cpu.h"
+
+#include <cstring>
+
+//------------------------------------------------------------------------------
+InstructionCache::InstructionCache(Memory& m, uint64_t base) :
+	mem(m),
+	ramBase(base),
+	ramSize(m.size()),
+	pages((m.size() + PAGE_SIZE - 1) / PAGE_SIZE)
+{
+}
+
+//------------------------------------------------------------------------------
+InstructionCache::~InstructionCache()
+{
+}
+
+//------------------------------------------------------------------------------
+void InstructionCache::flush()
+{
+	for (auto&& page : pages)
+		page.reset();
+}
+
+//------------------------------------------------------------------------------
+InstructionCache::Page* InstructionCache::resetPage(uint64_t offset)
+{
+	std::unique_ptr<Page>& page = pages[offset / PAGE_SIZE];
+	if (!page)
+		page.reset(new Page);
+
+	// A null handler marks a record that still has to be decoded.
+	std::memset(page->insts, 0, sizeof(page->insts));
+	page->version = mem.codeVersion(offset);
+	return page.get();
+}
+
+//------------------------------------------------------------------------------
+void InstructionCache::decode(DecodedInst& d, uint64_t offset)
+{
+	d = Cpu::predecode(ASU32(mem.load(offset, 32)));
+	mem.markCode(offset);
+}
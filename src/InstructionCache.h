@@ -0,0 +1,75 @@
+#pragma once
+
+#include "Defines.h"
+#include "Memory.h"
+
+#include <memory>
+#include <vector>
+
+class Cpu;
+
+/// A predecoded instruction. The register fields and the sign-extended immediate are extracted
+/// once, and `handler` points to the routine executing this very instruction.
+struct DecodedInst {
+	typedef void (*Handler)(Cpu& cpu, const DecodedInst& d);
+
+	Handler handler;
+	/// Immediate of the instruction (shift amount for shifts, CSR address for CSR accesses).
+	int64_t imm;
+	uint32_t inst;
+	uint8_t opcode;
+	uint8_t rd;
+	uint8_t rs1;
+	uint8_t rs2;
+	uint8_t funct3;
+	uint8_t funct7;
+};
+
+/// Cache of predecoded instructions keyed by physical address.
+/// Each 4 KiB page of RAM gets an array of records, filled in as instructions are first executed.
+/// Stores to a decoded line bump the page code version in Memory, which resets the page on its
+/// next lookup.
+class InstructionCache
+{
+public:
+	InstructionCache(Memory& m, uint64_t base = DRAM_BASE);
+	virtual ~InstructionCache();
+
+	/// Return the record of the instruction at physical address `paddr`, or nullptr if the
+	/// address is not a 4-byte aligned RAM address.
+	const DecodedInst* lookup(uint64_t paddr)
+	{
+		uint64_t offset = paddr - ramBase;
+		if (offset >= ramSize || (offset & 3) != 0) [[unlikely]]
+			return nullptr;
+
+		Page* page = pages[offset / PAGE_SIZE].get();
+		if (page == nullptr || page->version != mem.codeVersion(offset)) [[unlikely]]
+			page = resetPage(offset);
+
+		DecodedInst& d = page->insts[(offset % PAGE_SIZE) / 4];
+		if (d.handler == nullptr) [[unlikely]]
+			decode(d, offset);
+		return &d;
+	}
+
+	/// Drop every decoded page.
+	void flush();
+
+	/// Code version of the page holding the RAM physical address `paddr`.
+	uint32_t codeVersion(uint64_t paddr) const { return mem.codeVersion(paddr - ramBase); }
+
+protected:
+	struct Page {
+		uint32_t version;
+		DecodedInst insts[PAGE_SIZE / 4];
+	};
+
+	Page* resetPage(uint64_t offset);
+	void decode(DecodedInst& d, uint64_t offset);
+
+	Memory& mem;
+	uint64_t ramBase;
+	uint64_t ramSize;
+	std::vector<std::unique_ptr<Page>> pages;
+};
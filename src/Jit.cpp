@@ -0,0 +1,632 @@
+#include "Jit.h"
+#include "Cpu.h"
+#include "Trap.h"
+
+#if !defined(__x86_64__) || defined(_WIN32)
+#error "The JIT backend emits x86-64 code for the System V ABI"
+#endif
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+/// x86-64 registers, numbered as in their encoding.
+enum Reg : uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+/// Condition codes of jcc/setcc.
+enum Cond : uint8_t { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd };
+
+/// Callee-saved host registers holding guest registers, so that they survive helper calls.
+/// R14 holds the Cpu and R15 the guest register file; the virtual pc of the block is at [rsp].
+const Reg PINNED[] = { RBX, RBP, R12, R13 };
+const size_t PINNED_COUNT = sizeof(PINNED) / sizeof(PINNED[0]);
+
+/// Upper bound of the code emitted for one guest instruction.
+const size_t MAX_INST_CODE = 256;
+
+//------------------------------------------------------------------------------
+/// Minimal x86-64 encoder writing into the code buffer.
+class Emitter
+{
+public:
+	Emitter(uint8_t* p) : cur(p) {}
+
+	uint8_t* pos() const { return cur; }
+
+	void byte(uint8_t b) { *cur++ = b; }
+	void u32(uint32_t v) { std::memcpy(cur, &v, 4); cur += 4; }
+	void u64(uint64_t v) { std::memcpy(cur, &v, 8); cur += 8; }
+
+	void rex(bool w, uint8_t reg, uint8_t rm)
+	{
+		uint8_t r = 0x40 | (w ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((rm & 8) ? 1 : 0);
+		if (r != 0x40)
+			byte(r);
+	}
+	void modrm(uint8_t reg, uint8_t rm) { byte(0xc0 | ((reg & 7) << 3) | (rm & 7)); }
+	void mem(uint8_t reg, Reg base, int32_t disp)
+	{
+		byte(0x80 | ((reg & 7) << 3) | (base & 7));
+		if ((base & 7) == RSP)
+			byte(0x24);
+		u32(uint32_t(disp));
+	}
+
+	/// `op rm, reg` with a register destination.
+	void op(uint8_t opcode, Reg rm, Reg reg, bool w = true) { rex(w, reg, rm); byte(opcode); modrm(reg, rm); }
+	void mov(Reg dst, Reg src) { op(0x89, dst, src); }
+	void add(Reg dst, Reg src) { op(0x01, dst, src); }
+	void sub(Reg dst, Reg src) { op(0x29, dst, src); }
+	void or_(Reg dst, Reg src) { op(0x09, dst, src); }
+	void and_(Reg dst, Reg src) { op(0x21, dst, src); }
+	void xor_(Reg dst, Reg src) { op(0x31, dst, src); }
+	void cmp(Reg a, Reg b) { op(0x39, a, b); }
+	void test(Reg a, Reg b) { op(0x85, a, b); }
+	void zero(Reg dst) { op(0x31, dst, dst, false); }
+
+	void load(Reg dst, Reg base, int32_t disp) { rex(true, dst, base); byte(0x8b); mem(dst, base, disp); }
+	void store(Reg base, int32_t disp, Reg src) { rex(true, src, base); byte(0x89); mem(src, base, disp); }
+
+	void movImm(Reg dst, uint64_t v)
+	{
+		if (ASI64(v) == ASI64(ASI32(v)))
+		{
+			rex(true, 0, dst); byte(0xc7); modrm(0, dst); u32(uint32_t(v));
+		}
+		else if (v <= 0xffffffffull)
+		{
+			rex(false, 0, dst); byte(0xb8 + (dst & 7)); u32(uint32_t(v));
+		}
+		else
+		{
+			rex(true, 0, dst); byte(0xb8 + (dst & 7)); u64(v);
+		}
+	}
+	void addImm(Reg dst, int64_t v)
+	{
+		if (v == 0)
+			return;
+		rex(true, 0, dst); byte(0x81); modrm(0, dst); u32(uint32_t(v));
+	}
+
+	void imul(Reg dst, Reg src) { rex(true, dst, src); byte(0x0f); byte(0xaf); modrm(dst, src); }
+	void mfence() { byte(0x0f); byte(0xae); byte(0xf0); }
+	/// Shifts: kind is 4 (shl), 5 (shr) or 7 (sar).
+	void shiftCl(uint8_t kind, Reg dst, bool w) { rex(w, 0, dst); byte(0xd3); modrm(kind, dst); }
+	void shiftImm(uint8_t kind, Reg dst, uint8_t imm, bool w) { rex(w, 0, dst); byte(0xc1); modrm(kind, dst); byte(imm); }
+
+	void movsx8(Reg dst, Reg src) { rex(true, dst, src); byte(0x0f); byte(0xbe); modrm(dst, src); }
+	void movsx16(Reg dst, Reg src) { rex(true, dst, src); byte(0x0f); byte(0xbf); modrm(dst, src); }
+	void movsx32(Reg dst, Reg src) { rex(true, dst, src); byte(0x63); modrm(dst, src); }
+
+	/// rax = condition ? 1 : 0
+	void setcc(Cond cc) { byte(0x0f); byte(0x90 + cc); modrm(0, RAX); movzx8(RAX); }
+	void movzx8(Reg r) { rex(true, r, r); byte(0x0f); byte(0xb6); modrm(r, r); }
+
+	/// Forward conditional jump, to be resolved with bind().
+	uint8_t* jcc(Cond cc) { byte(0x0f); byte(0x80 + cc); u32(0); return cur; }
+	void bind(uint8_t* from) { int32_t rel = int32_t(cur - from); std::memcpy(from - 4, &rel, 4); }
+
+	void call(const void* fn) { movImm(RAX, uint64_t(fn)); byte(0xff); modrm(2, RAX); }
+	void push(Reg r) { rex(false, 0, r); byte(0x50 + (r & 7)); }
+	void pop(Reg r) { rex(false, 0, r); byte(0x58 + (r & 7)); }
+	void ret() { byte(0xc3); }
+
+protected:
+	uint8_t* cur;
+};
+
+//------------------------------------------------------------------------------
+/// Translation of one block.
+class Translator
+{
+public:
+	Translator(uint8_t* p, const std::vector<DecodedInst>& i, Jit::BlockInfo* bi) :
+		e(p), insts(i), info(bi)
+	{
+		std::fill(std::begin(pinned), std::end(pinned), RSP);
+	}
+
+	// Helpers, see Jit.
+	const void* loadFn;
+	const void* storeFn;
+	const void* interpretFn;
+
+	/// Emit the block, return its entry point.
+	uint8_t* emit();
+	uint8_t* end() const { return e.pos(); }
+
+protected:
+	void allocate();
+	void prologue();
+	void epilogue();
+	void writeback();
+	void reload();
+	void get(Reg host, uint8_t r);
+	void set(uint8_t r, Reg host);
+	void pcInto(Reg host, int64_t offset);
+	void exitIfStopped();
+
+	bool native(const DecodedInst& d, uint64_t offset);
+	void interpret(const DecodedInst& d, uint64_t offset);
+	void loadOp(const DecodedInst& d, uint64_t offset);
+	void storeOp(const DecodedInst& d, uint64_t offset);
+	void branch(Cond notTaken, const DecodedInst& d, uint64_t offset);
+
+	Emitter e;
+	const std::vector<DecodedInst>& insts;
+	Jit::BlockInfo* info;
+	/// Host register of each guest register, RSP when it lives in memory.
+	Reg pinned[32];
+};
+
+//------------------------------------------------------------------------------
+void Translator::allocate()
+{
+	// Pin the guest registers used the most in the block.
+	int uses[32] = {};
+	for (const DecodedInst& d : insts)
+	{
+		uses[d.rd]++;
+		uses[d.rs1]++;
+		uses[d.rs2]++;
+	}
+	uses[0] = 0;
+
+	for (size_t k = 0; k < PINNED_COUNT; k++)
+	{
+		int best = 0;
+		for (int r = 1; r < 32; r++)
+		{
+			if (pinned[r] == RSP && uses[r] > uses[best])
+				best = r;
+		}
+		if (uses[best] < 2)
+			break;
+		pinned[best] = PINNED[k];
+	}
+}
+
+//------------------------------------------------------------------------------
+void Translator::prologue()
+{
+	e.push(RBX); e.push(RBP); e.push(R12); e.push(R13); e.push(R14); e.push(R15);
+	// Room for the block pc, which also aligns the stack on 16 bytes for the helper calls.
+	e.rex(true, 0, RSP); e.byte(0x83); e.modrm(5, RSP); e.byte(8);
+	e.mov(R14, RDI);
+	e.mov(R15, RSI);
+	e.store(RSP, 0, RDX);
+	reload();
+}
+
+//------------------------------------------------------------------------------
+/// Leave the block, returning rax.
+void Translator::epilogue()
+{
+	writeback();
+	e.rex(true, 0, RSP); e.byte(0x83); e.modrm(0, RSP); e.byte(8);
+	e.pop(R15); e.pop(R14); e.pop(R13); e.pop(R12); e.pop(RBP); e.pop(RBX);
+	e.ret();
+}
+
+//------------------------------------------------------------------------------
+void Translator::writeback()
+{
+	for (int r = 1; r < 32; r++)
+		if (pinned[r] != RSP)
+			e.store(R15, r * 8, pinned[r]);
+}
+
+//------------------------------------------------------------------------------
+void Translator::reload()
+{
+	for (int r = 1; r < 32; r++)
+		if (pinned[r] != RSP)
+			e.load(pinned[r], R15, r * 8);
+}
+
+//------------------------------------------------------------------------------
+void Translator::get(Reg host, uint8_t r)
+{
+	if (r == 0)
+		e.zero(host);
+	else if (pinned[r] != RSP)
+		e.mov(host, pinned[r]);
+	else
+		e.load(host, R15, r * 8);
+}
+
+//------------------------------------------------------------------------------
+void Translator::set(uint8_t r, Reg host)
+{
+	if (r == 0)
+		return;
+	if (pinned[r] != RSP)
+		e.mov(pinned[r], host);
+	else
+		e.store(R15, r * 8, host);
+}
+
+//------------------------------------------------------------------------------
+/// host = virtual pc of the block + offset
+void Translator::pcInto(Reg host, int64_t offset)
+{
+	e.load(host, RSP, 0);
+	e.addImm(host, offset);
+}
+
+//------------------------------------------------------------------------------
+/// Leave with KEEP_PC when the helper just called returned stop (rdx).
+void Translator::exitIfStopped()
+{
+	e.test(RDX, RDX);
+	uint8_t* go = e.jcc(CC_E);
+	e.movImm(RAX, Jit::KEEP_PC);
+	epilogue();
+	e.bind(go);
+}
+
+//------------------------------------------------------------------------------
+uint8_t* Translator::emit()
+{
+	uint8_t* start = e.pos();
+	allocate();
+	prologue();
+
+	for (size_t i = 0; i < insts.size(); i++)
+	{
+		const DecodedInst& d = insts[i];
+		const uint64_t offset = i * 4;
+
+		if (!native(d, offset))
+			interpret(d, offset);
+		else if (d.opcode == 0x63 || d.opcode == 0x67 || d.opcode == 0x6f)
+			return start; // branches and jumps leave the block themselves
+	}
+
+	// Fall through to the next instruction.
+	pcInto(RAX, insts.size() * 4);
+	epilogue();
+	return start;
+}
+
+//------------------------------------------------------------------------------
+/// Call the interpreter handler of an instruction that is not translated.
+void Translator::interpret(const DecodedInst& d, uint64_t offset)
+{
+	writeback();
+	e.mov(RDI, R14);
+	e.movImm(RSI, uint64_t(&d));
+	pcInto(RDX, offset + 4);
+	e.movImm(RCX, uint64_t(info));
+	e.call(interpretFn);
+	reload();
+	exitIfStopped();
+}
+
+//------------------------------------------------------------------------------
+void Translator::loadOp(const DecodedInst& d, uint64_t offset)
+{
+	static const uint8_t sizes[] = { 8, 16, 32, 64, 8, 16, 32 };
+	get(RSI, d.rs1);
+	e.addImm(RSI, d.imm);
+	e.mov(RDI, R14);
+	pcInto(RDX, offset + 4);
+	e.movImm(RCX, sizes[d.funct3]);
+	e.movImm(R8, uint64_t(info));
+	e.call(loadFn);
+
+	switch (d.funct3) {
+	case 0x0: e.movsx8(RAX, RAX); break;
+	case 0x1: e.movsx16(RAX, RAX); break;
+	case 0x2: e.movsx32(RAX, RAX); break;
+	}
+	// Like the interpreter, rd is left alone when the access traps.
+	exitIfStopped();
+	set(d.rd, RAX);
+}
+
+//------------------------------------------------------------------------------
+void Translator::storeOp(const DecodedInst& d, uint64_t offset)
+{
+	static const uint8_t sizes[] = { 8, 16, 32, 64 };
+	get(RSI, d.rs1);
+	e.addImm(RSI, d.imm);
+	get(RDX, d.rs2);
+	e.mov(RDI, R14);
+	pcInto(RCX, offset + 4);
+	e.movImm(R8, sizes[d.funct3]);
+	e.movImm(R9, uint64_t(info));
+	e.call(storeFn);
+	exitIfStopped();
+}
+
+//------------------------------------------------------------------------------
+void Translator::branch(Cond notTaken, const DecodedInst& d, uint64_t offset)
+{
+	get(RAX, d.rs1);
+	get(RCX, d.rs2);
+	e.cmp(RAX, RCX);
+	uint8_t* skip = e.jcc(notTaken);
+	pcInto(RAX, offset);
+	e.addImm(RAX, d.imm);
+	epilogue();
+	e.bind(skip);
+	pcInto(RAX, offset + 4);
+	epilogue();
+}
+
+//------------------------------------------------------------------------------
+/// Emit the native code of an instruction, following the interpreter handler picked by
+/// Cpu::predecode. Return false for instructions left to the interpreter.
+bool Translator::native(const DecodedInst& d, uint64_t offset)
+{
+	const uint8_t f3 = d.funct3;
+	const uint8_t f7 = d.funct7;
+
+	switch (d.opcode) {
+	case 0x03: // loads
+		if (f3 == 0x7)
+			return false;
+		loadOp(d, offset);
+		return true;
+
+	case 0x0f: // fence, for the other harts
+		if (f3 != 0x0)
+			return false;
+		e.mfence();
+		return true;
+
+	case 0x13: // OP-IMM
+		if (f3 == 0x5 && (f7 >> 1) != 0x00 && (f7 >> 1) != 0x10)
+			return true; // nop
+		if (d.rd == 0)
+			return true;
+		get(RAX, d.rs1);
+		switch (f3) {
+		case 0x0: e.addImm(RAX, d.imm); break;
+		case 0x1: e.shiftImm(4, RAX, uint8_t(d.imm), true); break;
+		case 0x2: e.movImm(RCX, d.imm); e.cmp(RAX, RCX); e.setcc(CC_L); break;
+		case 0x3: e.movImm(RCX, d.imm); e.cmp(RAX, RCX); e.setcc(CC_B); break;
+		case 0x4: e.movImm(RCX, d.imm); e.xor_(RAX, RCX); break;
+		case 0x5: e.shiftImm((f7 >> 1) == 0x10 ? 7 : 5, RAX, uint8_t(d.imm), true); break;
+		case 0x6: e.movImm(RCX, d.imm); e.or_(RAX, RCX); break;
+		case 0x7: e.movImm(RCX, d.imm); e.and_(RAX, RCX); break;
+		}
+		set(d.rd, RAX);
+		return true;
+
+	case 0x17: // auipc
+		pcInto(RAX, offset);
+		e.addImm(RAX, d.imm);
+		set(d.rd, RAX);
+		return true;
+
+	case 0x1b: // OP-IMM-32
+		if (f3 == 0x0)
+		{
+			get(RAX, d.rs1);
+			e.addImm(RAX, d.imm);
+		}
+		else if (f3 == 0x1)
+		{
+			get(RAX, d.rs1);
+			e.shiftImm(4, RAX, uint8_t(d.imm), false);
+		}
+		else if (f3 == 0x5 && (f7 == 0x00 || f7 == 0x20))
+		{
+			get(RAX, d.rs1);
+			e.shiftImm(f7 == 0x20 ? 7 : 5, RAX, uint8_t(d.imm), false);
+		}
+		else
+			return false;
+		e.movsx32(RAX, RAX);
+		set(d.rd, RAX);
+		return true;
+
+	case 0x23: // stores
+		if (f3 > 0x3)
+			return false;
+		storeOp(d, offset);
+		return true;
+
+	case 0x33: // OP
+		get(RAX, d.rs1);
+		get(RCX, d.rs2);
+		if (f7 == 0x00)
+		{
+			switch (f3) {
+			case 0x0: e.add(RAX, RCX); break;
+			case 0x1: e.shiftCl(4, RAX, true); break;
+			case 0x2: e.cmp(RAX, RCX); e.setcc(CC_L); break;
+			case 0x3: e.cmp(RAX, RCX); e.setcc(CC_B); break;
+			case 0x4: e.xor_(RAX, RCX); break;
+			case 0x5: e.shiftCl(5, RAX, true); break;
+			case 0x6: e.or_(RAX, RCX); break;
+			case 0x7: e.and_(RAX, RCX); break;
+			}
+		}
+		else if (f7 == 0x01 && f3 == 0x0)
+			e.imul(RAX, RCX);
+		else if (f7 == 0x20 && f3 == 0x0)
+			e.sub(RAX, RCX);
+		else if (f7 == 0x20 && f3 == 0x5)
+			e.shiftCl(7, RAX, true);
+		else
+			return false;
+		set(d.rd, RAX);
+		return true;
+
+	case 0x37: // lui
+		e.movImm(RAX, d.imm);
+		set(d.rd, RAX);
+		return true;
+
+	case 0x3b: // OP-32
+		get(RAX, d.rs1);
+		get(RCX, d.rs2);
+		if (f3 == 0x0 && f7 == 0x00)
+			e.add(RAX, RCX);
+		else if (f3 == 0x0 && f7 == 0x20)
+			e.sub(RAX, RCX);
+		else if (f3 == 0x1 && f7 == 0x00)
+			e.shiftCl(4, RAX, false);
+		else if (f3 == 0x5 && f7 == 0x00)
+			e.shiftCl(5, RAX, false);
+		else if (f3 == 0x5 && f7 == 0x20)
+			e.shiftCl(7, RAX, false);
+		else
+			return false;
+		e.movsx32(RAX, RAX);
+		set(d.rd, RAX);
+		return true;
+
+	case 0x63: // branches
+		switch (f3) {
+		case 0x0: branch(CC_NE, d, offset); return true;
+		case 0x1: branch(CC_E, d, offset); return true;
+		case 0x4: branch(CC_GE, d, offset); return true;
+		case 0x5: branch(CC_L, d, offset); return true;
+		case 0x6: branch(CC_AE, d, offset); return true;
+		case 0x7: branch(CC_B, d, offset); return true;
+		}
+		return false;
+
+	case 0x67: // jalr
+		get(RAX, d.rs1);
+		e.addImm(RAX, d.imm);
+		e.movImm(RCX, ~1ull);
+		e.and_(RAX, RCX);
+		pcInto(RCX, offset + 4);
+		set(d.rd, RCX);
+		epilogue();
+		return true;
+
+	case 0x6f: // jal
+		pcInto(RAX, offset + 4);
+		set(d.rd, RAX);
+		pcInto(RAX, offset);
+		e.addImm(RAX, d.imm);
+		epilogue();
+		return true;
+	}
+	return false;
+}
+
+} // namespace
+
+//------------------------------------------------------------------------------
+Jit::Jit(InstructionCache& ic, size_t codeSize) :
+	icache(ic),
+	buffer(nullptr),
+	capacity(codeSize),
+	used(0)
+{
+	void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p != MAP_FAILED)
+		buffer = static_cast<uint8_t*>(p);
+}
+
+//------------------------------------------------------------------------------
+Jit::~Jit()
+{
+	if (buffer)
+		munmap(buffer, capacity);
+}
+
+//------------------------------------------------------------------------------
+void Jit::reset()
+{
+	used = 0;
+	infos.clear();
+}
+
+//------------------------------------------------------------------------------
+Jit::Code Jit::compile(const std::vector<DecodedInst>& insts, uint64_t ppc, uint32_t version)
+{
+	if (!buffer || insts.empty())
+		return nullptr;
+	if (capacity - used < (insts.size() + 2) * MAX_INST_CODE)
+		return nullptr;
+
+	infos.push_back(BlockInfo{ this, ppc, version });
+
+	Translator t(buffer + used, insts, &infos.back());
+	t.loadFn = reinterpret_cast<const void*>(&Jit::load);
+	t.storeFn = reinterpret_cast<const void*>(&Jit::store);
+	t.interpretFn = reinterpret_cast<const void*>(&Jit::interpret);
+
+	uint8_t* start = t.emit();
+	used = size_t(t.end() - buffer);
+	return reinterpret_cast<Code>(start);
+}
+
+//------------------------------------------------------------------------------
+void Jit::run(Code code, Cpu& cpu)
+{
+	uint64_t next = code(&cpu, cpu.regs.data(), cpu.pc);
+	if (next != KEEP_PC)
+		cpu.pc = next;
+
+	if (pending) [[unlikely]]
+	{
+		std::exception_ptr e = pending;
+		pending = nullptr;
+		std::rethrow_exception(e);
+	}
+}
+
+//------------------------------------------------------------------------------
+Jit::Result Jit::load(Cpu* cpu, uint64_t addr, uint64_t nextPc, uint64_t size, BlockInfo* info)
+{
+	// The trap of a fault moves the pc to the trap vector, leaving the block before rd is set.
+	try {
+		cpu->pc = nextPc;
+		AccessResult r = cpu->try_load(addr, uint8_t(size));
+		if (r.failed()) [[unlikely]]
+		{
+			cpu->raise(r.ex);
+			return Result{ 0, 1 };
+		}
+		return Result{ r.value, cpu->pc != nextPc };
+	}
+	catch (...)
+	{
+		info->jit->pending = std::current_exception();
+		return Result{ 0, 1 };
+	}
+}
+
+//------------------------------------------------------------------------------
+Jit::Result Jit::store(Cpu* cpu, uint64_t addr, uint64_t value, uint64_t nextPc, uint64_t size, BlockInfo* info)
+{
+	try {
+		cpu->pc = nextPc;
+		cpu->store(addr, uint8_t(size), value);
+		// Leave the block as well when it has just been overwritten.
+		return Result{ 0, cpu->pc != nextPc || info->jit->codeChanged(info) };
+	}
+	catch (...)
+	{
+		info->jit->pending = std::current_exception();
+		return Result{ 0, 1 };
+	}
+}
+
+//------------------------------------------------------------------------------
+Jit::Result Jit::interpret(Cpu* cpu, const DecodedInst* d, uint64_t nextPc, BlockInfo* info)
+{
+	try {
+		cpu->pc = nextPc;
+		cpu->execute(*d);
+		return Result{ cpu->pc, cpu->pc != nextPc || info->jit->codeChanged(info) };
+	}
+	catch (...)
+	{
+		info->jit->pending = std::current_exception();
+		return Result{ 0, 1 };
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+//! Dynamic binary translator from guest blocks to native x86-64 code (System V ABI).
+//! Built with the WITH_JIT option only.
+
+#include "InstructionCache.h"
+
+#include <deque>
+#include <exception>
+#include <vector>
+
+class Cpu;
+
+/// Compiles hot blocks of predecoded instructions to x86-64 code.
+/// The RV64I/M integer operations, loads, stores, branches and jumps are translated; the guest
+/// registers used the most in a block are kept in callee-saved host registers for the whole block.
+/// Any other instruction (SYSTEM, CSR, AMO, division...) calls back its interpreter handler.
+class Jit
+{
+public:
+	/// Value returned by compiled code when the pc has already been set: trap, SYSTEM instruction,
+	/// or a store overwriting the block.
+	static const uint64_t KEEP_PC = ~0ull;
+
+	/// A compiled block: runs from the virtual pc `pc` of its first instruction and returns the
+	/// next pc, or KEEP_PC.
+	typedef uint64_t (*Code)(Cpu* cpu, uint64_t* regs, uint64_t pc);
+
+	/// Size of the code buffer.
+	static const size_t DEFAULT_CODE_SIZE = 16 * 1024 * 1024;
+
+	Jit(InstructionCache& ic, size_t codeSize = DEFAULT_CODE_SIZE);
+	virtual ~Jit();
+
+	/// Translate the block `insts` found at physical address `ppc`, whose page has the code
+	/// version `version`. The records must stay alive as long as the code is used.
+	/// Return nullptr if the code buffer is full (see reset()) or could not be allocated.
+	Code compile(const std::vector<DecodedInst>& insts, uint64_t ppc, uint32_t version);
+
+	/// Run a compiled block and move the pc past it. Errors raised by the Cpu in the block
+	/// (CpuFatal) are thrown again from here.
+	void run(Code code, Cpu& cpu);
+
+	/// Drop every compiled block.
+	void reset();
+
+	//! Status
+	bool isAvailable() const { return buffer != nullptr; }
+	size_t codeUsed() const { return used; }
+
+	/// What the helpers called by compiled code need to know about their block.
+	struct BlockInfo {
+		Jit* jit;
+		uint64_t ppc;
+		uint32_t version;
+	};
+
+protected:
+	InstructionCache& icache;
+	uint8_t* buffer;
+	size_t capacity;
+	size_t used;
+	std::deque<BlockInfo> infos;
+	/// Exception raised by a helper, to be thrown once out of the compiled code.
+	std::exception_ptr pending;
+
+	//! Helpers called by compiled code. `stop` is set when the block must be left with KEEP_PC.
+	struct Result {
+		uint64_t value;
+		uint64_t stop;
+	};
+	static Result load(Cpu* cpu, uint64_t addr, uint64_t nextPc, uint64_t size, BlockInfo* info);
+	static Result store(Cpu* cpu, uint64_t addr, uint64_t value, uint64_t nextPc, uint64_t size, BlockInfo* info);
+	static Result interpret(Cpu* cpu, const DecodedInst* d, uint64_t nextPc, BlockInfo* info);
+	bool codeChanged(const BlockInfo* info) const { return icache.codeVersion(info->ppc) != info->version; }
+};
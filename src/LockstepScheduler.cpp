@@ -0,0 +1,77 @@
+#include "LockstepScheduler.h"
+#include "Cpu.h"
+#include "Trap.h"
+
+//------------------------------------------------------------------------------
+// Take the interrupt pending on `cpu`, if any, as the run loop does between instructions.
+static void takeInterrupt(Cpu& cpu)
+{
+	Interrupt i = cpu.check_pending_interrupt();
+	if (i != Interrupt::InvalidInterrupt) [[unlikely]]
+		Trap::take_trap(&cpu, Except::InvalidExcept, i);
+}
+
+//------------------------------------------------------------------------------
+LockstepScheduler::LockstepScheduler(const std::vector<Cpu*>& h, uint64_t quantum, bool blockMode, bool native) :
+	harts(h),
+	slice(quantum),
+	turn(0),
+	count(0)
+{
+	if (blockMode)
+	{
+		for (Cpu* cpu : harts)
+			engines.emplace_back(new BlockEngine(*cpu, native));
+	}
+}
+
+//------------------------------------------------------------------------------
+LockstepScheduler::~LockstepScheduler()
+{
+}
+
+//------------------------------------------------------------------------------
+void LockstepScheduler::round()
+{
+	bool ran = false;
+	for (size_t h = 0; h < harts.size(); h++)
+	{
+		turn = h;
+		Cpu& cpu = *harts[h];
+
+		// An interrupt pending in mie wakes a waiting hart up.
+		if (cpu.isWaiting())
+			takeInterrupt(cpu);
+		if (!cpu.isWaiting())
+		{
+			run(h);
+			ran = true;
+		}
+	}
+
+	if (!ran)
+	{
+		turn = 0;
+		harts[0]->step(); // sleeps
+		takeInterrupt(*harts[0]);
+	}
+	count++;
+}
+
+//------------------------------------------------------------------------------
+void LockstepScheduler::run(size_t h)
+{
+	Cpu& cpu = *harts[h];
+	BlockEngine* blocks = engines.empty() ? nullptr : engines[h].get();
+
+	// A wfi ends the turn early, rather than sleeping while the other harts could run.
+	uint64_t end = cpu.getInstret() + slice;
+	while (cpu.getInstret() < end && !cpu.isWaiting())
+	{
+		if (blocks)
+			blocks->step();
+		else
+			cpu.step();
+		takeInterrupt(cpu);
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "BlockEngine.h"
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+class Cpu;
+
+/// Default number of instructions a hart runs in its turn.
+const uint64_t LOCKSTEP_QUANTUM = 1000;
+
+/// Runs several harts on the calling thread, each in turn for a quantum of retired instructions.
+/// The interleaving of their memory accesses only depends on the quantum, so that a guest race
+/// shows up again on every run, as long as the devices are deterministic too: the instruction
+/// counting timer, a synchronous disk, no terminal input nor network.
+/// A small quantum interleaves the harts finely; a large one switches between them less often.
+class LockstepScheduler
+{
+public:
+	/// The RAM must already be mapped on the bus of the harts. In block mode, a turn ends with the
+	/// block which reaches its quantum; `native` compiles hot blocks as BlockEngine does.
+	LockstepScheduler(const std::vector<Cpu*>& harts, uint64_t quantum = LOCKSTEP_QUANTUM, bool blockMode = false, bool native = false);
+	virtual ~LockstepScheduler();
+
+	/// Give every hart its turn, by increasing index. A hart waiting for an interrupt passes;
+	/// while they all wait, the first hart sleeps for the machine, until its timer or a device.
+	/// A CpuFatal of a hart goes through, current() telling which one.
+	void round();
+
+	/// The hart running, or which ran last.
+	Cpu& current() const { return *harts[turn]; }
+
+	//! Statistics
+	uint64_t quantum() const { return slice; }
+	uint64_t rounds() const { return count; }
+
+protected:
+	/// Run a hart for its quantum, taking its interrupts between instructions.
+	void run(size_t h);
+
+	std::vector<Cpu*> harts;
+	/// Block engine of each hart, in block mode.
+	std::vector<std::unique_ptr<BlockEngine>> engines;
+	uint64_t slice;
+	size_t turn;
+	uint64_t count;
+};
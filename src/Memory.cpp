@@ -6,14 +6,162 @@
 #include <string.h>
 #include <fstream>
 #include <cstring>
+#include <algorithm>
+#include <new>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+//! Reserve `bytes` bytes of zero-filled memory from the OS, aligned on `alignment` bytes.
+//! Pages are only backed by physical memory once touched.
+static uint8_t* mapZeroed(size_t bytes, size_t alignment)
+{
+    if (bytes == 0)
+        return nullptr;
+
+#ifdef _WIN32
+    // Windows charges the commit up front, but still zero-fills pages on first access.
+    void* p = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return static_cast<uint8_t*>(p);
+#else
+    // Reserve a bit more to align the block, then give the rest back. The mapping is not
+    // charged against the swap either, so that multi-GiB configurations can be mapped even when
+    // the host could not back all of them.
+    size_t mapped = (bytes + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    size_t reserved = mapped + alignment - PAGE_SIZE;
+    void* p = mmap(nullptr, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        throw std::bad_alloc();
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = (start + alignment - 1) & ~uintptr_t(alignment - 1);
+    size_t tail = (start + reserved) - (aligned + mapped);
+    if (aligned > start)
+        munmap(p, aligned - start);
+    if (tail)
+        munmap(reinterpret_cast<void*>(start + reserved - tail), tail);
+    return reinterpret_cast<uint8_t*>(aligned);
+#endif
+}
+
+//! Give back a block of mapZeroed().
+static void unmapZeroed(void* p, size_t bytes)
+{
+    if (p == nullptr)
+        return;
+#ifdef _WIN32
+    VirtualFree(p, 0, MEM_RELEASE);
+#else
+    munmap(p, bytes);
+#endif
+}
 
 Memory::Memory(size_t size):
-	dram(size, 0x0)
+    dram(nullptr),
+    dramSize(size),
+    codeLines(nullptr),
+    codeVersions(nullptr)
 {
+    // Anonymous memory is zeroed by the OS on first access: untouched RAM costs neither
+    // start-up time nor resident memory. The code tracking arrays are allocated the same way,
+    // so that only the pages holding code ever cost anything.
+    size_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    try {
+        dram = mapZeroed(size, HUGE_PAGE_SIZE);
+        codeLines = reinterpret_cast<uint64_t*>(mapZeroed(pages * sizeof(uint64_t), PAGE_SIZE));
+        codeVersions = reinterpret_cast<uint32_t*>(mapZeroed(pages * sizeof(uint32_t), PAGE_SIZE));
+    }
+    catch (const std::bad_alloc&) {
+        unmapZeroed(dram, size);
+        unmapZeroed(codeLines, pages * sizeof(uint64_t));
+        throw;
+    }
 }
 
 Memory::~Memory()
 {
+    size_t pages = (dramSize + PAGE_SIZE - 1) / PAGE_SIZE;
+    unmapZeroed(dram, dramSize);
+    unmapZeroed(codeLines, pages * sizeof(uint64_t));
+    unmapZeroed(codeVersions, pages * sizeof(uint32_t));
+}
+
+//! Parse a RAM size
+size_t Memory::parseSize(const std::string& text)
+{
+    size_t end = 0;
+    uint64_t value;
+    try {
+        value = std::stoull(text, &end);
+    }
+    catch (const std::exception&) {
+        return 0;
+    }
+
+    uint64_t unit = 1024 * 1024;
+    std::string suffix = text.substr(end);
+    if (suffix == "G" || suffix == "g")
+        unit = 1024 * 1024 * 1024;
+    else if (!suffix.empty() && suffix != "M" && suffix != "m")
+        return 0;
+
+    if (value == 0 || value > std::min<uint64_t>(MAX_MEMORYSIZE, SIZE_MAX) / unit)
+        return 0;
+    return value * unit;
+}
+
+//! Direct memory access
+uint8_t* Memory::dmaSpan(uint64_t addr, uint64_t bytes, bool write)
+{
+    if (addr > dramSize || bytes > dramSize - addr)
+        return nullptr;
+    if (write)
+        invalidateCodeRange(addr, bytes);
+    return dram + addr;
+}
+
+//! Drop the decoded code of a range
+void Memory::invalidateCodeRange(uint64_t addr, uint64_t bytes)
+{
+    uint64_t end = addr + bytes;
+    while (addr < end)
+    {
+        // Lines of the range within the page of `addr`.
+        uint64_t pageEnd = (addr & ~(PAGE_SIZE - 1)) + PAGE_SIZE;
+        uint64_t first = (addr % PAGE_SIZE) / CODE_LINE_SIZE;
+        uint64_t last = ((std::min(end, pageEnd) - 1) % PAGE_SIZE) / CODE_LINE_SIZE;
+        uint64_t mask = (~ASU64(0) >> (63 - last)) & (~ASU64(0) << first);
+
+        std::atomic_ref lines(codeLines[addr / PAGE_SIZE]);
+        if (lines.load(std::memory_order_relaxed) & mask)
+        {
+            lines.store(0, std::memory_order_relaxed);
+            std::atomic_ref(codeVersions[addr / PAGE_SIZE]).fetch_add(1, std::memory_order_relaxed);
+        }
+        addr = pageEnd;
+    }
+}
+
+//! Back a hot region with huge pages
+bool Memory::adviseHugePages(uint64_t addr, uint64_t bytes)
+{
+#ifdef MADV_HUGEPAGE
+    // madvise() works on whole pages.
+    uint64_t start = addr & ~(PAGE_SIZE - 1);
+    uint64_t end = std::min<uint64_t>(addr + bytes, dramSize);
+    if (start >= end)
+        return false;
+    return madvise(dram + start, end - start, MADV_HUGEPAGE) == 0;
+#else
+    return false;
+#endif
 }
 
 
@@ -36,7 +184,7 @@ bool Memory::loadbin(const std::string& file)     // Load program
 
     size_t fsize = program.tellg();
     program.seekg(0, std::ios::beg);
-    program.read((char*)&dram[0], std::min(fsize, dram.size()));
+    program.read((char*)dram, std::min(fsize, dramSize));
 
     return true;
 }
@@ -46,26 +194,43 @@ bool Memory::loadbin(const std::string& file)     // Load program
 /// Load bytes from the little-endiam dram.
 uint64_t Memory::load(uint64_t addr, uint8_t size) const
 {
-    if (addr + (size / 8) > dram.size())
-        throw CpuException(Except::LoadAccessFault);
+    AccessResult r = tryLoad(addr, size);
+    if (r.failed())
+        throw CpuException(r.ex);
+    return r.value;
+}
+
+/// Store bytes to the little-endiam dram.
+void Memory::store(uint64_t addr, uint8_t size, uint64_t value)
+{
+    Except ex = tryStore(addr, size, value);
+    if (ex != Except::InvalidExcept)
+        throw CpuException(ex);
+}
+
+/// Load bytes from the little-endiam dram, without throwing.
+AccessResult Memory::tryLoad(uint64_t addr, uint8_t size) const
+{
+    if (addr + (size / 8) > dramSize)
+        return AccessResult::fault(Except::LoadAccessFault);
 
     switch (size)
     {
-    case 8: return load8(addr);
-    case 16: return load16(addr);
-    case 32: return load32(addr);
-    case 64: return load64(addr);
+    case 8: return AccessResult::ok(load8(addr));
+    case 16: return AccessResult::ok(load16(addr));
+    case 32: return AccessResult::ok(load32(addr));
+    case 64: return AccessResult::ok(load64(addr));
     default:
         std::cerr << "Memory::LOAD error: unknown size: " << size << std::endl;
-        throw CpuException(Except::LoadAccessFault);
+        return AccessResult::fault(Except::LoadAccessFault);
     }
 }
 
-/// Store bytes to the little-endiam dram.
-void Memory::store(uint64_t addr, uint8_t size, uint64_t value)
+/// Store bytes to the little-endiam dram, without throwing.
+Except Memory::tryStore(uint64_t addr, uint8_t size, uint64_t value)
 {
-    if (addr + (size/8) > dram.size())
-        throw CpuException(Except::StoreAMOAccessFault);
+    if (addr + (size/8) > dramSize)
+        return Except::StoreAMOAccessFault;
 
     switch(size)
     {
@@ -75,8 +240,9 @@ void Memory::store(uint64_t addr, uint8_t size, uint64_t value)
     case 64: store64(addr, value); break;
     default:
         std::cerr << "Memory::STORE error: unknown size: " << size << std::endl;
-        throw CpuException(Except::StoreAMOAccessFault);
+        return Except::StoreAMOAccessFault;
     }
+    return Except::InvalidExcept;
 }
 
 /// Load a byte from the little-endian dram.
@@ -155,6 +321,8 @@ uint64_t Memory::load64(uint64_t addr) const
 /// Store a byte to the little-endian dram.
 void Memory::store8(uint64_t addr, uint64_t value) 
 {
+    invalidateCode(addr, 1);
+
     dram[addr] = ASU8(value);
 }
 
@@ -164,6 +332,8 @@ void Memory::store8(uint64_t addr, uint64_t value)
 // On big-endian hosts: need to swap bytes to convert from big-endian host to little-endian dram
 void Memory::store16(uint64_t addr, uint64_t value) 
 {
+    invalidateCode(addr, 2);
+
 #if BYTE_ORDER==LITTLE_ENDIAN
     uint16_t val = ASU16(value);
     std::memcpy(&dram[addr], &val, sizeof(val));
@@ -181,6 +351,8 @@ void Memory::store16(uint64_t addr, uint64_t value)
 // On big-endian hosts: need to swap bytes to convert from big-endian host to little-endian dram
 void Memory::store32(uint64_t addr, uint64_t value) 
 {
+    invalidateCode(addr, 4);
+
 #if BYTE_ORDER==LITTLE_ENDIAN
     uint32_t val = ASU32(value);
     std::memcpy(&dram[addr], &val, sizeof(val));
@@ -201,6 +373,8 @@ void Memory::store32(uint64_t addr, uint64_t value)
 // On big-endian hosts: need to swap bytes to convert from big-endian host to little-endian dram
 void Memory::store64(uint64_t addr, uint64_t value)
 {
+    invalidateCode(addr, 8);
+
 #if BYTE_ORDER==LITTLE_ENDIAN
     std::memcpy(&dram[addr], &value, sizeof(value));
 #elif BYTE_ORDER==BIG_ENDIAN
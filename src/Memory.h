@@ -3,11 +3,16 @@
 #include "Device.h"
 #include "ElfLoader.h"
 
+#include <atomic>
 #include <vector>
 #include <stdint.h>
 
 // Default is 128MiB
 const size_t DEFAULT_MEMORYSIZE = 1024 * 1024 * 128;
+// Largest RAM accepted by Memory::parseSize(), 1 TiB
+const uint64_t MAX_MEMORYSIZE = 1024ull * 1024 * 1024 * 1024;
+// Size of the huge pages the RAM is aligned on.
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
 
 namespace ELFIO {
 	class elfio;
@@ -16,22 +21,68 @@ namespace ELFIO {
 class Memory : public Device {
 public:
 	//! Init
+	//! The RAM is reserved from the OS and zero-filled on first touch, page by page, so that
+	//! large configurations only cost the memory the guest actually uses.
 	Memory(size_t size = DEFAULT_MEMORYSIZE);
 	virtual ~Memory();
+	Memory(const Memory&) = delete;
+	Memory& operator=(const Memory&) = delete;
 
 	//! Device Interface
 	//!load
 	uint64_t load(uint64_t addr, uint8_t size) const;
 	//! store
 	void store(uint64_t addr, uint8_t size, uint64_t value);
+	//! Non-throwing load and store
+	AccessResult tryLoad(uint64_t addr, uint8_t size) const;
+	Except tryStore(uint64_t addr, uint8_t size, uint64_t value);
+	//! Host span of a DMA transfer, dropping the decoded code it is going to overwrite.
+	uint8_t* dmaSpan(uint64_t addr, uint64_t bytes, bool write);
 	//! Get address space size of device
-	uint64_t size() const {	return dram.size(); }
+	uint64_t size() const {	return dramSize; }
+
+	//! Parse a RAM size given in MiB, with an optional M or G suffix ("512", "512M", "4G").
+	//! Return 0 if the text is not a valid size.
+	static size_t parseSize(const std::string& text);
 
 	//! Preload memory with given program (BIN or ELF)
 	bool preload(const std::string& file);
 
 	//! Get base memory adress
-	const uint8_t* base() const { return &(dram[0]); }
+	const uint8_t* base() const { return dram; }
+	//! Host address of `addr`, for direct accesses (see Tlb). Stores done through it must be
+	//! reported to invalidateCode().
+	uint8_t* host(uint64_t addr) { return &dram[addr]; }
+
+	//! Ask for `bytes` bytes of RAM at `addr`, a hot region, to be backed by huge pages.
+	//! Return false where transparent huge pages are not available.
+	bool adviseHugePages(uint64_t addr, uint64_t bytes);
+
+	//! Self-modifying code tracking.
+	//! The instruction cache marks every 64-byte line it decodes; a store hitting a marked line
+	//! bumps the code version of its page so cached decodes of that page are dropped.
+	//! The instruction caches of every hart and the DMA share them, hence the atomic accesses.
+	void markCode(uint64_t addr) { std::atomic_ref(codeLines[addr / PAGE_SIZE]).fetch_or(lineBit(addr), std::memory_order_relaxed); }
+	uint32_t codeVersion(uint64_t addr) const { return std::atomic_ref(codeVersions[addr / PAGE_SIZE]).load(std::memory_order_relaxed); }
+	//! Note a store of `bytes` bytes at `addr`, dropping the decoded code it overwrites.
+	void invalidateCode(uint64_t addr, uint64_t bytes)
+	{
+		if (addr % PAGE_SIZE + bytes > PAGE_SIZE) [[unlikely]]
+		{
+			invalidateCodeRange(addr, bytes);
+			return;
+		}
+		std::atomic_ref lines(codeLines[addr / PAGE_SIZE]);
+		if (lines.load(std::memory_order_relaxed) == 0) [[likely]]
+			return;
+		if (lines.load(std::memory_order_relaxed) & (lineBit(addr) | lineBit(addr + bytes - 1)))
+		{
+			lines.store(0, std::memory_order_relaxed);
+			std::atomic_ref(codeVersions[addr / PAGE_SIZE]).fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+	//! Same for a write of any length, across pages.
+	void invalidateCodeRange(uint64_t addr, uint64_t bytes);
 
 
 protected:
@@ -50,6 +101,16 @@ protected:
 
 	bool loadbin(const std::string& file);
 
+	static uint64_t lineBit(uint64_t addr) { return ASU64(1) << ((addr / CODE_LINE_SIZE) % 64); }
+
+	/// Granularity of the self-modifying code tracking.
+	static const uint64_t CODE_LINE_SIZE = PAGE_SIZE / 64;
 
-	std::vector<uint8_t> dram;
+	/// Anonymous mapping of dramSize bytes.
+	uint8_t* dram;
+	size_t dramSize;
+	/// One bit per CODE_LINE_SIZE line holding decoded instructions, one word per page.
+	uint64_t* codeLines;
+	/// Per page counter bumped every time decoded code is overwritten.
+	uint32_t* codeVersions;
 };
\ No newline at end of file
@@ -1,13 +1,21 @@
 #include "Plic.h"
 #include "Trap.h"
 
+#include <bit>
+#include <cstring>
+
 //------------------------------------------------------------------------------
 Plic::Plic() :
-    pending(0),
-    senable(0),
-    spriority(0),
-    sclaim(0)
+    pending_words(0),
+    lines(0),
+    wakeup(nullptr)
 {
+    memset(priority, 0, sizeof(priority));
+    memset(enable, 0, sizeof(enable));
+    memset(threshold, 0, sizeof(threshold));
+    memset(pending, 0, sizeof(pending));
+    memset(claimed, 0, sizeof(claimed));
+    memset(deferred, 0, sizeof(deferred));
 }
 
 //------------------------------------------------------------------------------
@@ -36,24 +44,124 @@ void Plic::store(uint64_t addr, uint8_t size, uint64_t value)
 //------------------------------------------------------------------------------
 uint64_t Plic::load32(uint64_t addr) const
 {
-    switch (addr)
+    if (addr < PLIC_PENDING)
+        return priority[addr / 4];
+    if (addr < PLIC_PENDING + WORDS * 4)
+        return pending[(addr - PLIC_PENDING) / 4];
+    if (addr >= PLIC_ENABLE && addr < PLIC_ENABLE + PLIC_CONTEXTS * PLIC_ENABLE_STRIDE)
+    {
+        uint64_t offset = (addr - PLIC_ENABLE) % PLIC_ENABLE_STRIDE;
+        return offset < WORDS * 4 ? enable[(addr - PLIC_ENABLE) / PLIC_ENABLE_STRIDE][offset / 4] : 0;
+    }
+    if (addr >= PLIC_THRESHOLD && addr < PLIC_THRESHOLD + PLIC_CONTEXTS * PLIC_CONTEXT_STRIDE)
     {
-    case PLIC_PENDING: return pending;
-    case PLIC_SENABLE: return senable;
-    case PLIC_SPRIORITY: return spriority;
-    case PLIC_SCLAIM: return sclaim;
-    default: return 0;
+        uint32_t context = uint32_t((addr - PLIC_THRESHOLD) / PLIC_CONTEXT_STRIDE);
+        switch ((addr - PLIC_THRESHOLD) % PLIC_CONTEXT_STRIDE)
+        {
+        case 0: return threshold[context];
+        case 4: return claim(context);
+        }
     }
+    return 0;
 }
- 
+
 //------------------------------------------------------------------------------
 void Plic::store32(uint64_t addr, uint64_t value)
 {
-    switch (addr)
+    changed();
+
+    // Source 0 does not exist, and the pending bits are read-only.
+    if (addr < PLIC_PENDING)
+    {
+        if (addr >= 4)
+            priority[addr / 4] = value & PLIC_MAX_PRIORITY;
+        return;
+    }
+    if (addr >= PLIC_ENABLE && addr < PLIC_ENABLE + PLIC_CONTEXTS * PLIC_ENABLE_STRIDE)
+    {
+        uint64_t offset = (addr - PLIC_ENABLE) % PLIC_ENABLE_STRIDE;
+        if (offset < WORDS * 4)
+            enable[(addr - PLIC_ENABLE) / PLIC_ENABLE_STRIDE][offset / 4] = ASU32(offset == 0 ? value & ~1ull : value);
+        return;
+    }
+    if (addr >= PLIC_THRESHOLD && addr < PLIC_THRESHOLD + PLIC_CONTEXTS * PLIC_CONTEXT_STRIDE)
+    {
+        uint32_t context = uint32_t((addr - PLIC_THRESHOLD) / PLIC_CONTEXT_STRIDE);
+        switch ((addr - PLIC_THRESHOLD) % PLIC_CONTEXT_STRIDE)
+        {
+        case 0: threshold[context] = value & PLIC_MAX_PRIORITY; break;
+        case 4: complete(context, ASU32(value)); break;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+void Plic::trigger(uint32_t irq)
+{
+    if (irq == 0 || irq >= PLIC_SOURCES)
+        return;
+    uint32_t w = irq / 32, bit = 1u << (irq % 32);
+    if (claimed[w] & bit)
+    {
+        deferred[w] |= bit;
+        return;
+    }
+    pending[w] |= bit;
+    pending_words |= 1u << w;
+    changed();
+}
+
+//------------------------------------------------------------------------------
+uint32_t Plic::highest(uint32_t context) const
+{
+    // Scan the words with pending bits only, each for its enabled bits.
+    uint32_t irq = 0;
+    uint32_t top = threshold[context];
+    for (uint32_t words = pending_words; words != 0; words &= words - 1)
+    {
+        uint32_t w = std::countr_zero(words);
+        for (uint32_t bits = pending[w] & enable[context][w]; bits != 0; bits &= bits - 1)
+        {
+            uint32_t i = w * 32 + std::countr_zero(bits);
+            if (priority[i] > top)
+            {
+                top = priority[i];
+                irq = i;
+            }
+        }
+    }
+    return irq;
+}
+
+//------------------------------------------------------------------------------
+uint32_t Plic::claim(uint32_t context) const
+{
+    uint32_t irq = highest(context);
+    if (irq != 0)
+    {
+        uint32_t w = irq / 32, bit = 1u << (irq % 32);
+        pending[w] &= ~bit;
+        if (pending[w] == 0)
+            pending_words &= ~(1u << w);
+        claimed[w] |= bit;
+        changed();
+    }
+    return irq;
+}
+
+//------------------------------------------------------------------------------
+void Plic::complete(uint32_t context, uint32_t irq)
+{
+    // A completion for a source the context does not enable is ignored.
+    if (irq == 0 || irq >= PLIC_SOURCES)
+        return;
+    uint32_t w = irq / 32, bit = 1u << (irq % 32);
+    if ((enable[context][w] & bit) == 0 || (claimed[w] & bit) == 0)
+        return;
+    claimed[w] &= ~bit;
+    if (deferred[w] & bit)
     {
-    case PLIC_PENDING: pending = value; break;
-    case PLIC_SENABLE: senable = value; break;
-    case PLIC_SPRIORITY: spriority = value; break;
-    case PLIC_SCLAIM: sclaim = value; break;
+        deferred[w] &= ~bit;
+        trigger(irq);
     }
 }
@@ -1,14 +1,39 @@
 #pragma once
 
 #include "Device.h"
+#include "Wakeup.h"
+
+#include <atomic>
 
 //! The plic module contains the platform-level interrupt controller (PLIC).
 //! The plic connects all external interrupts in the system to all hart
 //! contexts in the system, via the external interrupt source in each hart.
 //! It's the global interrupt controller in a RISC-V system.
+//!
+//! Each source has a priority, 0 never interrupting. A hart context is interrupted by the
+//! pending sources it enables whose priority is above its threshold: it claims the one of
+//! highest priority, the lowest ID on ties, then completes it once serviced. A source requesting
+//! again while claimed becomes pending on its completion.
+
+/// The number of interrupt sources, source 0 meaning none.
+const uint32_t PLIC_SOURCES = 1024;
+/// The number of hart contexts: machine then supervisor mode of each hart.
+const uint32_t PLIC_CONTEXTS = 2 * MAX_HARTS;
+/// The highest priority, and threshold.
+const uint32_t PLIC_MAX_PRIORITY = 7;
 
+/// The address of the source priorities, a word per source.
+const uint64_t PLIC_PRIORITY = 0x0;
 /// The address of interrupt pending bits.
 const uint64_t PLIC_PENDING = 0x1000;
+/// The address of the enable bits of the first context, then of each context in turn.
+const uint64_t PLIC_ENABLE = 0x2000;
+const uint64_t PLIC_ENABLE_STRIDE = 0x80;
+/// The address of the priority threshold of the first context, its claim/complete register
+/// following, then of each context in turn.
+const uint64_t PLIC_THRESHOLD = 0x200000;
+const uint64_t PLIC_CONTEXT_STRIDE = 0x1000;
+
 /// The address of the regsiters to enable interrupts for S-mode.
 const uint64_t PLIC_SENABLE = 0x2080;
 /// The address of the registers to set a priority for S-mode.
@@ -19,6 +44,10 @@ const uint64_t PLIC_SCLAIM = 0x201004;
 /// The size of PLIC.
 const uint64_t PLIC_SIZE = 0x4000000;
 
+/// The contexts of the M-mode and of the S-mode of `hart`.
+inline uint32_t plic_mcontext(uint64_t hart) { return uint32_t(2 * hart); }
+inline uint32_t plic_scontext(uint64_t hart) { return uint32_t(2 * hart + 1); }
+
 /// The platform-level-interrupt controller (PLIC).
 class Plic : public Device
 {
@@ -34,14 +63,54 @@ public:
     //! Get address space size of device
     uint64_t size() const { return PLIC_SIZE; }
 
+    //! Interrupt lines
+    /// Assert the line of the source `irq`, below 64, from any thread. The harts sleeping in
+    /// wfi wake up.
+    void raise(uint32_t irq)
+    {
+        lines.fetch_or(uint64_t(1) << irq, std::memory_order_release);
+        if (Wakeup* w = wakeup.load(std::memory_order_acquire))
+            w->notify();
+    }
+    void lower(uint32_t irq) { lines.fetch_and(~(uint64_t(1) << irq), std::memory_order_relaxed); }
+    /// The lines asserted: a single load, which the harts check between their instructions.
+    uint64_t asserted() const { return lines.load(std::memory_order_acquire); }
+    /// Also notified when the state of the gateways and cores changes, for every hart to
+    /// look at its external interrupts.
+    void setWakeup(Wakeup* w) { wakeup = w; }
+
+    //! Gateways and cores, driven by the harts holding the device lock of the bus
+    /// Request an interrupt from the source `irq`, once its device was serviced.
+    void trigger(uint32_t irq);
+    /// The source `context` would claim, 0 if none: its external interrupt is pending.
+    uint32_t highest(uint32_t context) const;
+    uint32_t claim(uint32_t context) const;
+    void complete(uint32_t context, uint32_t irq);
+
 protected:
     uint64_t load32(uint64_t addr) const;
     void store32(uint64_t addr, uint64_t value);
+    void changed() const
+    {
+        if (Wakeup* w = wakeup.load(std::memory_order_acquire))
+            w->notify();
+    }
+
+    static const uint32_t WORDS = PLIC_SOURCES / 32;
+
+    uint32_t priority[PLIC_SOURCES];
+    uint32_t enable[PLIC_CONTEXTS][WORDS];
+    uint32_t threshold[PLIC_CONTEXTS];
+    // Claimed by a load.
+    mutable uint32_t pending[WORDS];
+    /// Bit w set when pending[w] has some bit set, for the scan.
+    mutable uint32_t pending_words;
+    mutable uint32_t claimed[WORDS];
+    /// Requested again while claimed.
+    uint32_t deferred[WORDS];
 
-    uint64_t pending;
-    uint64_t senable;
-    uint64_t spriority;
-    uint64_t sclaim;
+    std::atomic<uint64_t> lines;
+    std::atomic<Wakeup*> wakeup;
 };
 
 
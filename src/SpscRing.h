@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+/// Lock-free ring buffer between one producer thread and one consumer thread.
+/// Each side only writes its own index: the producer publishes an element by moving `tail`
+/// past it with a release store, the consumer frees it by moving `head` the same way.
+/// `N` must be a power of two; the ring holds up to N elements.
+template <typename T, size_t N>
+class SpscRing
+{
+	static_assert(N != 0 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+public:
+	SpscRing() : head(0), tail(0) {}
+
+	//! Producer side. Return false if the ring is full.
+	bool push(const T& value)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - head.load(std::memory_order_acquire) == N)
+			return false;
+		items[t % N] = value;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	//! Consumer side. Return false if the ring is empty.
+	bool pop(T& value)
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		value = items[h % N];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	//! Consumer side: next element, left in the ring. Return false if the ring is empty.
+	bool peek(T& value) const
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		value = items[h % N];
+		return true;
+	}
+
+	//! Either side, exact for the consumer.
+	bool empty() const { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+	//! Either side, an upper bound for the producer and a lower bound for the consumer.
+	size_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+
+private:
+	T items[N];
+	// On separate cache lines, each being written by one side only.
+	alignas(64) std::atomic<size_t> head;
+	alignas(64) std::atomic<size_t> tail;
+};
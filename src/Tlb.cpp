@@ -0,0 +1,77 @@
+#include "Tlb.h"
+
+//------------------------------------------------------------------------------
+const Tlb::Entry* Tlb::insert(Access access, uint64_t vaddr, uint64_t paddr, uint8_t* host, bool global, uint64_t span)
+{
+	size_t set = (vaddr / PAGE_SIZE) % SETS;
+	uint8_t& victim = victims[access][set];
+
+	Entry& e = entries[access][set][victim];
+	victim = (victim + 1) % WAYS;
+
+	e.vpage = vaddr & ~(PAGE_SIZE - 1);
+	e.ppage = paddr & ~(PAGE_SIZE - 1);
+	e.host = host;
+	e.span = span;
+	e.asid = asid;
+	e.global = global;
+	superpages |= span > PAGE_SIZE;
+	return &e;
+}
+
+//------------------------------------------------------------------------------
+void Tlb::flush()
+{
+	for (auto& sets : entries)
+		for (auto& set : sets)
+			for (Entry& e : set)
+				e = Entry{ INVALID, 0, nullptr, PAGE_SIZE, 0, false };
+
+	for (auto& sets : victims)
+		for (uint8_t& v : sets)
+			v = 0;
+	superpages = false;
+}
+
+//------------------------------------------------------------------------------
+template <typename Match>
+void Tlb::flushMatching(uint64_t vaddr, Match match)
+{
+	// The pages of a superpage are spread over every set: look at all of them once one is cached.
+	if (superpages)
+	{
+		for (auto& sets : entries)
+			for (auto& set : sets)
+				for (Entry& e : set)
+					if (e.covers(vaddr) && match(e))
+						e.vpage = INVALID;
+		return;
+	}
+
+	for (auto& sets : entries)
+		for (Entry& e : sets[(vaddr / PAGE_SIZE) % SETS])
+			if (e.covers(vaddr) && match(e))
+				e.vpage = INVALID;
+}
+
+//------------------------------------------------------------------------------
+void Tlb::flushPage(uint64_t vaddr)
+{
+	flushMatching(vaddr, [](const Entry&) { return true; });
+}
+
+//------------------------------------------------------------------------------
+void Tlb::flushPage(uint64_t vaddr, uint16_t a)
+{
+	flushMatching(vaddr, [a](const Entry& e) { return e.asid == a && !e.global; });
+}
+
+//------------------------------------------------------------------------------
+void Tlb::flushAsid(uint16_t a)
+{
+	for (auto& sets : entries)
+		for (auto& set : sets)
+			for (Entry& e : set)
+				if (e.asid == a && !e.global)
+					e.vpage = INVALID;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "Defines.h"
+
+#include <stdint.h>
+
+/// Software TLB caching the Sv39 translations of 4 KiB pages.
+/// Instruction fetches, loads and stores have their own set-associative arrays, each set being
+/// selected directly by the low bits of the virtual page number. Entries of RAM pages also hold the
+/// host address of the page, so that the Cpu can reach the RAM without going through the Bus.
+/// Superpages are cached one 4 KiB page at a time, each entry remembering the superpage it comes
+/// from, so that flushing any address of the superpage drops all of them.
+/// Entries are tagged with the ASID of SATP they were filled under, so switching between address
+/// spaces keeps their translations; global mappings match any ASID.
+class Tlb
+{
+public:
+	/// Same order as Cpu::AccessType.
+	enum Access {
+		Instruction,
+		Load,
+		Store,
+		ACCESS_COUNT
+	};
+
+	static const size_t SETS = 64;
+	static const size_t WAYS = 4;
+
+	struct Entry {
+		/// Virtual address of the page, INVALID if the entry is empty.
+		uint64_t vpage;
+		/// Physical address of the page.
+		uint64_t ppage;
+		/// Host address of the page in RAM, nullptr for any other device.
+		uint8_t* host;
+		/// Size of the page or superpage of the leaf PTE.
+		uint64_t span;
+		/// Address space of the translation, ignored for global ones.
+		uint16_t asid;
+		bool global;
+
+		/// The translation comes from the leaf PTE mapping `vaddr`.
+		bool covers(uint64_t vaddr) const { return ((vpage ^ vaddr) & ~(span - 1)) == 0; }
+	};
+
+	/// Tag of an empty entry: not page aligned, so no virtual page matches it.
+	static const uint64_t INVALID = ~0ull;
+
+	Tlb() { flush(); }
+
+	/// Return the entry translating the page of `vaddr` in the current address space, or nullptr
+	/// on a miss.
+	const Entry* find(Access access, uint64_t vaddr) const
+	{
+		uint64_t vpage = vaddr & ~(PAGE_SIZE - 1);
+		const Entry* set = entries[access][(vaddr / PAGE_SIZE) % SETS];
+		for (size_t w = 0; w < WAYS; w++)
+		{
+			if (set[w].vpage == vpage && (set[w].asid == asid || set[w].global))
+				return &set[w];
+		}
+		return nullptr;
+	}
+
+	/// Cache the translation of the page of `vaddr` to the page of `paddr` in the current address
+	/// space, evicting the oldest entry of its set. `span` is the size of the (super)page mapped.
+	const Entry* insert(Access access, uint64_t vaddr, uint64_t paddr, uint8_t* host, bool global, uint64_t span = PAGE_SIZE);
+
+	/// Address space used by find() and insert() (ASID field of SATP).
+	uint16_t getAsid() const { return asid; }
+	void setAsid(uint16_t a) { asid = a; }
+
+	//! Flushes, following the operands of sfence.vma.
+	/// Drop every translation.
+	void flush();
+	/// Drop the translations of the page or superpage of `vaddr`, in every address space.
+	void flushPage(uint64_t vaddr);
+	/// Drop the translations of the page or superpage of `vaddr` in the address space `a`, but
+	/// global ones.
+	void flushPage(uint64_t vaddr, uint16_t a);
+	/// Drop the translations of the address space `a`, but global ones.
+	void flushAsid(uint16_t a);
+
+protected:
+	/// Drop the entries of the page or superpage of `vaddr` which `match`.
+	template <typename Match>
+	void flushMatching(uint64_t vaddr, Match match);
+
+	Entry entries[ACCESS_COUNT][SETS][WAYS];
+	/// Next way to evict in each set (round robin).
+	uint8_t victims[ACCESS_COUNT][SETS];
+	uint16_t asid = 0;
+	/// A superpage was cached since the last full flush: its pages may be in any set.
+	bool superpages = false;
+};
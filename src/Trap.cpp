@@ -5,7 +5,10 @@
 /// Helper method for a trap handler.
 void Trap::take_trap(Cpu* cpu, Except e, Interrupt i)
 {
-    auto exception_pc = cpu->pc - 4;
+    // The pc is moved before an instruction runs, so an exception is reported at pc - 4.
+    // Interrupts are taken between two instructions: returning from them must resume at the
+    // next instruction, the current pc.
+    auto exception_pc = (i != Interrupt::InvalidInterrupt && e == Except::InvalidExcept) ? cpu->pc : cpu->pc - 4;
     auto previous_mode = cpu->mode;
 
     uint64_t cause = (uint64_t)-1;
@@ -22,12 +25,20 @@ void Trap::take_trap(Cpu* cpu, Except e, Interrupt i)
     else
         return;
 
+    // An sc after the trap handler fails.
+    cpu->reserved = nullptr;
+
+    // Exceptions are delegated by medeleg, interrupts by mideleg. Machine interrupts are always
+    // taken in M-mode.
+    uint64_t deleg = cpu->load_csr(MEDELEG);
+    if (e == Except::InvalidExcept)
+        deleg = cpu->load_csr(MIDELEG) & (MIP_SSIP | MIP_STIP | MIP_SEIP);
 
     if ((previous_mode <= Cpu::Mode::Supervisor) &&
-       (((cpu->warppingShr(cpu->load_csr(MEDELEG),cause)) & 1) != 0))
+       (((cpu->warppingShr(deleg, cause & 63)) & 1) != 0))
     {
         // Handle the trap in S-mode.
-        cpu->mode = Cpu::Mode::Supervisor;
+        cpu->set_mode(Cpu::Mode::Supervisor);
 
         // Set the program counter to the supervisor trap-handler base address (stvec).
         if (i != Interrupt::InvalidInterrupt)
@@ -90,7 +101,7 @@ void Trap::take_trap(Cpu* cpu, Except e, Interrupt i)
     else 
     {
         // Handle the trap in M-mode.
-        cpu->mode = Cpu::Mode::Machine;
+        cpu->set_mode(Cpu::Mode::Machine);
 
         // Set the program counter to the machine trap-handler base address (mtvec).
         if (i != Interrupt::InvalidInterrupt)
@@ -143,7 +154,8 @@ void Trap::take_trap(Cpu* cpu, Except e, Interrupt i)
 
         // Set a global interrupt-enable bit for supervisor mode (MIE, 3) to 0.
         cpu->store_csr(MSTATUS, cpu->load_csr(MSTATUS) & ~(1 << 3));
-        // Set a privious privilege mode for supervisor mode (MPP, 11..13) to 0.
-        cpu->store_csr(MSTATUS, cpu->load_csr(MSTATUS) & ~(0b11 << 11));
+        // 3.1.6.1 "When a trap is taken from privilege mode y into privilege mode x, xPIE is set
+        // to the value of xIE; xIE is set to 0; and xPP is set to y."
+        cpu->store_csr(MSTATUS, (cpu->load_csr(MSTATUS) & ~(0b11 << 11)) | ((uint64_t)previous_mode << 11));
     }
 }
@@ -50,39 +50,62 @@ struct CpuFatal : public std::runtime_error
 	CpuFatal(const std::string& msg) : std::runtime_error(msg) {}
 };
 
+/// Name of an exception.
+inline const char* except_name(Except ex)
+{
+	switch (ex) {
+	case Except::InstructionAddressMisaligned: return "InstructionAddressMisaligned";
+	case Except::InstructionAccessFault: return "InstructionAccessFault";
+	case Except::IllegalInstruction: return "IllegalInstruction";
+	case Except::Breakpoint: return "Breakpoint";
+	case Except::LoadAddressMisaligned: return "LoadAddressMisaligned";
+	case Except::LoadAccessFault: return "LoadAccessFault";
+	case Except::StoreAMOAddressMisaligned: return "StoreAMOAddressMisaligned";
+	case Except::StoreAMOAccessFault: return "StoreAMOAccessFault";
+	case Except::EnvironmentCallFromUMode: return "EnvironmentCallFromUMode";
+	case Except::EnvironmentCallFromSMode: return "EnvironmentCallFromSMode";
+	case Except::EnvironmentCallFromMMode: return "EnvironmentCallFromMMode";
+	case Except::InstructionPageFault: return "InstructionPageFault";
+	case Except::LoadPageFault: return "LoadPageFault";
+	case Except::StoreAMOPageFault: return "StoreAMOPageFault";
+	default: return "Unkown Cpu Exception";
+	}
+}
+
+/// Exceptions the emulator cannot go on after: they end the run with CpuFatal.
+inline bool is_fatal(Except ex)
+{
+	return (ex == Except::InstructionAddressMisaligned ||
+		ex == Except::InstructionAccessFault ||
+		ex == Except::LoadAccessFault ||
+		ex == Except::StoreAMOAddressMisaligned ||
+		ex == Except::StoreAMOAccessFault);
+}
+
+/// Result of a memory access or an address translation: the value read or translated, or the
+/// exception it raises. The memory hot path returns it rather than throwing CpuException, as guest
+/// page faults are routine (lazy allocation, copy-on-write) and a throw costs microseconds.
+struct AccessResult
+{
+	uint64_t value;
+	Except ex;
+
+	static AccessResult ok(uint64_t v) { return AccessResult{ v, Except::InvalidExcept }; }
+	static AccessResult fault(Except e) { return AccessResult{ 0, e }; }
+	bool failed() const { return ex != Except::InvalidExcept; }
+};
+
 struct CpuException : public std::exception
 {
 	CpuException(Except e) : ex(e) {}
 	const char* what() const throw ()
 	{
-		switch (ex) {
-		case Except::InstructionAddressMisaligned: return "InstructionAddressMisaligned";
-		case Except::InstructionAccessFault: return "InstructionAccessFault";
-		case Except::IllegalInstruction: return "IllegalInstruction";
-		case Except::Breakpoint: return "Breakpoint";
-		case Except::LoadAddressMisaligned: return "LoadAddressMisaligned";
-		case Except::LoadAccessFault: return "LoadAccessFault";
-		case Except::StoreAMOAddressMisaligned: return "StoreAMOAddressMisaligned";
-		case Except::StoreAMOAccessFault: return "StoreAMOAccessFault";
-		case Except::EnvironmentCallFromUMode: return "EnvironmentCallFromUMode";
-		case Except::EnvironmentCallFromSMode: return "EnvironmentCallFromSMode";
-		case Except::EnvironmentCallFromMMode: return "EnvironmentCallFromMMode";
-		case Except::InstructionPageFault: return "InstructionPageFault";
-		case Except::LoadPageFault: return "LoadPageFault";
-		case Except::StoreAMOPageFault: return "StoreAMOPageFault";
-		default: return "Unkown Cpu Exception";
-		}
+		return except_name(ex);
 	}
 
 	void take_trap(Cpu* cpu) const { Trap::take_trap(cpu, ex); }
 
-	bool is_fatal() const {
-		return (ex == Except::InstructionAddressMisaligned ||
-			ex == Except::InstructionAccessFault ||
-			ex == Except::LoadAccessFault ||
-			ex == Except::StoreAMOAddressMisaligned ||
-			ex == Except::StoreAMOAccessFault);
-	};
+	bool is_fatal() const { return ::is_fatal(ex); }
 
 	Except ex;
 };
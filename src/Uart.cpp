@@ -1,5 +1,6 @@
 #include "Uart.h"
 #include "Trap.h"
+#include "Plic.h"
 
 #include <iostream>
 #include <chrono>
@@ -7,34 +8,68 @@
 #ifdef WIN32
 #include <conio.h>
 #else
-#include <termios.h>
+#include <cerrno>
+#include <poll.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
-int getch(void)
-{
-    return getchar();
-}
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #endif
 
 //------------------------------------------------------------------------------
-Uart::Uart(bool useConsole) :
-    interrupting(false),
+Uart::Uart(bool useConsole, int consoleFd) :
+    myUseConsole(useConsole),
+    myConsoleFd(consoleFd),
     uart(UART_SIZE,0),
+    txFile(nullptr),
+    ownsTxFile(false),
+    txPending(false),
+    txFlush(false),
+    txQuit(false),
+    txIdle(false),
+    plic(nullptr),
     quitThread(false),
-    myUseConsole(useConsole),
-    uartThread(&Uart::threadFunc, this)
+    wakeFd{ -1, -1 }
 {
-    {
-        std::lock_guard<std::mutex> lock(uartMutex);
-        uart[UART_LSR] |= UART_LSR_TX;
-    }
+    uart[UART_LSR] |= UART_LSR_TX;
+    if (myUseConsole)
+        setOutput(stdout);
+
+    // Only the console has to be waited for: putChar() feeds the input directly.
+    if (!myUseConsole)
+        return;
+#if defined(__linux__)
+    wakeFd[0] = wakeFd[1] = eventfd(0, EFD_CLOEXEC);
+#elif !defined(WIN32)
+    if (pipe(wakeFd) != 0)
+        wakeFd[0] = wakeFd[1] = -1;
+#endif
+    uartThread = std::thread(&Uart::threadFunc, this);
 }
 
 //------------------------------------------------------------------------------
 Uart::~Uart()
 {
+    setOutput(nullptr);
+
     quitThread = true;
-    uartThread.join();
+#ifndef WIN32
+    if (wakeFd[1] >= 0)
+    {
+        // An eventfd takes 8-byte counters.
+        uint64_t one = 1;
+        ssize_t written = write(wakeFd[1], &one, wakeFd[0] == wakeFd[1] ? sizeof(one) : 1);
+        (void)written;
+    }
+#endif
+    if (uartThread.joinable())
+        uartThread.join();
+#ifndef WIN32
+    if (wakeFd[0] >= 0)
+        close(wakeFd[0]);
+    if (wakeFd[1] >= 0 && wakeFd[1] != wakeFd[0])
+        close(wakeFd[1]);
+#endif
 }
 
 //! return next char available in queue
@@ -45,14 +80,7 @@ char Uart::getChar()
         return 0;
 
     char res = 0;
-    outputMutex.lock();
-    if (!output.empty())
-    {
-        res = output.front();
-        output.pop_front();
-    }
-    outputMutex.unlock();
-
+    output.pop(res);
     return res;
 }
 
@@ -63,60 +91,77 @@ void Uart::putChar(char c)
     if (myUseConsole)
         return;
 
-    inputMutex.lock();
-    input.push_back(c);
-    inputMutex.unlock();
+    // Typed faster than the guest reads: the key is lost, as with a real UART overrun.
+    receive(c);
+}
+
+//------------------------------------------------------------------------------
+void Uart::setPlic(Plic* p)
+{
+    plic = p;
+    if (p && !input.empty())
+        p->raise(UART_IRQ);
 }
 
+//------------------------------------------------------------------------------
+bool Uart::receive(char c)
+{
+    if (!input.push(c))
+        return false;
+    if (Plic* p = plic.load())
+        p->raise(UART_IRQ);
+    return true;
+}
 
 //------------------------------------------------------------------------------
 void Uart::threadFunc()
 {
+#ifdef WIN32
     while (!quitThread)
     {
-        char key = 0;
-        if (myUseConsole)
+        if (_kbhit())
         {
-#ifdef WIN32
-            key = _getch();
-#else
-            key = getch();
-#endif
+            char key = static_cast<char>(_getch());
+            while (!receive(key) && !quitThread)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
         }
         else
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+#else
+    char bytes[256];
+    while (!quitThread)
+    {
+        // Sleep until input arrives, or until the Uart is destroyed.
+        pollfd fds[2] = { { myConsoleFd, POLLIN, 0 }, { wakeFd[0], POLLIN, 0 } };
+        int n = poll(fds, wakeFd[0] >= 0 ? 2 : 1, -1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || quitThread)
+            break;
+
+        ssize_t count = read(myConsoleFd, bytes, sizeof(bytes));
+        if (count < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if (count <= 0)
         {
-            inputMutex.lock();
-            if (!input.empty())
+            // End of the input: nothing more will come.
+            if (wakeFd[0] >= 0)
             {
-                key = input.front();
-                input.pop_front();
+                pollfd wake = { wakeFd[0], POLLIN, 0 };
+                while (!quitThread && poll(&wake, 1, -1) < 0 && errno == EINTR);
             }
-            inputMutex.unlock();
+            break;
         }
 
-        if (key != 0)
+        // Pasted text may fill the ring: wait for the guest to read it.
+        for (ssize_t i = 0; i < count && !quitThread; i++)
         {
-            //  Wait for previous data to be read
-            bool ready = false;
-            while (!ready)
-            {
-                {
-                    std::lock_guard<std::mutex> lock(uartMutex);
-                    ready = (uart[UART_LSR] & UART_LSR_RX) == 0;
-                }
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            }
-
-            // Read the char
-            {
-                std::lock_guard<std::mutex> lock(uartMutex);
-                uart[0] = key;
-                interrupting = true;
-                uart[UART_LSR] |= UART_LSR_RX;
-            }
+            while (!receive(bytes[i]) && !quitThread)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
         }
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
+#endif
 }
 
 //------------------------------------------------------------------------------
@@ -140,12 +185,15 @@ void Uart::store(uint64_t addr, uint8_t size, uint64_t value)
 //------------------------------------------------------------------------------
 uint64_t Uart::load8(uint64_t addr) const
 {
-    std::lock_guard<std::mutex> lock(uartMutex);
     if (addr == UART_RHR)
     {
-        uart[UART_LSR] &= ~UART_LSR_RX;
+        char c;
+        if (input.pop(c))
+            uart[UART_RHR] = ASU8(c);
         return ASU64(uart[UART_RHR]);
     }
+    else if (addr == UART_LSR)
+        return ASU64(uart[UART_LSR] | (input.empty() ? 0 : UART_LSR_RX));
     else
         return uart[addr];
 }
@@ -155,21 +203,128 @@ void Uart::store8(uint64_t addr, uint64_t value)
 {
     if (addr == UART_THR)
     {
-        uint8_t ch = ASU8(value);
-        if (myUseConsole)
-            std::cout << ch << std::flush;
-        else
+        char ch = static_cast<char>(value);
+        if (txFile)
         {
-            outputMutex.lock();
-            output.push_back(ch);
-            outputMutex.unlock();
+            // Full: the guest waits for the writer, as for a real transmitter.
+            while (!tx.push(ch))
+            {
+                requestFlush(true);
+                std::this_thread::yield();
+            }
+
+            // Pairs with the fence of the writer going idle: either it sees the byte, or this
+            // sees it idle.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ch == '\n' || tx.size() >= UART_TX_FLUSH_SIZE)
+                requestFlush(true);
+            else if (txIdle.load(std::memory_order_relaxed))
+                requestFlush(false);
         }
+        else
+            output.push(ch);
         if (onOutput)
-            onOutput(ch);
+            onOutput(ASU8(ch));
     }
     else
-    {
-        std::lock_guard<std::mutex> lock(uartMutex);
         uart[addr] = ASU8(value);
+}
+
+//------------------------------------------------------------------------------
+void Uart::setOutput(FILE* file)
+{
+    stopWriter();
+    if (ownsTxFile && txFile)
+        fclose(txFile);
+    txFile = file;
+    ownsTxFile = false;
+    if (txFile)
+        txThread = std::thread(&Uart::writerFunc, this);
+}
+
+//------------------------------------------------------------------------------
+bool Uart::setOutputFile(const std::string& path)
+{
+    FILE* file = fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        std::cerr << "Unable to open: " << path << std::endl;
+        return false;
+    }
+    setOutput(file);
+    ownsTxFile = true;
+    return true;
+}
+
+//------------------------------------------------------------------------------
+void Uart::requestFlush(bool now)
+{
+    {
+        std::lock_guard<std::mutex> lock(txMutex);
+        txPending = true;
+        txFlush = txFlush || now;
+        txIdle = false;
+    }
+    txWake.notify_one();
+}
+
+//------------------------------------------------------------------------------
+void Uart::stopWriter()
+{
+    if (!txThread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(txMutex);
+        txQuit = true;
+    }
+    txWake.notify_one();
+    txThread.join();
+    txQuit = txPending = txFlush = false;
+    txIdle = false;
+}
+
+//------------------------------------------------------------------------------
+void Uart::writerFunc()
+{
+    std::unique_lock<std::mutex> lock(txMutex);
+    while (true)
+    {
+        if (!txPending && !txQuit)
+        {
+            // Going idle: from now on the Cpu thread wakes this up on its next byte.
+            txIdle = true;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (tx.empty())
+                txWake.wait(lock, [this] { return txQuit || txPending; });
+            txIdle = false;
+        }
+
+        // Let the line complete, unless it already did.
+        txWake.wait_for(lock, std::chrono::milliseconds(UART_TX_FLUSH_MS), [this] { return txQuit || txFlush; });
+        txPending = txFlush = false;
+        bool quit = txQuit;
+
+        lock.unlock();
+        writePending();
+        lock.lock();
+        if (quit)
+            return;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Uart::writePending()
+{
+    char chunk[4096];
+    size_t count = 0;
+    while (tx.pop(chunk[count]))
+    {
+        if (++count == sizeof(chunk))
+        {
+            fwrite(chunk, 1, count, txFile);
+            count = 0;
+        }
     }
+    fwrite(chunk, 1, count, txFile);
+    fflush(txFile);
 }
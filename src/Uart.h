@@ -4,12 +4,16 @@
 //! See the spec: http://byterunner.com/16550.html
 //! 
 #include "Device.h"
+#include "SpscRing.h"
 
 #include <thread>
 #include <atomic>
+#include <condition_variable>
 #include <mutex>
-#include <deque>
 #include <functional>
+#include <string>
+#include <vector>
+#include <stdio.h>
 
 /// The interrupt request of UART.
 const uint64_t UART_IRQ = 10;
@@ -37,10 +41,20 @@ const uint8_t UART_LSR_TX = 1 << 5;
 /// The size of UART.
 const uint64_t UART_SIZE = 0x100;
 
+/// Buffered output is written once this many bytes are pending,
+const size_t UART_TX_FLUSH_SIZE = 4096;
+/// or on a newline, or at the latest this long after the first byte pending.
+const unsigned UART_TX_FLUSH_MS = 5;
+
+class Plic;
+
 class Uart : public Device
 {
 public:
-    Uart(bool useConsole = true);
+    /// In console mode the input is read from `consoleFd`, stdin by default, and the output
+    /// written to stdout. Otherwise both go through putChar() and getChar(), unless the output
+    /// is sent elsewhere by setOutput().
+    Uart(bool useConsole = true, int consoleFd = 0);
     virtual ~Uart();
 
     //! Device Interface
@@ -56,42 +70,70 @@ public:
     //! Post char to in port
     void putChar(char c);
 
-    bool is_interrupting() {
-        if (interrupting) { interrupting = false; return true; }
-        return false;
-    }
+    //! Interrupt controller, whose UART_IRQ line is raised when input arrives, or at once if
+    //! some is waiting.
+    void setPlic(Plic* p);
 
     //! Hook called for every character written to UART_THR.
     void setOutputHook(std::function<void(uint8_t)> hook) { onOutput = std::move(hook); }
 
+    //! Write the output to `file`: stdout, a file, a pipe... or nowhere if nullptr. The output
+    //! is buffered and written by a thread on every newline, every UART_TX_FLUSH_SIZE bytes,
+    //! and UART_TX_FLUSH_MS after the first byte pending.
+    void setOutput(FILE* file);
+    //! Same, to the file or named pipe `path`, created or truncated. Return false on error.
+    bool setOutputFile(const std::string& path);
+
 protected:
     uint64_t load8(uint64_t addr) const;
     void store8(uint64_t addr, uint64_t value);
 
+    /// Queue a received byte for the guest. Return false if the input ring is full.
+    bool receive(char c);
+
     // Flag to use console or custom terminal
     bool myUseConsole;
+    int myConsoleFd;
 
-    // Uart buffer
+    // Uart registers, only accessed by the Cpu thread. The RX bit of UART_LSR is not stored:
+    // it is set while the input ring holds bytes.
     mutable std::vector<uint8_t> uart;
 
-    // Uart thread stuff
-    std::atomic<bool> quitThread;
-    std::thread uartThread;
-    void threadFunc();
-    mutable std::mutex uartMutex;
-
-    // FIFO for custom terminal
-    mutable std::mutex inputMutex;
-    std::deque<char> input;
-
-    mutable std::mutex outputMutex;
-    std::deque<char> output;
-
-    /// Bit if an interrupt happens.
-    std::atomic<bool> interrupting;
+    /// Received bytes, from the console thread or putChar() to the Cpu reading UART_RHR.
+    mutable SpscRing<char, 4096> input;
+
+    /// Output for getChar(), when there is no output file. Dropped when full.
+    SpscRing<char, 4096> output;
+
+    /// Output file, written by the writer thread from `tx`.
+    FILE* txFile;
+    bool ownsTxFile;
+    SpscRing<char, 65536> tx;
+    std::thread txThread;
+    std::mutex txMutex;
+    std::condition_variable txWake;
+    /// Bytes are pending, to be written once the timer expires.
+    bool txPending;
+    /// Write them now.
+    bool txFlush;
+    bool txQuit;
+    /// The writer sleeps until a byte is pending, the Cpu thread has to wake it up.
+    std::atomic<bool> txIdle;
+    void requestFlush(bool now);
+    void writerFunc();
+    /// Write what is pending, on the writer thread.
+    void writePending();
+    void stopWriter();
+
+    std::atomic<Plic*> plic;
 
     /// Optional callback for every UART_THR byte written.
     std::function<void(uint8_t)> onOutput;
-};
-
 
+    // Console thread, blocked until input arrives or quitThread is set and wakeFd signaled.
+    std::atomic<bool> quitThread;
+    /// eventfd, or pipe where there is none: read end then write end.
+    int wakeFd[2];
+    std::thread uartThread;
+    void threadFunc();
+};
@@ -1,44 +1,63 @@
 #include "VirtIO.h"
 #include "Trap.h"
 #include "Cpu.h"
+#include "Plic.h"
 
-#include <fstream>
 #include <iostream>
 
 //------------------------------------------------------------------------------
-VirtIO::VirtIO() :
-    id(0), driver_features(0), page_size(0),
-    queue_sel(0), queue_num(0), queue_pfn(0),
-    queue_notify(9999), status(0)
+VirtIO::VirtIO(bool async_io) :
+    driver_features(0), page_size(0),
+    queue_sel(0), queue_num(0), queue_align(ASU32(PAGE_SIZE)), queue_pfn(0),
+    queue_notify(9999), status(0), interrupt_status(0),
+    async(async_io), quit_worker(false), completed(0), plic(nullptr)
 {
 }
 
 //------------------------------------------------------------------------------
 VirtIO::~VirtIO()
 {
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        quit_worker = true;
+    }
+    worker_wake.notify_all();
+    if (worker.joinable())
+        worker.join();
 }
 
 //------------------------------------------------------------------------------
-bool VirtIO::loadDisk(const std::string& imageFile)
+bool VirtIO::loadDisk(const std::string& imageFile, MappedDisk::Mode mode)
 {
-    // Load program
-    std::ifstream image(imageFile, std::ios::in | std::ios::binary | std::ios::ate);
-    if (!image.is_open())
-    {
-        std::cerr << "Unable to read: " << imageFile << std::endl;
+    // The image is mapped rather than read: nothing is loaded until the guest accesses it.
+    std::unique_ptr<MappedDisk> image(new MappedDisk());
+    if (!image->open(imageFile, mode))
         return false;
-    }
-
-    size_t fsize = image.tellg();
-    image.seekg(0, std::ios::beg);
 
-    disk.resize(fsize, 0);
+    set_disk(std::move(image));
+    return true;
+}
 
-    image.read((char*)&disk[0], std::min(fsize, disk.size()));
+//------------------------------------------------------------------------------
+bool VirtIO::loadOverlay(const std::string& imageFile, const std::string& deltaFile)
+{
+    std::unique_ptr<OverlayDisk> overlay(new OverlayDisk());
+    if (!overlay->open(imageFile, deltaFile))
+        return false;
 
+    set_disk(std::move(overlay));
     return true;
 }
 
+//------------------------------------------------------------------------------
+void VirtIO::set_disk(std::unique_ptr<Disk> d)
+{
+    // The worker may still be using the previous disk.
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    wait_idle(lock);
+    disk = std::move(d);
+}
+
 
 //------------------------------------------------------------------------------
 uint64_t VirtIO::load(uint64_t addr, uint8_t size) const
@@ -67,11 +86,14 @@ uint64_t VirtIO::load32(uint64_t addr) const
     case VIRTIO_VERSION: return 0x1;
     case VIRTIO_DEVICE_ID: return 0x2;
     case VIRTIO_VENDOR_ID: return 0x554d4551;
-    case VIRTIO_DEVICE_FEATURES: return 0; // TODO: what should it return?
+    case VIRTIO_DEVICE_FEATURES: return ASU64(1) << VIRTIO_RING_F_INDIRECT_DESC;
     case VIRTIO_DRIVER_FEATURES: return ASU64(driver_features);
-    case VIRTIO_QUEUE_NUM_MAX: return 8;
+    case VIRTIO_QUEUE_NUM_MAX: return VIRTQ_SIZE_MAX;
     case VIRTIO_QUEUE_PFN: return ASU64(queue_pfn);
+    case VIRTIO_INTERRUPT_STATUS: return ASU64(interrupt_status);
     case VIRTIO_STATUS: return ASU64(status);
+    case VIRTIO_CONFIG: return disk ? ASU32(disk->size() / VIRTIO_BLK_SECTOR_SIZE) : 0;
+    case VIRTIO_CONFIG + 4: return disk ? (disk->size() / VIRTIO_BLK_SECTOR_SIZE) >> 32 : 0;
     default: return 0;
     }
 }
@@ -81,106 +103,221 @@ void VirtIO::store32(uint64_t addr, uint64_t value)
 {
     switch (addr)
     {
-    case VIRTIO_DEVICE_FEATURES: driver_features = ASU32(value); break;
+    case VIRTIO_DRIVER_FEATURES: driver_features = ASU32(value); break;
     case VIRTIO_GUEST_PAGE_SIZE: page_size = ASU32(value); break;
     case VIRTIO_QUEUE_SEL: queue_sel = ASU32(value); break;
     case VIRTIO_QUEUE_NUM: queue_num = ASU32(value); break;
-    case VIRTIO_QUEUE_PFN: queue_pfn = ASU32(value); break;
+    case VIRTIO_QUEUE_ALIGN: queue_align = ASU32(value); break;
+    case VIRTIO_QUEUE_PFN:
+        // The queue is laid out from its size and alignment, written before.
+        drain();
+        queue_pfn = ASU32(value);
+        queue.setup(desc_addr(), queue_num, queue_align);
+        break;
     case VIRTIO_QUEUE_NOTIFY: queue_notify = ASU32(value); break;
-    case VIRTIO_STATUS: status = ASU32(value); break;
+    case VIRTIO_INTERRUPT_ACK: interrupt_status &= ~ASU32(value); break;
+    case VIRTIO_STATUS:
+        status = ASU32(value);
+        if (status == 0)
+        {
+            drain();
+            driver_features = 0;
+            interrupt_status = 0;
+            queue_pfn = 0;
+            queue.reset();
+        }
+        break;
     }
 }
 
-/// Access the disk via virtio. This is an associated function which takes a `cpu` object to
-/// read and write with a dram directly (DMA).
+//------------------------------------------------------------------------------
 void VirtIO::disk_access(Cpu * cpu)
 {
     // See more information in
     // https://github.com/mit-pdos/xv6-riscv/blob/riscv/kernel/virtio_disk.c
 
-    // the spec says that legacy block operations use three
-    // descriptors: one for type/reserved/sector, one for
-    // the data, one for a 1-byte status result.
-
-    // desc = pages -- num * VRingDesc
-    // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-    // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
-    uint64_t desc_add = desc_addr();
-    uint64_t avail_add = desc_addr() + 0x40;
-    uint64_t used_add = desc_addr() + 4096;
-
-    // avail[0] is flags
-    // avail[1] tells the device how far to look in avail[2...].
-    uint64_t offset = cpu->bus.load(avail_add + 1, 16); //.wrapping_add(1)
-                                                           // .expect("failed to read offset");
-    // avail[2...] are desc[] indices the device should process.
-    // we only tell device the first index in our chain of descriptors.
-    uint64_t index = cpu->bus.load(avail_add + (offset % DESC_NUM) + 2, 16);
-        //.expect("failed to read index");
-
-    // Read `VRingDesc`, virtio descriptors.
-    uint64_t desc_addr0 = desc_add + VRING_DESC_SIZE * index;
-    uint64_t addr0 = cpu->bus.load(desc_addr0, 64);
-        //.expect("failed to read an address field in a descriptor");
-    // Add 14 because of `VRingDesc` structure.
-    // struct VRingDesc {
-    //   uint64 addr;
-    //   uint32 len;
-    //   uint16 flags;
-    //   uint16 next
-    // };
-    // The `next` field can be accessed by offset 14 (8 + 4 + 2) bytes.
-    uint64_t next0 = cpu->bus.load(desc_addr0 + 14, 16);
-        //.expect("failed to read a next field in a descripor");
-
-    // Read `VRingDesc` again, virtio descriptors.
-    uint64_t desc_addr1 = desc_add + VRING_DESC_SIZE * next0;
-    uint64_t addr1 = cpu->bus.load(desc_addr1, 64);
-        //.expect("failed to read an address field in a descriptor");
-    uint64_t len1 = cpu->bus.load(desc_addr1 + 8, 32);
-        //.expect("failed to read a length field in a descriptor");
-    uint64_t flags1 = cpu->bus.load(desc_addr1 + 12, 16);
-        //.expect("failed to read a flags field in a descriptor");
-
-    // Read `virtio_blk_outhdr`. Add 8 because of its structure.
-    // struct virtio_blk_outhdr {
-    //   uint32 type;
-    //   uint32 reserved;
-    //   uint64 sector;
-    // } buf0;
-    uint64_t blk_sector = cpu->bus.load(addr0 + 8, 64);
-        //.expect("failed to read a sector field in a virtio_blk_outhdr");
-
-    // Write to a device if the second bit `flag1` is set.
-    if ((flags1 & 2) == 0)
+    // Take every request made available since the last notification: the driver may have queued
+    // several before notifying, or while the previous ones were in flight.
+    std::vector<Request> batch;
+    VirtQueue::Chain chain;
+    while (queue.pop(cpu->bus, chain))
     {
-        // Read dram data and write it to a disk directly (DMA).
-        for (uint64_t i = 0; i < len1; i++)
-        {
-            uint64_t data = cpu->bus.load(addr1 + i, 8);
-                //.expect("failed to read from dram");
-            write_disk(blk_sector * 512 + i, data);
-        }
+        batch.emplace_back();
+        parse_request(cpu, chain, batch.back());
     }
-    else
+    if (batch.empty())
+        return;
+
+    if (!async)
     {
-        // Read disk data and write it to dram directly (DMA).
-        for (uint64_t i = 0; i < len1; i++)
-        {
-            uint64_t data = read_disk(blk_sector * 512 + i);
-            cpu->bus.store(addr1 + i, 8, data);
-                //.expect("failed to write to dram");
-        }
+        for (Request& r : batch)
+            transfer(r);
+    }
+
+    std::lock_guard<std::mutex> lock(worker_mutex);
+    if (!async)
+    {
+        for (Request& r : batch)
+            done.push_back(std::move(r));
+        completed.store(ASU32(done.size()), std::memory_order_relaxed);
+        if (Plic* p = plic.load())
+            p->raise(VIRTIO_IRQ);
+        return;
+    }
+
+    if (!worker.joinable())
+        worker = std::thread(&VirtIO::worker_func, this);
+    for (Request& r : batch)
+        requests.push_back(std::move(r));
+    worker_wake.notify_one();
+}
+
+//------------------------------------------------------------------------------
+void VirtIO::parse_request(Cpu* cpu, const VirtQueue::Chain& chain, Request& r)
+{
+    // The spec says that legacy block requests are a chain of descriptors: the header
+    // (type/reserved/sector), the data buffers, then a 1-byte status written by the device.
+    r.head = chain.head;
+    r.type = 0;
+    r.disk_offset = 0;
+    r.status = nullptr;
+    r.result = VIRTIO_BLK_S_IOERR;
+
+    const std::vector<VirtQueue::Buffer>& buffers = chain.buffers;
+    if (buffers.size() < 2 || !buffers.back().write || buffers.back().len == 0)
+        return;
+    const VirtQueue::Buffer& last = buffers.back();
+    r.status = cpu->bus.dmaSpan(last.addr + last.len - 1, 1, true);
+
+    const VirtQueue::Buffer& header = buffers.front();
+    AccessResult type = cpu->bus.tryLoad(header.addr, 32);
+    AccessResult sector = cpu->bus.tryLoad(header.addr + 8, 64);
+    if (header.write || header.len < VIRTIO_BLK_HEADER_SIZE || type.failed() || sector.failed() || !disk)
+        return;
+    r.type = ASU32(type.value);
+
+    if (r.type == VIRTIO_BLK_T_FLUSH)
+    {
+        r.result = VIRTIO_BLK_S_OK;
+        return;
+    }
+    if (r.type != VIRTIO_BLK_T_IN && r.type != VIRTIO_BLK_T_OUT)
+    {
+        r.result = VIRTIO_BLK_S_UNSUPP;
+        return;
+    }
+
+    // Data buffers, each copied at once (DMA).
+    bool toDisk = r.type == VIRTIO_BLK_T_OUT;
+    uint64_t length = 0;
+    for (size_t i = 1; i + 1 < buffers.size(); i++)
+    {
+        const VirtQueue::Buffer& b = buffers[i];
+        uint8_t* span = b.write == toDisk ? nullptr : cpu->bus.dmaSpan(b.addr, b.len, !toDisk);
+        if (!span)
+            return;
+        r.segments.push_back(Segment{ span, b.len });
+        length += b.len;
+    }
+
+    r.disk_offset = sector.value * VIRTIO_BLK_SECTOR_SIZE;
+    if (sector.value <= disk->size() / VIRTIO_BLK_SECTOR_SIZE && length <= disk->size() - r.disk_offset)
+        r.result = VIRTIO_BLK_S_OK;
+}
+
+//------------------------------------------------------------------------------
+void VirtIO::transfer(Request& r)
+{
+    uint64_t offset = r.disk_offset;
+    uint64_t read = 0;
+    for (const Segment& s : r.segments)
+    {
+        if (r.result != VIRTIO_BLK_S_OK)
+            break;
+        bool ok = r.type == VIRTIO_BLK_T_OUT ?
+            disk->write(offset, s.buffer, s.length) : disk->read(offset, s.buffer, s.length);
+        if (!ok)
+            r.result = VIRTIO_BLK_S_IOERR;
+        offset += s.length;
+        read += r.type == VIRTIO_BLK_T_IN ? s.length : 0;
     }
 
-    // Write id to `UsedArea`. Add 2 because of its structure.
-    // struct UsedArea {
-    //   uint16 flags;
-    //   uint16 id;
-    //   struct VRingUsedElem elems[NUM];
-    // };
-    uint64_t new_id = get_new_id();
-    cpu->bus.store(used_add + 2, 16, new_id % 8);
-        //.expect("failed to write to dram");
+    // A request without a status byte goes back unused.
+    r.written = 0;
+    if (r.status)
+    {
+        *r.status = r.result;
+        r.written = ASU32(read + 1);
+    }
 }
 
+//------------------------------------------------------------------------------
+bool VirtIO::complete(Cpu* cpu, bool wait)
+{
+    if (wait)
+    {
+        std::unique_lock<std::mutex> lock(worker_mutex);
+        wait_idle(lock);
+    }
+
+    if (completed.load(std::memory_order_relaxed) == 0) [[likely]]
+        return false;
+
+    std::deque<Request> batch;
+    {
+        std::lock_guard<std::mutex> lock(worker_mutex);
+        batch.swap(done);
+        completed.store(0, std::memory_order_relaxed);
+    }
+    if (batch.empty())
+        return false;
+
+    // One interrupt for the whole batch.
+    for (const Request& r : batch)
+        queue.push(cpu->bus, r.head, r.written);
+    interrupt_status |= 1;
+    return queue.interruptWanted(cpu->bus);
+}
+
+//------------------------------------------------------------------------------
+void VirtIO::drain()
+{
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    wait_idle(lock);
+    done.clear();
+    completed.store(0, std::memory_order_relaxed);
+}
+
+//------------------------------------------------------------------------------
+void VirtIO::wait_idle(std::unique_lock<std::mutex>& lock)
+{
+    worker_idle.wait(lock, [this] { return requests.empty(); });
+}
+
+//------------------------------------------------------------------------------
+void VirtIO::worker_func()
+{
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    while (true)
+    {
+        worker_wake.wait(lock, [this] { return quit_worker || !requests.empty(); });
+        if (quit_worker)
+            return;
+
+        // Transfer without the lock, so that the guest can queue the next requests. The front
+        // request stays in place: references to deque elements survive push_back.
+        Request& r = requests.front();
+        lock.unlock();
+        transfer(r);
+        lock.lock();
+
+        // The lock publishes the data to the thread posting the completion.
+        done.push_back(std::move(r));
+        requests.pop_front();
+        completed.store(ASU32(done.size()), std::memory_order_relaxed);
+        if (Plic* p = plic.load())
+            p->raise(VIRTIO_IRQ);
+        if (requests.empty())
+            worker_idle.notify_all();
+    }
+}
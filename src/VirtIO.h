@@ -1,6 +1,16 @@
 #pragma once
 
 #include "Device.h"
+#include "Disk.h"
+#include "VirtQueue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 //! The virtio module contains a virtualization standard for network and disk device drivers.
 //! This is the "legacy" virtio interface.
@@ -12,10 +22,6 @@
 /// The interrupt request of virtio.
 const uint64_t VIRTIO_IRQ  = 1;
 
-const uint64_t VRING_DESC_SIZE = 16;
-/// The number of virtio descriptors. It must be a power of two.
-const uint64_t DESC_NUM = 8;
-
 /// Always return 0x74726976.
 const uint64_t VIRTIO_MAGIC  = 0x000;
 /// The version. 1 is legacy.
@@ -32,28 +38,54 @@ const uint64_t VIRTIO_DRIVER_FEATURES  = 0x020;
 const uint64_t VIRTIO_GUEST_PAGE_SIZE  = 0x028;
 /// Select queue, write-only.
 const uint64_t VIRTIO_QUEUE_SEL  = 0x030;
-/// Max size of current queue, read-only. In QEMU, `VIRTIO_COUNT = 8`.
+/// Max size of current queue, read-only.
 const uint64_t VIRTIO_QUEUE_NUM_MAX  = 0x034;
 /// Size of current queue, write-only.
 const uint64_t VIRTIO_QUEUE_NUM  = 0x038;
+/// Used ring alignment in the current queue, write-only.
+const uint64_t VIRTIO_QUEUE_ALIGN  = 0x03c;
 /// Physical page number for queue, read and write.
 const uint64_t VIRTIO_QUEUE_PFN  = 0x040;
 /// Notify the queue number, write-only.
 const uint64_t VIRTIO_QUEUE_NOTIFY  = 0x050;
+/// Why the device interrupted, read-only. Bit 0: the used rings were updated.
+const uint64_t VIRTIO_INTERRUPT_STATUS  = 0x060;
+/// Acknowledge the bits of VIRTIO_INTERRUPT_STATUS, write-only.
+const uint64_t VIRTIO_INTERRUPT_ACK  = 0x064;
 /// Device status, read and write. Reading from this register returns the current device status flags.
 /// Writing non-zero values to this register sets the status flags, indicating the OS/driver
 /// progress. Writing zero (0x0) to this register triggers a device reset.
 const uint64_t VIRTIO_STATUS  = 0x070;
+/// Device configuration space. For a block device, the capacity in 512-byte sectors (64 bits).
+const uint64_t VIRTIO_CONFIG  = 0x100;
 /// The size of virtio.
 const uint64_t VIRTIO_SIZE = 0x1000;
 
+/// The device supports descriptors holding a table of descriptors (feature bit).
+const uint32_t VIRTIO_RING_F_INDIRECT_DESC = 28;
+
+/// Block request types, in the request header.
+const uint32_t VIRTIO_BLK_T_IN = 0;
+const uint32_t VIRTIO_BLK_T_OUT = 1;
+const uint32_t VIRTIO_BLK_T_FLUSH = 4;
+/// Block request status, the last byte of the request.
+const uint8_t VIRTIO_BLK_S_OK = 0;
+const uint8_t VIRTIO_BLK_S_IOERR = 1;
+const uint8_t VIRTIO_BLK_S_UNSUPP = 2;
+/// Size of the request header: uint32 type; uint32 reserved; uint64 sector;
+const uint64_t VIRTIO_BLK_HEADER_SIZE = 16;
+const uint64_t VIRTIO_BLK_SECTOR_SIZE = 512;
+
 class Cpu;
+class Plic;
 
 /// The core-local interruptor (CLINT).
 class VirtIO : public Device
 {
 public:
-    VirtIO();
+    /// With `async_io`, block transfers run on an I/O worker thread while the guest keeps running.
+    /// Otherwise they are done on the spot, which keeps runs deterministic.
+    VirtIO(bool async_io = true);
     virtual ~VirtIO();
 
     //! Device Interface
@@ -64,8 +96,8 @@ public:
     //! Get address space size of device
     uint64_t size() const { return VIRTIO_SIZE; }
 
-    /// Return true if an interrupt is pending.
-    bool is_interrupting()
+    /// Return true once the driver notified a queue.
+    bool is_notified()
     {
         if (queue_notify != 9999) {
             queue_notify = 9999;
@@ -74,31 +106,95 @@ public:
         return false;
     }
 
-    bool loadDisk(const std::string& imageFile);
+    /// Map the disk image file. Guest writes stay in memory unless `mode` is Shared.
+    bool loadDisk(const std::string& imageFile, MappedDisk::Mode mode = MappedDisk::Mode::Private);
+    /// Use the disk image file read-only, its writes going to the copy-on-write `deltaFile`.
+    bool loadOverlay(const std::string& imageFile, const std::string& deltaFile);
 
-    /// Access the disk via virtio. This is an associated function which takes a `cpu` object to
-    /// read and write with a dram directly (DMA).
+    /// Start every block request the driver made available since the last notification. This is
+    /// an associated function which takes a `cpu` object to read the virtqueue in dram; the data
+    /// is then transferred between the disk and the dram (DMA) by the I/O worker thread when the
+    /// device is asynchronous.
     void disk_access(Cpu* cpu);
 
+    /// Post the requests the I/O worker completed to the used ring. Return true if there were
+    /// some and the driver wants to know: VIRTIO_IRQ should then be raised, once for the batch.
+    /// With `wait`, wait for the requests in flight first.
+    bool complete(Cpu* cpu, bool wait = false);
+
+    /// Interrupt controller, whose VIRTIO_IRQ line is raised when requests complete: complete()
+    /// should then be called.
+    void setPlic(Plic* p) { plic = p; }
+
 protected:
     uint64_t load32(uint64_t addr) const;
     void store32(uint64_t addr, uint64_t value);
 
-    uint64_t get_new_id() { return ++id; } //wrapping_add
     uint64_t desc_addr() const { return ASU64(queue_pfn) * ASU64(page_size); }
 
-    uint64_t read_disk(uint64_t addr) const { return ASU64(disk[addr]); }
-    void write_disk(uint64_t addr, uint64_t value) { disk[addr] = ASU8(value); }
+    /// Span of guest RAM a request transfers to or from.
+    struct Segment {
+        /// Host address of the buffer.
+        uint8_t* buffer;
+        uint64_t length;
+    };
+
+    /// Block request taken from the available ring.
+    struct Request {
+        uint16_t head;
+        uint32_t type;
+        uint64_t disk_offset;
+        std::vector<Segment> segments;
+        /// Host address of the status byte, nullptr if there is none.
+        uint8_t* status;
+        /// Status, VIRTIO_BLK_S_OK if the request is to be carried out.
+        uint8_t result;
+        /// Bytes written to the guest buffers, status included.
+        uint32_t written;
+    };
+
+    /// Parse the chain into `r`, checking its buffers against the RAM and the disk.
+    void parse_request(Cpu* cpu, const VirtQueue::Chain& chain, Request& r);
+    /// Transfer the data of the request and write its status.
+    void transfer(Request& r);
+    /// Wait for the requests in flight and drop the completions not posted, before the queue
+    /// is moved or reset.
+    void drain();
+
+    void worker_func();
+    /// Wait for the worker to finish every request, with `lock` held on worker_mutex.
+    void wait_idle(std::unique_lock<std::mutex>& lock);
+    void set_disk(std::unique_ptr<Disk> d);
 
-    uint64_t id;
     uint32_t driver_features;
     uint32_t page_size;
     uint32_t queue_sel;
     uint32_t queue_num;
+    uint32_t queue_align;
     uint32_t queue_pfn;
     uint32_t queue_notify;
     uint32_t status;
-    std::vector<uint8_t> disk;
+    /// Bit 0 set when the used ring was updated, until acknowledged.
+    uint32_t interrupt_status;
+    VirtQueue queue;
+    std::unique_ptr<Disk> disk;
+
+    // I/O worker, started with the first request.
+    std::thread worker;
+    std::mutex worker_mutex;
+    /// Signaled when a request is queued, or on exit.
+    std::condition_variable worker_wake;
+    /// Signaled when the queue becomes empty.
+    std::condition_variable worker_idle;
+    /// Requests in order, the front one being transferred.
+    std::deque<Request> requests;
+    bool async;
+    bool quit_worker;
+    /// Requests done but not posted to the used ring yet, in order.
+    std::deque<Request> done;
+    /// Size of `done`, checked without the lock.
+    std::atomic<uint32_t> completed;
+    std::atomic<Plic*> plic;
 };
 
 
@@ -0,0 +1,498 @@
+#include "VirtIONet.h"
+#include "Trap.h"
+#include "Cpu.h"
+#include "Plic.h"
+
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+#ifndef __linux__
+/// Batches are sent and received one datagram at a time where sendmmsg() and recvmmsg() are
+/// missing.
+struct mmsghdr {
+    msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+//------------------------------------------------------------------------------
+// Send the `n` datagrams of `msgs` without blocking. Return how many were sent.
+static unsigned sendBatch(int fd, mmsghdr* msgs, unsigned n)
+{
+#ifdef __linux__
+    int sent = sendmmsg(fd, msgs, n, MSG_DONTWAIT);
+    return sent > 0 ? unsigned(sent) : 0;
+#else
+    unsigned i = 0;
+    for (; i < n && sendmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT) >= 0; i++);
+    return i;
+#endif
+}
+
+//------------------------------------------------------------------------------
+// Receive up to `n` datagrams into `msgs` without blocking. Return how many were received.
+static unsigned recvBatch(int fd, mmsghdr* msgs, unsigned n)
+{
+#ifdef __linux__
+    int received = recvmmsg(fd, msgs, n, MSG_DONTWAIT, nullptr);
+    return received > 0 ? unsigned(received) : 0;
+#else
+    unsigned i = 0;
+    for (; i < n; i++)
+    {
+        ssize_t len = recvmsg(fd, &msgs[i].msg_hdr, MSG_DONTWAIT);
+        if (len <= 0)
+            break;
+        msgs[i].msg_len = unsigned(len);
+    }
+    return i;
+#endif
+}
+
+//------------------------------------------------------------------------------
+static bool socketAddress(const std::string& path, sockaddr_un& addr)
+{
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        return false;
+    std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+    return true;
+}
+#endif
+
+//------------------------------------------------------------------------------
+VirtIONet::VirtIONet() :
+    driver_features(0), page_size(0), queue_sel(0), status(0),
+    mac{ 0x52, 0x54, 0x00, 0x12, 0x34, 0x56 },
+    tx_notified(false), rx_notified(false), rx_stalled(false), interrupting(false),
+    sent(0), received(0), dropped(0),
+    fd(-1), interrupt_status(0),
+    rx_ready(false), quit_watcher(false), wake_pipe{ -1, -1 }, plic(nullptr)
+{
+    for (Queue& q : queues)
+    {
+        q.num = 0;
+        q.align = ASU32(PAGE_SIZE);
+        q.pfn = 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+VirtIONet::~VirtIONet()
+{
+    close();
+}
+
+//------------------------------------------------------------------------------
+bool VirtIONet::open(const std::string& localPath, const std::string& peerPath)
+{
+#ifdef _WIN32
+    std::cerr << "Networking is not available on this platform" << std::endl;
+    return false;
+#else
+    sockaddr_un local;
+    sockaddr_un peer;
+    if (!socketAddress(localPath, local) || !socketAddress(peerPath, peer))
+    {
+        std::cerr << "Socket path too long: " << localPath << ", " << peerPath << std::endl;
+        return false;
+    }
+
+    int s = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (s < 0)
+    {
+        std::cerr << "Unable to create a socket" << std::endl;
+        return false;
+    }
+
+    // A socket left by a previous run would make bind() fail.
+    struct stat st;
+    if (stat(localPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(localPath.c_str());
+    if (bind(s, reinterpret_cast<const sockaddr*>(&local), sizeof(local)) != 0)
+    {
+        ::close(s);
+        std::cerr << "Unable to bind: " << localPath << std::endl;
+        return false;
+    }
+
+    if (!attach(s))
+        return false;
+    local_path = localPath;
+    peer_path = peerPath;
+
+    // Locally administered address, different for every socket.
+    size_t hash = std::hash<std::string>()(localPath);
+    mac[3] = ASU8(hash);
+    mac[4] = ASU8(hash >> 8);
+    mac[5] = ASU8(hash >> 16);
+    return true;
+#endif
+}
+
+//------------------------------------------------------------------------------
+bool VirtIONet::attach(int s)
+{
+#ifdef _WIN32
+    (void)s;
+    return false;
+#else
+    close();
+    if (pipe(wake_pipe) != 0)
+    {
+        ::close(s);
+        std::cerr << "Unable to create a pipe" << std::endl;
+        return false;
+    }
+
+    fd = s;
+    quit_watcher = false;
+    watcher = std::thread(&VirtIONet::watcher_func, this);
+    return true;
+#endif
+}
+
+//------------------------------------------------------------------------------
+void VirtIONet::close()
+{
+#ifndef _WIN32
+    if (watcher.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(watcher_mutex);
+            quit_watcher = true;
+        }
+        watcher_wake.notify_all();
+        char byte = 0;
+        if (write(wake_pipe[1], &byte, 1) != 1)
+            std::cerr << "Unable to stop the network watcher" << std::endl;
+        watcher.join();
+    }
+
+    for (int& p : wake_pipe)
+    {
+        if (p >= 0)
+            ::close(p);
+        p = -1;
+    }
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    if (!local_path.empty())
+        unlink(local_path.c_str());
+    local_path.clear();
+    peer_path.clear();
+    rx_ready = false;
+#endif
+}
+
+//------------------------------------------------------------------------------
+void VirtIONet::watcher_func()
+{
+#ifndef _WIN32
+    std::unique_lock<std::mutex> lock(watcher_mutex);
+    while (true)
+    {
+        // Sleep until the frames signaled are received, then until the next ones arrive.
+        watcher_wake.wait(lock, [this] { return quit_watcher || !rx_ready; });
+        if (quit_watcher)
+            return;
+
+        lock.unlock();
+        pollfd fds[2] = { { fd, POLLIN, 0 }, { wake_pipe[0], POLLIN, 0 } };
+        int n = poll(fds, 2, -1);
+        lock.lock();
+
+        if (n > 0 && (fds[0].revents & POLLIN))
+        {
+            rx_ready = true;
+            if (Plic* p = plic.load())
+                p->raise(VIRTIO_NET_IRQ);
+        }
+        // Peer of a socketpair closed: the frames left are received, then the link is down.
+        if (n > 0 && (fds[0].revents & (POLLHUP | POLLERR | POLLNVAL)))
+            return;
+    }
+#endif
+}
+
+//------------------------------------------------------------------------------
+uint64_t VirtIONet::load(uint64_t addr, uint8_t size) const
+{
+    // The config space is read byte by byte by some drivers.
+    if (addr >= VIRTIO_CONFIG && addr + size / 8 <= VIRTIO_CONFIG + sizeof(mac))
+    {
+        uint64_t value = 0;
+        for (uint64_t i = 0; i < size / 8; i++)
+            value |= ASU64(mac[addr - VIRTIO_CONFIG + i]) << (8 * i);
+        return value;
+    }
+    if (size == 32)
+        return load32(addr);
+    else
+        throw CpuException(Except::LoadAccessFault);
+}
+
+//------------------------------------------------------------------------------
+void VirtIONet::store(uint64_t addr, uint8_t size, uint64_t value)
+{
+    if (size == 32)
+        store32(addr, value);
+    else
+        throw CpuException(Except::StoreAMOAccessFault);
+}
+
+//------------------------------------------------------------------------------
+uint64_t VirtIONet::load32(uint64_t addr) const
+{
+    switch (addr)
+    {
+    case VIRTIO_MAGIC: return 0x74726976;
+    case VIRTIO_VERSION: return 0x1;
+    case VIRTIO_DEVICE_ID: return 0x1;
+    case VIRTIO_VENDOR_ID: return 0x554d4551;
+    case VIRTIO_DEVICE_FEATURES: return (ASU64(1) << VIRTIO_NET_F_MAC) | (ASU64(1) << VIRTIO_RING_F_INDIRECT_DESC);
+    case VIRTIO_DRIVER_FEATURES: return ASU64(driver_features);
+    case VIRTIO_QUEUE_NUM_MAX: return queue_sel < 2 ? VIRTQ_SIZE_MAX : 0;
+    case VIRTIO_QUEUE_PFN: return queue_sel < 2 ? ASU64(queues[queue_sel].pfn) : 0;
+    case VIRTIO_INTERRUPT_STATUS: return ASU64(interrupt_status);
+    case VIRTIO_STATUS: return ASU64(status);
+    default: return 0;
+    }
+}
+
+//------------------------------------------------------------------------------
+void VirtIONet::store32(uint64_t addr, uint64_t value)
+{
+    Queue* q = selected();
+    switch (addr)
+    {
+    case VIRTIO_DRIVER_FEATURES: driver_features = ASU32(value); break;
+    case VIRTIO_GUEST_PAGE_SIZE: page_size = ASU32(value); break;
+    case VIRTIO_QUEUE_SEL: queue_sel = ASU32(value); break;
+    case VIRTIO_QUEUE_NUM: if (q) q->num = ASU32(value); break;
+    case VIRTIO_QUEUE_ALIGN: if (q) q->align = ASU32(value); break;
+    case VIRTIO_QUEUE_PFN:
+        if (q)
+        {
+            q->pfn = ASU32(value);
+            q->ring.setup(ASU64(q->pfn) * ASU64(page_size), q->num, q->align);
+        }
+        break;
+    case VIRTIO_QUEUE_NOTIFY:
+        if (value == VIRTIO_NET_TX)
+            tx_notified = true;
+        else if (value == VIRTIO_NET_RX)
+            rx_notified = true;
+        break;
+    case VIRTIO_INTERRUPT_ACK: interrupt_status &= ~ASU32(value); break;
+    case VIRTIO_STATUS:
+        status = ASU32(value);
+        if (status == 0)
+        {
+            driver_features = 0;
+            interrupt_status = 0;
+            for (Queue& r : queues)
+            {
+                r.pfn = 0;
+                r.ring.reset();
+            }
+        }
+        break;
+    }
+}
+
+//------------------------------------------------------------------------------
+void VirtIONet::process(Cpu* cpu)
+{
+    if (rx_notified)
+        rx_stalled = false;
+    bool transmitting = tx_notified;
+    tx_notified = rx_notified = false;
+
+    if (transmitting)
+        transmit(cpu);
+    if (rx_ready.load(std::memory_order_relaxed) && !rx_stalled)
+        receive(cpu);
+
+    Plic* p = plic.load(std::memory_order_relaxed);
+    if (interrupting && p)
+        p->raise(VIRTIO_NET_IRQ);
+}
+
+//------------------------------------------------------------------------------
+void VirtIONet::transmit(Cpu* cpu)
+{
+#ifndef _WIN32
+    VirtQueue& ring = queues[VIRTIO_NET_TX].ring;
+    sockaddr_un peer;
+    bool toPeer = !peer_path.empty() && socketAddress(peer_path, peer);
+
+    mmsghdr msgs[VIRTIO_NET_BATCH];
+    uint16_t heads[VIRTIO_NET_BATCH];
+    std::vector<iovec> iov;
+    std::vector<size_t> first;
+    VirtQueue::Chain chain;
+    while (true)
+    {
+        // Gather a batch of frames, each sent straight from the guest buffers.
+        unsigned chains = 0;
+        unsigned frames = 0;
+        iov.clear();
+        first.clear();
+        while (chains < VIRTIO_NET_BATCH && ring.pop(cpu->bus, chain))
+        {
+            heads[chains++] = chain.head;
+            size_t start = iov.size();
+            bool ok = !chain.buffers.empty();
+            for (const VirtQueue::Buffer& b : chain.buffers)
+            {
+                uint8_t* span = b.write ? nullptr : cpu->bus.dmaSpan(b.addr, b.len, false);
+                if (!span)
+                {
+                    ok = false;
+                    break;
+                }
+                iov.push_back(iovec{ span, b.len });
+            }
+            if (!ok)
+            {
+                iov.resize(start);
+                continue;
+            }
+            first.push_back(start);
+            frames++;
+        }
+        if (chains == 0)
+            break;
+
+        for (unsigned i = 0; i < frames; i++)
+        {
+            msghdr& h = msgs[i].msg_hdr;
+            std::memset(&h, 0, sizeof(h));
+            h.msg_name = toPeer ? &peer : nullptr;
+            h.msg_namelen = toPeer ? sizeof(peer) : 0;
+            h.msg_iov = &iov[first[i]];
+            h.msg_iovlen = (i + 1 < frames ? first[i + 1] : iov.size()) - first[i];
+        }
+
+        // Frames the peer cannot take (absent, or its socket full) are lost, as on a wire.
+        unsigned done = frames ? sendBatch(fd, msgs, frames) : 0;
+        sent += done;
+        dropped += frames - done;
+
+        // The device writes nothing to transmit buffers.
+        for (unsigned i = 0; i < chains; i++)
+            ring.push(cpu->bus, heads[i], 0);
+        interrupt_status |= 1;
+        interrupting = interrupting || ring.interruptWanted(cpu->bus);
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+//------------------------------------------------------------------------------
+void VirtIONet::receive(Cpu* cpu)
+{
+#ifndef _WIN32
+    VirtQueue& ring = queues[VIRTIO_NET_RX].ring;
+
+    mmsghdr msgs[VIRTIO_NET_BATCH];
+    uint16_t heads[VIRTIO_NET_BATCH];
+    std::vector<iovec> iov;
+    std::vector<size_t> first;
+    VirtQueue::Chain chain;
+    while (true)
+    {
+        // Offer a batch of receive buffers in guest RAM, for the frames to land in directly.
+        unsigned buffers = 0;
+        iov.clear();
+        first.clear();
+        while (buffers < VIRTIO_NET_BATCH && ring.pop(cpu->bus, chain))
+        {
+            size_t start = iov.size();
+            bool ok = !chain.buffers.empty();
+            for (const VirtQueue::Buffer& b : chain.buffers)
+            {
+                uint8_t* span = b.write ? cpu->bus.dmaSpan(b.addr, b.len, true) : nullptr;
+                if (!span)
+                {
+                    ok = false;
+                    break;
+                }
+                iov.push_back(iovec{ span, b.len });
+            }
+            if (!ok)
+            {
+                // Unusable: returned empty, but only ahead of the batch so that the chains not
+                // filled can be given back.
+                iov.resize(start);
+                if (buffers > 0)
+                {
+                    ring.unpop(1);
+                    break;
+                }
+                ring.push(cpu->bus, chain.head, 0);
+                continue;
+            }
+            heads[buffers++] = chain.head;
+            first.push_back(start);
+        }
+        if (buffers == 0)
+        {
+            // Wait for the driver to give buffers.
+            rx_stalled = true;
+            return;
+        }
+
+        for (unsigned i = 0; i < buffers; i++)
+        {
+            msghdr& h = msgs[i].msg_hdr;
+            std::memset(&h, 0, sizeof(h));
+            h.msg_iov = &iov[first[i]];
+            h.msg_iovlen = (i + 1 < buffers ? first[i + 1] : iov.size()) - first[i];
+        }
+
+        unsigned done = recvBatch(fd, msgs, buffers);
+        ring.unpop(uint16_t(buffers - done));
+        for (unsigned i = 0; i < done; i++)
+        {
+            // A frame larger than the buffers is dropped.
+            bool truncated = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+            ring.push(cpu->bus, heads[i], truncated ? 0 : msgs[i].msg_len);
+            received += truncated ? 0 : 1;
+        }
+        if (done > 0)
+        {
+            interrupt_status |= 1;
+            interrupting = interrupting || ring.interruptWanted(cpu->bus);
+        }
+
+        if (done < buffers)
+        {
+            // The socket is drained: back to the watcher.
+            {
+                std::lock_guard<std::mutex> lock(watcher_mutex);
+                rx_ready = false;
+            }
+            watcher_wake.notify_one();
+            return;
+        }
+    }
+#else
+    (void)cpu;
+#endif
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "Device.h"
+#include "VirtIO.h"
+#include "VirtQueue.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+//! Legacy virtio network device, the frames going through a local datagram socket instead of a
+//! network: two emulators bound to each other's socket path, or the two ends of a socketpair,
+//! make a point-to-point link between their guests.
+//!
+//! Each datagram carries the virtio_net_hdr of the frame then the frame, exactly the bytes of
+//! the guest buffers: frames are sent from and received into guest RAM, without copies.
+
+/// The interrupt request of the virtio network device.
+const uint64_t VIRTIO_NET_IRQ = 2;
+
+/// The device has a MAC address, in the config space.
+const uint32_t VIRTIO_NET_F_MAC = 5;
+
+/// Queues of a network device.
+const uint32_t VIRTIO_NET_RX = 0;
+const uint32_t VIRTIO_NET_TX = 1;
+
+/// Frames moved per socket call.
+const uint32_t VIRTIO_NET_BATCH = 32;
+
+class Cpu;
+
+class VirtIONet : public Device
+{
+public:
+    VirtIONet();
+    virtual ~VirtIONet();
+
+    //! Device Interface
+    //!load
+    uint64_t load(uint64_t addr, uint8_t size) const;
+    //! store
+    void store(uint64_t addr, uint8_t size, uint64_t value);
+    //! Get address space size of device
+    uint64_t size() const { return VIRTIO_SIZE; }
+
+    /// Bind the Unix socket `localPath`, sending the frames to the socket `peerPath`. The MAC
+    /// address is derived from `localPath`. Return false on error.
+    bool open(const std::string& localPath, const std::string& peerPath);
+    /// Use `fd`, a connected datagram socket such as one end of a socketpair, closing it with
+    /// the device.
+    bool attach(int fd);
+
+    /// Return true when there is work for process(): the driver notified a queue, or frames
+    /// arrived while it has receive buffers.
+    bool is_notified() const
+    {
+        return tx_notified || rx_notified || (rx_ready.load(std::memory_order_relaxed) && !rx_stalled);
+    }
+
+    /// Send the frames of the transmit queue and receive the frames waiting on the socket, in
+    /// batches. This is an associated function which takes a `cpu` object to read the
+    /// virtqueues in dram.
+    void process(Cpu* cpu);
+
+    /// Return true once if process() used some buffers and the driver wants to know:
+    /// VIRTIO_NET_IRQ should then be raised.
+    bool complete()
+    {
+        bool irq = interrupting;
+        interrupting = false;
+        return irq;
+    }
+
+    /// Interrupt controller, whose VIRTIO_NET_IRQ line is raised when frames arrive or when
+    /// buffers were used: process() then complete() should be called.
+    void setPlic(Plic* p) { plic = p; }
+
+    //! Statistics
+    uint64_t framesSent() const { return sent; }
+    uint64_t framesReceived() const { return received; }
+    /// Frames sent while the peer was absent or not keeping up.
+    uint64_t framesDropped() const { return dropped; }
+
+protected:
+    uint64_t load32(uint64_t addr) const;
+    void store32(uint64_t addr, uint64_t value);
+
+    void transmit(Cpu* cpu);
+    void receive(Cpu* cpu);
+
+    void close();
+    void watcher_func();
+
+    struct Queue {
+        uint32_t num;
+        uint32_t align;
+        uint32_t pfn;
+        VirtQueue ring;
+    };
+    Queue* selected() { return queue_sel < 2 ? &queues[queue_sel] : nullptr; }
+
+    uint32_t driver_features;
+    uint32_t page_size;
+    uint32_t queue_sel;
+    uint32_t status;
+    Queue queues[2];
+    uint8_t mac[6];
+
+    bool tx_notified;
+    bool rx_notified;
+    /// Frames are waiting but the driver gave no receive buffers.
+    bool rx_stalled;
+    bool interrupting;
+
+    uint64_t sent;
+    uint64_t received;
+    uint64_t dropped;
+
+    int fd;
+    /// Bound socket, removed on close.
+    std::string local_path;
+    /// Socket the frames are sent to, none for a connected socket.
+    std::string peer_path;
+    /// Bit 0 set when the used rings were updated, until acknowledged.
+    uint32_t interrupt_status;
+
+    /// Socket watcher: sets rx_ready when frames arrive, then waits for them to be received.
+    std::thread watcher;
+    std::mutex watcher_mutex;
+    std::condition_variable watcher_wake;
+    std::atomic<bool> rx_ready;
+    bool quit_watcher;
+    /// Pipe waking the watcher out of poll() on exit.
+    int wake_pipe[2];
+    std::atomic<Plic*> plic;
+};
@@ -0,0 +1,104 @@
+#include "VirtQueue.h"
+#include "Bus.h"
+#include "Defines.h"
+#include "Trap.h"
+
+//------------------------------------------------------------------------------
+// Guest memory read by the device. Return false if `addr` is not backed.
+static bool readGuest(const Bus& bus, uint64_t addr, uint8_t size, uint64_t& value)
+{
+    AccessResult r = bus.tryLoad(addr, size);
+    value = r.value;
+    return !r.failed();
+}
+
+//------------------------------------------------------------------------------
+VirtQueue::VirtQueue() :
+    desc(0), avail(0), used(0), num(0), last_avail(0), used_idx(0)
+{
+}
+
+//------------------------------------------------------------------------------
+void VirtQueue::setup(uint64_t base, uint32_t size, uint32_t align)
+{
+    bool valid = base != 0 && size != 0 && size <= VIRTQ_SIZE_MAX && (size & (size - 1)) == 0 &&
+        align != 0 && (align & (align - 1)) == 0;
+    num = valid ? size : 0;
+    desc = base;
+    avail = desc + VRING_DESC_SIZE * num;
+    // flags, idx, ring[num], used_event
+    used = valid ? (avail + 6 + 2 * ASU64(num) + align - 1) & ~ASU64(align - 1) : 0;
+    last_avail = 0;
+    used_idx = 0;
+}
+
+//------------------------------------------------------------------------------
+bool VirtQueue::pop(Bus& bus, Chain& chain)
+{
+    chain.buffers.clear();
+    uint64_t avail_idx;
+    if (!ready() || !readGuest(bus, avail + 2, 16, avail_idx) || ASU16(avail_idx) == last_avail)
+        return false;
+
+    uint64_t head;
+    bool ok = readGuest(bus, avail + 4 + 2 * (last_avail % num), 16, head) && head < num;
+    last_avail++;
+    chain.head = ASU16(head);
+
+    // Walk the descriptors, from the table of the queue then from an indirect table. A chain
+    // has at most as many descriptors as its table: more means it loops.
+    uint64_t table = desc;
+    uint64_t table_size = num;
+    uint64_t remaining = num;
+    uint64_t i = head;
+    while (ok)
+    {
+        uint64_t entry = table + VRING_DESC_SIZE * i;
+        uint64_t addr, len, flags, next;
+        if (remaining-- == 0 ||
+            !readGuest(bus, entry, 64, addr) || !readGuest(bus, entry + 8, 32, len) ||
+            !readGuest(bus, entry + 12, 16, flags) || !readGuest(bus, entry + 14, 16, next))
+            break;
+
+        if (flags & VIRTQ_DESC_F_INDIRECT)
+        {
+            // Only one level, and not from a chain already started.
+            if (table != desc || !chain.buffers.empty() || len == 0 || len % VRING_DESC_SIZE)
+                break;
+            table = addr;
+            table_size = remaining = len / VRING_DESC_SIZE;
+            i = 0;
+            continue;
+        }
+
+        chain.buffers.push_back(Buffer{ addr, ASU32(len), (flags & VIRTQ_DESC_F_WRITE) != 0 });
+        if ((flags & VIRTQ_DESC_F_NEXT) == 0)
+            return true;
+        i = next;
+        ok = i < table_size;
+    }
+
+    chain.buffers.clear();
+    return true;
+}
+
+//------------------------------------------------------------------------------
+void VirtQueue::push(Bus& bus, uint16_t head, uint32_t written)
+{
+    if (!ready())
+        return;
+
+    uint64_t elem = used + 4 + 8 * ASU64(used_idx % num);
+    bus.tryStore(elem, 32, head);
+    bus.tryStore(elem + 4, 32, written);
+    // The element is visible to the driver once the index moves past it.
+    used_idx++;
+    bus.tryStore(used + 2, 16, used_idx);
+}
+
+//------------------------------------------------------------------------------
+bool VirtQueue::interruptWanted(Bus& bus) const
+{
+    uint64_t flags;
+    return !readGuest(bus, avail, 16, flags) || (flags & VIRTQ_AVAIL_F_NO_INTERRUPT) == 0;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+class Bus;
+
+//! Split virtqueue of the legacy virtio interface, shared by the virtio devices.
+//! The driver lays it out in guest memory from the queue base address:
+//!   descriptor table  num * { uint64 addr; uint32 len; uint16 flags; uint16 next; }
+//!   available ring    uint16 flags; uint16 idx; uint16 ring[num]; uint16 used_event;
+//!   used ring         uint16 flags; uint16 idx; { uint32 id; uint32 len; } ring[num];
+//! the used ring starting on the next queue alignment boundary.
+
+/// Size of a virtqueue descriptor.
+const uint64_t VRING_DESC_SIZE = 16;
+/// Largest queue size offered to the drivers.
+const uint32_t VIRTQ_SIZE_MAX = 256;
+
+/// The buffer continues in the `next` descriptor.
+const uint16_t VIRTQ_DESC_F_NEXT = 1;
+/// The buffer is written by the device, read otherwise.
+const uint16_t VIRTQ_DESC_F_WRITE = 2;
+/// The buffer holds a table of descriptors.
+const uint16_t VIRTQ_DESC_F_INDIRECT = 4;
+/// Set in the available ring flags by a driver which does not want interrupts.
+const uint16_t VIRTQ_AVAIL_F_NO_INTERRUPT = 1;
+
+class VirtQueue
+{
+public:
+    /// One descriptor of a chain.
+    struct Buffer {
+        uint64_t addr;
+        uint32_t len;
+        bool write;
+    };
+
+    /// The buffers the driver made available under one head descriptor.
+    struct Chain {
+        uint16_t head;
+        /// Empty if the chain is malformed: it should be returned unused.
+        std::vector<Buffer> buffers;
+    };
+
+    VirtQueue();
+
+    /// Place the queue at `base`, with `num` entries and the used ring aligned on `align`.
+    /// The queue stays disabled if `num` is not a power of two up to VIRTQ_SIZE_MAX.
+    void setup(uint64_t base, uint32_t num, uint32_t align);
+    void reset() { setup(0, 0, 0); }
+    bool ready() const { return num != 0; }
+
+    /// Take the next chain made available by the driver, following the descriptor links and an
+    /// indirect table. Return false once the available ring is drained.
+    bool pop(Bus& bus, Chain& chain);
+    /// Give back the last `count` chains popped, unused: they are popped again next time.
+    void unpop(uint16_t count) { last_avail = uint16_t(last_avail - count); }
+    /// Return the chain of `head` to the driver, `written` bytes having been written to it.
+    void push(Bus& bus, uint16_t head, uint32_t written);
+    /// Whether the driver wants an interrupt for the chains returned.
+    bool interruptWanted(Bus& bus) const;
+
+protected:
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint32_t num;
+    /// Next entry of the available ring to process.
+    uint16_t last_avail;
+    /// Shadow of the used ring index.
+    uint16_t used_idx;
+};
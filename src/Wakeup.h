@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+
+/// Lets the harts sleep in wfi until a device has news for them. The devices working on their
+/// own threads notify it after updating their state: a hart samples epoch() before looking at
+/// that state, then sleeps only while no notification came since.
+class Wakeup
+{
+public:
+	Wakeup() : count(0), sleepers(0) {}
+
+	uint64_t epoch() const { return count.load(std::memory_order_seq_cst); }
+
+	//! Device side, from any thread. Only takes the lock when a hart sleeps.
+	void notify()
+	{
+		count.fetch_add(1, std::memory_order_seq_cst);
+		if (sleepers.load(std::memory_order_seq_cst) == 0)
+			return;
+		std::lock_guard<std::mutex> lock(mutex);
+		wake.notify_all();
+	}
+
+	//! Hart side: sleep until a notification after `since`, or until `deadline`. Return false
+	//! on the deadline.
+	bool wait(uint64_t since, std::chrono::steady_clock::time_point deadline)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		sleepers.fetch_add(1, std::memory_order_seq_cst);
+		bool notified = wake.wait_until(lock, deadline, [&] { return epoch() != since; });
+		sleepers.fetch_sub(1, std::memory_order_seq_cst);
+		return notified;
+	}
+
+private:
+	std::atomic<uint64_t> count;
+	std::atomic<uint32_t> sleepers;
+	std::mutex mutex;
+	std::condition_variable wake;
+};
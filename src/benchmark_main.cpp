@@ -7,16 +7,20 @@
 #include "Uart.h"
 #include "VirtIO.h"
 #include "Trap.h"
+#include "BlockEngine.h"
 #ifdef WITH_ELFIO
 #include "ElfLoader.h"
 #endif
 
 #include <iostream>
 #include <iomanip>
+#include <new>
 #include <chrono>
 #include <string>
 #include <csignal>
 #include <future>
+#include <vector>
+#include <algorithm>
 
 static constexpr int BENCHMARK_TIMEOUT_S = 30;
 
@@ -31,23 +35,34 @@ void timeout_handler(int signum) {
 void printUsage(const char* name)
 {
 	std::cout << "RVemuBench: RISC-V boot benchmark" << std::endl;
-	std::cout << "Usage: " << name << " <file.bin|elf> [disk.img]" << std::endl;
+	std::cout << "Usage: " << name << " [--mode=step|block|jit|all] [--ram=size] <file.bin|elf> [disk.img]" << std::endl;
+	std::cout << "  --mode=step   boot running one instruction at a time" << std::endl;
+	std::cout << "  --mode=block  boot running translated basic blocks" << std::endl;
+#ifdef WITH_JIT
+	std::cout << "  --mode=jit    boot compiling hot basic blocks to native code" << std::endl;
+#endif
+	std::cout << "  --mode=all    boot once in each mode (default)" << std::endl;
+	std::cout << "  --ram=N       size of the guest RAM in MiB, or with a G suffix in GiB (default 128)" << std::endl;
 }
 
 //---------------------------------------------------------
-int main(int argc, char** argv)
+/// Boot a fresh computer until the shell starts and return the elapsed time in seconds,
+/// or a negative value on error.
+double boot(const std::string& mode, const char* kernel, const char* disk, size_t ramSize)
 {
-	if (argc < 2)
-	{
-		printUsage(argv[0]);
-		return 1;
+	// Instantiate computer. The Uart does not read the console so that it can be stopped
+	// between runs, its output is echoed by the hook below.
+	std::unique_ptr<Memory> mem;
+	try {
+		mem.reset(new Memory(ramSize));
+	}
+	catch (const std::bad_alloc&) {
+		std::cerr << "Unable to allocate " << ramSize / (1024 * 1024) << " MiB of RAM" << std::endl;
+		return -1;
 	}
-
-	// Instantiate computer
-	std::unique_ptr<Memory> mem(new Memory());
 	std::unique_ptr<Plic> plic(new Plic());
 	std::unique_ptr<Clint> clint(new Clint());
-	std::unique_ptr<Uart> uart(new Uart());
+	std::unique_ptr<Uart> uart(new Uart(false));
 	std::unique_ptr<Bus> bus(new Bus());
 	std::unique_ptr<Cpu> cpu(new Cpu(*bus, DRAM_BASE+mem->size()));
 	std::unique_ptr<VirtIO> virtio(new VirtIO());
@@ -61,15 +76,15 @@ int main(int argc, char** argv)
 	bool isElf = false;
 #ifdef WITH_ELFIO
 	ElfLoader eloader;
-	isElf = eloader.load(argv[1], mem.get());
+	isElf = eloader.load(kernel, mem.get());
 #endif
 
 	if (!isElf)
 	{
-		if (!isElf && !mem->preload(argv[1]))
+		if (!isElf && !mem->preload(kernel))
 		{
-			std::cerr << "Error while loading: " << argv[1] << std::endl;
-			return 1;
+			std::cerr << "Error while loading: " << kernel << std::endl;
+			return -1;
 		}
 	}
 	else
@@ -80,44 +95,22 @@ int main(int argc, char** argv)
 		cpu->store_csr(MTVEC, eloader.mtvec);
 	}
 
-	if (argc == 3)
+	if (disk)
 	{
-		if (!virtio->loadDisk(argv[2]))
+		if (!virtio->loadDisk(disk))
 		{
-			std::cerr << "Error while loading: " << argv[2] << std::endl;
-			return 1;
+			std::cerr << "Error while loading: " << disk << std::endl;
+			return -1;
 		}
 	}
 
-
-	// Register the signal handler for the main thread
-    std::signal(SIGUSR1, timeout_handler);
-    pthread_t main_thread = pthread_self();
-
-    // Promise/Future pair to communicate with the watchdog
-    std::promise<void> work_done;
-    std::future<void> watchdog_future = work_done.get_future();
-
-    // 1. Launch the Watchdog Thread
-    std::thread watchdog([&watchdog_future, main_thread]() {
-        // Watchdog waits for 3 seconds for the future to be fulfilled
-        if (watchdog_future.wait_for(std::chrono::seconds(BENCHMARK_TIMEOUT_S)) == std::future_status::timeout) {
-            std::cout << "[Watchdog] Time is up! Sending interrupt to main thread...\n";
-            // Fire an OS-level interrupt at the main thread
-            pthread_kill(main_thread, SIGUSR1);
-        } else {
-            std::cout << "[Watchdog] Work finished in time. Shutting down.\n";
-        }
-    });
-
 	// Benchmark state
 	std::string buf;
 	bool found = false;
-	auto start = std::chrono::high_resolution_clock::now();
-	auto deadline = start + std::chrono::seconds(BENCHMARK_TIMEOUT_S);
 
 	uart->setOutputHook([&](uint8_t ch)
 	{
+		std::cout << static_cast<char>(ch) << std::flush;
 		buf.push_back(static_cast<char>(ch));
 		if (buf.size() > 80)
 			buf.erase(0, buf.size() - 40);
@@ -125,50 +118,111 @@ int main(int argc, char** argv)
 			found = true;
 	});
 
+	auto start = std::chrono::high_resolution_clock::now();
+
 	// Run program
 	try {
-		uint32_t inst = 0;
+		std::unique_ptr<BlockEngine> blocks(mode != "step" ? new BlockEngine(*cpu, mode == "jit") : nullptr);
 		while (true)
 		{
-			// 1. Fetch.
-			inst = cpu->fetch();
-
-			// 2. Add 4 to the program counter.
-			cpu->forwardPC();
-
-			// 3. Decode.
-			uint8_t opcode, rd, rs1, rs2, funct3, funct7;
-			cpu->decode(inst, opcode, rd, rs1, rs2, funct3, funct7);
-
-			// Debug
-			//printInstruction(inst, opcode, rd, rs1, rs2, funct3, funct7);
-			//printCsrs(cpu.get());
-			//printStack(cpu.get());
-
-			// 4. Execute.
-			cpu->execute(inst, opcode, rd, rs1, rs2, funct3, funct7);
-
-			// 5. check interrupt
+			// 1. Fetch, decode and execute through the predecoded instruction cache,
+			//    a whole basic block at a time in block mode.
+			if (blocks)
+				blocks->step();
+			else
+				cpu->step();
+
+			// 2. check interrupt
 			Interrupt i = cpu->check_pending_interrupt();
 			if (i != Interrupt::InvalidInterrupt) [[unlikely]]
 				Trap::take_trap(cpu.get(), Except::InvalidExcept, i);
 
 			if (found)
 				break;
-
 		}
 	}
 	catch (const CpuFatal& e)
 	{
 		std::cerr << "\nFatal Error: " << e.what() << std::endl;
-		exit(1);
+		return -1;
 	}
 
 	auto end = std::chrono::high_resolution_clock::now();
 	std::chrono::duration<double> elapsed = end - start;
+	return elapsed.count();
+}
+
+//---------------------------------------------------------
+int main(int argc, char** argv)
+{
+	// Check args
+#ifdef WITH_JIT
+	const std::vector<std::string> allModes = { "step", "block", "jit" };
+#else
+	const std::vector<std::string> allModes = { "step", "block" };
+#endif
+	std::vector<std::string> modes = allModes;
+	std::vector<const char*> files;
+	size_t ramSize = DEFAULT_MEMORYSIZE;
+	for (int a = 1; a < argc; a++)
+	{
+		std::string arg = argv[a];
+		if (arg.rfind("--mode=", 0) == 0 && std::find(allModes.begin(), allModes.end(), arg.substr(7)) != allModes.end())
+			modes = { arg.substr(7) };
+		else if (arg == "--mode=all")
+			modes = allModes;
+		else if (arg.rfind("--ram=", 0) == 0 && Memory::parseSize(arg.substr(6)) != 0)
+			ramSize = Memory::parseSize(arg.substr(6));
+		else if (arg.rfind("--", 0) == 0)
+		{
+			printUsage(argv[0]);
+			return 1;
+		}
+		else
+			files.push_back(argv[a]);
+	}
+
+	if (files.empty() || files.size() > 2)
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+
+	// Register the signal handler for the main thread
+    std::signal(SIGUSR1, timeout_handler);
+    pthread_t main_thread = pthread_self();
+
+    // Promise/Future pair to communicate with the watchdog
+    std::promise<void> work_done;
+    std::future<void> watchdog_future = work_done.get_future();
+    const auto timeout = std::chrono::seconds(BENCHMARK_TIMEOUT_S * modes.size());
+
+    // 1. Launch the Watchdog Thread
+    std::thread watchdog([&watchdog_future, main_thread, timeout]() {
+        // Watchdog waits for every boot to complete
+        if (watchdog_future.wait_for(timeout) == std::future_status::timeout) {
+            std::cout << "[Watchdog] Time is up! Sending interrupt to main thread...\n";
+            // Fire an OS-level interrupt at the main thread
+            pthread_kill(main_thread, SIGUSR1);
+        } else {
+            std::cout << "[Watchdog] Work finished in time. Shutting down.\n";
+        }
+    });
+
+	// 2. Boot once per mode
+	std::vector<double> times;
+	for (const std::string& mode : modes)
+	{
+		std::cout << "\n--- Booting in " << mode << " mode ---" << std::endl;
+		double t = boot(mode, files[0], files.size() == 2 ? files[1] : nullptr, ramSize);
+		if (t < 0)
+			exit(1);
+		times.push_back(t);
+	}
 
 	std::cout << "\n--- Benchmark complete ---" << std::endl;
-	std::cout << "Boot time: " << std::fixed << std::setprecision(6) << elapsed.count() << " s" << std::endl;
+	for (size_t m = 0; m < modes.size(); m++)
+		std::cout << "Boot time (" << modes[m] << "): " << std::fixed << std::setprecision(6) << times[m] << " s" << std::endl;
 	std::cout << "\n--- Validation passed ---" << std::endl;
 
 	// If work finishes successfully, notify the watchdog to cancel the timeout
@@ -0,0 +1,50 @@
+#include "Disk.h"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+//---------------------------------------------------------
+void printUsage(const char* name)
+{
+	std::cout << "RVdisk: manage the copy-on-write deltas of RVemu disk images (see RVemu --overlay)" << std::endl;
+	std::cout << "Usage: " << name << " info|commit <disk.img> <delta>" << std::endl;
+	std::cout << "       " << name << " discard <delta>" << std::endl;
+	std::cout << "  info     print how much of the image the delta holds" << std::endl;
+	std::cout << "  commit   write the delta into the image, then delete the delta" << std::endl;
+	std::cout << "  discard  delete the delta, dropping its writes" << std::endl;
+}
+
+//---------------------------------------------------------
+int main(int argc, char** argv)
+{
+	std::string command = argc > 1 ? argv[1] : "";
+
+	if (command == "discard" && argc == 3)
+		return OverlayDisk::discard(argv[2]) ? 0 : 1;
+
+	if (command == "commit" && argc == 4)
+		return OverlayDisk::commit(argv[2], argv[3]) ? 0 : 1;
+
+	if (command == "info" && argc == 4)
+	{
+		// Opening the overlay would create a missing delta.
+		if (!std::ifstream(argv[3]))
+		{
+			std::cerr << "No delta: " << argv[3] << std::endl;
+			return 1;
+		}
+
+		OverlayDisk disk;
+		if (!disk.open(argv[2], argv[3]))
+			return 1;
+
+		uint64_t blocks = (disk.size() + OverlayDisk::BLOCK_SIZE - 1) / OverlayDisk::BLOCK_SIZE;
+		std::cout << argv[3] << ": " << disk.deltaBlocks() << " of " << blocks << " blocks of "
+			<< OverlayDisk::BLOCK_SIZE << " bytes written" << std::endl;
+		return 0;
+	}
+
+	printUsage(argv[0]);
+	return 1;
+}
@@ -6,19 +6,48 @@
 #include "Plic.h"
 #include "Uart.h"
 #include "VirtIO.h"
+#include "VirtIONet.h"
 #include "Trap.h"
+#include "BlockEngine.h"
+#include "LockstepScheduler.h"
 #ifdef WITH_ELFIO
 #include "ElfLoader.h"
 #endif
 
+#include <atomic>
+#include <charconv>
 #include <iostream>
 #include <iomanip>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
 
 //---------------------------------------------------------
 void printUsage(const char* name)
 {
 	std::cout << "RVemu: a simple RISC-V emulator" << std::endl;
-	std::cout << "Usage: " << name << " <file.bin> <disk.img>" << std::endl;
+	std::cout << "Usage: " << name << " [--mode=step|block|jit] [--harts=N] [--lockstep[=N]] [--ram=size] [--hugepages=MiB] [--disk-mode=private|shared] [--overlay=delta] [--timer=instructions|host] [--net=socket,peer] [--uart-out=file] <file.bin> <disk.img>" << std::endl;
+	std::cout << "  --mode=step   run one instruction at a time (default)" << std::endl;
+	std::cout << "  --mode=block  run translated basic blocks" << std::endl;
+#ifdef WITH_JIT
+	std::cout << "  --mode=jit    run basic blocks, compiling hot ones to native code" << std::endl;
+#endif
+	std::cout << "  --harts=N     number of harts, each one running on its own host thread (default 1, at most " << MAX_HARTS << ")" << std::endl;
+	std::cout << "  --lockstep[=N] run the harts in turn on one thread, N instructions each (default " << LOCKSTEP_QUANTUM << "):" << std::endl;
+	std::cout << "                 runs are reproducible, with a synchronous disk and --timer=instructions" << std::endl;
+	std::cout << "  --ram=N       size of the guest RAM in MiB, or with a G suffix in GiB (default 128)" << std::endl;
+	std::cout << "  --hugepages=N back the first N MiB of RAM, where the kernel lives, with huge pages" << std::endl;
+	std::cout << "  --disk-mode=private  keep the disk writes in memory, they are lost at exit (default)" << std::endl;
+	std::cout << "  --disk-mode=shared   write the disk writes through to the image file" << std::endl;
+	std::cout << "  --overlay=delta      only read the image file, writing to the copy-on-write delta file" << std::endl;
+	std::cout << "                       (created if missing, see RVdisk to commit or discard it)" << std::endl;
+	std::cout << "  --timer=instructions mtime counts the instructions run by hart 0, reproducibly (default)" << std::endl;
+	std::cout << "  --timer=host         mtime follows the host clock, at 10 MHz" << std::endl;
+	std::cout << "  --uart-out=file      write the console output to a file or a named pipe instead of stdout" << std::endl;
+	std::cout << "  --net=socket,peer    add a network device on the Unix socket file socket, linked to the" << std::endl;
+	std::cout << "                       emulator started with --net=peer,socket" << std::endl;
 }
 
 //---------------------------------------------------------
@@ -59,10 +88,11 @@ void printInstruction(uint32_t inst, uint8_t opcode, uint8_t rd, uint8_t rs1, ui
 }
 
 //---------------------------------------------------------
-void printStack(const Cpu* cpu)
+/// Dump the stack, from SP up to `top`, its initial value.
+void printStack(const Cpu* cpu, uint64_t top)
 {
 	std::cout << "==== Stack ====" << std::endl;
-	for (uint64_t sp = cpu->getRegister(REGSP); sp < DRAM_BASE + DEFAULT_MEMORYSIZE; sp += 8)
+	for (uint64_t sp = cpu->getRegister(REGSP); sp < top; sp += 8)
 	{
 		std::cout << std::hex << "0x" << std::setfill('0') << std::setw(16) << sp
 			<< std::hex << "   0x" << std::setfill('0') << std::setw(16) << cpu->readMem(sp, 64) << std::endl;
@@ -70,100 +100,237 @@ void printStack(const Cpu* cpu)
 	std::cout << "===============" << std::endl;
 }
 
+//---------------------------------------------------------
+/// Parse the decimal number of an option into `value`. Return false unless it is a whole
+/// number at most `max`.
+bool parseCount(const std::string& text, uint64_t max, uint64_t& value)
+{
+	const char* end = text.data() + text.size();
+	std::from_chars_result r = std::from_chars(text.data(), end, value);
+	return r.ec == std::errc() && r.ptr == end && value <= max;
+}
+//---------------------------------------------------------
+/// Run a hart until a fatal error, or until another hart stops on one. Return false on a fatal
+/// error, after reporting it.
+bool runHart(Cpu& cpu, bool blockMode, bool jitMode, std::atomic<bool>& stop)
+{
+	try {
+		std::unique_ptr<BlockEngine> blocks(blockMode ? new BlockEngine(cpu, jitMode) : nullptr);
+		while (!stop.load(std::memory_order_relaxed))
+		{
+			// 1. Fetch, decode and execute through the predecoded instruction cache,
+			//    a whole basic block at a time in block mode.
+			if (blocks)
+				blocks->step();
+			else
+				cpu.step();
+
+			// Debug
+			//printCsrs(&cpu);
+
+			// 2. check interrupt
+			Interrupt i = cpu.check_pending_interrupt();
+			if (i != Interrupt::InvalidInterrupt) [[unlikely]]
+				Trap::take_trap(&cpu, Except::InvalidExcept, i);
+		}
+	}
+	catch (const CpuFatal& e)
+	{
+		static std::mutex report;
+		std::lock_guard<std::mutex> lock(report);
+		std::cerr << "Fatal Error: " << e.what() << " on hart " << cpu.getHartId() << std::endl;
+		printRegisters(&cpu);
+
+		// Wake up the harts waiting for an interrupt, for them to stop too.
+		stop = true;
+		cpu.bus.wakeup().notify();
+		return false;
+	}
+	return true;
+}
 
 int main(int argc, char** argv)
 {
 	// Check args
-	if (argc < 2)
+	bool blockMode = false;
+	bool jitMode = false;
+	uint32_t harts = 1;
+	uint64_t lockstep = 0;
+	uint64_t hugePages = 0;
+	size_t ramSize = DEFAULT_MEMORYSIZE;
+	MappedDisk::Mode diskMode = MappedDisk::Mode::Private;
+	std::string overlay;
+	std::string netSocket, netPeer;
+	std::string uartOut;
+	Clint::TimeSource timeSource = Clint::TimeSource::Instructions;
+	std::vector<const char*> files;
+	for (int a = 1; a < argc; a++)
+	{
+		std::string arg = argv[a];
+		uint64_t count = 0;
+		if (arg == "--mode=step")
+			blockMode = false;
+		else if (arg == "--mode=block")
+			blockMode = true;
+#ifdef WITH_JIT
+		else if (arg == "--mode=jit")
+			blockMode = jitMode = true;
+#endif
+		else if (arg.rfind("--harts=", 0) == 0 && parseCount(arg.substr(8), MAX_HARTS, count) && count != 0)
+			harts = uint32_t(count);
+		else if (arg == "--lockstep")
+			lockstep = LOCKSTEP_QUANTUM;
+		else if (arg.rfind("--lockstep=", 0) == 0 && parseCount(arg.substr(11), UINT64_MAX, count) && count != 0)
+			lockstep = count;
+		else if (arg.rfind("--ram=", 0) == 0 && Memory::parseSize(arg.substr(6)) != 0)
+			ramSize = Memory::parseSize(arg.substr(6));
+		else if (arg == "--disk-mode=private")
+			diskMode = MappedDisk::Mode::Private;
+		else if (arg == "--disk-mode=shared")
+			diskMode = MappedDisk::Mode::Shared;
+		else if (arg.rfind("--overlay=", 0) == 0 && arg.size() > 10)
+			overlay = arg.substr(10);
+		else if (arg == "--timer=instructions")
+			timeSource = Clint::TimeSource::Instructions;
+		else if (arg == "--timer=host")
+			timeSource = Clint::TimeSource::Host;
+		else if (arg.rfind("--uart-out=", 0) == 0 && arg.size() > 11)
+			uartOut = arg.substr(11);
+		else if (arg.rfind("--net=", 0) == 0 && arg.find(',') != std::string::npos)
+		{
+			netSocket = arg.substr(6, arg.find(',') - 6);
+			netPeer = arg.substr(arg.find(',') + 1);
+		}
+		else if (arg.rfind("--hugepages=", 0) == 0 && parseCount(arg.substr(12), MAX_MEMORYSIZE / (1024 * 1024), count))
+			hugePages = count * 1024 * 1024;
+		else if (arg.rfind("--", 0) == 0)
+		{
+			printUsage(argv[0]);
+			return 1;
+		}
+		else
+			files.push_back(argv[a]);
+	}
+
+	if (files.empty() || files.size() > 2)
 	{
 		printUsage(argv[0]);
 		return 1;
 	}
 
 	// Instanciate Computer
-	std::unique_ptr<Memory> mem(new Memory());
+	std::unique_ptr<Memory> mem;
+	try {
+		mem.reset(new Memory(ramSize));
+	}
+	catch (const std::bad_alloc&) {
+		std::cerr << "Unable to allocate " << ramSize / (1024 * 1024) << " MiB of RAM" << std::endl;
+		return 1;
+	}
 	std::unique_ptr<Plic> plic(new Plic());
-	std::unique_ptr<Clint> clint(new Clint());
+	std::unique_ptr<Clint> clint(new Clint(timeSource));
 	std::unique_ptr<Uart> uart(new Uart());
 	std::unique_ptr<Bus> bus(new Bus());
-	std::unique_ptr<Cpu> cpu(new Cpu(*bus, DRAM_BASE+mem->size()));
-	std::unique_ptr<VirtIO> virtio(new VirtIO());
+	std::vector<std::unique_ptr<Cpu>> cpus;
+	for (uint32_t h = 0; h < harts; h++)
+		cpus.emplace_back(new Cpu(*bus, DRAM_BASE + mem->size(), h));
+	std::unique_ptr<VirtIO> virtio(new VirtIO(lockstep == 0));
+	std::unique_ptr<VirtIONet> net;
+
+	if (!uartOut.empty() && !uart->setOutputFile(uartOut))
+		return 1;
+
+	if (hugePages && !mem->adviseHugePages(0, hugePages))
+		std::cerr << "Huge pages are not available, going on without them" << std::endl;
 
 	bus->addDevice(DRAM_BASE, mem.get()); // Add first for faster access
 	bus->addDevice(PLIC_BASE, plic.get());
 	bus->addDevice(CLINT_BASE, clint.get());
 	bus->addDevice(UART_BASE, uart.get());
 	bus->addDevice(VIRTIO_BASE, virtio.get());
+
+	if (!netSocket.empty())
+	{
+		net.reset(new VirtIONet());
+		if (!net->open(netSocket, netPeer))
+			return 1;
+		bus->addDevice(VIRTIO_NET_BASE, net.get());
+	}
 	
 	bool isElf = false;
 #ifdef WITH_ELFIO
 	ElfLoader eloader;
-	isElf = eloader.load(argv[1], mem.get());
+	isElf = eloader.load(files[0], mem.get());
 #endif
 
 	if (!isElf)
 	{
-		if (!isElf && !mem->preload(argv[1]))
+		if (!isElf && !mem->preload(files[0]))
 		{
-			std::cerr << "Error while loading: " << argv[1] << std::endl;
+			std::cerr << "Error while loading: " << files[0] << std::endl;
 			return 1;
 		}
 	}
 	else
 	{
-		if (eloader.start != 0)
-			cpu->setPC(eloader.start);
+		for (auto&& cpu : cpus)
+		{
+			if (eloader.start != 0)
+				cpu->setPC(eloader.start);
 
-		cpu->store_csr(MTVEC, eloader.mtvec);
+			cpu->store_csr(MTVEC, eloader.mtvec);
+		}
 	}
 
-	if (argc == 3)
+	if (files.size() == 2)
 	{
-		if (!virtio->loadDisk(argv[2]))
+		bool loaded = overlay.empty() ? virtio->loadDisk(files[1], diskMode) : virtio->loadOverlay(files[1], overlay);
+		if (!loaded)
 		{
-			std::cerr << "Error while loading: " << argv[2] << std::endl;
+			std::cerr << "Error while loading: " << files[1] << std::endl;
 			return 1;
 		}
 	}
 
-	// Run program
-	try {
-		uint32_t inst = 0;
-		while (true)
+	// Run program: the harts in turn on this thread...
+	if (lockstep)
+	{
+		std::vector<Cpu*> turns;
+		for (auto&& cpu : cpus)
+			turns.push_back(cpu.get());
+		LockstepScheduler scheduler(turns, lockstep, blockMode, jitMode);
+		try {
+			for (;;)
+				scheduler.round();
+		}
+		catch (const CpuFatal& e)
 		{
-			// 1. Fetch.
-			inst = cpu->fetch();
-
-			// 2. Add 4 to the program counter.
-			cpu->forwardPC();
-
-			// 3. Decode.
-			uint8_t opcode, rd, rs1, rs2, funct3, funct7;
-			cpu->decode(inst, opcode, rd, rs1, rs2, funct3, funct7);
-
-			// Debug
-			//printInstruction(inst, opcode, rd, rs1, rs2, funct3, funct7);
-			//printCsrs(cpu.get());
-			//printStack(cpu.get());
-
-			// 4. Execute.
-			cpu->execute(inst, opcode, rd, rs1, rs2, funct3, funct7);
-
-			// 5. check interrupt
-			Interrupt i = cpu->check_pending_interrupt();
-			if (i != Interrupt::InvalidInterrupt) [[unlikely]]
-				Trap::take_trap(cpu.get(), Except::InvalidExcept, i);
+			std::cerr << "Fatal Error: " << e.what() << " on hart " << scheduler.current().getHartId() << std::endl;
+			printRegisters(&scheduler.current());
+			return 1;
 		}
 	}
-	catch (const CpuFatal& e)
+
+	// ...or together, hart 0 on this thread.
+	std::atomic<bool> stop(false);
+	std::atomic<bool> failed(false);
+	std::vector<std::thread> threads;
+	for (size_t h = 1; h < cpus.size(); h++)
 	{
-		std::cerr << "Fatal Error: " << e.what() << std::endl;
-		printRegisters(cpu.get());
-		return 1;
+		threads.emplace_back([&, h] {
+			if (!runHart(*cpus[h], blockMode, jitMode, stop))
+				failed = true;
+		});
 	}
+	if (!runHart(*cpus[0], blockMode, jitMode, stop))
+		failed = true;
+	for (auto&& t : threads)
+		t.join();
+	if (failed)
+		return 1;
 
 	std::cout << "Normal End of program" << std::endl;
-	printRegisters(cpu.get());
+	printRegisters(cpus[0].get());
 
 	return 0;
 }
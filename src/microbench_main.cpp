@@ -0,0 +1,219 @@
+#include "Cpu.h"
+#include "Memory.h"
+#include "Bus.h"
+#include "Trap.h"
+#include "BlockEngine.h"
+
+#include <charconv>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+
+//---------------------------------------------------------
+// Page fault workload: a loop loading from an unmapped page, whose trap handler skips the load.
+// The page tables map the first 2 MiB of the virtual space to the start of the RAM. The program
+// runs in S-mode, translation being off in M-mode, the load page faults being delegated to it.
+const uint64_t FAULT_LOOPS = 1000;
+const uint64_t FAULT_ENTRY = 0x1000;
+const uint64_t FAULT_HANDLER = 0x2000;
+const uint64_t FAULT_TABLES = 0x10000;
+
+void buildFaultProgram(Memory& mem)
+{
+	const uint32_t program[] = {
+		0x3e800293, // addi x5, x0, 1000
+		0x002003b7, // lui x7, 0x200: not mapped
+		0x0003b303, // loop: ld x6, 0(x7)
+		0xfff28293, // addi x5, x5, -1
+		0xfe029ce3, // bne x5, x0, loop
+		0x00000067, // jalr x0, 0(x0)
+	};
+	const uint32_t handler[] = {
+		0x14102473, // csrrs x8, sepc, x0
+		0x00440413, // addi x8, x8, 4
+		0x14141073, // csrrw x0, sepc, x8
+		0x10200073, // sret
+	};
+	static_assert(sizeof(program) / 4 < (FAULT_HANDLER - FAULT_ENTRY) / 4, "program overlaps the handler");
+
+	for (size_t k = 0; k < sizeof(program) / 4; k++)
+		mem.store(FAULT_ENTRY + k * 4, 32, program[k]);
+	for (size_t k = 0; k < sizeof(handler) / 4; k++)
+		mem.store(FAULT_HANDLER + k * 4, 32, handler[k]);
+
+	// Root, level 1 and level 0 tables; only the first entry of the first two is valid.
+	auto pte = [](uint64_t paddr, uint64_t flags) { return ((paddr >> 12) << 10) | flags; };
+	const uint64_t root = FAULT_TABLES, l1 = root + PAGE_SIZE, l0 = root + 2 * PAGE_SIZE;
+	mem.store(root, 64, pte(DRAM_BASE + l1, 0x1));
+	mem.store(l1, 64, pte(DRAM_BASE + l0, 0x1));
+	for (uint64_t vpn = 0; vpn < 512; vpn++)
+		mem.store(l0 + vpn * 8, 64, pte(DRAM_BASE + vpn * PAGE_SIZE, 0xF));
+}
+
+void enterFaultProgram(Cpu& cpu)
+{
+	cpu.store_csr(MEDELEG, ASU64(1) << uint64_t(Except::LoadPageFault));
+	cpu.store_csr(STVEC, FAULT_HANDLER);
+	cpu.store_csr(SATP, (ASU64(8) << 60) | ((DRAM_BASE + FAULT_TABLES) >> 12));
+	cpu.update_paging(SATP);
+	cpu.set_mode(Cpu::Mode::Supervisor);
+}
+
+//---------------------------------------------------------
+void printUsage(const char* name)
+{
+	std::cout << "RVemuMicroBench: interpreter throughput on a bare-metal program returning to address 0" << std::endl;
+	std::cout << "Usage: " << name << " [--mode=decode|step|block|jit|all] [--runs=N] <fib.bin | --faults>" << std::endl;
+	std::cout << "  --mode=decode  fetch, decode and execute every instruction (GUI loop)" << std::endl;
+	std::cout << "  --mode=step    run through the predecoded instruction cache" << std::endl;
+	std::cout << "  --mode=block   run translated basic blocks" << std::endl;
+#ifdef WITH_JIT
+	std::cout << "  --mode=jit     run basic blocks, compiling hot ones to native code" << std::endl;
+#endif
+	std::cout << "  --runs=N       number of times the program is run (default 20000, 1000 with --faults)" << std::endl;
+	std::cout << "  --faults       run a built-in program taking " << FAULT_LOOPS << " page faults instead of a file" << std::endl;
+}
+
+//---------------------------------------------------------
+/// Parse the decimal number of an option into `value`. Return false unless it is a whole
+/// number at most `max`.
+bool parseCount(const std::string& text, uint64_t max, uint64_t& value)
+{
+	const char* end = text.data() + text.size();
+	std::from_chars_result r = std::from_chars(text.data(), end, value);
+	return r.ec == std::errc() && r.ptr == end && value <= max;
+}
+
+//---------------------------------------------------------
+/// Run the program `runs` times in `mode` and return the elapsed time in seconds.
+/// `count` receives the number of instructions of one run (decode and step modes only).
+double run(const std::string& mode, Memory& mem, bool faults, uint64_t runs, uint64_t& count)
+{
+	Bus bus;
+	bus.addDevice(DRAM_BASE, &mem);
+	Cpu cpu(bus, DRAM_BASE + mem.size());
+	std::unique_ptr<BlockEngine> blocks((mode == "block" || mode == "jit") ? new BlockEngine(cpu, mode == "jit") : nullptr);
+	if (faults)
+		enterFaultProgram(cpu);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	uint64_t n = 0;
+	for (uint64_t r = 0; r < runs; r++)
+	{
+		// The program ends with a jump to ra, which is 0.
+		cpu.setPC(faults ? FAULT_ENTRY : DRAM_BASE);
+		if (mode == "decode")
+		{
+			while (cpu.getPC() != 0)
+			{
+				uint8_t opcode, rd, rs1, rs2, funct3, funct7;
+				uint32_t inst = cpu.fetch();
+				cpu.forwardPC();
+				cpu.decode(inst, opcode, rd, rs1, rs2, funct3, funct7);
+				cpu.execute(inst, opcode, rd, rs1, rs2, funct3, funct7);
+				n++;
+			}
+		}
+		else if (blocks)
+		{
+			while (cpu.getPC() != 0)
+				blocks->step();
+		}
+		else
+		{
+			while (cpu.getPC() != 0)
+			{
+				cpu.step();
+				n++;
+			}
+		}
+	}
+	auto end = std::chrono::high_resolution_clock::now();
+
+	if (n)
+		count = n / runs;
+	std::chrono::duration<double> elapsed = end - start;
+	return elapsed.count();
+}
+
+//---------------------------------------------------------
+int main(int argc, char** argv)
+{
+#ifdef WITH_JIT
+	const std::vector<std::string> allModes = { "decode", "step", "block", "jit" };
+#else
+	const std::vector<std::string> allModes = { "decode", "step", "block" };
+#endif
+	std::vector<std::string> modes = allModes;
+	uint64_t runs = 0;
+	const char* file = nullptr;
+	bool faults = false;
+
+	for (int a = 1; a < argc; a++)
+	{
+		std::string arg = argv[a];
+		uint64_t count = 0;
+		if (arg == "--mode=all")
+			modes = allModes;
+		else if (arg.rfind("--mode=", 0) == 0 && std::find(allModes.begin(), allModes.end(), arg.substr(7)) != allModes.end())
+			modes = { arg.substr(7) };
+		else if (arg.rfind("--runs=", 0) == 0 && parseCount(arg.substr(7), UINT64_MAX, count))
+			runs = std::max<uint64_t>(count, 1);
+		else if (arg == "--faults")
+			faults = true;
+		else if (arg.rfind("--", 0) != 0 && !file)
+			file = argv[a];
+		else
+		{
+			printUsage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!file == !faults)
+	{
+		printUsage(argv[0]);
+		return 1;
+	}
+	if (runs == 0)
+		runs = faults ? 1000 : 20000;
+
+	Memory mem;
+	if (faults)
+		buildFaultProgram(mem);
+	else if (!mem.preload(file))
+	{
+		std::cerr << "Error while loading: " << file << std::endl;
+		return 1;
+	}
+
+	// Block modes do not count instructions: the step mode count is used for them.
+	if (modes.front() != "decode" && modes.front() != "step")
+		modes.insert(modes.begin(), "step");
+
+	uint64_t count = 0;
+	try {
+		for (const std::string& mode : modes)
+		{
+			double t = run(mode, mem, faults, runs, count);
+			std::cout << std::left << std::setw(8) << mode << std::right
+				<< std::fixed << std::setprecision(3) << t << " s  "
+				<< std::setprecision(1) << (double(count) * runs / t / 1e6) << " MIPS ("
+				<< count << " instructions x " << runs << " runs)";
+			if (faults)
+				std::cout << "  " << (t / (runs * FAULT_LOOPS) * 1e9) << " ns/fault";
+			std::cout << std::endl;
+		}
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "Fatal Error: " << e.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+// Tests for the basic-block execution engine.
+
+#include "BlockEngine.h"
+#include "Cpu.h"
+#include "Memory.h"
+#include "Bus.h"
+#include "Defines.h"
+#include "Encoders.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <memory>
+
+class BlockEngineTest : public ::testing::Test {
+protected:
+	static constexpr uint64_t kMemSize = 2 * PAGE_SIZE;
+
+	Memory mem{kMemSize};
+	Bus bus;
+	std::unique_ptr<Cpu> cpu;
+	std::unique_ptr<BlockEngine> engine;
+
+	void SetUp() override
+	{
+		bus.addDevice(DRAM_BASE, &mem);
+		cpu = std::unique_ptr<Cpu>(new Cpu(bus, DRAM_BASE + kMemSize));
+		engine = std::unique_ptr<BlockEngine>(new BlockEngine(*cpu));
+	}
+};
+
+// A block runs up to and including its branch.
+TEST_F(BlockEngineTest, BlockEndsAtBranch)
+{
+	// 0: addi x1, x0, 3
+	// 4: addi x5, x5, 1
+	// 8: addi x1, x1, -1
+	// c: bne x1, x0, -8
+	// 10: addi x3, x0, 7
+	mem.store(0x0, 32, addi(1, 0, 3));
+	mem.store(0x4, 32, addi(5, 5, 1));
+	mem.store(0x8, 32, addi(1, 1, -1));
+	mem.store(0xc, 32, bne(1, 0, -8));
+	mem.store(0x10, 32, addi(3, 0, 7));
+
+	engine->step();
+	EXPECT_EQ(cpu->getRegister(5), 1u);
+	EXPECT_EQ(cpu->getPC(), DRAM_BASE + 0x4);
+
+	// Loop body twice more, then fall through.
+	engine->step();
+	engine->step();
+	EXPECT_EQ(cpu->getRegister(1), 0u);
+	EXPECT_EQ(cpu->getRegister(5), 3u);
+	EXPECT_EQ(cpu->getPC(), DRAM_BASE + 0x10);
+	EXPECT_EQ(cpu->getRegister(3), 0u);
+	EXPECT_EQ(engine->blockCount(), 2u);
+}
+
+// Block mode and step mode reach the same state.
+TEST_F(BlockEngineTest, MatchesStepMode)
+{
+	mem.store(0x0, 32, addi(1, 0, 100));
+	mem.store(0x4, 32, addi(5, 5, 3));
+	mem.store(0x8, 32, addi(1, 1, -1));
+	mem.store(0xc, 32, bne(1, 0, -8));
+	mem.store(0x10, 32, j(0));
+
+	while (cpu->getPC() != DRAM_BASE + 0x10)
+		engine->step();
+	const uint64_t x5 = cpu->getRegister(5);
+
+	Cpu ref(bus, DRAM_BASE + kMemSize);
+	while (ref.getPC() != DRAM_BASE + 0x10)
+		ref.step();
+
+	EXPECT_EQ(x5, 300u);
+	EXPECT_EQ(ref.getRegister(5), x5);
+}
+
+// A store overwriting the rest of the running block stops it, and the new code runs.
+TEST_F(BlockEngineTest, SelfModifyingBlock)
+{
+	// 0: auipc x7, 0          ; x7 = DRAM_BASE
+	// 4: lw x6, 0x100(x7)     ; replacement instruction
+	// 8: sw x6, 0x10(x7)      ; overwrite the instruction at 0x10
+	// c: addi x0, x0, 0
+	// 10: addi x1, x0, 1      ; replaced by addi x1, x0, 2
+	// 14: j 0
+	mem.store(0x0, 32, (7 << 7) | 0x17);
+	mem.store(0x4, 32, (0x100 << 20) | (7 << 15) | (0x2 << 12) | (6 << 7) | 0x03);
+	mem.store(0x8, 32, sw(6, 7, 0x10));
+	mem.store(0xc, 32, addi(0, 0, 0));
+	mem.store(0x10, 32, addi(1, 0, 1));
+	mem.store(0x14, 32, j(0));
+	mem.store(0x100, 32, addi(1, 0, 2));
+
+	while (cpu->getPC() != DRAM_BASE + 0x14)
+		engine->step();
+	EXPECT_EQ(cpu->getRegister(1), 2u);
+}
+
+// Blocks never span two pages.
+TEST_F(BlockEngineTest, BlockEndsAtPageBoundary)
+{
+	mem.store(PAGE_SIZE - 4, 32, addi(1, 1, 1));
+	mem.store(PAGE_SIZE, 32, addi(1, 1, 1));
+	mem.store(PAGE_SIZE + 4, 32, j(0));
+
+	cpu->setPC(DRAM_BASE + PAGE_SIZE - 4);
+	engine->step();
+	EXPECT_EQ(cpu->getRegister(1), 1u);
+	EXPECT_EQ(cpu->getPC(), DRAM_BASE + PAGE_SIZE);
+}
@@ -65,6 +65,27 @@ TEST(BusTest, UnmappedStoreFaults)
 	EXPECT_THROW(bus.store(0x1234, 8, 0), CpuException);
 }
 
+// The non-throwing accesses return the fault, including the one thrown by a device.
+TEST(BusTest, TryAccessReturnsFault)
+{
+	Bus bus;
+	FakeDevice dev(0x100);
+	Memory mem(0x100);
+	bus.addDevice(0x80000000, &dev);
+	bus.addDevice(0x90000000, &mem);
+
+	AccessResult r = bus.tryLoad(0x80000040, 8);
+	EXPECT_FALSE(r.failed());
+	EXPECT_EQ(r.value, 0x40u);
+	EXPECT_EQ(bus.tryLoad(0x70000000, 8).ex, Except::LoadAccessFault);
+	EXPECT_EQ(bus.tryStore(0x70000000, 8, 0), Except::StoreAMOAccessFault);
+
+	EXPECT_EQ(bus.tryStore(0x900000F8, 64, 42), Except::InvalidExcept);
+	EXPECT_EQ(bus.tryLoad(0x900000F8, 64).value, 42u);
+	EXPECT_EQ(bus.tryLoad(0x900000F9, 64).ex, Except::LoadAccessFault);
+	EXPECT_EQ(bus.tryStore(0x900000F9, 64, 0), Except::StoreAMOAccessFault);
+}
+
 // Multiple devices coexist; the bus hands each access to the right one.
 TEST(BusTest, MultipleDevicesSelectCorrectly)
 {
@@ -112,3 +133,22 @@ TEST(BusTest, RoutesToRealMemory)
 	EXPECT_EQ(mem.load(0x100, 32), 0xCAFEBABEu);
 	EXPECT_EQ(bus.load(0x80000100, 32), 0xCAFEBABEu);
 }
+
+// DMA spans cover guest physical ranges held entirely by one memory device.
+TEST(BusTest, DmaSpan)
+{
+	Bus bus;
+	FakeDevice dev(0x100);
+	Memory mem(2 * PAGE_SIZE);
+	bus.addDevice(0x80000000, &mem);
+	bus.addDevice(0x90000000, &dev);
+
+	uint8_t* span = bus.dmaSpan(0x80000F00, 0x200, true);
+	ASSERT_EQ(span, mem.base() + 0xF00);
+	span[0x1FF] = 0x5A;
+	EXPECT_EQ(mem.load(0x10FF, 8), 0x5Au);
+
+	EXPECT_EQ(bus.dmaSpan(0x80001F00, 0x101, false), nullptr); // past the end of the RAM
+	EXPECT_EQ(bus.dmaSpan(0x90000000, 0x10, false), nullptr);  // not a memory
+	EXPECT_EQ(bus.dmaSpan(0x70000000, 0x10, false), nullptr);  // unmapped
+}
@@ -1,17 +1,26 @@
 #include "Clint.h"
+#include "Bus.h"
+#include "Cpu.h"
+#include "Memory.h"
 #include "Trap.h"
 
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <thread>
 
-// CLINT only accepts 64-bit accesses.
-TEST(ClintTest, RejectsNon64BitAccess)
+// CLINT only accepts 32-bit accesses to msip, and 64-bit accesses to the timer.
+TEST(ClintTest, RejectsWrongSizeAccess)
 {
 	Clint clint;
 	EXPECT_THROW(clint.load(CLINT_MTIME, 32), CpuException);
 	EXPECT_THROW(clint.store(CLINT_MTIME, 32, 0), CpuException);
 	EXPECT_NO_THROW(clint.load(CLINT_MTIME, 64));
+	EXPECT_THROW(clint.load(CLINT_MSIP, 64), CpuException);
+	EXPECT_THROW(clint.store(CLINT_MSIP, 64, 0), CpuException);
+	EXPECT_NO_THROW(clint.load(CLINT_MSIP, 32));
 }
 
 TEST(ClintTest, MtimeRoundTrip)
@@ -44,7 +53,118 @@ TEST(ClintTest, RegistersAreIndependent)
 TEST(ClintTest, UnknownOffsetIsZero)
 {
 	Clint clint;
-	EXPECT_EQ(clint.load(0x0000, 64), 0u);
-	clint.store(0x0000, 64, 0x1234);
-	EXPECT_EQ(clint.load(0x0000, 64), 0u);
+	EXPECT_EQ(clint.load(0x8000, 64), 0u);
+	clint.store(0x8000, 64, 0x1234);
+	EXPECT_EQ(clint.load(0x8000, 64), 0u);
+}
+
+// mtime counts the instructions retired, from its last value written.
+TEST(ClintTest, MtimeFollowsInstructions)
+{
+	Clint clint;
+	std::atomic<uint64_t> instret(1000);
+	clint.setInstructionCounter(0, &instret);
+	EXPECT_EQ(clint.load(CLINT_MTIME, 64), 0u);
+	instret += 50;
+	EXPECT_EQ(clint.load(CLINT_MTIME, 64), 50u);
+	clint.store(CLINT_MTIME, 64, 10);
+	instret += 5;
+	EXPECT_EQ(clint.load(CLINT_MTIME, 64), 15u);
+}
+
+TEST(ClintTest, MtimeFollowsHostClock)
+{
+	Clint clint(Clint::TimeSource::Host);
+	uint64_t start = clint.load(CLINT_MTIME, 64);
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	EXPECT_GE(clint.load(CLINT_MTIME, 64) - start, CLINT_HOST_FREQUENCY / 1000 * 2);
+}
+
+// The timer is looked at again when mtime reaches mtimecmp, or when one of them is written.
+TEST(ClintTest, DeadlineOfTimer)
+{
+	Clint clint;
+	std::atomic<uint64_t> instret(0);
+	clint.setInstructionCounter(0, &instret);
+	clint.store(CLINT_MTIMECMP, 64, 100);
+	EXPECT_EQ(clint.deadline(0), 0u);
+	EXPECT_FALSE(clint.update(0));
+	EXPECT_EQ(clint.deadline(0), 100u);
+
+	instret = 100;
+	EXPECT_TRUE(clint.update(0));
+	EXPECT_EQ(clint.deadline(0), UINT64_MAX);
+
+	clint.store(CLINT_MTIMECMP, 64, UINT64_MAX);
+	EXPECT_EQ(clint.deadline(0), 0u);
+	EXPECT_FALSE(clint.update(0));
+	EXPECT_EQ(clint.deadline(0), UINT64_MAX);
+}
+
+// Each hart has its own mtimecmp and msip.
+TEST(ClintTest, PerHartRegisters)
+{
+	Clint clint;
+	clint.store(CLINT_MTIMECMP, 64, 100);
+	clint.store(CLINT_MTIMECMP + 8, 64, 200);
+	EXPECT_EQ(clint.load(CLINT_MTIMECMP, 64), 100u);
+	EXPECT_EQ(clint.load(CLINT_MTIMECMP + 8, 64), 200u);
+
+	clint.store(CLINT_MSIP + 4, 32, 1);
+	EXPECT_FALSE(clint.softwareInterrupt(0));
+	EXPECT_TRUE(clint.softwareInterrupt(1));
+	EXPECT_EQ(clint.load(CLINT_MSIP + 4, 32), 1u);
+	// Only bit 0 is implemented.
+	clint.store(CLINT_MSIP + 4, 32, 2);
+	EXPECT_FALSE(clint.softwareInterrupt(1));
+	EXPECT_EQ(clint.load(CLINT_MSIP + 4, 32), 0u);
+}
+
+// A hart spinning in machine mode takes the timer interrupt once mtime reaches mtimecmp.
+TEST(ClintTest, RaisesTimerInterrupt)
+{
+	Memory mem(4096);
+	Clint clint;
+	Bus bus;
+	bus.addDevice(DRAM_BASE, &mem);
+	bus.addDevice(CLINT_BASE, &clint);
+	Cpu cpu(bus, DRAM_BASE + 4096);
+	mem.store(0, 32, 0x0000006f); // jal x0, 0
+	cpu.store_csr(MIE, MIP_MTIP); // MTIE
+	cpu.store_csr(MSTATUS, 1 << 3);
+	clint.store(CLINT_MTIMECMP, 64, 100);
+
+	Interrupt taken = Interrupt::InvalidInterrupt;
+	while (taken == Interrupt::InvalidInterrupt && cpu.getInstret() < 1000)
+	{
+		cpu.step();
+		taken = cpu.check_pending_interrupt();
+	}
+	EXPECT_EQ(taken, Interrupt::MachineTimerInterrupt);
+	EXPECT_EQ(clint.load(CLINT_MTIME, 64), 100u);
+}
+
+// A hart writing the msip of another one interrupts it, until it clears it.
+TEST(ClintTest, RaisesSoftwareInterrupt)
+{
+	Memory mem(4096);
+	Clint clint;
+	Bus bus;
+	bus.addDevice(DRAM_BASE, &mem);
+	bus.addDevice(CLINT_BASE, &clint);
+	Cpu cpu0(bus, DRAM_BASE + 4096, 0);
+	Cpu cpu1(bus, DRAM_BASE + 4096, 1);
+	EXPECT_EQ(cpu1.load_csr(MHARTID), 1u);
+	mem.store(0, 32, 0x0000006f); // jal x0, 0
+	cpu1.store_csr(MIE, MIP_MSIP);
+	cpu1.store_csr(MSTATUS, 1 << 3);
+	EXPECT_EQ(cpu1.check_pending_interrupt(), Interrupt::InvalidInterrupt);
+
+	cpu0.store(CLINT_BASE + CLINT_MSIP + 4, 32, 1);
+	EXPECT_EQ(cpu0.check_pending_interrupt(), Interrupt::InvalidInterrupt);
+	EXPECT_EQ(cpu1.check_pending_interrupt(), Interrupt::MachineSoftwareInterrupt);
+
+	cpu0.store(CLINT_BASE + CLINT_MSIP + 4, 32, 0);
+	EXPECT_EQ(cpu1.check_pending_interrupt(), Interrupt::InvalidInterrupt);
+	EXPECT_EQ(cpu1.load_csr(MIP) & MIP_MSIP, 0u);
 }
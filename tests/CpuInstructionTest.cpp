@@ -3,7 +3,7 @@
 // Each test lays out a small straight-line program at DRAM_BASE, then drives the
 // real fetch -> forwardPC -> decode -> execute loop one step at a time and
 // asserts on architectural state (registers / PC / CSRs). Instruction words are
-// built with the encoder helpers below so the bit packing is self-documenting.
+// built with the encoder helpers of Encoders.h so the bit packing is self-documenting.
 //
 // PC convention used by the emulator: forwardPC() is applied BEFORE execute(),
 // so inside execute() `pc` already points past the current instruction. For
@@ -16,87 +16,19 @@
 #include "Bus.h"
 #include "Trap.h"
 #include "Defines.h"
+#include "Clint.h"
+#include "Plic.h"
+#include "Uart.h"
+#include "Encoders.h"
 
 #include <gtest/gtest.h>
 
+#include <chrono>
 #include <cstdint>
 #include <memory>
+#include <thread>
 #include <vector>
 
-namespace {
-
-// ---- instruction encoders -------------------------------------------------
-
-uint32_t r(uint8_t opcode, uint8_t rd, uint8_t f3, uint8_t rs1, uint8_t rs2, uint8_t f7 = 0)
-{
-	return (uint32_t(f7) << 25) | (uint32_t(rs2) << 20) | (uint32_t(rs1) << 15) |
-	       (uint32_t(f3) << 12) | (uint32_t(rd) << 7) | opcode;
-}
-
-// I-type: imm is the raw 12-bit immediate field (caller supplies 0xFFF for -1).
-uint32_t i(uint8_t opcode, uint8_t rd, uint8_t f3, uint8_t rs1, uint16_t imm12)
-{
-	return (uint32_t(imm12 & 0xFFF) << 20) | (uint32_t(rs1) << 15) |
-	       (uint32_t(f3) << 12) | (uint32_t(rd) << 7) | opcode;
-}
-
-// U-type: imm20 is the 20-bit field placed at bits 31:12.
-uint32_t u(uint8_t opcode, uint8_t rd, uint32_t imm20)
-{
-	return (uint32_t(imm20 & 0xFFFFF) << 12) | (uint32_t(rd) << 7) | opcode;
-}
-
-// S-type store.
-uint32_t s(uint8_t f3, uint8_t rs1, uint8_t rs2, int32_t imm)
-{
-	uint32_t im = uint32_t(imm);
-	return (((im >> 5) & 0x7F) << 25) | (uint32_t(rs2) << 20) | (uint32_t(rs1) << 15) |
-	       (uint32_t(f3) << 12) | ((im & 0x1F) << 7) | 0x23;
-}
-
-// B-type branch. imm is the byte offset (multiple of 2).
-uint32_t b(uint8_t f3, uint8_t rs1, uint8_t rs2, int32_t imm)
-{
-	uint32_t im = uint32_t(imm);
-	return (((im >> 12) & 0x1) << 31) | (((im >> 5) & 0x3F) << 25) |
-	       (uint32_t(rs2) << 20) | (uint32_t(rs1) << 15) | (uint32_t(f3) << 12) |
-	       (((im >> 1) & 0xF) << 8) | (((im >> 11) & 0x1) << 7) | 0x63;
-}
-
-// J-type jal. imm is the byte offset (multiple of 2).
-uint32_t jal(uint8_t rd, int32_t imm)
-{
-	uint32_t im = uint32_t(imm);
-	return (((im >> 20) & 0x1) << 31) | (((im >> 1) & 0x3FF) << 21) |
-	       (((im >> 11) & 0x1) << 20) | (((im >> 12) & 0xFF) << 12) |
-	       (uint32_t(rd) << 7) | 0x6F;
-}
-
-uint32_t jalr(uint8_t rd, uint8_t rs1, int32_t imm)
-{
-	return i(0x67, rd, 0, rs1, uint16_t(imm & 0xFFF));
-}
-
-	uint32_t csr(uint8_t f3, uint8_t rd, uint16_t csr_addr, uint8_t rs1)
-{
-	return (uint32_t(csr_addr & 0xFFF) << 20) | (uint32_t(rs1) << 15) |
-	       (uint32_t(f3) << 12) | (uint32_t(rd) << 7) | 0x73;
-}
-
-// CSR immediate variants (csrrwi, csrrsi, csrrci)
-uint32_t csri(uint8_t f3, uint8_t rd, uint16_t csr_addr, uint8_t uimm)
-{
-	return (uint32_t(csr_addr & 0xFFF) << 20) | (uint32_t(uimm & 0x1F) << 15) |
-	       (uint32_t(f3) << 12) | (uint32_t(rd) << 7) | 0x73;
-}
-
-// Common aliases for register/immediate forms.
-uint32_t addi(uint8_t rd, uint8_t rs1, int32_t imm) { return i(0x13, rd, 0, rs1, uint16_t(imm & 0xFFF)); }
-uint32_t auipc(uint8_t rd, uint32_t imm20) { return u(0x17, rd, imm20); }
-uint32_t lui(uint8_t rd, uint32_t imm20) { return u(0x37, rd, imm20); }
-
-} // namespace
-
 class CpuInstructionTest : public ::testing::Test {
 protected:
 	static constexpr uint64_t kMemSize = 4096;
@@ -557,7 +489,7 @@ TEST_F(CpuInstructionTest, DivuwDivideByZeroIsAllOnes)
 }
 
 // ===========================================================================
-// fence (opcode 0x0f) is a no-op for this single-threaded model. The case
+// fence (opcode 0x0f) only orders the memory accesses of the harts. The case
 // previously fell through into the OP-IMM (0x13) body, which would corrupt a
 // register if the fence word's rd / immediate fields were non-zero.
 // ===========================================================================
@@ -675,15 +607,325 @@ TEST_F(CpuInstructionTest, MretExecutes)
 	EXPECT_NO_THROW(run({mret})) << "mret should execute without throwing";
 }
 
+// An interrupt is taken between two instructions: mret resumes at the next one instead of
+// running the previous one again.
+TEST_F(CpuInstructionTest, InterruptReturnsToNextInstruction)
+{
+	const uint32_t mret = 0x30200073u;
+	mem.store(0x100, 32, mret);
+	cpu->store_csr(MTVEC, DRAM_BASE + 0x100);
+
+	run({addi(1, 1, 1)});
+	Trap::take_trap(cpu.get(), Except::InvalidExcept, Interrupt::MachineExternalInterrupt);
+	EXPECT_EQ(cpu->getCsr(MEPC), DRAM_BASE + 4);
+	EXPECT_EQ(pc(), DRAM_BASE + 0x100);
+
+	run({}, 1);
+	EXPECT_EQ(pc(), DRAM_BASE + 4);
+	EXPECT_EQ(reg(1), 1u);
+}
+
+// Machine interrupts are never delegated, whatever mideleg says: the trap goes to mtvec.
+TEST_F(CpuInstructionTest, MachineTimerInterruptIsNotDelegated)
+{
+	cpu->store_csr(MTVEC, DRAM_BASE + 0x100);
+	cpu->store_csr(STVEC, DRAM_BASE + 0x200);
+	cpu->store_csr(MEDELEG, 0xffff);
+	cpu->store_csr(MIDELEG, 0xffff);
+	Trap::take_trap(cpu.get(), Except::InvalidExcept, Interrupt::MachineTimerInterrupt);
+	EXPECT_EQ(pc(), DRAM_BASE + 0x100);
+	EXPECT_EQ(cpu->getCsr(MCAUSE), (1ULL << 63) | 7);
+}
+
+// A trap into machine mode stops the address translation, mret from it restores the mode and
+// the translation.
+TEST_F(CpuInstructionTest, MachineModeIsNotTranslated)
+{
+	// Sv39 with an empty root table at the end of the RAM: every translated access faults.
+	cpu->store_csr(SATP, (ASU64(8) << 60) | ((DRAM_BASE + kMemSize - PAGE_SIZE) >> 12));
+	cpu->update_paging(SATP);
+	EXPECT_EQ(cpu->try_translate(DRAM_BASE, Cpu::AccessType::Load).value, DRAM_BASE);
+
+	cpu->set_mode(Cpu::Mode::Supervisor);
+	EXPECT_EQ(cpu->try_translate(DRAM_BASE, Cpu::AccessType::Load).ex, Except::LoadPageFault);
+
+	Trap::take_trap(cpu.get(), Except::InvalidExcept, Interrupt::MachineTimerInterrupt);
+	EXPECT_EQ(cpu->try_translate(DRAM_BASE, Cpu::AccessType::Load).value, DRAM_BASE);
+	EXPECT_EQ((cpu->getCsr(MSTATUS) >> 11) & 0b11, 1u);
+}
+
+// sip is the delegated part of mip, the supervisor only writing its software interrupt.
+TEST_F(CpuInstructionTest, SipAliasesMip)
+{
+	cpu->store_csr(MIDELEG, MIP_SSIP | MIP_STIP | MIP_SEIP);
+	cpu->store_csr(MIP, MIP_MTIP | MIP_SEIP);
+	EXPECT_EQ(cpu->getCsr(SIP), MIP_SEIP);
+	cpu->store_csr(SIP, MIP_SSIP | MIP_STIP);
+	EXPECT_EQ(cpu->getCsr(MIP), MIP_MTIP | MIP_SEIP | MIP_SSIP);
+}
+
+// wfi sleeps on the host until the timer expires, without running instructions, then resumes
+// at the next instruction even with interrupts globally disabled.
+TEST_F(CpuInstructionTest, WfiSleepsUntilTimer)
+{
+	const uint32_t wfi = 0x10500073u;
+	Clint clint;
+	bus.addDevice(CLINT_BASE, &clint);
+	mem.store(0, 32, wfi);
+	cpu->store_csr(MIE, MIP_MTIP); // MTIE
+	clint.store(CLINT_MTIMECMP, 64, CLINT_HOST_FREQUENCY / 100);
+
+	auto start = std::chrono::steady_clock::now();
+	cpu->step();
+	EXPECT_TRUE(cpu->isWaiting());
+	while (true)
+	{
+		EXPECT_EQ(cpu->check_pending_interrupt(), Interrupt::InvalidInterrupt);
+		if (!cpu->isWaiting())
+			break;
+		cpu->step();
+	}
+	EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(10));
+	EXPECT_EQ(cpu->getInstret(), 1u);
+	EXPECT_EQ(pc(), DRAM_BASE + 4);
+	EXPECT_NE(cpu->getCsr(MIP) & MIP_MTIP, 0u);
+}
+
+// The supervisor external interrupt is pending while the PLIC has a source for the hart to
+// claim, the sources it does not enable being ignored.
+TEST_F(CpuInstructionTest, ExternalInterruptFollowsPlic)
+{
+	Plic plic;
+	Uart uart(false);
+	bus.addDevice(PLIC_BASE, &plic);
+	bus.addDevice(UART_BASE, &uart);
+	plic.store(PLIC_PRIORITY + 4 * UART_IRQ, 32, 1);
+
+	uart.putChar('x');
+	cpu->check_pending_interrupt();
+	EXPECT_EQ(cpu->getCsr(MIP) & MIP_SEIP, 0u);
+	EXPECT_EQ(plic.load(PLIC_PENDING, 32), 1u << UART_IRQ);
+
+	cpu->store(PLIC_BASE + PLIC_SENABLE, 32, 1u << UART_IRQ);
+	cpu->check_pending_interrupt();
+	EXPECT_NE(cpu->getCsr(MIP) & MIP_SEIP, 0u);
+
+	EXPECT_EQ(cpu->load(PLIC_BASE + PLIC_SCLAIM, 32), UART_IRQ);
+	cpu->check_pending_interrupt();
+	EXPECT_EQ(cpu->getCsr(MIP) & MIP_SEIP, 0u);
+}
+
+// The machine context of the hart drives the machine external interrupt the same way.
+TEST_F(CpuInstructionTest, MachineExternalInterruptFollowsPlic)
+{
+	Plic plic;
+	Uart uart(false);
+	bus.addDevice(PLIC_BASE, &plic);
+	bus.addDevice(UART_BASE, &uart);
+	plic.store(PLIC_PRIORITY + 4 * UART_IRQ, 32, 1);
+	cpu->store(PLIC_BASE + PLIC_ENABLE, 32, 1u << UART_IRQ);
+
+	uart.putChar('x');
+	cpu->check_pending_interrupt();
+	EXPECT_NE(cpu->getCsr(MIP) & MIP_MEIP, 0u);
+	EXPECT_EQ(cpu->getCsr(MIP) & MIP_SEIP, 0u);
+
+	EXPECT_EQ(cpu->load(PLIC_BASE + PLIC_THRESHOLD + 4, 32), UART_IRQ);
+	cpu->check_pending_interrupt();
+	EXPECT_EQ(cpu->getCsr(MIP) & MIP_MEIP, 0u);
+}
+
+// A device interrupting from its own thread wakes up a hart sleeping in wfi.
+TEST_F(CpuInstructionTest, WfiWokenByDevice)
+{
+	const uint32_t wfi = 0x10500073u;
+	Plic plic;
+	Uart uart(false);
+	bus.addDevice(PLIC_BASE, &plic);
+	bus.addDevice(UART_BASE, &uart);
+	mem.store(0, 32, wfi);
+	cpu->store_csr(MIE, MIP_SEIP); // SEIE
+	plic.store(PLIC_PRIORITY + 4 * UART_IRQ, 32, 1);
+	plic.store(PLIC_SENABLE, 32, 1u << UART_IRQ);
+
+	auto start = std::chrono::steady_clock::now();
+	cpu->step();
+	cpu->check_pending_interrupt();
+	std::thread terminal([&] {
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		uart.putChar('x');
+	});
+	while (cpu->isWaiting() && std::chrono::steady_clock::now() - start < std::chrono::seconds(5))
+	{
+		cpu->step();
+		cpu->check_pending_interrupt();
+	}
+	terminal.join();
+	EXPECT_FALSE(cpu->isWaiting());
+	EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(500));
+	EXPECT_NE(cpu->getCsr(MIP) & MIP_SEIP, 0u);
+}
+
 // ===========================================================================
 // sfence.vma: memory management fence
 // ===========================================================================
 
-TEST_F(CpuInstructionTest, SfenceVmaIsNop)
+// sfence.vma flushes the TLB (see TlbTest), then execution goes on with the next instruction.
+TEST_F(CpuInstructionTest, SfenceVmaFallsThrough)
 {
-	// sfence.vma rs1, rs2: order memory management operations (no-op in single-threaded emulator)
-	const uint32_t sfence = 0x12000073u; // sfence.vma x0, x0
-	run({sfence, addi(1, 0, 42)});
+	run({sfence(0, 0), addi(1, 0, 42)});
 	EXPECT_EQ(reg(1), 42u);
 	EXPECT_EQ(pc(), DRAM_BASE + 8);
 }
+
+// ===========================================================================
+// A extension: atomic memory operations
+// ===========================================================================
+
+TEST_F(CpuInstructionTest, AmoaddWSignExtends)
+{
+	// amoadd.w x3, x2, (x1): x3 gets the old word, sign-extended.
+	mem.store(0x400, 32, 0x80000000u);
+	run({auipc(1, 0), addi(1, 1, 0x400), addi(2, 0, 1), r(0x2f, 3, 2, 1, 2, 0x00)});
+	EXPECT_EQ(reg(3), 0xFFFFFFFF80000000ULL);
+	EXPECT_EQ(mem.load(0x400, 32), 0x80000001u);
+}
+
+// Harts running on their own threads add to the same word without losing any update.
+TEST_F(CpuInstructionTest, AmoaddIsAtomicAcrossHarts)
+{
+	const int kLoops = 100000;
+	// x1 = counter, x2 = 1; loop: amoadd.w x0, x2, (x1)
+	run({auipc(1, 0), addi(1, 1, 0x400), addi(2, 0, 1), r(0x2f, 0, 2, 1, 2, 0x00), jal(0, -4)}, 0);
+	std::unique_ptr<Cpu> other(new Cpu(bus, DRAM_BASE + kMemSize, 1));
+	auto loop = [&](Cpu& c) {
+		for (int k = 0; k < 3 + 2 * kLoops; ++k)
+			c.step();
+	};
+	std::thread second([&] { loop(*other); });
+	loop(*cpu);
+	second.join();
+	EXPECT_EQ(mem.load(0x400, 32), uint64_t(2 * kLoops));
+}
+
+TEST_F(CpuInstructionTest, AmoLogic)
+{
+	mem.store(0x400, 64, 0xF0);
+	run({auipc(1, 0), addi(1, 1, 0x400), addi(2, 0, 0x3C),
+	     amo(0x04, 3, 3, 1, 2),   // amoxor.d
+	     amo(0x0c, 3, 4, 1, 2),   // amoand.d
+	     amo(0x08, 3, 5, 1, 2)}); // amoor.d
+	EXPECT_EQ(reg(3), 0xF0u);
+	EXPECT_EQ(reg(4), 0xCCu);
+	EXPECT_EQ(reg(5), 0x0Cu);
+	EXPECT_EQ(mem.load(0x400, 64), 0x3Cu);
+}
+
+TEST_F(CpuInstructionTest, AmoMinMaxSignedAndUnsigned)
+{
+	mem.store(0x400, 32, 15);
+	run({auipc(1, 0), addi(1, 1, 0x400), addi(2, 0, -1), addi(5, 0, 7),
+	     amo(0x10, 2, 3, 1, 2),   // amomin.w: min(15, -1) = -1
+	     amo(0x14, 2, 4, 1, 5),   // amomax.w: max(-1, 7) = 7
+	     amo(0x18, 2, 6, 1, 2),   // amominu.w: minu(7, 0xFFFFFFFF) = 7
+	     amo(0x1c, 2, 7, 1, 2)}); // amomaxu.w: maxu(7, 0xFFFFFFFF) = 0xFFFFFFFF
+	EXPECT_EQ(reg(3), 15u);
+	EXPECT_EQ(reg(4), 0xFFFFFFFFFFFFFFFFULL);
+	EXPECT_EQ(reg(6), 7u);
+	EXPECT_EQ(reg(7), 7u);
+	EXPECT_EQ(mem.load(0x400, 32), 0xFFFFFFFFu);
+}
+
+// An AMO on a device register reads then writes it through the bus.
+TEST_F(CpuInstructionTest, AmoOnDeviceRegister)
+{
+	Clint clint;
+	bus.addDevice(CLINT_BASE, &clint);
+	run({lui(1, CLINT_BASE >> 12), addi(2, 0, 1),
+	     amo(0x08, 2, 3, 1, 2)}); // amoor.w x3, x2, (x1)
+	EXPECT_EQ(reg(3), 0u);
+	EXPECT_EQ(clint.load(CLINT_MSIP, 32), 1u);
+}
+
+// An AMO outside of any device traps once, as a store, leaving rd alone.
+TEST_F(CpuInstructionTest, AmoAccessFaultKeepsRd)
+{
+	EXPECT_THROW(run({addi(1, 0, 0x100), addi(3, 0, 7),
+	                  amo(0x00, 2, 3, 1, 0)}), CpuFatal); // amoadd.w x3, x0, (x1)
+	EXPECT_EQ(cpu->getCsr(MCAUSE), uint64_t(Except::StoreAMOAccessFault));
+	EXPECT_EQ(reg(3), 7u);
+}
+
+// sc stores once after lr, then fails: the reservation is gone.
+TEST_F(CpuInstructionTest, LrScPair)
+{
+	mem.store(0x400, 64, 5);
+	run({auipc(1, 0), addi(1, 1, 0x400),
+	     amo(0x02, 3, 3, 1, 0),   // lr.d x3, (x1)
+	     addi(3, 3, 1),
+	     amo(0x03, 3, 4, 1, 3),   // sc.d x4, x3, (x1)
+	     amo(0x03, 3, 5, 1, 3)}); // sc.d x5, x3, (x1)
+	EXPECT_EQ(reg(4), 0u);
+	EXPECT_EQ(reg(5), 1u);
+	EXPECT_EQ(mem.load(0x400, 64), 6u);
+}
+
+// A store by another hart between lr and sc makes sc fail.
+TEST_F(CpuInstructionTest, ScFailsAfterStoreOfOtherHart)
+{
+	mem.store(0x400, 32, 5);
+	const std::vector<uint32_t> prog = {auipc(1, 0), addi(1, 1, 0x400), addi(2, 0, 1),
+	                                    amo(0x02, 2, 3, 1, 0),  // lr.w x3, (x1)
+	                                    amo(0x03, 2, 4, 1, 2)}; // sc.w x4, x2, (x1)
+	run(prog, 4);
+	Cpu other(bus, DRAM_BASE + kMemSize, 1);
+	other.store(DRAM_BASE + 0x400, 32, 9);
+	run(prog, 1);
+	EXPECT_EQ(reg(3), 5u);
+	EXPECT_EQ(reg(4), 1u);
+	EXPECT_EQ(mem.load(0x400, 32), 9u);
+}
+
+// lr faults as a load.
+TEST_F(CpuInstructionTest, LrMisalignedIsLoadFault)
+{
+	run({auipc(1, 0), addi(1, 1, 0x402), amo(0x02, 2, 3, 1, 0)});
+	EXPECT_EQ(cpu->getCsr(MCAUSE), uint64_t(Except::LoadAddressMisaligned));
+	EXPECT_EQ(reg(3), 0u);
+}
+
+// lr outside of any device traps as a load, leaving rd alone.
+TEST_F(CpuInstructionTest, LrAccessFaultKeepsRd)
+{
+	EXPECT_THROW(run({addi(1, 0, 0x100), addi(3, 0, 7), amo(0x02, 2, 3, 1, 0)}), CpuFatal);
+	EXPECT_EQ(cpu->getCsr(MCAUSE), uint64_t(Except::LoadAccessFault));
+	EXPECT_EQ(reg(3), 7u);
+}
+
+// Harts taking a lr/sc spinlock in turn never are in the critical section together.
+TEST_F(CpuInstructionTest, LrScSpinlockAcrossHarts)
+{
+	const int kLoops = 5000;
+	// x1 = lock, x2 = 1
+	// acquire: lr.w x3, (x1); bne x3, x0, acquire; sc.w x3, x2, (x1); bne x3, x0, acquire
+	// critical section: lw x4, 4(x1); addi x4, x4, 1; sw x4, 4(x1)
+	// release: amoswap.w x0, x0, (x1); jal x0, acquire
+	run({auipc(1, 0), addi(1, 1, 0x400), addi(2, 0, 1),
+	     amo(0x02, 2, 3, 1, 0), b(0x1, 3, 0, -4), amo(0x03, 2, 3, 1, 2), b(0x1, 3, 0, -12),
+	     i(0x03, 4, 2, 1, 4), addi(4, 4, 1), s(0x2, 1, 4, 4),
+	     amo(0x01, 2, 0, 1, 0), jal(0, -32)}, 0);
+	std::unique_ptr<Cpu> other(new Cpu(bus, DRAM_BASE + kMemSize, 1));
+	auto loop = [&](Cpu& c) {
+		for (int k = 0; k < kLoops; )
+		{
+			// Count the critical sections by their release.
+			bool counting = c.getPC() == DRAM_BASE + 0x28;
+			c.step();
+			k += counting;
+		}
+	};
+	std::thread second([&] { loop(*other); });
+	loop(*cpu);
+	second.join();
+	EXPECT_EQ(mem.load(0x404, 32), uint64_t(2 * kLoops));
+}
@@ -0,0 +1,182 @@
+#include "Disk.h"
+#include "Defines.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+namespace {
+// 8 KiB image file, each byte holding the low bits of its offset.
+class DiskTest : public ::testing::Test {
+protected:
+	void SetUp() override
+	{
+		path = testing::TempDir() + "disk_test.img";
+		std::vector<char> bytes(8192);
+		for (size_t i = 0; i < bytes.size(); i++)
+			bytes[i] = static_cast<char>(i);
+		std::ofstream(path, std::ios::binary).write(bytes.data(), bytes.size());
+	}
+
+	void TearDown() override { std::remove(path.c_str()); }
+
+	std::vector<uint8_t> fileContents() const
+	{
+		std::ifstream file(path, std::ios::binary);
+		return std::vector<uint8_t>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+
+	std::string path;
+};
+} // namespace
+
+TEST_F(DiskTest, MapsWholeImage)
+{
+	MappedDisk disk;
+	ASSERT_TRUE(disk.open(path, MappedDisk::Mode::Private));
+	EXPECT_EQ(disk.size(), 8192u);
+
+	uint8_t block[512];
+	ASSERT_TRUE(disk.read(4096 + 512, block, sizeof(block)));
+	EXPECT_EQ(block[0], 0u);
+	EXPECT_EQ(block[511], 0xFFu);
+}
+
+TEST_F(DiskTest, RejectsOutOfRange)
+{
+	MappedDisk disk;
+	ASSERT_TRUE(disk.open(path, MappedDisk::Mode::Private));
+
+	uint8_t block[512] = {};
+	EXPECT_FALSE(disk.read(8192 - 256, block, sizeof(block)));
+	EXPECT_FALSE(disk.write(8192, block, 1));
+	EXPECT_FALSE(disk.read(~0ull, block, 2));
+	EXPECT_TRUE(disk.read(8192, block, 0));
+}
+
+TEST_F(DiskTest, MissingFileFails)
+{
+	MappedDisk disk;
+	EXPECT_FALSE(disk.open(path + ".missing", MappedDisk::Mode::Private));
+	EXPECT_EQ(disk.size(), 0u);
+}
+
+// Writes to a private disk are seen by the guest but never reach the file.
+TEST_F(DiskTest, PrivateWritesStayInMemory)
+{
+	{
+		MappedDisk disk;
+		ASSERT_TRUE(disk.open(path, MappedDisk::Mode::Private));
+		const uint8_t block[4] = { 0xDE, 0xAD, 0xBE, 0xEF };
+		ASSERT_TRUE(disk.write(100, block, sizeof(block)));
+
+		uint8_t back[4];
+		ASSERT_TRUE(disk.read(100, back, sizeof(back)));
+		EXPECT_EQ(back[0], 0xDEu);
+		EXPECT_EQ(back[3], 0xEFu);
+	}
+	EXPECT_EQ(fileContents()[100], 100u);
+}
+
+// Writes to a shared disk go through to the image file.
+TEST_F(DiskTest, SharedWritesReachFile)
+{
+	{
+		MappedDisk disk;
+		ASSERT_TRUE(disk.open(path, MappedDisk::Mode::Shared));
+		const uint8_t block[4] = { 0xDE, 0xAD, 0xBE, 0xEF };
+		ASSERT_TRUE(disk.write(100, block, sizeof(block)));
+	}
+	std::vector<uint8_t> contents = fileContents();
+	ASSERT_EQ(contents.size(), 8192u);
+	EXPECT_EQ(contents[100], 0xDEu);
+	EXPECT_EQ(contents[103], 0xEFu);
+	EXPECT_EQ(contents[104], 104u);
+}
+
+// Writes to an overlay land in its delta, block by block, and never in the base image.
+TEST_F(DiskTest, OverlayWritesToDelta)
+{
+	std::string deltaPath = path + ".delta";
+	{
+		OverlayDisk disk;
+		ASSERT_TRUE(disk.open(path, deltaPath));
+		EXPECT_EQ(disk.size(), 8192u);
+		EXPECT_EQ(disk.deltaBlocks(), 0u);
+
+		// Straddles both blocks of the image.
+		const uint8_t bytes[4] = { 0xDE, 0xAD, 0xBE, 0xEF };
+		ASSERT_TRUE(disk.write(4094, bytes, sizeof(bytes)));
+		EXPECT_EQ(disk.deltaBlocks(), 2u);
+
+		uint8_t back[8];
+		ASSERT_TRUE(disk.read(4092, back, sizeof(back)));
+		EXPECT_EQ(back[0], ASU8(4092));
+		EXPECT_EQ(back[2], 0xDEu);
+		EXPECT_EQ(back[5], 0xEFu);
+		EXPECT_EQ(back[6], ASU8(4098));
+		EXPECT_FALSE(disk.write(8190, bytes, sizeof(bytes)));
+	}
+	EXPECT_EQ(fileContents()[4094], ASU8(4094));
+
+	// The delta keeps the writes from one run to the next.
+	OverlayDisk disk;
+	ASSERT_TRUE(disk.open(path, deltaPath));
+	EXPECT_EQ(disk.deltaBlocks(), 2u);
+	uint8_t back = 0;
+	ASSERT_TRUE(disk.read(4097, &back, 1));
+	EXPECT_EQ(back, 0xEFu);
+	disk.close();
+	EXPECT_TRUE(OverlayDisk::discard(deltaPath));
+}
+
+// A delta only opens over an image of the size it was made for.
+TEST_F(DiskTest, OverlayRejectsOtherImage)
+{
+	std::string deltaPath = path + ".delta";
+	std::string otherPath = path + ".other";
+	std::ofstream(otherPath, std::ios::binary) << "short image";
+	{
+		OverlayDisk disk;
+		ASSERT_TRUE(disk.open(path, deltaPath));
+	}
+
+	OverlayDisk disk;
+	EXPECT_FALSE(disk.open(otherPath, deltaPath));
+	std::remove(otherPath.c_str());
+	std::remove(deltaPath.c_str());
+}
+
+// Committing writes the delta blocks into the image and deletes the delta.
+TEST_F(DiskTest, OverlayCommit)
+{
+	std::string deltaPath = path + ".delta";
+	{
+		OverlayDisk disk;
+		ASSERT_TRUE(disk.open(path, deltaPath));
+		const uint8_t byte = 0x5A;
+		ASSERT_TRUE(disk.write(8191, &byte, 1));
+	}
+	ASSERT_TRUE(OverlayDisk::commit(path, deltaPath));
+	EXPECT_FALSE(std::ifstream(deltaPath).good());
+
+	std::vector<uint8_t> contents = fileContents();
+	ASSERT_EQ(contents.size(), 8192u);
+	EXPECT_EQ(contents[8191], 0x5Au);
+	EXPECT_EQ(contents[8190], ASU8(8190));
+	EXPECT_EQ(contents[100], 100u);
+}
+
+// There is nothing to commit without a delta, which is not created either.
+TEST_F(DiskTest, OverlayCommitRefusesMissingDelta)
+{
+	std::string deltaPath = path + ".missing";
+	EXPECT_FALSE(OverlayDisk::commit(path, deltaPath));
+	EXPECT_FALSE(std::ifstream(deltaPath).good());
+	EXPECT_EQ(fileContents().size(), 8192u);
+}
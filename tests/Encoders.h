@@ -0,0 +1,95 @@
+// RV64 instruction encoders shared by the tests, so that the bit packing of the test programs
+// is self-documenting. Immediates are byte offsets or raw fields, as in the assembly syntax.
+
+#pragma once
+
+#include <cstdint>
+
+// ---- formats ----------------------------------------------------------------
+
+inline uint32_t r(uint8_t opcode, uint8_t rd, uint8_t f3, uint8_t rs1, uint8_t rs2, uint8_t f7 = 0)
+{
+	return (uint32_t(f7) << 25) | (uint32_t(rs2) << 20) | (uint32_t(rs1) << 15) |
+	       (uint32_t(f3) << 12) | (uint32_t(rd) << 7) | opcode;
+}
+
+// I-type: the low 12 bits of imm are the immediate field (0xFFF or -1 for -1).
+inline uint32_t i(uint8_t opcode, uint8_t rd, uint8_t f3, uint8_t rs1, int32_t imm)
+{
+	return (uint32_t(imm & 0xFFF) << 20) | (uint32_t(rs1) << 15) |
+	       (uint32_t(f3) << 12) | (uint32_t(rd) << 7) | opcode;
+}
+
+// U-type: imm20 is the 20-bit field placed at bits 31:12.
+inline uint32_t u(uint8_t opcode, uint8_t rd, uint32_t imm20)
+{
+	return (uint32_t(imm20 & 0xFFFFF) << 12) | (uint32_t(rd) << 7) | opcode;
+}
+
+// S-type store.
+inline uint32_t s(uint8_t f3, uint8_t rs1, uint8_t rs2, int32_t imm)
+{
+	uint32_t im = uint32_t(imm);
+	return (((im >> 5) & 0x7F) << 25) | (uint32_t(rs2) << 20) | (uint32_t(rs1) << 15) |
+	       (uint32_t(f3) << 12) | ((im & 0x1F) << 7) | 0x23;
+}
+
+// B-type branch. imm is the byte offset (multiple of 2).
+inline uint32_t b(uint8_t f3, uint8_t rs1, uint8_t rs2, int32_t imm)
+{
+	uint32_t im = uint32_t(imm);
+	return (((im >> 12) & 0x1) << 31) | (((im >> 5) & 0x3F) << 25) |
+	       (uint32_t(rs2) << 20) | (uint32_t(rs1) << 15) | (uint32_t(f3) << 12) |
+	       (((im >> 1) & 0xF) << 8) | (((im >> 11) & 0x1) << 7) | 0x63;
+}
+
+// J-type jal. imm is the byte offset (multiple of 2).
+inline uint32_t jal(uint8_t rd, int32_t imm)
+{
+	uint32_t im = uint32_t(imm);
+	return (((im >> 20) & 0x1) << 31) | (((im >> 1) & 0x3FF) << 21) |
+	       (((im >> 11) & 0x1) << 20) | (((im >> 12) & 0xFF) << 12) |
+	       (uint32_t(rd) << 7) | 0x6F;
+}
+
+inline uint32_t jalr(uint8_t rd, uint8_t rs1, int32_t imm)
+{
+	return i(0x67, rd, 0, rs1, imm);
+}
+
+// CSR register variants (csrrw, csrrs, csrrc)
+inline uint32_t csr(uint8_t f3, uint8_t rd, uint16_t csr_addr, uint8_t rs1)
+{
+	return (uint32_t(csr_addr & 0xFFF) << 20) | (uint32_t(rs1) << 15) |
+	       (uint32_t(f3) << 12) | (uint32_t(rd) << 7) | 0x73;
+}
+
+// CSR immediate variants (csrrwi, csrrsi, csrrci)
+inline uint32_t csri(uint8_t f3, uint8_t rd, uint16_t csr_addr, uint8_t uimm)
+{
+	return (uint32_t(csr_addr & 0xFFF) << 20) | (uint32_t(uimm & 0x1F) << 15) |
+	       (uint32_t(f3) << 12) | (uint32_t(rd) << 7) | 0x73;
+}
+
+// A extension: funct5 in funct7[6:2], aq and rl clear. f3 = 2 for words, 3 for double words.
+inline uint32_t amo(uint8_t funct5, uint8_t f3, uint8_t rd, uint8_t rs1, uint8_t rs2)
+{
+	return r(0x2f, rd, f3, rs1, rs2, uint8_t(funct5 << 2));
+}
+
+// ---- common aliases ---------------------------------------------------------
+
+inline uint32_t addi(uint8_t rd, uint8_t rs1, int32_t imm) { return i(0x13, rd, 0, rs1, imm); }
+inline uint32_t auipc(uint8_t rd, uint32_t imm20) { return u(0x17, rd, imm20); }
+inline uint32_t lui(uint8_t rd, uint32_t imm20) { return u(0x37, rd, imm20); }
+// lw/ld rd, imm(rs1)
+inline uint32_t lw(uint8_t rd, uint8_t rs1, int32_t imm) { return i(0x03, rd, 0x2, rs1, imm); }
+inline uint32_t ld(uint8_t rd, uint8_t rs1, int32_t imm) { return i(0x03, rd, 0x3, rs1, imm); }
+// sw rs2, imm(rs1)
+inline uint32_t sw(uint8_t rs2, uint8_t rs1, int32_t imm) { return s(0x2, rs1, rs2, imm); }
+// bne rs1, rs2, imm
+inline uint32_t bne(uint8_t rs1, uint8_t rs2, int32_t imm) { return b(0x1, rs1, rs2, imm); }
+// jal x0, imm
+inline uint32_t j(int32_t imm) { return jal(0, imm); }
+// sfence.vma rs1, rs2
+inline uint32_t sfence(uint8_t rs1, uint8_t rs2) { return r(0x73, 0, 0, rs1, rs2, 0x09); }
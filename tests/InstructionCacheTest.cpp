@@ -0,0 +1,114 @@
+// Tests for the predecoded instruction cache driven by Cpu::step().
+
+#include "Cpu.h"
+#include "Memory.h"
+#include "Bus.h"
+#include "InstructionCache.h"
+#include "Defines.h"
+#include "Trap.h"
+#include "Encoders.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <memory>
+
+class InstructionCacheTest : public ::testing::Test {
+protected:
+	static constexpr uint64_t kMemSize = 2 * PAGE_SIZE;
+
+	Memory mem{kMemSize};
+	Bus bus;
+	std::unique_ptr<Cpu> cpu;
+
+	void SetUp() override
+	{
+		bus.addDevice(DRAM_BASE, &mem);
+		cpu = std::unique_ptr<Cpu>(new Cpu(bus, DRAM_BASE + kMemSize));
+	}
+};
+
+// A record carries its handler and the already sign-extended immediate.
+TEST_F(InstructionCacheTest, PredecodeExtractsImmediate)
+{
+	DecodedInst d = Cpu::predecode(addi(5, 6, -3));
+	EXPECT_NE(d.handler, nullptr);
+	EXPECT_EQ(d.opcode, 0x13);
+	EXPECT_EQ(d.rd, 5);
+	EXPECT_EQ(d.rs1, 6);
+	EXPECT_EQ(d.imm, -3);
+}
+
+// step() gives the same results as the fetch/decode/execute pipeline.
+TEST_F(InstructionCacheTest, StepRunsLoop)
+{
+	// x1 += 1 four times through a backward jump, then fall out by patching nothing:
+	// 0: addi x1, x1, 1
+	// 4: j -4
+	mem.store(0, 32, addi(1, 1, 1));
+	mem.store(4, 32, j(-4));
+	for (int k = 0; k < 8; ++k)
+		cpu->step();
+	EXPECT_EQ(cpu->getRegister(1), 4u);
+	EXPECT_EQ(cpu->getPC(), DRAM_BASE);
+}
+
+// Overwriting an instruction that has already been decoded is seen on its next execution.
+TEST_F(InstructionCacheTest, StoreToDecodedCodeInvalidates)
+{
+	mem.store(0, 32, addi(1, 1, 1));
+	mem.store(4, 32, j(-4));
+	cpu->step();
+	cpu->step();
+	EXPECT_EQ(cpu->getRegister(1), 1u);
+
+	mem.store(0, 32, addi(1, 1, 10));
+	cpu->step();
+	EXPECT_EQ(cpu->getRegister(1), 11u);
+}
+
+// Only stores to lines holding decoded code change the page code version.
+TEST_F(InstructionCacheTest, CodeVersionTracksDecodedLines)
+{
+	const uint32_t v0 = mem.codeVersion(0);
+	mem.markCode(0);
+
+	mem.store(PAGE_SIZE - 8, 64, 0); // same page, other line
+	EXPECT_EQ(mem.codeVersion(0), v0);
+	mem.store(PAGE_SIZE, 64, 0);     // next page
+	EXPECT_EQ(mem.codeVersion(0), v0);
+
+	mem.store(4, 8, 0);              // decoded line
+	EXPECT_EQ(mem.codeVersion(0), v0 + 1);
+
+	// The line is no longer marked once invalidated.
+	mem.store(4, 8, 0);
+	EXPECT_EQ(mem.codeVersion(0), v0 + 1);
+}
+
+// A store across pages drops the decoded code of both.
+TEST_F(InstructionCacheTest, StoreAcrossPagesInvalidatesBoth)
+{
+	const uint32_t v1 = mem.codeVersion(PAGE_SIZE);
+	mem.markCode(PAGE_SIZE);
+	mem.store(PAGE_SIZE - 4, 64, 0);
+	EXPECT_EQ(mem.codeVersion(PAGE_SIZE), v1 + 1);
+}
+
+// Stores of the Cpu, done directly on the RAM, also drop the decoded code they overwrite.
+TEST_F(InstructionCacheTest, CpuStoreToDecodedCodeInvalidates)
+{
+	mem.store(0, 32, addi(1, 1, 1));
+	mem.store(4, 32, j(-4));
+	cpu->step();
+	cpu->step();
+	EXPECT_EQ(cpu->getRegister(1), 1u);
+
+	cpu->store(DRAM_BASE, 32, addi(1, 1, 10));
+	cpu->step();
+	EXPECT_EQ(cpu->getRegister(1), 11u);
+
+	// The direct accesses stop at the end of the RAM.
+	EXPECT_EQ(cpu->load(DRAM_BASE + kMemSize - 8, 64), 0u);
+	EXPECT_THROW(cpu->load(DRAM_BASE + kMemSize - 4, 64), CpuFatal);
+}
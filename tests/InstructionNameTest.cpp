@@ -42,6 +42,15 @@ TEST(InstructionNameTest, AtomicSwapFunct7)
 	EXPECT_EQ(name(0x2f, 0x3, 0x04), "amoswap.d");
 }
 
+// The rest of the A extension, funct5 in funct7[6:2] as well.
+TEST(InstructionNameTest, AtomicNames)
+{
+	EXPECT_EQ(name(0x2f, 0x2, 0x08), "lr.w");
+	EXPECT_EQ(name(0x2f, 0x3, 0x0c), "sc.d");
+	EXPECT_EQ(name(0x2f, 0x2, 0x30), "amoand.w");
+	EXPECT_EQ(name(0x2f, 0x3, 0x70), "amomaxu.d");
+}
+
 // RV64M word ops live at opcode 0x3b with funct7 = 0000001; the table previously
 // named the (0x3b, funct3=5, funct7=1) slot "divu" -- per spec that is divuw.
 TEST(InstructionNameTest, DivUwName)
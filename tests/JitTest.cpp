@@ -0,0 +1,215 @@
+// Tests for the x86-64 JIT backend (WITH_JIT).
+//
+// Each test runs the same program natively and through Cpu::step() on a second Cpu
+// sharing the bus, and compares the architectural state.
+
+#include "Jit.h"
+#include "BlockEngine.h"
+#include "Cpu.h"
+#include "Memory.h"
+#include "Bus.h"
+#include "InstructionCache.h"
+#include "Defines.h"
+#include "Trap.h"
+#include "Encoders.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class JitTest : public ::testing::Test {
+protected:
+	static constexpr uint64_t kMemSize = 2 * PAGE_SIZE;
+
+	Memory mem{kMemSize};
+	Bus bus;
+	InstructionCache icache{mem};
+	std::unique_ptr<Cpu> cpu;
+	std::unique_ptr<Cpu> ref;
+	std::vector<DecodedInst> insts;
+
+	void SetUp() override
+	{
+		bus.addDevice(DRAM_BASE, &mem);
+		cpu = std::unique_ptr<Cpu>(new Cpu(bus, DRAM_BASE + kMemSize));
+		ref = std::unique_ptr<Cpu>(new Cpu(bus, DRAM_BASE + kMemSize));
+	}
+
+	void load(const std::vector<uint32_t>& prog)
+	{
+		for (size_t k = 0; k < prog.size(); ++k)
+			mem.store(k * 4, 32, prog[k]);
+		insts.clear();
+		for (size_t k = 0; k < prog.size(); ++k)
+			insts.push_back(*icache.lookup(DRAM_BASE + k * 4));
+	}
+
+	void expectSameState()
+	{
+		for (int k = 0; k < 32; ++k)
+			EXPECT_EQ(cpu->getRegister(k), ref->getRegister(k)) << "x" << k;
+		EXPECT_EQ(cpu->getPC(), ref->getPC());
+		EXPECT_EQ(cpu->getCsr(MEPC), ref->getCsr(MEPC));
+		EXPECT_EQ(cpu->getCsr(MCAUSE), ref->getCsr(MCAUSE));
+	}
+};
+
+// Integer operations, including a division left to the interpreter.
+TEST_F(JitTest, IntegerOpsMatchInterpreter)
+{
+	load({
+		lui(5, 0x12345), addi(5, 5, 0x678),
+		lui(6, 0xFEDCB), addi(6, 6, -0x123),
+		r(0x33, 7, 0, 5, 6),            // add
+		r(0x33, 8, 0, 5, 6, 0x20),      // sub
+		r(0x33, 9, 0, 5, 6, 0x01),      // mul
+		r(0x33, 10, 1, 5, 6),           // sll
+		r(0x33, 11, 5, 6, 5),           // srl
+		r(0x33, 12, 5, 6, 5, 0x20),     // sra
+		r(0x33, 13, 2, 6, 5),           // slt
+		r(0x33, 14, 3, 6, 5),           // sltu
+		r(0x33, 15, 4, 5, 6),           // xor
+		r(0x33, 16, 6, 5, 6),           // or
+		r(0x33, 17, 7, 5, 6),           // and
+		r(0x3b, 18, 0, 5, 6),           // addw
+		r(0x3b, 19, 0, 5, 6, 0x20),     // subw
+		r(0x3b, 20, 1, 6, 5),           // sllw
+		r(0x3b, 21, 5, 6, 5),           // srlw
+		r(0x3b, 22, 5, 6, 5, 0x20),     // sraw
+		i(0x1b, 23, 0, 6, -1),          // addiw
+		i(0x1b, 24, 1, 6, 3),           // slliw
+		i(0x1b, 25, 5, 6, 7),           // srliw
+		i(0x1b, 26, 5, 6, 0x400 | 7),   // sraiw
+		i(0x13, 27, 2, 6, 5),           // slti
+		i(0x13, 28, 3, 6, -1),          // sltiu
+		i(0x13, 29, 4, 5, -1),          // xori
+		i(0x13, 30, 5, 6, 0x400 | 9),   // srai
+		i(0x13, 31, 1, 5, 40),          // slli
+		u(0x17, 4, 1),                  // auipc
+		r(0x3b, 3, 5, 5, 6, 0x01),      // divuw, interpreted
+		r(0x33, 5, 6, 5, 6),            // or, after the call back
+		jal(1, 0x40),
+	});
+
+	Jit jit(icache);
+	Jit::Code code = jit.compile(insts, DRAM_BASE, icache.codeVersion(DRAM_BASE));
+	ASSERT_NE(code, nullptr);
+	jit.run(code, *cpu);
+
+	for (size_t k = 0; k < insts.size(); ++k)
+		ref->step();
+	expectSameState();
+}
+
+// Loads and stores go through the Cpu; a fatal access fault is thrown out of the block with the
+// registers written so far.
+TEST_F(JitTest, LoadStoreAndFatalFault)
+{
+	load({
+		u(0x17, 5, 0),                  // auipc x5, 0 -> DRAM_BASE
+		lui(6, 0x89ABC), addi(6, 6, -1),
+		s(3, 5, 6, 0x200),              // sd
+		i(0x03, 7, 0, 5, 0x200),        // lb
+		i(0x03, 8, 2, 5, 0x200),        // lw
+		i(0x03, 9, 6, 5, 0x200),        // lwu
+		i(0x03, 10, 3, 5, 0x200),       // ld
+		i(0x03, 11, 3, 0, 0x100),       // ld from an unmapped address
+		addi(12, 0, 1),
+	});
+
+	Jit jit(icache);
+	Jit::Code code = jit.compile(insts, DRAM_BASE, icache.codeVersion(DRAM_BASE));
+	ASSERT_NE(code, nullptr);
+	EXPECT_THROW(jit.run(code, *cpu), CpuFatal);
+
+	for (size_t k = 0; k < 8; ++k)
+		ref->step();
+	EXPECT_THROW(ref->step(), CpuFatal);
+	expectSameState();
+	EXPECT_EQ(cpu->getRegister(10), 0xFFFFFFFF89ABBFFFull);
+}
+
+// A load which traps leaves its destination register alone, here its own base register.
+TEST_F(JitTest, FaultingLoadKeepsRd)
+{
+	load({
+		addi(5, 0, 0x100),
+		i(0x03, 5, 3, 5, 0),            // ld x5, 0(x5) from an unmapped address
+		addi(6, 0, 1),
+	});
+
+	Jit jit(icache);
+	Jit::Code code = jit.compile(insts, DRAM_BASE, icache.codeVersion(DRAM_BASE));
+	ASSERT_NE(code, nullptr);
+	EXPECT_THROW(jit.run(code, *cpu), CpuFatal);
+	EXPECT_EQ(cpu->getRegister(5), 0x100u);
+	EXPECT_EQ(cpu->getRegister(6), 0u);
+}
+
+// An instruction trapping in the middle of a block leaves it at the trap vector.
+TEST_F(JitTest, TrapLeavesBlock)
+{
+	load({
+		addi(5, 0, 7),
+		addi(5, 5, 1),
+		0x0000000B,                     // illegal, left to the interpreter
+		addi(5, 5, 1),
+		jal(0, 0),
+	});
+	cpu->store_csr(MTVEC, DRAM_BASE + 0x100);
+	ref->store_csr(MTVEC, DRAM_BASE + 0x100);
+
+	Jit jit(icache);
+	Jit::Code code = jit.compile(insts, DRAM_BASE, icache.codeVersion(DRAM_BASE));
+	ASSERT_NE(code, nullptr);
+	jit.run(code, *cpu);
+
+	for (size_t k = 0; k < 3; ++k)
+		ref->step();
+	expectSameState();
+	EXPECT_EQ(cpu->getRegister(5), 8u);
+	EXPECT_EQ(cpu->getPC(), DRAM_BASE + 0x100);
+}
+
+// A store over the running block leaves it right after the store.
+TEST_F(JitTest, StoreToBlockLeavesIt)
+{
+	load({
+		u(0x17, 5, 0),                  // auipc x5, 0
+		addi(6, 0, 0x13),               // nop encoding
+		s(2, 5, 6, 0xc),                // sw over the next instruction
+		addi(1, 0, 1),
+		jal(0, 0),
+	});
+
+	Jit jit(icache);
+	Jit::Code code = jit.compile(insts, DRAM_BASE, icache.codeVersion(DRAM_BASE));
+	ASSERT_NE(code, nullptr);
+	jit.run(code, *cpu);
+
+	EXPECT_EQ(cpu->getPC(), DRAM_BASE + 0xc);
+	EXPECT_EQ(cpu->getRegister(1), 0u);
+}
+
+// Hot loops compiled by the block engine give the same results as step mode.
+TEST_F(JitTest, BlockEngineLoop)
+{
+	load({
+		addi(5, 0, 1000),
+		addi(6, 6, 3),                  // loop:
+		r(0x33, 7, 0, 7, 6),
+		addi(5, 5, -1),
+		b(1, 5, 0, -12),                // bne x5, x0, loop
+		jal(0, 0),
+	});
+
+	BlockEngine engine(*cpu, true);
+	while (cpu->getPC() != DRAM_BASE + 0x14)
+		engine.step();
+	while (ref->getPC() != DRAM_BASE + 0x14)
+		ref->step();
+	expectSameState();
+	EXPECT_EQ(cpu->getRegister(6), 3000u);
+}
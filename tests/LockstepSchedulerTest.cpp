@@ -0,0 +1,121 @@
+// Tests for the deterministic scheduler running several harts on one thread.
+
+#include "LockstepScheduler.h"
+#include "Cpu.h"
+#include "Memory.h"
+#include "Bus.h"
+#include "Clint.h"
+#include "Defines.h"
+#include "Encoders.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace {
+
+const uint32_t WFI = 0x10500073u;
+
+// Harts sharing a RAM and a CLINT, all starting at DRAM_BASE.
+struct Machine {
+	static constexpr uint64_t kMemSize = 4096;
+
+	Memory mem{kMemSize};
+	Clint clint;
+	Bus bus;
+	std::vector<std::unique_ptr<Cpu>> cpus;
+	std::vector<Cpu*> harts;
+
+	Machine(uint32_t count, const std::vector<uint32_t>& prog)
+	{
+		bus.addDevice(DRAM_BASE, &mem);
+		bus.addDevice(CLINT_BASE, &clint);
+		for (size_t k = 0; k < prog.size(); ++k)
+			mem.store(k * 4, 32, prog[k]);
+		for (uint32_t h = 0; h < count; h++)
+		{
+			cpus.emplace_back(new Cpu(bus, DRAM_BASE + kMemSize, h));
+			harts.push_back(cpus.back().get());
+		}
+	}
+};
+
+// Each hart increments the word at 0x400 without an atomic: the updates lost depend on where
+// the turns end.
+const std::vector<uint32_t> RACE = {
+	auipc(1, 0), addi(1, 1, 0x400),
+	lw(2, 1, 0), addi(2, 2, 1), sw(2, 1, 0), j(-12),
+};
+
+uint64_t race(uint64_t quantum, bool blockMode)
+{
+	Machine m(3, RACE);
+	LockstepScheduler scheduler(m.harts, quantum, blockMode);
+	for (int r = 0; r < 200; r++)
+		scheduler.round();
+	return m.mem.load(0x400, 32);
+}
+
+} // namespace
+
+TEST(LockstepSchedulerTest, HartsRunTheirQuantumInTurn)
+{
+	Machine m(2, RACE);
+	LockstepScheduler scheduler(m.harts, 10);
+	scheduler.round();
+	EXPECT_EQ(&scheduler.current(), m.harts[1]);
+	scheduler.round();
+	scheduler.round();
+	EXPECT_EQ(scheduler.rounds(), 3u);
+	EXPECT_EQ(m.harts[0]->getInstret(), 30u);
+	EXPECT_EQ(m.harts[1]->getInstret(), 30u);
+}
+
+// The same quantum gives the same interleaving, hence the same lost updates.
+TEST(LockstepSchedulerTest, RunsAreReproducible)
+{
+	uint64_t count = race(7, false);
+	EXPECT_GT(count, 0u);
+	EXPECT_EQ(race(7, false), count);
+	EXPECT_EQ(race(7, true), race(7, true));
+}
+
+// A hart waiting for an interrupt passes its turn without blocking the others, until woken.
+TEST(LockstepSchedulerTest, WaitingHartPasses)
+{
+	Machine m(2, {j(0)});
+	m.mem.store(0x100, 32, WFI);
+	m.mem.store(0x104, 32, j(0));
+	m.harts[1]->setPC(DRAM_BASE + 0x100);
+	m.harts[1]->store_csr(MIE, MIP_MSIP);
+	LockstepScheduler scheduler(m.harts, 10);
+	for (int r = 0; r < 5; r++)
+		scheduler.round();
+	EXPECT_TRUE(m.harts[1]->isWaiting());
+	EXPECT_EQ(m.harts[1]->getInstret(), 1u);
+	EXPECT_EQ(m.harts[0]->getInstret(), 50u);
+
+	m.harts[0]->store(CLINT_BASE + CLINT_MSIP + 4, 32, 1);
+	scheduler.round();
+	EXPECT_FALSE(m.harts[1]->isWaiting());
+	EXPECT_EQ(m.harts[1]->getInstret(), 11u);
+}
+
+// While every hart waits, the first one sleeps until its timer.
+TEST(LockstepSchedulerTest, AllWaitingSleepsOnFirstHart)
+{
+	Machine m(2, {WFI, j(0)});
+	m.harts[0]->store_csr(MIE, MIP_MTIP);
+	m.clint.store(CLINT_MTIMECMP, 64, 100);
+	LockstepScheduler scheduler(m.harts, 10);
+	scheduler.round();
+	EXPECT_TRUE(m.harts[0]->isWaiting());
+	EXPECT_TRUE(m.harts[1]->isWaiting());
+
+	scheduler.round();
+	EXPECT_FALSE(m.harts[0]->isWaiting());
+	EXPECT_TRUE(m.harts[1]->isWaiting());
+	EXPECT_GE(m.clint.load(CLINT_MTIME, 64), 100u);
+}
@@ -75,3 +75,92 @@ TEST(MemoryTest, RaisesLoadAccessFault)
 		EXPECT_EQ(e.ex, Except::LoadAccessFault);
 	}
 }
+
+// The RAM reads as zero everywhere until written, and sizes need not be page multiples.
+TEST(MemoryTest, FreshMemoryIsZero)
+{
+	Memory mem(DEFAULT_MEMORYSIZE);
+	EXPECT_EQ(mem.load(0, 64), 0u);
+	EXPECT_EQ(mem.load(DEFAULT_MEMORYSIZE / 2, 64), 0u);
+	EXPECT_EQ(mem.load(DEFAULT_MEMORYSIZE - 8, 64), 0u);
+
+	Memory odd(4096 + 12);
+	odd.store(4096 + 4, 64, 0x0123456789ABCDEFULL);
+	EXPECT_EQ(odd.load(4096 + 4, 64), 0x0123456789ABCDEFULL);
+	EXPECT_EQ(odd.load(0, 64), 0u);
+}
+
+#ifndef _WIN32
+// The RAM starts on a huge page boundary, so that whole huge pages can back it.
+TEST(MemoryTest, AlignedOnHugePages)
+{
+	Memory mem(3 * HUGE_PAGE_SIZE);
+	EXPECT_EQ(reinterpret_cast<uintptr_t>(mem.base()) % HUGE_PAGE_SIZE, 0u);
+	mem.adviseHugePages(0, HUGE_PAGE_SIZE);
+	mem.store(3 * HUGE_PAGE_SIZE - 8, 64, 1);
+	EXPECT_EQ(mem.load(3 * HUGE_PAGE_SIZE - 8, 64), 1u);
+}
+#endif
+
+// Sizes are given in MiB, or in GiB with a G suffix.
+TEST(MemoryTest, ParseSize)
+{
+	EXPECT_EQ(Memory::parseSize("128"), DEFAULT_MEMORYSIZE);
+	EXPECT_EQ(Memory::parseSize("512M"), 512ull * 1024 * 1024);
+	EXPECT_EQ(Memory::parseSize("4G"), 4ull * 1024 * 1024 * 1024);
+	EXPECT_EQ(Memory::parseSize("0"), 0u);
+	EXPECT_EQ(Memory::parseSize("4K"), 0u);
+	EXPECT_EQ(Memory::parseSize("big"), 0u);
+	EXPECT_EQ(Memory::parseSize("2048G"), 0u);
+}
+
+// DMA writes drop the decoded code of every page they overlap, and only of those.
+TEST(MemoryTest, DmaWriteInvalidatesCode)
+{
+	Memory mem(4 * PAGE_SIZE);
+	mem.markCode(PAGE_SIZE + 0xFC0);
+	mem.markCode(2 * PAGE_SIZE);
+	mem.markCode(3 * PAGE_SIZE + 0x800);
+
+	ASSERT_NE(mem.dmaSpan(PAGE_SIZE + 0xF80, 0x100, false), nullptr);
+	EXPECT_EQ(mem.codeVersion(PAGE_SIZE), 0u);
+
+	// Covers the last line of page 1 and the first one of page 2, stops short of page 3's.
+	mem.dmaSpan(PAGE_SIZE + 0xF80, 0x100, true);
+	EXPECT_EQ(mem.codeVersion(PAGE_SIZE), 1u);
+	EXPECT_EQ(mem.codeVersion(2 * PAGE_SIZE), 1u);
+	mem.dmaSpan(3 * PAGE_SIZE, 0x800, true);
+	EXPECT_EQ(mem.codeVersion(3 * PAGE_SIZE), 0u);
+
+	EXPECT_EQ(mem.dmaSpan(3 * PAGE_SIZE, PAGE_SIZE + 1, true), nullptr);
+}
+
+#if defined(__linux__) && UINTPTR_MAX > 0xFFFFFFFFu
+#include <unistd.h>
+#include <fstream>
+
+// Resident pages of the process, from /proc/self/statm.
+static uint64_t residentBytes()
+{
+	uint64_t size = 0, resident = 0;
+	std::ifstream("/proc/self/statm") >> size >> resident;
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// A multi-GiB RAM only costs the pages the guest touches, code tracking included.
+TEST(MemoryTest, LargeMemoryIsSparse)
+{
+	const uint64_t size = 16ull * 1024 * 1024 * 1024;
+	uint64_t before = residentBytes();
+	Memory mem(size);
+	mem.store(0, 64, 1);
+	mem.store(size - 8, 64, 2);
+	mem.markCode(size - PAGE_SIZE);
+	mem.invalidateCode(size - PAGE_SIZE, 4);
+	EXPECT_EQ(mem.load(0, 64), 1u);
+	EXPECT_EQ(mem.load(size - 8, 64), 2u);
+	EXPECT_EQ(mem.load(size / 2, 64), 0u);
+	EXPECT_EQ(mem.codeVersion(size - PAGE_SIZE), 1u);
+	EXPECT_LT(residentBytes() - before, 8u * 1024 * 1024);
+}
+#endif
@@ -14,12 +14,17 @@ TEST(PlicTest, RejectsNon32BitAccess)
 	EXPECT_NO_THROW(plic.load(PLIC_SENABLE, 32));
 }
 
-TEST(PlicTest, PendingRoundTrip)
+// The pending bits are set by the gateways only.
+TEST(PlicTest, PendingIsReadOnly)
 {
 	Plic plic;
 	EXPECT_EQ(plic.load(PLIC_PENDING, 32), 0u);
 	plic.store(PLIC_PENDING, 32, 0xDEADBEEF);
-	EXPECT_EQ(plic.load(PLIC_PENDING, 32), 0xDEADBEEFu);
+	EXPECT_EQ(plic.load(PLIC_PENDING, 32), 0u);
+	plic.trigger(5);
+	plic.trigger(33);
+	EXPECT_EQ(plic.load(PLIC_PENDING, 32), 1u << 5);
+	EXPECT_EQ(plic.load(PLIC_PENDING + 4, 32), 1u << 1);
 }
 
 TEST(PlicTest, SenableRoundTrip)
@@ -27,6 +32,9 @@ TEST(PlicTest, SenableRoundTrip)
 	Plic plic;
 	plic.store(PLIC_SENABLE, 32, 0xABCD1234);
 	EXPECT_EQ(plic.load(PLIC_SENABLE, 32), 0xABCD1234u);
+	// Source 0 does not exist.
+	plic.store(PLIC_SENABLE, 32, 1);
+	EXPECT_EQ(plic.load(PLIC_SENABLE, 32), 0u);
 }
 
 TEST(PlicTest, SpriorityRoundTrip)
@@ -34,24 +42,111 @@ TEST(PlicTest, SpriorityRoundTrip)
 	Plic plic;
 	plic.store(PLIC_SPRIORITY, 32, 7);
 	EXPECT_EQ(plic.load(PLIC_SPRIORITY, 32), 7u);
-}
-
-TEST(PlicTest, SclaimRoundTrip)
-{
-	Plic plic;
-	plic.store(PLIC_SCLAIM, 32, 42);
-	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 42u);
+	plic.store(PLIC_PRIORITY + 4 * 10, 32, 3);
+	EXPECT_EQ(plic.load(PLIC_PRIORITY + 4 * 10, 32), 3u);
+	plic.store(PLIC_PRIORITY + 4 * 10, 32, 0xFF);
+	EXPECT_EQ(plic.load(PLIC_PRIORITY + 4 * 10, 32), PLIC_MAX_PRIORITY);
 }
 
 TEST(PlicTest, RegistersAreIndependent)
 {
 	Plic plic;
-	plic.store(PLIC_PENDING, 32, 1);
 	plic.store(PLIC_SENABLE, 32, 2);
+	plic.store(PLIC_SENABLE + 4, 32, 4);
+	plic.store(PLIC_ENABLE, 32, 8);
 	plic.store(PLIC_SPRIORITY, 32, 3);
-	plic.store(PLIC_SCLAIM, 32, 4);
-	EXPECT_EQ(plic.load(PLIC_PENDING, 32), 1u);
+	plic.store(PLIC_THRESHOLD, 32, 5);
+	plic.store(PLIC_PRIORITY + 4, 32, 6);
 	EXPECT_EQ(plic.load(PLIC_SENABLE, 32), 2u);
+	EXPECT_EQ(plic.load(PLIC_SENABLE + 4, 32), 4u);
+	EXPECT_EQ(plic.load(PLIC_ENABLE, 32), 8u);
 	EXPECT_EQ(plic.load(PLIC_SPRIORITY, 32), 3u);
-	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 4u);
+	EXPECT_EQ(plic.load(PLIC_THRESHOLD, 32), 5u);
+	EXPECT_EQ(plic.load(PLIC_PRIORITY + 4, 32), 6u);
+	EXPECT_EQ(plic.load(PLIC_PENDING, 32), 0u);
+}
+
+// A claim takes the source off the pending bits until completed: a request meanwhile waits
+// for the completion.
+TEST(PlicTest, ClaimComplete)
+{
+	Plic plic;
+	plic.store(PLIC_PRIORITY + 4 * 10, 32, 1);
+	plic.store(PLIC_SENABLE, 32, 1u << 10);
+	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 0u);
+
+	plic.trigger(10);
+	EXPECT_EQ(plic.highest(plic_scontext(0)), 10u);
+	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 10u);
+	EXPECT_EQ(plic.load(PLIC_PENDING, 32), 0u);
+	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 0u);
+
+	plic.trigger(10);
+	EXPECT_EQ(plic.highest(plic_scontext(0)), 0u);
+	plic.store(PLIC_SCLAIM, 32, 10);
+	EXPECT_EQ(plic.highest(plic_scontext(0)), 10u);
+	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 10u);
+	plic.store(PLIC_SCLAIM, 32, 10);
+	EXPECT_EQ(plic.highest(plic_scontext(0)), 0u);
+}
+
+// The highest priority is claimed first, the lowest ID on ties, and only above the threshold.
+TEST(PlicTest, PriorityAndThreshold)
+{
+	Plic plic;
+	for (uint32_t irq : { 3u, 40u, 41u })
+		plic.store(PLIC_PRIORITY + 4 * irq, 32, irq == 3 ? 2 : 5);
+	plic.store(PLIC_SENABLE, 32, 1u << 3);
+	plic.store(PLIC_SENABLE + 4, 32, (1u << 8) | (1u << 9));
+	plic.store(PLIC_SPRIORITY, 32, 2);
+	for (uint32_t irq : { 3u, 41u, 40u })
+		plic.trigger(irq);
+
+	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 40u);
+	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 41u);
+	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 0u);
+	plic.store(PLIC_SPRIORITY, 32, 1);
+	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 3u);
+}
+
+// Every source and context is addressable, a context only claiming what it enables.
+TEST(PlicTest, SourcesAndContexts)
+{
+	Plic plic;
+	const uint32_t last = PLIC_SOURCES - 1;
+	const uint32_t context = PLIC_CONTEXTS - 1;
+	plic.store(PLIC_PRIORITY + 4 * last, 32, 1);
+	plic.store(PLIC_ENABLE + PLIC_ENABLE_STRIDE * context + 4 * (last / 32), 32, 1u << (last % 32));
+	plic.trigger(last);
+	EXPECT_EQ(plic.load(PLIC_PENDING + 4 * (last / 32), 32), 1u << (last % 32));
+	EXPECT_EQ(plic.highest(plic_scontext(0)), 0u);
+	EXPECT_EQ(plic.load(PLIC_SCLAIM, 32), 0u);
+
+	EXPECT_EQ(plic.load(PLIC_THRESHOLD + PLIC_CONTEXT_STRIDE * context + 4, 32), last);
+	// A completion by a context not enabling the source is ignored.
+	plic.trigger(last);
+	plic.store(PLIC_SCLAIM, 32, last);
+	EXPECT_EQ(plic.highest(context), 0u);
+	plic.store(PLIC_THRESHOLD + PLIC_CONTEXT_STRIDE * context + 4, 32, last);
+	EXPECT_EQ(plic.highest(context), last);
+}
+
+// The lines stay asserted until lowered, each raise waking up the harts in wfi.
+TEST(PlicTest, InterruptLines)
+{
+	Plic plic;
+	Wakeup wakeup;
+	plic.setWakeup(&wakeup);
+	EXPECT_EQ(plic.asserted(), 0u);
+
+	uint64_t epoch = wakeup.epoch();
+	plic.raise(1);
+	plic.raise(10);
+	EXPECT_EQ(plic.asserted(), (1ull << 1) | (1ull << 10));
+	EXPECT_NE(wakeup.epoch(), epoch);
+
+	plic.lower(1);
+	EXPECT_EQ(plic.asserted(), 1ull << 10);
+	plic.lower(1);
+	EXPECT_EQ(plic.asserted(), 1ull << 10);
 }
@@ -0,0 +1,54 @@
+#include "SpscRing.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <thread>
+
+TEST(SpscRingTest, FirstInFirstOut)
+{
+	SpscRing<int, 4> ring;
+	int value = 0;
+	EXPECT_TRUE(ring.empty());
+	EXPECT_FALSE(ring.pop(value));
+
+	for (int i = 1; i <= 4; i++)
+		EXPECT_TRUE(ring.push(i));
+	EXPECT_FALSE(ring.push(5)); // full
+
+	EXPECT_TRUE(ring.peek(value));
+	EXPECT_EQ(value, 1);
+	for (int i = 1; i <= 4; i++)
+	{
+		ASSERT_TRUE(ring.pop(value));
+		EXPECT_EQ(value, i);
+	}
+	EXPECT_TRUE(ring.empty());
+}
+
+// Elements cross from the producer thread to the consumer thread in order, none lost.
+TEST(SpscRingTest, TwoThreads)
+{
+	const uint32_t COUNT = 1000000;
+	SpscRing<uint32_t, 64> ring;
+	std::thread producer([&] {
+		for (uint32_t i = 0; i < COUNT; i++)
+			while (!ring.push(i))
+				std::this_thread::yield();
+	});
+
+	uint32_t expected = 0;
+	while (expected < COUNT)
+	{
+		uint32_t value;
+		if (!ring.pop(value))
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		ASSERT_EQ(value, expected);
+		expected++;
+	}
+	producer.join();
+	EXPECT_TRUE(ring.empty());
+}
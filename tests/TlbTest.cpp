@@ -0,0 +1,325 @@
+// Tests for the software TLB caching the Sv39 translations.
+
+#include "Tlb.h"
+#include "Cpu.h"
+#include "Memory.h"
+#include "Bus.h"
+#include "Defines.h"
+#include "Trap.h"
+#include "Encoders.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace {
+
+const uint64_t PTE_V = 1 << 0;
+const uint64_t PTE_RWX = 0x7 << 1;
+const uint64_t PTE_G = 1 << 5;
+
+uint64_t pte(uint64_t paddr, uint64_t flags) { return ((paddr >> 12) << 10) | flags; }
+
+} // namespace
+
+class TlbTest : public ::testing::Test {
+protected:
+	static constexpr uint64_t kMemSize = 64 * PAGE_SIZE;
+	// Two sets of page tables, each made of a root, a level 1 and a level 0 table mapping the
+	// first 2 MiB.
+	static constexpr uint64_t kRoot = DRAM_BASE + 0x10000;
+	static constexpr uint64_t kTables = 3 * PAGE_SIZE;
+
+	Memory mem{kMemSize};
+	Bus bus;
+	std::unique_ptr<Cpu> cpu;
+
+	void SetUp() override
+	{
+		bus.addDevice(DRAM_BASE, &mem);
+		cpu = std::unique_ptr<Cpu>(new Cpu(bus, DRAM_BASE + kMemSize));
+		// Addresses are only translated below machine mode.
+		cpu->set_mode(Cpu::Mode::Supervisor);
+
+		for (uint64_t root = kRoot; root < kRoot + 2 * kTables; root += kTables)
+		{
+			mem.store(root - DRAM_BASE, 64, pte(root + PAGE_SIZE, PTE_V));
+			mem.store(root + PAGE_SIZE - DRAM_BASE, 64, pte(root + 2 * PAGE_SIZE, PTE_V));
+		}
+	}
+
+	/// Map the virtual page `vpn` (in the first 2 MiB) to the physical address `paddr` in the
+	/// page tables `table`.
+	void map(uint64_t vpn, uint64_t paddr, int table = 0, uint64_t flags = 0)
+	{
+		uint64_t l0 = kRoot + table * kTables + 2 * PAGE_SIZE;
+		mem.store(l0 - DRAM_BASE + vpn * 8, 64, pte(paddr, PTE_V | PTE_RWX | flags));
+	}
+
+	void enablePaging(int table = 0, uint64_t asid = 0)
+	{
+		cpu->store_csr(SATP, (ASU64(8) << 60) | (asid << 44) | ((kRoot + table * kTables) >> 12));
+		cpu->update_paging(SATP);
+	}
+
+	/// Run `prog` from the virtual address 0, mapped to the start of the RAM in both tables.
+	void run(const std::vector<uint32_t>& prog)
+	{
+		map(0, DRAM_BASE, 0);
+		map(0, DRAM_BASE, 1);
+		for (size_t k = 0; k < prog.size(); ++k)
+			mem.store(k * 4, 32, prog[k]);
+		cpu->setPC(0);
+		for (size_t k = 0; k < prog.size(); ++k)
+			cpu->step();
+	}
+};
+
+// Entries are found by virtual page, and the oldest entry of a full set is evicted.
+TEST_F(TlbTest, SetEviction)
+{
+	Tlb tlb;
+	EXPECT_EQ(tlb.find(Tlb::Load, 0x1234), nullptr);
+
+	for (uint64_t w = 0; w <= Tlb::WAYS; w++)
+		tlb.insert(Tlb::Load, w * Tlb::SETS * PAGE_SIZE, DRAM_BASE + w * PAGE_SIZE, nullptr, false);
+
+	EXPECT_EQ(tlb.find(Tlb::Load, 0), nullptr);
+	const Tlb::Entry* e = tlb.find(Tlb::Load, Tlb::SETS * PAGE_SIZE + 0x123);
+	ASSERT_NE(e, nullptr);
+	EXPECT_EQ(e->ppage, DRAM_BASE + PAGE_SIZE);
+
+	// Instruction, load and store translations are separate.
+	EXPECT_EQ(tlb.find(Tlb::Store, Tlb::SETS * PAGE_SIZE), nullptr);
+
+	tlb.flush();
+	EXPECT_EQ(tlb.find(Tlb::Load, Tlb::SETS * PAGE_SIZE), nullptr);
+}
+
+// Entries only match in their address space, but global ones.
+TEST_F(TlbTest, AsidTags)
+{
+	Tlb tlb;
+	tlb.setAsid(1);
+	tlb.insert(Tlb::Load, 0x1000, DRAM_BASE, nullptr, false);
+	tlb.insert(Tlb::Load, 0x2000, DRAM_BASE, nullptr, true);
+	tlb.insert(Tlb::Load, 0x3000, DRAM_BASE, nullptr, false);
+
+	tlb.setAsid(2);
+	EXPECT_EQ(tlb.find(Tlb::Load, 0x1000), nullptr);
+	EXPECT_NE(tlb.find(Tlb::Load, 0x2000), nullptr);
+	tlb.insert(Tlb::Load, 0x1000, DRAM_BASE + PAGE_SIZE, nullptr, false);
+
+	tlb.flushAsid(1);
+	EXPECT_NE(tlb.find(Tlb::Load, 0x1000), nullptr);
+	EXPECT_NE(tlb.find(Tlb::Load, 0x2000), nullptr);
+	tlb.setAsid(1);
+	EXPECT_EQ(tlb.find(Tlb::Load, 0x1000), nullptr);
+	EXPECT_EQ(tlb.find(Tlb::Load, 0x3000), nullptr);
+
+	tlb.flushPage(0x2000, 1);
+	EXPECT_NE(tlb.find(Tlb::Load, 0x2000), nullptr);
+	tlb.flushPage(0x2000);
+	EXPECT_EQ(tlb.find(Tlb::Load, 0x2000), nullptr);
+}
+
+// Loads and stores through a cached translation reach the RAM.
+TEST_F(TlbTest, LoadStoreThroughMapping)
+{
+	map(1, DRAM_BASE + 0x20000);
+	enablePaging();
+
+	cpu->store(PAGE_SIZE + 0x10, 64, 0x1122334455667788ull);
+	EXPECT_EQ(mem.load(0x20010, 64), 0x1122334455667788ull);
+	EXPECT_EQ(cpu->load(PAGE_SIZE + 0x10, 16), 0x7788u);
+	EXPECT_EQ(cpu->load(PAGE_SIZE + 0x17, 8), 0x11u);
+	EXPECT_EQ(cpu->translate(PAGE_SIZE + 0x10, Cpu::AccessType::Load), DRAM_BASE + 0x20010);
+
+	// An access crossing the page goes on in the following physical page.
+	mem.store(0x21000, 32, 0xAABBCCDD);
+	EXPECT_EQ(cpu->load(2 * PAGE_SIZE - 4, 64), 0xAABBCCDD00000000ull);
+}
+
+// Translations stay cached until the page tables are declared changed by sfence.vma.
+TEST_F(TlbTest, FlushedBySfence)
+{
+	map(1, DRAM_BASE + 0x20000);
+	enablePaging();
+	mem.store(0x20000, 64, 1);
+	mem.store(0x21000, 64, 2);
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 1u);
+
+	map(1, DRAM_BASE + 0x21000);
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 1u);
+
+	run({ sfence(0, 0) });
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 2u);
+}
+
+// Flushing one address of a superpage drops the translations of all its pages.
+TEST_F(TlbTest, SfenceFlushesWholeSuperpage)
+{
+	mem.store(0x20000, 64, 1);
+	mem.store(0x21000, 64, 2);
+	mem.store(0x22000, 64, 3);
+	// The second entry of the level 1 table maps 2 MiB at 0x200000 to the start of the RAM.
+	const uint64_t l1 = kRoot + PAGE_SIZE - DRAM_BASE;
+	mem.store(l1 + 8, 64, pte(DRAM_BASE, PTE_V | PTE_RWX));
+	enablePaging();
+	EXPECT_EQ(cpu->load(0x220000, 64), 1u);
+	EXPECT_EQ(cpu->load(0x221000, 64), 2u);
+
+	// Split it into 4 KiB pages, both mapped to 0x22000.
+	mem.store(l1 + 8, 64, pte(kRoot + kTables + 2 * PAGE_SIZE, PTE_V));
+	map(0x20, DRAM_BASE + 0x22000, 1);
+	map(0x21, DRAM_BASE + 0x22000, 1);
+	run({ lui(6, 0x220), sfence(6, 0) });
+	EXPECT_EQ(cpu->load(0x221000, 64), 3u);
+}
+
+// Switching address spaces keeps the translations of each; giving an ASID to other page tables
+// drops its translations.
+TEST_F(TlbTest, SatpSwitchKeepsOtherAsids)
+{
+	mem.store(0x20000, 64, 1);
+	mem.store(0x21000, 64, 2);
+	mem.store(0x22000, 64, 3);
+	map(1, DRAM_BASE + 0x20000, 0);
+	map(1, DRAM_BASE + 0x21000, 1);
+
+	enablePaging(0, 1);
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 1u);
+	enablePaging(1, 2);
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 2u);
+
+	// Stale entries show that nothing was walked again.
+	map(1, DRAM_BASE + 0x22000, 0);
+	map(1, DRAM_BASE + 0x22000, 1);
+	enablePaging(0, 1);
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 1u);
+	enablePaging(1, 2);
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 2u);
+
+	enablePaging(0, 2);
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 3u);
+}
+
+// sfence.vma flushes by virtual address, by ASID, or both; global mappings survive ASID flushes.
+TEST_F(TlbTest, SfenceOperands)
+{
+	mem.store(0x20000, 64, 1);
+	mem.store(0x21000, 64, 2);
+	mem.store(0x22000, 64, 3);
+	mem.store(0x23000, 64, 4);
+	map(1, DRAM_BASE + 0x20000);
+	map(2, DRAM_BASE + 0x21000, 0, PTE_G);
+	enablePaging(0, 5);
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 1u);
+	EXPECT_EQ(cpu->load(2 * PAGE_SIZE, 64), 2u);
+
+	map(1, DRAM_BASE + 0x22000);
+	map(2, DRAM_BASE + 0x23000, 0, PTE_G);
+
+	// Another ASID.
+	run({ addi(5, 0, 6), sfence(0, 5) });
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 1u);
+
+	// This ASID, but not the global page.
+	run({ addi(5, 0, 5), sfence(0, 5) });
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 3u);
+	EXPECT_EQ(cpu->load(2 * PAGE_SIZE, 64), 2u);
+
+	// The global page in this ASID is kept; by address alone it goes.
+	run({ lui(6, 2), addi(7, 0, 5), sfence(6, 7) });
+	EXPECT_EQ(cpu->load(2 * PAGE_SIZE, 64), 2u);
+	run({ lui(6, 2), sfence(6, 0) });
+	EXPECT_EQ(cpu->load(2 * PAGE_SIZE, 64), 4u);
+
+	// Address in this ASID.
+	map(1, DRAM_BASE + 0x20000);
+	run({ lui(6, 1), addi(7, 0, 5), sfence(6, 7) });
+	EXPECT_EQ(cpu->load(PAGE_SIZE, 64), 1u);
+}
+
+// A store through a cached translation still drops the decoded instructions it overwrites.
+TEST_F(TlbTest, StoreInvalidatesDecodedCode)
+{
+	map(0, DRAM_BASE);
+	enablePaging();
+
+	const uint32_t addi_x5_1 = 0x00128293u;  // addi x5, x5, 1
+	const uint32_t addi_x5_10 = 0x00a28293u; // addi x5, x5, 10
+	mem.store(0, 32, addi_x5_1);
+	cpu->setPC(0);
+	cpu->step();
+	EXPECT_EQ(cpu->getRegister(5), 1u);
+
+	cpu->store(0, 32, addi_x5_10);
+	cpu->setPC(0);
+	cpu->step();
+	EXPECT_EQ(cpu->getRegister(5), 11u);
+}
+
+// A missing mapping is a page fault of the access type, taken without leaving the instruction.
+TEST_F(TlbTest, PageFaultTrap)
+{
+	enablePaging();
+	EXPECT_EQ(cpu->try_translate(5 * PAGE_SIZE, Cpu::AccessType::Instruction).ex, Except::InstructionPageFault);
+	EXPECT_EQ(cpu->try_translate(5 * PAGE_SIZE, Cpu::AccessType::Load).ex, Except::LoadPageFault);
+	EXPECT_EQ(cpu->try_translate(5 * PAGE_SIZE, Cpu::AccessType::Store).ex, Except::StoreAMOPageFault);
+	EXPECT_THROW(cpu->translate(5 * PAGE_SIZE, Cpu::AccessType::Load), CpuException);
+
+	cpu->store_csr(MTVEC, 0x100);
+	cpu->setPC(0x44);
+	EXPECT_EQ(cpu->load(5 * PAGE_SIZE, 64), 0u);
+	EXPECT_EQ(cpu->getPC(), 0x100u);
+	EXPECT_EQ(cpu->getCsr(MEPC), 0x40u);
+	EXPECT_EQ(cpu->getCsr(MCAUSE), uint64_t(Except::LoadPageFault));
+
+	// Back from the trap handler, which runs untranslated in machine mode.
+	cpu->set_mode(Cpu::Mode::Supervisor);
+	cpu->setPC(0x44);
+	cpu->store(5 * PAGE_SIZE, 64, 0);
+	EXPECT_EQ(cpu->getCsr(MCAUSE), uint64_t(Except::StoreAMOPageFault));
+}
+
+// A page mapped outside of any device still raises an access fault.
+TEST_F(TlbTest, UnmappedPhysicalPageFaults)
+{
+	map(3, DRAM_BASE + kMemSize);
+	enablePaging();
+
+	EXPECT_THROW(cpu->load(3 * PAGE_SIZE, 64), CpuFatal);
+	EXPECT_THROW(cpu->store(3 * PAGE_SIZE, 64, 0), CpuFatal);
+}
+
+// A load page fault leaves rd alone: the load runs again, from the same base register, once the
+// handler mapped the page.
+TEST_F(TlbTest, LoadRestartsAfterPageFault)
+{
+	const uint32_t mret = 0x30200073u;
+	map(0, DRAM_BASE);
+	mem.store(0, 32, lui(5, 0x5));
+	mem.store(4, 32, ld(5, 5, 0));
+	mem.store(0x800, 32, mret);
+	mem.store(0x20000, 64, 0x1234);
+	cpu->store_csr(MTVEC, DRAM_BASE + 0x800);
+	enablePaging();
+	cpu->setPC(0);
+
+	cpu->step();
+	cpu->step();
+	EXPECT_EQ(cpu->getCsr(MCAUSE), uint64_t(Except::LoadPageFault));
+	EXPECT_EQ(cpu->getCsr(MEPC), 4u);
+	EXPECT_EQ(cpu->getRegister(5), 0x5000u);
+
+	// The handler maps the page and returns to the load.
+	map(5, DRAM_BASE + 0x20000);
+	cpu->step();
+	EXPECT_EQ(cpu->getPC(), 4u);
+	cpu->step();
+	EXPECT_EQ(cpu->getRegister(5), 0x1234u);
+	EXPECT_EQ(cpu->getPC(), 8u);
+}
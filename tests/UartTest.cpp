@@ -1,14 +1,27 @@
 #include "Uart.h"
+#include "Plic.h"
 #include "Trap.h"
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
 
-// NOTE: Uart(false) is mandatory in unit tests. The default constructor spawns
-// a background thread that blocks on stdin when useConsole == true, which would
-// hang the test process. With useConsole == false the thread only drains an
-// in-memory input queue and is safe to construct/destroy in a test.
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+// NOTE: Uart(false), or a console on a pipe, is mandatory in unit tests. The
+// default constructor reads stdin from a background thread, which would steal
+// the input of the test process. With useConsole == false there is no thread:
+// putChar() feeds the input directly.
 
 // On construction the LSR "transmitter empty" bit is set, so the CPU can
 // immediately push the next character.
@@ -29,6 +42,50 @@ TEST(UartTest, TransmitHoldingRegisterBuffersOutput)
 	EXPECT_EQ(uart.getChar(), 'i');
 }
 
+// The output hook sees every byte written, whatever the output.
+TEST(UartTest, OutputHookSeesEveryByte)
+{
+	Uart uart(false);
+	std::string seen;
+	uart.setOutputHook([&](uint8_t ch) { seen.push_back(char(ch)); });
+	uart.store(UART_THR, 8, 'o');
+	uart.store(UART_THR, 8, 'k');
+	EXPECT_EQ(seen, "ok");
+}
+
+// Buffered output to a file: written on newlines, after a short delay for a partial line, and
+// in full when the Uart is destroyed.
+TEST(UartTest, OutputToFile)
+{
+	std::string path = testing::TempDir() + "uart_test.out";
+	auto contents = [&] {
+		std::ifstream file(path, std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	};
+	auto waitFor = [&](const std::string& text) {
+		for (int i = 0; i < 1000 && contents() != text; i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		return contents();
+	};
+
+	{
+		Uart uart(false);
+		ASSERT_TRUE(uart.setOutputFile(path));
+		for (char c : std::string("line\n"))
+			uart.store(UART_THR, 8, uint8_t(c));
+		EXPECT_EQ(waitFor("line\n"), "line\n");
+
+		for (char c : std::string("$ "))
+			uart.store(UART_THR, 8, uint8_t(c));
+		EXPECT_EQ(waitFor("line\n$ "), "line\n$ ");
+		EXPECT_EQ(uart.getChar(), 0);
+
+		uart.store(UART_THR, 8, 'x');
+	}
+	EXPECT_EQ(contents(), "line\n$ x");
+	std::remove(path.c_str());
+}
+
 // Generic registers (e.g. LCR) are plain read/write storage.
 TEST(UartTest, LineControlRegisterRoundTrip)
 {
@@ -44,3 +101,109 @@ TEST(UartTest, RejectsNonByteAccess)
 	EXPECT_THROW(uart.load(UART_LSR, 32), CpuException);
 	EXPECT_THROW(uart.store(UART_THR, 16, 0), CpuException);
 }
+
+// A key posted by the terminal is readable at once, and raises the interrupt line.
+TEST(UartTest, PostedCharIsReceived)
+{
+	Plic plic;
+	Uart uart(false);
+	uart.setPlic(&plic);
+	EXPECT_EQ(uart.load(UART_LSR, 8) & UART_LSR_RX, 0u);
+	EXPECT_EQ(plic.asserted(), 0u);
+
+	uart.putChar('a');
+	uart.putChar('b');
+	EXPECT_EQ(plic.asserted(), 1ull << UART_IRQ);
+	plic.lower(UART_IRQ);
+	EXPECT_EQ(plic.asserted(), 0u);
+	EXPECT_NE(uart.load(UART_LSR, 8) & UART_LSR_RX, 0u);
+	EXPECT_EQ(uart.load(UART_RHR, 8), uint64_t('a'));
+	EXPECT_EQ(uart.load(UART_RHR, 8), uint64_t('b'));
+	EXPECT_EQ(uart.load(UART_LSR, 8) & UART_LSR_RX, 0u);
+}
+
+#ifndef WIN32
+// Keystroke to guest latency: the console thread wakes up as soon as a key is typed.
+TEST(UartTest, ConsoleInputLatency)
+{
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	std::vector<double> latencies;
+	{
+		Plic plic;
+		Uart uart(true, fds[0]);
+		uart.setPlic(&plic);
+		for (int i = 0; i < 20; i++)
+		{
+			char key = char('a' + i);
+			auto typed = std::chrono::steady_clock::now();
+			ASSERT_EQ(write(fds[1], &key, 1), 1);
+			while ((plic.asserted() & (1ull << UART_IRQ)) == 0)
+			{
+				ASSERT_LT(std::chrono::steady_clock::now() - typed, std::chrono::seconds(2));
+				std::this_thread::yield();
+			}
+			latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - typed).count());
+			plic.lower(UART_IRQ);
+			EXPECT_NE(uart.load(UART_LSR, 8) & UART_LSR_RX, 0u);
+			EXPECT_EQ(uart.load(UART_RHR, 8), uint64_t(key));
+		}
+	}
+	close(fds[0]);
+	close(fds[1]);
+
+	std::sort(latencies.begin(), latencies.end());
+	double median = latencies[latencies.size() / 2];
+	RecordProperty("median_latency_us", std::to_string(median));
+	std::cout << "keystroke to guest latency: median " << median << " us, max " << latencies.back() << " us" << std::endl;
+	EXPECT_LT(median, 5000.0);
+}
+
+// Output to a pipe, in order even when it is larger than the buffer.
+TEST(UartTest, OutputToPipe)
+{
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	std::string expected;
+	for (int i = 0; i < 20000; i++)
+		expected.push_back(char('a' + i % 26));
+	expected.push_back('\n');
+
+	std::string received;
+	std::thread reader([&] {
+		char chunk[1024];
+		ssize_t n;
+		while ((n = read(fds[0], chunk, sizeof(chunk))) > 0)
+			received.append(chunk, n);
+	});
+	FILE* pipeOut = fdopen(fds[1], "w");
+	ASSERT_NE(pipeOut, nullptr);
+	{
+		Uart uart(false);
+		uart.setOutput(pipeOut);
+		for (char c : expected)
+			uart.store(UART_THR, 8, uint8_t(c));
+	}
+	fclose(pipeOut);
+	reader.join();
+	close(fds[0]);
+	EXPECT_EQ(received, expected);
+}
+
+// The end of the console input is not taken for input.
+TEST(UartTest, ConsoleEndOfInput)
+{
+	int fds[2];
+	ASSERT_EQ(pipe(fds), 0);
+	{
+		Plic plic;
+		Uart uart(true, fds[0]);
+		uart.setPlic(&plic);
+		close(fds[1]);
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		EXPECT_EQ(uart.load(UART_LSR, 8) & UART_LSR_RX, 0u);
+		EXPECT_EQ(plic.asserted(), 0u);
+	}
+	close(fds[0]);
+}
+#endif
@@ -0,0 +1,225 @@
+#include "VirtIONet.h"
+#include "Bus.h"
+#include "Cpu.h"
+#include "Memory.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+// A guest driving a network device, its receive queue in the first pages of RAM, its transmit
+// queue in the next ones, and its frame buffers after them.
+class NetGuest {
+public:
+	static const uint64_t RX_QUEUE = DRAM_BASE;
+	static const uint64_t TX_QUEUE = DRAM_BASE + 0x2000;
+	static const uint64_t BUFFERS = DRAM_BASE + 0x4000;
+	static const uint64_t BUFFER_SIZE = 2048;
+	static const uint32_t NUM = 8;
+	/// Legacy virtio_net_hdr.
+	static const uint32_t HEADER_SIZE = 10;
+
+	NetGuest() : mem(0x40000), cpu(bus, DRAM_BASE + 0x40000), next{ 0, 0 }
+	{
+		bus.addDevice(DRAM_BASE, &mem);
+		bus.addDevice(VIRTIO_NET_BASE, &net);
+		net.store(VIRTIO_GUEST_PAGE_SIZE, 32, PAGE_SIZE);
+		for (uint32_t q : { VIRTIO_NET_RX, VIRTIO_NET_TX })
+		{
+			net.store(VIRTIO_QUEUE_SEL, 32, q);
+			net.store(VIRTIO_QUEUE_NUM, 32, NUM);
+			net.store(VIRTIO_QUEUE_PFN, 32, queue(q) / PAGE_SIZE);
+		}
+	}
+
+	static uint64_t queue(uint32_t q) { return q == VIRTIO_NET_RX ? RX_QUEUE : TX_QUEUE; }
+	static uint64_t used(uint32_t q) { return queue(q) + PAGE_SIZE; }
+	uint64_t usedIdx(uint32_t q) { return bus.load(used(q) + 2, 16); }
+	uint64_t usedLen(uint32_t q, uint64_t n) { return bus.load(used(q) + 4 + 8 * (n % NUM) + 4, 32); }
+
+	// Queue one buffer of `len` bytes at `addr` as a chain of its own. Return its descriptor.
+	uint16_t add(uint32_t q, uint64_t addr, uint32_t len, bool write)
+	{
+		uint16_t d = next[q]++ % NUM;
+		uint64_t entry = queue(q) + VRING_DESC_SIZE * d;
+		bus.store(entry, 64, addr);
+		bus.store(entry + 8, 32, len);
+		bus.store(entry + 12, 16, write ? VIRTQ_DESC_F_WRITE : 0);
+		uint64_t avail = queue(q) + VRING_DESC_SIZE * NUM;
+		uint16_t idx = ASU16(bus.load(avail + 2, 16));
+		bus.store(avail + 4 + 2 * (idx % NUM), 16, d);
+		bus.store(avail + 2, 16, ASU16(idx + 1));
+		return d;
+	}
+
+	// Queue a frame holding `payload` after a zeroed header.
+	void send(uint64_t n, const std::string& payload)
+	{
+		uint64_t addr = BUFFERS + BUFFER_SIZE * n;
+		bus.store(addr, 64, 0);
+		bus.store(addr + 8, 16, 0);
+		for (size_t i = 0; i < payload.size(); i++)
+			bus.store(addr + HEADER_SIZE + i, 8, uint8_t(payload[i]));
+		add(VIRTIO_NET_TX, addr, ASU32(HEADER_SIZE + payload.size()), false);
+	}
+
+	std::string payload(uint64_t n, uint64_t len)
+	{
+		std::string text;
+		for (uint64_t i = HEADER_SIZE; i < len; i++)
+			text += char(bus.load(BUFFERS + BUFFER_SIZE * n + i, 8));
+		return text;
+	}
+
+	void notify(uint32_t q)
+	{
+		net.store(VIRTIO_QUEUE_NOTIFY, 32, q);
+		ASSERT_TRUE(net.is_notified());
+		net.process(&cpu);
+	}
+
+	// Wait for the watcher to see frames on the socket, then receive them.
+	bool receive()
+	{
+		for (int i = 0; i < 2000 && !net.is_notified(); i++)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		if (!net.is_notified())
+			return false;
+		net.process(&cpu);
+		return true;
+	}
+
+	Memory mem;
+	Bus bus;
+	Cpu cpu;
+	VirtIONet net;
+	uint16_t next[2];
+};
+
+std::string datagram(const std::string& payload)
+{
+	return std::string(NetGuest::HEADER_SIZE, '\0') + payload;
+}
+} // namespace
+
+TEST(VirtIONetTest, IdentifiesAsNetworkDevice)
+{
+	VirtIONet net;
+	EXPECT_EQ(net.load(VIRTIO_MAGIC, 32), 0x74726976u);
+	EXPECT_EQ(net.load(VIRTIO_DEVICE_ID, 32), 1u);
+	EXPECT_TRUE(net.load(VIRTIO_DEVICE_FEATURES, 32) & (1u << VIRTIO_NET_F_MAC));
+	EXPECT_EQ(net.load(VIRTIO_CONFIG, 8), 0x52u);
+	EXPECT_EQ(net.load(VIRTIO_CONFIG + 4, 16), 0x5634u);
+
+	// Two queues, receive and transmit.
+	net.store(VIRTIO_QUEUE_SEL, 32, VIRTIO_NET_TX);
+	EXPECT_EQ(net.load(VIRTIO_QUEUE_NUM_MAX, 32), VIRTQ_SIZE_MAX);
+	net.store(VIRTIO_QUEUE_SEL, 32, 2);
+	EXPECT_EQ(net.load(VIRTIO_QUEUE_NUM_MAX, 32), 0u);
+}
+
+// Every frame queued before the notification goes out, one datagram each.
+TEST(VirtIONetTest, TransmitsQueuedFrames)
+{
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv), 0);
+	NetGuest guest;
+	ASSERT_TRUE(guest.net.attach(sv[0]));
+
+	guest.send(0, "first");
+	guest.send(1, "second");
+	guest.send(2, "third");
+	guest.notify(VIRTIO_NET_TX);
+
+	EXPECT_EQ(guest.usedIdx(VIRTIO_NET_TX), 3u);
+	EXPECT_TRUE(guest.net.complete());
+	EXPECT_FALSE(guest.net.complete());
+	EXPECT_EQ(guest.net.load(VIRTIO_INTERRUPT_STATUS, 32), 1u);
+	EXPECT_EQ(guest.net.framesSent(), 3u);
+
+	char frame[64];
+	for (const char* payload : { "first", "second", "third" })
+	{
+		ssize_t len = recv(sv[1], frame, sizeof(frame), MSG_DONTWAIT);
+		EXPECT_EQ(std::string(frame, len > 0 ? len : 0), datagram(payload));
+	}
+	close(sv[1]);
+}
+
+// Frames land in the receive buffers, as many as arrived, the others being kept for later.
+TEST(VirtIONetTest, ReceivesIntoGuestBuffers)
+{
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv), 0);
+	NetGuest guest;
+	ASSERT_TRUE(guest.net.attach(sv[0]));
+	for (uint64_t n = 0; n < 4; n++)
+		guest.add(VIRTIO_NET_RX, NetGuest::BUFFERS + NetGuest::BUFFER_SIZE * n, NetGuest::BUFFER_SIZE, true);
+	guest.notify(VIRTIO_NET_RX);
+
+	for (const char* payload : { "ping", "pong" })
+		ASSERT_GT(send(sv[1], datagram(payload).data(), datagram(payload).size(), 0), 0);
+	ASSERT_TRUE(guest.receive());
+	EXPECT_EQ(guest.usedIdx(VIRTIO_NET_RX), 2u);
+	EXPECT_EQ(guest.usedLen(VIRTIO_NET_RX, 1), datagram("pong").size());
+	EXPECT_EQ(guest.payload(0, guest.usedLen(VIRTIO_NET_RX, 0)), "ping");
+	EXPECT_EQ(guest.payload(1, guest.usedLen(VIRTIO_NET_RX, 1)), "pong");
+	EXPECT_TRUE(guest.net.complete());
+
+	ASSERT_GT(send(sv[1], datagram("again").data(), datagram("again").size(), 0), 0);
+	ASSERT_TRUE(guest.receive());
+	EXPECT_EQ(guest.usedIdx(VIRTIO_NET_RX), 3u);
+	EXPECT_EQ(guest.payload(2, guest.usedLen(VIRTIO_NET_RX, 2)), "again");
+	EXPECT_EQ(guest.net.framesReceived(), 3u);
+	close(sv[1]);
+}
+
+// Frames arriving while the driver gave no buffers wait on the socket for its notification.
+TEST(VirtIONetTest, WaitsForReceiveBuffers)
+{
+	int sv[2];
+	ASSERT_EQ(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv), 0);
+	NetGuest guest;
+	ASSERT_TRUE(guest.net.attach(sv[0]));
+
+	ASSERT_GT(send(sv[1], datagram("early").data(), datagram("early").size(), 0), 0);
+	ASSERT_TRUE(guest.receive());
+	EXPECT_FALSE(guest.net.is_notified());
+	EXPECT_FALSE(guest.net.complete());
+
+	guest.add(VIRTIO_NET_RX, NetGuest::BUFFERS, NetGuest::BUFFER_SIZE, true);
+	guest.notify(VIRTIO_NET_RX);
+	EXPECT_EQ(guest.usedIdx(VIRTIO_NET_RX), 1u);
+	EXPECT_EQ(guest.payload(0, guest.usedLen(VIRTIO_NET_RX, 0)), "early");
+	close(sv[1]);
+}
+
+// Two emulators bound to each other's socket path exchange frames.
+TEST(VirtIONetTest, LinksTwoGuests)
+{
+	std::string a = testing::TempDir() + "rvemu_net_a.sock";
+	std::string b = testing::TempDir() + "rvemu_net_b.sock";
+	NetGuest guestA, guestB;
+	ASSERT_TRUE(guestA.net.open(a, b));
+	ASSERT_TRUE(guestB.net.open(b, a));
+	EXPECT_NE(guestA.net.load(VIRTIO_CONFIG + 5, 8), guestB.net.load(VIRTIO_CONFIG + 5, 8));
+
+	guestB.add(VIRTIO_NET_RX, NetGuest::BUFFERS, NetGuest::BUFFER_SIZE, true);
+	guestB.notify(VIRTIO_NET_RX);
+	guestA.send(0, "hello B");
+	guestA.notify(VIRTIO_NET_TX);
+	EXPECT_EQ(guestA.net.framesSent(), 1u);
+
+	ASSERT_TRUE(guestB.receive());
+	EXPECT_EQ(guestB.usedIdx(VIRTIO_NET_RX), 1u);
+	EXPECT_EQ(guestB.payload(0, guestB.usedLen(VIRTIO_NET_RX, 0)), "hello B");
+}
+#endif
@@ -1,9 +1,17 @@
 #include "VirtIO.h"
+#include "Bus.h"
+#include "Cpu.h"
+#include "Memory.h"
 #include "Trap.h"
 
 #include <gtest/gtest.h>
 
 #include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
 
 // Legacy virtio "magic value" identifies the device to the driver.
 TEST(VirtIOTest, MagicValue)
@@ -30,11 +38,19 @@ TEST(VirtIOTest, VendorId)
 	EXPECT_EQ(v.load(VIRTIO_VENDOR_ID, 32), 0x554d4551u); // "QEMU"
 }
 
-// QUEUE_NUM_MAX is fixed at 8 (the DESC_NUM constant).
+// Drivers may use queues of up to 256 entries.
 TEST(VirtIOTest, QueueNumMax)
 {
 	VirtIO v;
-	EXPECT_EQ(v.load(VIRTIO_QUEUE_NUM_MAX, 32), 8u);
+	EXPECT_EQ(v.load(VIRTIO_QUEUE_NUM_MAX, 32), 256u);
+}
+
+TEST(VirtIOTest, OffersIndirectDescriptors)
+{
+	VirtIO v;
+	EXPECT_EQ(v.load(VIRTIO_DEVICE_FEATURES, 32), 1u << VIRTIO_RING_F_INDIRECT_DESC);
+	v.store(VIRTIO_DRIVER_FEATURES, 32, 0);
+	EXPECT_EQ(v.load(VIRTIO_DRIVER_FEATURES, 32), 0u);
 }
 
 TEST(VirtIOTest, StatusRoundTripAndReset)
@@ -63,3 +79,257 @@ TEST(VirtIOTest, RejectsNon32BitAccess)
 	EXPECT_THROW(v.load(VIRTIO_MAGIC, 64), CpuException);
 	EXPECT_THROW(v.store(VIRTIO_STATUS, 8, 0), CpuException);
 }
+
+namespace {
+// A guest driving a disk of 4 sectors through a queue at the start of its RAM, each byte of the
+// disk holding its offset plus its sector number.
+class VirtIODiskTest : public ::testing::Test {
+protected:
+	static const uint64_t QUEUE = DRAM_BASE;
+	static const uint64_t HEADERS = DRAM_BASE + 0x3000;
+	static const uint64_t BUFFER = DRAM_BASE + 0x4000;
+	static const uint64_t STATUS = DRAM_BASE + 0x6000;
+
+	VirtIODiskTest() : mem(0x10000), cpu(bus, DRAM_BASE + 0x10000), num(0), next(0) {}
+
+	void start(bool async, uint32_t size = 8)
+	{
+		std::string image = testing::TempDir() + "virtio_test.img";
+		{
+			std::vector<char> sectors(4 * 512);
+			for (size_t i = 0; i < sectors.size(); i++)
+				sectors[i] = static_cast<char>(i / 512 + i);
+			std::ofstream(image, std::ios::binary).write(sectors.data(), sectors.size());
+		}
+
+		v.reset(new VirtIO(async));
+		bus.addDevice(DRAM_BASE, &mem);
+		bus.addDevice(VIRTIO_BASE, v.get());
+		ASSERT_TRUE(v->loadDisk(image));
+		std::remove(image.c_str());
+
+		// The legacy driver sequence, as xv6 does it.
+		num = size;
+		v->store(VIRTIO_GUEST_PAGE_SIZE, 32, PAGE_SIZE);
+		v->store(VIRTIO_QUEUE_SEL, 32, 0);
+		v->store(VIRTIO_QUEUE_NUM, 32, num);
+		v->store(VIRTIO_QUEUE_PFN, 32, QUEUE / PAGE_SIZE);
+	}
+
+	uint64_t availRing() const { return QUEUE + VRING_DESC_SIZE * num; }
+	uint64_t usedRing() const { return (availRing() + 6 + 2 * num + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE; }
+
+	void descriptor(uint64_t table, uint64_t i, uint64_t addr, uint32_t len, uint16_t flags, uint16_t link)
+	{
+		uint64_t entry = table + VRING_DESC_SIZE * i;
+		bus.store(entry, 64, addr);
+		bus.store(entry + 8, 32, len);
+		bus.store(entry + 12, 16, flags);
+		bus.store(entry + 14, 16, link);
+	}
+
+	// Queue a request of `len` bytes at `buffer` as a chain of three descriptors, the request
+	// number `n` also picking its header and status byte. Return the head descriptor.
+	uint16_t request(uint32_t type, uint64_t sector, uint64_t buffer, uint32_t len, uint64_t n)
+	{
+		uint64_t header = HEADERS + 16 * n;
+		bus.store(header, 32, type);
+		bus.store(header + 8, 64, sector);
+		bus.store(STATUS + n, 8, 0xFF);
+
+		uint16_t head = next;
+		uint16_t flags = type == VIRTIO_BLK_T_IN ? VIRTQ_DESC_F_WRITE : 0;
+		descriptor(QUEUE, head, header, 16, VIRTQ_DESC_F_NEXT, ASU16((head + 1) % num));
+		descriptor(QUEUE, (head + 1) % num, buffer, len, flags | VIRTQ_DESC_F_NEXT, ASU16((head + 2) % num));
+		descriptor(QUEUE, (head + 2) % num, STATUS + n, 1, VIRTQ_DESC_F_WRITE, 0);
+		next = ASU16((head + 3) % num);
+		makeAvailable(head);
+		return head;
+	}
+
+	void makeAvailable(uint16_t head)
+	{
+		uint16_t idx = ASU16(bus.load(availRing() + 2, 16));
+		bus.store(availRing() + 4 + 2 * (idx % num), 16, head);
+		bus.store(availRing() + 2, 16, ASU16(idx + 1));
+	}
+
+	void notify()
+	{
+		v->store(VIRTIO_QUEUE_NOTIFY, 32, 0);
+		ASSERT_TRUE(v->is_notified());
+		v->disk_access(&cpu);
+	}
+
+	uint64_t usedIdx() { return bus.load(usedRing() + 2, 16); }
+
+	Memory mem;
+	Bus bus;
+	Cpu cpu;
+	std::unique_ptr<VirtIO> v;
+	uint32_t num;
+	/// Next free descriptor.
+	uint16_t next;
+};
+} // namespace
+
+// A block request copies a whole sector between the disk image and the RAM buffer of its
+// descriptor, in both directions. The transfers are done on the spot without the I/O worker.
+TEST_F(VirtIODiskTest, DiskAccessCopiesSectors)
+{
+	start(false);
+
+	// Read sector 2: the device writes the buffer, the status, and returns the chain.
+	uint16_t head = request(VIRTIO_BLK_T_IN, 2, BUFFER, 512, 0);
+	notify();
+	EXPECT_TRUE(v->complete(&cpu, true));
+	for (uint64_t i = 0; i < 512; i += 97)
+		EXPECT_EQ(bus.load(BUFFER + i, 8), ASU8(2 + 2 * 512 + i)) << i;
+	EXPECT_EQ(bus.load(STATUS, 8), VIRTIO_BLK_S_OK);
+	EXPECT_EQ(usedIdx(), 1u);
+	EXPECT_EQ(bus.load(usedRing() + 4, 32), head);
+	EXPECT_EQ(bus.load(usedRing() + 8, 32), 513u);
+
+	// Write it back to sector 0, then read sector 0.
+	request(VIRTIO_BLK_T_OUT, 0, BUFFER, 512, 1);
+	notify();
+	EXPECT_TRUE(v->complete(&cpu, true));
+	EXPECT_EQ(bus.load(usedRing() + 12 + 4, 32), 1u); // only the status is written
+	bus.store(BUFFER, 64, 0);
+	request(VIRTIO_BLK_T_IN, 0, BUFFER, 512, 2);
+	notify();
+	EXPECT_TRUE(v->complete(&cpu, true));
+	EXPECT_FALSE(v->complete(&cpu));
+	EXPECT_EQ(bus.load(BUFFER, 8), ASU8(2 + 2 * 512));
+	EXPECT_EQ(bus.load(BUFFER + 511, 8), ASU8(2 + 2 * 512 + 511));
+	EXPECT_EQ(usedIdx(), 3u);
+}
+
+// Requests in flight on the I/O worker are transferred in order, and completed together.
+TEST_F(VirtIODiskTest, DiskRequestsCompleteInOrder)
+{
+	start(true);
+
+	// Write 'b's to sector 1 then read it back into another buffer, without waiting.
+	for (uint64_t i = 0; i < 512; i++)
+		bus.store(BUFFER + i, 8, 'b');
+	request(VIRTIO_BLK_T_OUT, 1, BUFFER, 512, 0);
+	notify();
+	request(VIRTIO_BLK_T_IN, 1, BUFFER + 512, 512, 1);
+	notify();
+
+	EXPECT_TRUE(v->complete(&cpu, true));
+	EXPECT_EQ(usedIdx(), 2u);
+	EXPECT_EQ(bus.load(BUFFER + 512, 8), uint64_t('b'));
+	EXPECT_EQ(bus.load(BUFFER + 1023, 8), uint64_t('b'));
+}
+
+// One notification starts every request made available before it, and their completion is
+// posted at once, for a single interrupt.
+TEST_F(VirtIODiskTest, DrainsAvailableRingPerNotify)
+{
+	start(true, 16);
+	for (uint64_t n = 0; n < 4; n++)
+		request(VIRTIO_BLK_T_IN, n, BUFFER + 512 * n, 512, n);
+	notify();
+
+	EXPECT_TRUE(v->complete(&cpu, true));
+	EXPECT_FALSE(v->complete(&cpu, true));
+	EXPECT_EQ(usedIdx(), 4u);
+	for (uint64_t n = 0; n < 4; n++)
+	{
+		EXPECT_EQ(bus.load(STATUS + n, 8), VIRTIO_BLK_S_OK) << n;
+		EXPECT_EQ(bus.load(usedRing() + 4 + 8 * n, 32), 3 * n) << n;
+		EXPECT_EQ(bus.load(BUFFER + 512 * n + 1, 8), ASU8(n + 512 * n + 1)) << n;
+	}
+}
+
+// The interrupt status tells that the used ring was updated, until acknowledged or reset.
+TEST_F(VirtIODiskTest, InterruptStatusFollowsUsedRing)
+{
+	start(false);
+	EXPECT_EQ(v->load(VIRTIO_INTERRUPT_STATUS, 32), 0u);
+	request(VIRTIO_BLK_T_IN, 0, BUFFER, 512, 0);
+	notify();
+	EXPECT_TRUE(v->complete(&cpu));
+	EXPECT_EQ(v->load(VIRTIO_INTERRUPT_STATUS, 32), 1u);
+	v->store(VIRTIO_INTERRUPT_ACK, 32, 1);
+	EXPECT_EQ(v->load(VIRTIO_INTERRUPT_STATUS, 32), 0u);
+
+	request(VIRTIO_BLK_T_IN, 1, BUFFER, 512, 1);
+	notify();
+	EXPECT_TRUE(v->complete(&cpu));
+	v->store(VIRTIO_STATUS, 32, 0);
+	EXPECT_EQ(v->load(VIRTIO_INTERRUPT_STATUS, 32), 0u);
+}
+
+// With 256 entries the used ring is two pages after the descriptors, and the rings wrap.
+TEST_F(VirtIODiskTest, LargeQueueWraps)
+{
+	start(false, VIRTQ_SIZE_MAX);
+	EXPECT_EQ(usedRing(), QUEUE + 2 * PAGE_SIZE);
+	for (uint64_t n = 0; n < 300; n++)
+	{
+		request(VIRTIO_BLK_T_IN, n % 4, BUFFER, 16, n % 8);
+		if (n % 30 == 29)
+		{
+			notify();
+			EXPECT_TRUE(v->complete(&cpu));
+		}
+	}
+	EXPECT_EQ(usedIdx(), 300u);
+	// Request 299 used descriptors 129 to 131, its used element wrapped to slot 43.
+	EXPECT_EQ(bus.load(usedRing() + 4 + 8 * (299 % 256), 32), 299 * 3 % 256);
+	EXPECT_EQ(bus.load(BUFFER, 8), ASU8(3 + 3 * 512));
+}
+
+// A request may come as an indirect table, its data split over several buffers.
+TEST_F(VirtIODiskTest, IndirectDescriptors)
+{
+	start(false);
+	const uint64_t table = DRAM_BASE + 0x7000;
+	bus.store(HEADERS, 32, VIRTIO_BLK_T_IN);
+	bus.store(HEADERS + 8, 64, 1);
+	descriptor(table, 0, HEADERS, 16, VIRTQ_DESC_F_NEXT, 1);
+	descriptor(table, 1, BUFFER + 1024, 512, VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT, 2);
+	descriptor(table, 2, BUFFER, 512, VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT, 3);
+	descriptor(table, 3, STATUS, 1, VIRTQ_DESC_F_WRITE, 0);
+	descriptor(QUEUE, 4, table, 4 * VRING_DESC_SIZE, VIRTQ_DESC_F_INDIRECT, 0);
+	makeAvailable(4);
+	notify();
+
+	EXPECT_TRUE(v->complete(&cpu));
+	EXPECT_EQ(bus.load(STATUS, 8), VIRTIO_BLK_S_OK);
+	EXPECT_EQ(bus.load(usedRing() + 4, 32), 4u);
+	EXPECT_EQ(bus.load(usedRing() + 8, 32), 1025u);
+	EXPECT_EQ(bus.load(BUFFER + 1024, 8), ASU8(1 + 512));
+	EXPECT_EQ(bus.load(BUFFER, 8), ASU8(2 + 1024));
+}
+
+// Requests that cannot be carried out are still returned, with an error status.
+TEST_F(VirtIODiskTest, FailedRequestsGetStatus)
+{
+	start(false, 16);
+	request(VIRTIO_BLK_T_IN, 3, BUFFER, 1024, 0); // past the end of the disk
+	request(42, 0, BUFFER, 512, 1);
+	request(VIRTIO_BLK_T_FLUSH, 0, BUFFER, 0, 2);
+	notify();
+
+	EXPECT_TRUE(v->complete(&cpu));
+	EXPECT_EQ(usedIdx(), 3u);
+	EXPECT_EQ(bus.load(STATUS, 8), VIRTIO_BLK_S_IOERR);
+	EXPECT_EQ(bus.load(usedRing() + 8, 32), 1u);
+	EXPECT_EQ(bus.load(STATUS + 1, 8), VIRTIO_BLK_S_UNSUPP);
+	EXPECT_EQ(bus.load(STATUS + 2, 8), VIRTIO_BLK_S_OK);
+}
+
+// A driver polling the used ring turns interrupts off: requests complete without any.
+TEST_F(VirtIODiskTest, NoInterruptWhenSuppressed)
+{
+	start(false);
+	bus.store(availRing(), 16, VIRTQ_AVAIL_F_NO_INTERRUPT);
+	request(VIRTIO_BLK_T_IN, 0, BUFFER, 512, 0);
+	notify();
+	EXPECT_FALSE(v->complete(&cpu));
+	EXPECT_EQ(usedIdx(), 1u);
+}
@@ -0,0 +1,135 @@
+#include "VirtQueue.h"
+#include "Bus.h"
+#include "Memory.h"
+
+#include <gtest/gtest.h>
+
+#include <cstdint>
+
+namespace {
+// A queue of 8 entries at the start of a small RAM.
+class VirtQueueTest : public ::testing::Test {
+protected:
+	static const uint64_t BASE = DRAM_BASE;
+	static const uint32_t NUM = 8;
+
+	VirtQueueTest() : mem(0x10000)
+	{
+		bus.addDevice(DRAM_BASE, &mem);
+		queue.setup(BASE, NUM, PAGE_SIZE);
+	}
+
+	void descriptor(uint64_t table, uint64_t i, uint64_t addr, uint32_t len, uint16_t flags, uint16_t next)
+	{
+		uint64_t entry = table + VRING_DESC_SIZE * i;
+		bus.store(entry, 64, addr);
+		bus.store(entry + 8, 32, len);
+		bus.store(entry + 12, 16, flags);
+		bus.store(entry + 14, 16, next);
+	}
+
+	// Make the chain of `head` available, as the driver does.
+	void makeAvailable(uint16_t head)
+	{
+		const uint64_t avail = BASE + VRING_DESC_SIZE * NUM;
+		uint16_t idx = ASU16(bus.load(avail + 2, 16));
+		bus.store(avail + 4 + 2 * (idx % NUM), 16, head);
+		bus.store(avail + 2, 16, ASU16(idx + 1));
+	}
+
+	Memory mem;
+	Bus bus;
+	VirtQueue queue;
+};
+} // namespace
+
+// Every chain made available is popped in order, then the ring is empty.
+TEST_F(VirtQueueTest, PopsAvailableChainsInOrder)
+{
+	descriptor(BASE, 0, 0x1000, 16, VIRTQ_DESC_F_NEXT, 1);
+	descriptor(BASE, 1, 0x2000, 512, VIRTQ_DESC_F_WRITE, 0);
+	descriptor(BASE, 5, 0x3000, 1, VIRTQ_DESC_F_WRITE, 0);
+	makeAvailable(0);
+	makeAvailable(5);
+
+	VirtQueue::Chain chain;
+	ASSERT_TRUE(queue.pop(bus, chain));
+	EXPECT_EQ(chain.head, 0u);
+	ASSERT_EQ(chain.buffers.size(), 2u);
+	EXPECT_EQ(chain.buffers[0].addr, 0x1000u);
+	EXPECT_FALSE(chain.buffers[0].write);
+	EXPECT_EQ(chain.buffers[1].len, 512u);
+	EXPECT_TRUE(chain.buffers[1].write);
+
+	ASSERT_TRUE(queue.pop(bus, chain));
+	EXPECT_EQ(chain.head, 5u);
+	EXPECT_EQ(chain.buffers.size(), 1u);
+	EXPECT_FALSE(queue.pop(bus, chain));
+}
+
+// A descriptor holding an indirect table continues the chain in that table.
+TEST_F(VirtQueueTest, FollowsIndirectTable)
+{
+	const uint64_t table = DRAM_BASE + 0x3000;
+	descriptor(BASE, 2, table, 3 * VRING_DESC_SIZE, VIRTQ_DESC_F_INDIRECT, 0);
+	descriptor(table, 0, 0x1000, 16, VIRTQ_DESC_F_NEXT, 2);
+	descriptor(table, 2, 0x2000, 512, VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE, 1);
+	descriptor(table, 1, 0x3000, 1, VIRTQ_DESC_F_WRITE, 0);
+	makeAvailable(2);
+
+	VirtQueue::Chain chain;
+	ASSERT_TRUE(queue.pop(bus, chain));
+	EXPECT_EQ(chain.head, 2u);
+	ASSERT_EQ(chain.buffers.size(), 3u);
+	EXPECT_EQ(chain.buffers[1].addr, 0x2000u);
+	EXPECT_EQ(chain.buffers[2].addr, 0x3000u);
+}
+
+// A chain looping on itself, or leaving its table, is returned without buffers.
+TEST_F(VirtQueueTest, RejectsMalformedChains)
+{
+	descriptor(BASE, 0, 0x1000, 16, VIRTQ_DESC_F_NEXT, 0);
+	descriptor(BASE, 1, 0x1000, 16, VIRTQ_DESC_F_NEXT, NUM);
+	makeAvailable(0);
+	makeAvailable(1);
+
+	VirtQueue::Chain chain;
+	ASSERT_TRUE(queue.pop(bus, chain));
+	EXPECT_TRUE(chain.buffers.empty());
+	ASSERT_TRUE(queue.pop(bus, chain));
+	EXPECT_EQ(chain.head, 1u);
+	EXPECT_TRUE(chain.buffers.empty());
+}
+
+// Used elements go to the used ring on the page after the available ring, for any queue size.
+TEST_F(VirtQueueTest, PushesToUsedRing)
+{
+	queue.push(bus, 5, 513);
+	EXPECT_EQ(bus.load(BASE + 4096 + 2, 16), 1u);
+	EXPECT_EQ(bus.load(BASE + 4096 + 4, 32), 5u);
+	EXPECT_EQ(bus.load(BASE + 4096 + 8, 32), 513u);
+
+	// 256 descriptors fill a page, the available ring takes most of the next one.
+	queue.setup(BASE, VIRTQ_SIZE_MAX, PAGE_SIZE);
+	queue.push(bus, 200, 1);
+	EXPECT_EQ(bus.load(BASE + 2 * 4096 + 2, 16), 1u);
+	EXPECT_EQ(bus.load(BASE + 2 * 4096 + 4, 32), 200u);
+}
+
+TEST_F(VirtQueueTest, SizeMustBePowerOfTwo)
+{
+	queue.setup(BASE, 12, PAGE_SIZE);
+	EXPECT_FALSE(queue.ready());
+	queue.setup(BASE, 2 * VIRTQ_SIZE_MAX, PAGE_SIZE);
+	EXPECT_FALSE(queue.ready());
+	queue.setup(BASE, 64, PAGE_SIZE);
+	EXPECT_TRUE(queue.ready());
+}
+
+// The driver may turn interrupts off in the available ring flags.
+TEST_F(VirtQueueTest, InterruptSuppression)
+{
+	EXPECT_TRUE(queue.interruptWanted(bus));
+	bus.store(BASE + VRING_DESC_SIZE * NUM, 16, VIRTQ_AVAIL_F_NO_INTERRUPT);
+	EXPECT_FALSE(queue.interruptWanted(bus));
+}